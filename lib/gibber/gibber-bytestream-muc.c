@@ -153,9 +153,10 @@ check_stream_id (GibberBytestreamMuc *self)
   if (priv->stream_id_multicast != 0)
     return TRUE;
 
-  /* No stream allocated yet. Request one now */
+  /* No stream allocated yet. Request one now. What we send only has to
+   * arrive in order, it doesn't have to wait for the rest of the room */
   priv->stream_id_multicast = gibber_muc_connection_new_stream (
-      priv->muc_connection);
+      priv->muc_connection, GIBBER_R_MULTICAST_ORDERING_FIFO);
   if (priv->stream_id_multicast == 0)
     {
       DEBUG ("Can't allocate a new stream. Bytestream closed");
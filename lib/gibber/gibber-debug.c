@@ -5,6 +5,8 @@
 
 #include <glib.h>
 
+DebugFlags gibber_debug_active_flags = (DebugFlags) ~0;
+
 static DebugFlags flags = 0;
 static gboolean initialized = FALSE;
 
@@ -38,12 +40,14 @@ void gibber_debug_set_flags_from_env ()
     gibber_debug_set_flags (g_parse_debug_string (flags_string, keys, nkeys));
 
   initialized = TRUE;
+  gibber_debug_active_flags = flags;
 }
 
 void gibber_debug_set_flags (DebugFlags new_flags)
 {
   flags |= new_flags;
   initialized = TRUE;
+  gibber_debug_active_flags = flags;
 }
 
 gboolean gibber_debug_flag_is_set (DebugFlags flag)
@@ -27,6 +27,10 @@ typedef enum
 
 #define DEBUG_XMPP (DEBUG_XMPP_READER | DEBUG_XMPP_WRITER)
 
+/* The flags whose messages are logged, or all of them until GIBBER_DEBUG
+ * has been read. DEBUG() checks it before evaluating its arguments. */
+extern DebugFlags gibber_debug_active_flags;
+
 void gibber_debug_set_flags_from_env (void);
 void gibber_debug_set_flags (DebugFlags flags);
 gboolean gibber_debug_flag_is_set (DebugFlags flag);
@@ -38,12 +42,16 @@ void gibber_debug_stanza (DebugFlags flag, WockyStanza *stanza,
 
 #ifdef DEBUG_FLAG
 
-#define DEBUG(format, ...) \
-  gibber_debug (DEBUG_FLAG, "%s: " format, G_STRFUNC, ##__VA_ARGS__)
+#define DEBUG(format, ...) G_STMT_START {                                 \
+  if (G_UNLIKELY (gibber_debug_active_flags & DEBUG_FLAG))                \
+    gibber_debug (DEBUG_FLAG, "%s: " format, G_STRFUNC, ##__VA_ARGS__);   \
+} G_STMT_END
 
-#define DEBUG_STANZA(stanza, format, ...) \
-  gibber_debug_stanza (DEBUG_FLAG, stanza, "%s: " format, G_STRFUNC,\
-      ##__VA_ARGS__)
+#define DEBUG_STANZA(stanza, format, ...) G_STMT_START {                  \
+  if (G_UNLIKELY (gibber_debug_active_flags & DEBUG_FLAG))                \
+    gibber_debug_stanza (DEBUG_FLAG, stanza, "%s: " format, G_STRFUNC,    \
+        ##__VA_ARGS__);                                                   \
+} G_STMT_END
 
 #define DEBUGGING debug_flag_is_set(DEBUG_FLAG)
 
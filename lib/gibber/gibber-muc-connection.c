@@ -31,15 +31,119 @@
 #include "gibber-multicast-transport.h"
 #include "gibber-r-multicast-transport.h"
 #include "gibber-r-multicast-causal-transport.h"
+#include "gibber-timer-wheel.h"
 
 #include <wocky/wocky.h>
 
+#include <zlib.h>
+
 #define ADDRESS_KEY "address"
 #define PORT_KEY "port"
+#define COMPRESSION_KEY "compression"
+
+/* Rooms whose parameters have "k,r" for this are sent r parity packets for
+ * every k packets by every member that understands it, as losses on the
+ * network are a property of the room rather than of the sender. Members
+ * that don't know about parity packets ignore them. */
+#define FEC_KEY "fec"
+
+/* Stanzas on the default stream can be compressed with raw deflate, primed
+ * with a dictionary of the vocabulary found in MUC traffic. Rooms we create
+ * only use it when asked to, as older versions can't read it, and then
+ * advertise it in their parameters, so it reaches the people we invite;
+ * rooms without the parameter keep on sending plain XML. The dictionary is
+ * part of the protocol: changing it means picking a new name for the
+ * method. */
+#define COMPRESSION_DEFLATE "deflate"
+
+/* Compressed stanzas start with a NUL byte, which can't appear in XML, so
+ * both kinds of data can be received in the same room */
+#define COMPRESSED_MARKER '\0'
+
+/* Don't let a small packet inflate to something huge */
+#define MAX_INFLATED_SIZE (1024 * 1024)
+
+/* What's sent to the room can be paced at a given rate, so the kernel and
+ * the receivers' queues don't fill up; it isn't by default. Messages that
+ * can't go right away are queued per stream, and when more is queued than
+ * can be sent, streams take turns (deficit round robin), each turn allowing
+ * a quantum of bytes depending on their priority. A stream's messages go out
+ * in order, and whatever is queued on a stream is sent before the stream is
+ * freed, which is before its closing is announced on the default stream. */
+#define SEND_BURST (64 * 1024)
+#define QUANTUM 1500
+#define SCHEDULE_INTERVAL 10
+
+static const guint priority_quantums[] = {
+  8 * QUANTUM, /* GIBBER_MUC_CONNECTION_PRIORITY_HIGH */
+  2 * QUANTUM, /* GIBBER_MUC_CONNECTION_PRIORITY_NORMAL */
+  QUANTUM,     /* GIBBER_MUC_CONNECTION_PRIORITY_BULK */
+};
+
+/* Messages on the other streams that are bigger than this are streamed, so
+ * that only as much of them as the members' acks allow is sent out and kept
+ * for repairs at a time, rather than all of it at once. Only one message can
+ * be streamed at a time; while it waits for acks, the stream it's on waits
+ * with it but the others take their turns. */
+#define STREAM_THRESHOLD (64 * 1024)
+
+typedef struct {
+  guint16 id;
+  GibberMucConnectionPriority priority;
+  /* queued QueuedMessages */
+  GQueue queue;
+  gssize deficit;
+  /* whether it's in the active list, and if it got its quantum for the
+   * current turn */
+  gboolean active;
+  gboolean in_turn;
+  /* whether it's in the waiting list, as its first message is streamed and
+   * can't go on for now */
+  gboolean waiting;
+  GibberMucConnectionStreamStats stats;
+} MucStream;
+
+typedef struct {
+  guint8 *data;
+  gsize size;
+  gint64 queued;
+  /* for streamed messages, whether it was started and how much of it was
+   * sent */
+  gboolean started;
+  gsize sent;
+} QueuedMessage;
+
+/* The most common strings are at the end, where they are the cheapest to
+ * refer to */
+static const gchar compression_dictionary[] =
+  "<properties xmlns='http://laptop.org/xmpp/buddy-properties'>"
+  "<properties xmlns='http://laptop.org/xmpp/activity-properties'"
+  " activity='' room=''>"
+  "<property type='bytes' name='color'></property>"
+  "<property type='bool' name='private'>true</property></properties>"
+  "<parameter type='int' name=''></parameter>"
+  "<parameter type='uint' name=''></parameter>"
+  "<parameter type='str' name=''></parameter>"
+  "<tube type='stream' service='' stream-id='' id='' initiator=''>"
+  "<tube type='dbus' service='org.freedesktop.Telepathy.' stream-id=''"
+  " id='' initiator='' dbus-name=':2.'><parameters/></tube>"
+  "<tubes xmlns='" WOCKY_TELEPATHY_NS_TUBES "'></tubes>"
+  "<html xmlns='http://jabber.org/protocol/xhtml-im'>"
+  "<body xmlns='http://www.w3.org/1999/xhtml'></body></html>"
+  "<message type='normal' from='' to=''></message>"
+  "<message type='groupchat' from='' to=''><body></body></message>"
+  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+  "<?xml version='1.0' encoding='UTF-8'?>\n";
 
 #define DEBUG_FLAG DEBUG_MUC_CONNECTION
 #include "gibber-debug.h"
 
+/* Stanzas on the default stream are fed to a streaming reader, inside a
+ * stream of our own, so the parser context is kept from one stanza to the
+ * next instead of being rebuilt for each of them. */
+#define STREAM_OPENING "<stream:stream xmlns='" WOCKY_XMPP_NS_JABBER_CLIENT \
+  "' xmlns:stream='" WOCKY_XMPP_NS_STREAM "'>"
+
 static void _connection_received_data (GibberTransport *transport,
     GibberBuffer *buffer, gpointer user_data);
 
@@ -82,10 +186,45 @@ struct _GibberMucConnectionPrivate
   GibberMulticastTransport *mtransport;
   GibberRMulticastCausalTransport *rmctransport;
   GibberRMulticastTransport *rmtransport;
+  /* borrowed from rmctransport, our clock and random numbers too */
+  GibberTimerWheel *timers;
 
-  GArray *streams_used;
+  /* guint16 stream id -> MucStream */
+  GHashTable *streams;
   guint16 last_stream_allocated;
+  /* MucStreams with something queued, in turn order */
+  GQueue active_streams;
+  /* MucStreams waiting for the acks, or for the stream to be free */
+  GQueue waiting_streams;
+  /* the MucStream whose first message is being streamed, if any */
+  MucStream *streaming;
+  /* bytes we may send right now, refilled at send_rate */
+  gssize tokens;
+  gint64 tokens_updated;
+  gsize send_rate;
+  guint schedule_timer;
+  /* first error sending a queued message, reported by the next send */
+  GError *send_error;
   gulong rmc_connected_handler;
+  /* gets what we send instead of the room, in tests */
+  GibberMucConnectionTestSendFunc test_send_func;
+  gpointer test_send_data;
+
+  /* stanzas to something else than filter_to, or from senders rejected by
+   * sender_filter, are dropped before being parsed */
+  gchar *filter_to;
+  GibberMucConnectionSenderFilterFunc sender_filter;
+  gpointer sender_filter_data;
+
+  /* whether we compress the stanzas we send */
+  gboolean compress;
+  /* "k,r" while we send parity packets, NULL otherwise */
+  gchar *fec;
+  /* created the first time they're needed and reused afterwards */
+  z_stream *deflater;
+  z_stream *inflater;
+  GByteArray *deflated;
+  GByteArray *inflated;
 };
 
 #define GIBBER_MUC_CONNECTION_GET_PRIVATE(o)     (G_TYPE_INSTANCE_GET_PRIVATE ((o), GIBBER_TYPE_MUC_CONNECTION, GibberMucConnectionPrivate))
@@ -101,6 +240,50 @@ gibber_muc_connection_error_quark (void) {
 }
 
 
+static void
+queued_message_free (gpointer data)
+{
+  QueuedMessage *msg = data;
+
+  g_free (msg->data);
+  g_slice_free (QueuedMessage, msg);
+}
+
+static void
+muc_stream_free (gpointer data)
+{
+  MucStream *stream = data;
+
+  g_queue_foreach (&stream->queue, (GFunc) queued_message_free, NULL);
+  g_queue_clear (&stream->queue);
+  g_slice_free (MucStream, stream);
+}
+
+static MucStream *
+muc_stream_add (GibberMucConnection *self,
+    guint16 stream_id,
+    GibberMucConnectionPriority priority)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  MucStream *stream = g_slice_new0 (MucStream);
+
+  stream->id = stream_id;
+  stream->priority = priority;
+  g_queue_init (&stream->queue);
+  g_hash_table_insert (priv->streams, GUINT_TO_POINTER (stream_id), stream);
+
+  return stream;
+}
+
+static MucStream *
+muc_stream_lookup (GibberMucConnection *self,
+    guint16 stream_id)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  return g_hash_table_lookup (priv->streams, GUINT_TO_POINTER (stream_id));
+}
+
 static void
 gibber_muc_connection_init (GibberMucConnection *obj)
 {
@@ -108,14 +291,20 @@ gibber_muc_connection_init (GibberMucConnection *obj)
   guint16 stream_id;
 
   /* allocate any data required by the object here */
-  priv->reader = wocky_xmpp_reader_new_no_stream ();
+  priv->reader = wocky_xmpp_reader_new ();
   priv->writer = wocky_xmpp_writer_new_no_stream ();
+  wocky_xmpp_reader_push (priv->reader, (const guint8 *) STREAM_OPENING,
+      strlen (STREAM_OPENING));
 
-  priv->streams_used = g_array_sized_new (FALSE, TRUE, sizeof (guint16), 1);
+  priv->streams = g_hash_table_new_full (NULL, NULL, NULL, muc_stream_free);
   /* 0 is the "default" stream */
   stream_id = 0;
-  g_array_append_val (priv->streams_used, stream_id);
+  muc_stream_add (obj, stream_id, GIBBER_MUC_CONNECTION_PRIORITY_HIGH);
   priv->last_stream_allocated = 0;
+
+  g_queue_init (&priv->active_streams);
+  g_queue_init (&priv->waiting_streams);
+  priv->tokens = SEND_BURST;
 }
 
 static void gibber_muc_connection_dispose (GObject *object);
@@ -210,17 +399,44 @@ gibber_muc_connection_class_init (
       G_TYPE_NONE, 1, G_TYPE_POINTER);
 }
 
+static void flush_streams (GibberMucConnection *self);
+static void _rmctransport_stream_room_cb (
+    GibberRMulticastCausalTransport *transport, gpointer user_data);
+
 void
 gibber_muc_connection_dispose (GObject *object)
 {
   GibberMucConnection *self = GIBBER_MUC_CONNECTION (object);
   GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  guint recovered, repaired;
+  guint high_water, queue_drops, kernel_drops;
+  guint evictions, oldest_unstable;
+  gsize bytes;
 
   if (priv->dispose_has_run)
     return;
 
   priv->dispose_has_run = TRUE;
 
+  flush_streams (self);
+
+  gibber_muc_connection_get_fec_counters (self, &recovered, &repaired);
+  DEBUG ("%u lost packets rebuilt from parity packets, %u repaired",
+      recovered, repaired);
+
+  gibber_muc_connection_get_receive_stats (self, &high_water, &queue_drops,
+      &kernel_drops);
+  DEBUG ("%u packets queued at most, %u dropped by us, %u by the kernel",
+      high_water, queue_drops, kernel_drops);
+
+  gibber_muc_connection_get_cache_stats (self, &bytes, &evictions,
+      &oldest_unstable);
+  DEBUG ("%" G_GSIZE_FORMAT " bytes of packets cached, %u evicted, oldest "
+      "unacked one %u ms old", bytes, evictions, oldest_unstable);
+
+  g_signal_handlers_disconnect_by_func (priv->rmctransport,
+      _rmctransport_stream_room_cb, self);
+
   /* release any references held by the object here */
   g_object_unref (priv->reader);
   g_object_unref (priv->writer);
@@ -256,7 +472,33 @@ gibber_muc_connection_finalize (GObject *object)
     priv->parameters = NULL;
   }
 
-  g_array_unref (priv->streams_used);
+  g_queue_clear (&priv->active_streams);
+  g_queue_clear (&priv->waiting_streams);
+  g_hash_table_unref (priv->streams);
+
+  if (priv->send_error != NULL)
+    g_error_free (priv->send_error);
+
+  g_free (priv->filter_to);
+  g_free (priv->fec);
+
+  if (priv->deflater != NULL)
+    {
+      deflateEnd (priv->deflater);
+      g_slice_free (z_stream, priv->deflater);
+    }
+
+  if (priv->inflater != NULL)
+    {
+      inflateEnd (priv->inflater);
+      g_slice_free (z_stream, priv->inflater);
+    }
+
+  if (priv->deflated != NULL)
+    g_byte_array_unref (priv->deflated);
+
+  if (priv->inflated != NULL)
+    g_byte_array_unref (priv->inflated);
 
   G_OBJECT_CLASS (gibber_muc_connection_parent_class)->finalize (object);
 }
@@ -290,6 +532,19 @@ gibber_muc_connection_get_required_parameters (const gchar *protocol)
   return NULL;
 }
 
+/* Parameters that may be given to gibber_muc_connection_new on top of the
+ * required ones */
+const gchar **
+gibber_muc_connection_get_optional_parameters (const gchar *protocol)
+{
+  static const gchar *parameters[] = { COMPRESSION_KEY, FEC_KEY, NULL };
+
+  if (!strcmp (protocol, WOCKY_TELEPATHY_NS_CLIQUE))
+    return parameters;
+
+  return NULL;
+}
+
 static gboolean
 gibber_muc_connection_validate_address (const gchar *address,
   const gchar *port, GError **error)
@@ -358,13 +613,14 @@ gibber_muc_connection_create_random_address (GibberMucConnection *self)
   g_free (priv->port);
 
   /* Just pick any port above 1024 */
-  p = g_random_int_range (1024, G_MAXUINT16);
+  p = gibber_timer_wheel_random_int_range (priv->timers, 1024, G_MAXUINT16);
   priv->port = g_strdup_printf ("%d", p);
   /* RFC 2365 defines 239.255.0.0/16 as the IPv4 local scope (for multicast
    * addresses). One /24 net was randomly picked out of this and is used for
    * Clique muc groups */
   priv->address =
-      g_strdup_printf ("239.255.71.%d", g_random_int_range (1, 254));
+      g_strdup_printf ("239.255.71.%d",
+          gibber_timer_wheel_random_int_range (priv->timers, 1, 254));
 
   /* Just to be sure */
   ret = gibber_muc_connection_validate_address (priv->address, priv->port,
@@ -381,8 +637,11 @@ gibber_muc_connection_new (const gchar *name, const gchar *protocol,
 {
   const gchar *address = NULL;
   const gchar *port = NULL;
+  const gchar *compression = NULL;
+  const gchar *fec = NULL;
   GibberMucConnection *result;
   GibberMucConnectionPrivate *priv;
+  guint k, r;
 
   if (protocol != NULL && strcmp (protocol, WOCKY_TELEPATHY_NS_CLIQUE) != 0)
     {
@@ -407,6 +666,9 @@ gibber_muc_connection_new (const gchar *name, const gchar *protocol,
         {
           goto err;
         }
+
+      compression = g_hash_table_lookup (parameters, COMPRESSION_KEY);
+      fec = g_hash_table_lookup (parameters, FEC_KEY);
     }
 
   /* Got an address, so we can init the transport */
@@ -427,13 +689,37 @@ gibber_muc_connection_new (const gchar *name, const gchar *protocol,
   priv->address = g_strdup (address);
   priv->port = g_strdup (port);
 
+  if (!wocky_strdiff (compression, COMPRESSION_DEFLATE))
+    {
+      priv->compress = TRUE;
+    }
+  else if (compression != NULL)
+    {
+      /* We can still talk to the room, just without compressing what we
+       * send */
+      DEBUG ("Unknown compression method %s, not compressing", compression);
+    }
+
   priv->mtransport = gibber_multicast_transport_new ();
   priv->rmctransport = gibber_r_multicast_causal_transport_new (
         GIBBER_TRANSPORT (priv->mtransport), priv->name);
   priv->rmtransport = gibber_r_multicast_transport_new (priv->rmctransport);
+  priv->timers = gibber_r_multicast_causal_transport_get_timers (
+      priv->rmctransport);
+  priv->tokens_updated = gibber_timer_wheel_get_time (priv->timers);
 
   gibber_transport_set_handler (GIBBER_TRANSPORT (priv->rmtransport),
       _connection_received_data, result);
+  g_signal_connect (priv->rmctransport, "stream-room",
+      G_CALLBACK (_rmctransport_stream_room_cb), result);
+
+  if (fec != NULL)
+    {
+      if (gibber_muc_connection_parse_fec (fec, &k, &r))
+        gibber_muc_connection_set_fec (result, k, r);
+      else
+        DEBUG ("Invalid FEC parameter %s, not sending parity packets", fec);
+    }
 
   return result;
 
@@ -587,6 +873,9 @@ gibber_muc_connection_disconnect (GibberMucConnection *connection)
   connection->state = GIBBER_MUC_CONNECTION_DISCONNECTING;
   g_signal_emit (connection, signals[DISCONNECTING], 0);
 
+  /* before saying goodbye */
+  flush_streams (connection);
+
   gibber_transport_disconnect (GIBBER_TRANSPORT (priv->rmtransport));
 }
 
@@ -615,153 +904,1122 @@ gibber_muc_connection_get_parameters (GibberMucConnection *connection)
       priv->parameters = g_hash_table_new (g_str_hash, g_str_equal);
       g_hash_table_insert (priv->parameters, ADDRESS_KEY, priv->address);
       g_hash_table_insert (priv->parameters, PORT_KEY, priv->port);
+
+      if (priv->compress)
+        g_hash_table_insert (priv->parameters, COMPRESSION_KEY,
+            COMPRESSION_DEFLATE);
+
+      if (priv->fec != NULL)
+        g_hash_table_insert (priv->parameters, FEC_KEY, priv->fec);
     }
 
   return priv->parameters;
 }
 
-static void
-_connection_received_data (GibberTransport *transport, GibberBuffer *buffer,
+void
+gibber_muc_connection_set_filter (GibberMucConnection *connection,
+    const gchar *to,
+    GibberMucConnectionSenderFilterFunc sender_filter,
     gpointer user_data)
 {
-  GibberMucConnection *self = GIBBER_MUC_CONNECTION (user_data);
-  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
-  GibberRMulticastBuffer *rmbuffer = (GibberRMulticastBuffer *) buffer;
-  WockyStanza *stanza;
-  GError *error = NULL;
+  GibberMucConnectionPrivate *priv =
+    GIBBER_MUC_CONNECTION_GET_PRIVATE (connection);
 
-  g_assert (buffer->length > 0);
+  g_free (priv->filter_to);
+  priv->filter_to = g_strdup (to);
+  priv->sender_filter = sender_filter;
+  priv->sender_filter_data = user_data;
+}
 
-  if (rmbuffer->stream_id != GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM)
+static const guint8 *
+skip_until (const guint8 *p,
+    const guint8 *end,
+    const gchar *marker)
+{
+  gsize len = strlen (marker);
+
+  for (; p + len <= end; p++)
     {
-      g_signal_emit (self, signals[RECEIVED_DATA], 0,
-          rmbuffer->sender, (guint) rmbuffer->stream_id,
-          buffer->data, buffer->length);
-      return;
+      if (memcmp (p, marker, len) == 0)
+        return p + len;
     }
 
-  /* push the data into the reader */
-  wocky_xmpp_reader_push (priv->reader, buffer->data, buffer->length);
+  return NULL;
+}
 
-  error = wocky_xmpp_reader_get_error (priv->reader);
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
 
-  if (error != NULL)
+/* Looks at the 'to' attribute of the first element in data without parsing
+ * it. Only returns TRUE if it's certainly not addressed to @to; anything
+ * unusual is left for the reader to deal with. */
+static gboolean
+addressed_elsewhere (const gchar *to,
+    const guint8 *data,
+    gsize length)
+{
+  const guint8 *p = data, *end = data + length;
+
+  /* skip the XML declaration, comments and such */
+  for (;;)
     {
-      DEBUG ("reader error: %s", error->message);
-      g_signal_emit (self, signals[PARSE_ERROR], 0);
-      g_clear_error (&error);
+      while (p < end && *p != '<')
+        p++;
+
+      if (p + 1 >= end)
+        return FALSE;
+
+      if (p[1] == '?')
+        p = skip_until (p, end, "?>");
+      else if (p[1] == '!')
+        p = skip_until (p, end, ">");
+      else
+        break;
 
-      wocky_xmpp_reader_reset (priv->reader);
+      if (p == NULL)
+        return FALSE;
     }
 
-  /* now check if we got a stanza out of it */
-  stanza = wocky_xmpp_reader_pop_stanza (priv->reader);
+  /* element name */
+  for (p++; p < end && !IS_SPACE (*p) && *p != '>' && *p != '/'; p++)
+    ;
 
-  if (stanza != NULL)
+  while (p < end)
     {
-      g_signal_emit (self, signals[RECEIVED_STANZA], 0,
-          rmbuffer->sender, stanza);
-      g_object_unref (stanza);
+      const guint8 *name, *value;
+      gsize name_len;
+      guint8 quote;
+
+      while (p < end && IS_SPACE (*p))
+        p++;
+
+      if (p >= end || *p == '>' || *p == '/')
+        return FALSE;
+
+      name = p;
+      while (p < end && !IS_SPACE (*p) && *p != '=')
+        p++;
+      name_len = p - name;
+
+      while (p < end && IS_SPACE (*p))
+        p++;
+      if (p >= end || *p != '=')
+        return FALSE;
+
+      for (p++; p < end && IS_SPACE (*p); p++)
+        ;
+      if (p >= end || (*p != '\'' && *p != '"'))
+        return FALSE;
+
+      quote = *p;
+      value = ++p;
+      while (p < end && *p != quote)
+        p++;
+      if (p >= end)
+        return FALSE;
+
+      if (name_len == 2 && memcmp (name, "to", 2) == 0)
+        {
+          gsize value_len = p - value;
+
+          /* don't bother unescaping */
+          if (memchr (value, '&', value_len) != NULL)
+            return FALSE;
 
-      wocky_xmpp_reader_reset (priv->reader);
+          return value_len != strlen (to) ||
+              memcmp (value, to, value_len) != 0;
+        }
+
+      p++;
     }
+
+  return FALSE;
 }
 
-gboolean
-gibber_muc_connection_send (GibberMucConnection *connection,
-    WockyStanza *stanza, GError **error)
+static void
+reopen_reader (GibberMucConnection *self)
 {
-  GibberMucConnectionPrivate *priv =
-    GIBBER_MUC_CONNECTION_GET_PRIVATE (connection);
-  const guint8 *data;
-  gsize length;
-
-  wocky_xmpp_writer_write_stanza (priv->writer, stanza,
-      &data, &length);
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
 
-  return gibber_transport_send (GIBBER_TRANSPORT (priv->rmtransport),
-      data, length, error);
+  wocky_xmpp_reader_reset (priv->reader);
+  wocky_xmpp_reader_push (priv->reader, (const guint8 *) STREAM_OPENING,
+      strlen (STREAM_OPENING));
 }
 
-static gboolean
-stream_is_used (GibberMucConnection *self,
-                guint16 stream_id)
+/* Returns the compressed stanza, or NULL if it's not worth it */
+static const guint8 *
+deflate_stanza (GibberMucConnection *self,
+    const guint8 *data,
+    gsize length,
+    gsize *deflated_length)
 {
   GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
-  guint i;
+  z_stream *z;
+  gsize bound;
 
-  for (i = 0; i < priv->streams_used->len; i++)
+  if (priv->deflater == NULL)
     {
-      guint16 tmp;
+      priv->deflater = g_slice_new0 (z_stream);
+      priv->deflated = g_byte_array_new ();
 
-      tmp = g_array_index (priv->streams_used, guint16, i);
-      if (tmp == stream_id)
+      if (deflateInit2 (priv->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+            -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
         {
-          return TRUE;
+          DEBUG ("Failed to initialise deflate: %s", priv->deflater->msg);
+          g_slice_free (z_stream, priv->deflater);
+          priv->deflater = NULL;
+          priv->compress = FALSE;
+          return NULL;
         }
     }
+  else
+    {
+      deflateReset (priv->deflater);
+    }
 
-  return FALSE;
-}
+  z = priv->deflater;
 
-gboolean
-gibber_muc_connection_send_raw (GibberMucConnection *connection,
-    guint16 stream_id, const guint8 *data, gsize size, GError **error)
-{
-  GibberMucConnectionPrivate *priv =
-    GIBBER_MUC_CONNECTION_GET_PRIVATE (connection);
+  /* every stanza is compressed on its own so it can be decompressed
+   * whatever the other ones we got */
+  deflateSetDictionary (z, (const Bytef *) compression_dictionary,
+      sizeof (compression_dictionary) - 1);
+
+  bound = deflateBound (z, length) + 1;
+  g_byte_array_set_size (priv->deflated, bound);
+  priv->deflated->data[0] = COMPRESSED_MARKER;
 
-  g_assert (stream_is_used (connection, stream_id));
+  z->next_in = (Bytef *) data;
+  z->avail_in = length;
+  z->next_out = priv->deflated->data + 1;
+  z->avail_out = bound - 1;
 
-  return gibber_r_multicast_transport_send (priv->rmtransport,
-      stream_id, data, size, error);
+  if (deflate (z, Z_FINISH) != Z_STREAM_END)
+    {
+      DEBUG ("Failed to compress stanza: %s", z->msg);
+      return NULL;
+    }
+
+  *deflated_length = z->total_out + 1;
+
+  if (*deflated_length >= length)
+    return NULL;
+
+  return priv->deflated->data;
 }
 
-guint16
-gibber_muc_connection_new_stream (GibberMucConnection *self)
+static const guint8 *
+inflate_stanza (GibberMucConnection *self,
+    const guint8 *data,
+    gsize length,
+    gsize *inflated_length)
 {
   GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
-  guint16 stream_id;
+  z_stream *z;
+  int ret;
 
-  if (priv->streams_used->len >= G_MAXUINT16)
-    /* All streams are allocated */
-    return 0;
+  g_assert (length > 0 && data[0] == COMPRESSED_MARKER);
 
-  /* in pathological cases (nearly running out of streams) that function
-   * will be O(n**2) */
-  stream_id = priv->last_stream_allocated + 1;
-  while (stream_is_used (self, stream_id))
+  if (priv->inflater == NULL)
     {
-      if (stream_id == G_MAXUINT16)
-        stream_id = 1;
-      else
-        stream_id++;
+      priv->inflater = g_slice_new0 (z_stream);
+      priv->inflated = g_byte_array_new ();
+
+      if (inflateInit2 (priv->inflater, -MAX_WBITS) != Z_OK)
+        {
+          DEBUG ("Failed to initialise inflate: %s", priv->inflater->msg);
+          g_slice_free (z_stream, priv->inflater);
+          priv->inflater = NULL;
+          return NULL;
+        }
+    }
+  else
+    {
+      inflateReset (priv->inflater);
     }
 
-  priv->last_stream_allocated = stream_id;
-  g_array_append_val (priv->streams_used, stream_id);
+  z = priv->inflater;
 
-  return stream_id;
+  inflateSetDictionary (z, (const Bytef *) compression_dictionary,
+      sizeof (compression_dictionary) - 1);
+
+  if (priv->inflated->len < 4 * length)
+    g_byte_array_set_size (priv->inflated,
+        MIN (4 * length, MAX_INFLATED_SIZE));
+
+  z->next_in = (Bytef *) data + 1;
+  z->avail_in = length - 1;
+  z->next_out = priv->inflated->data;
+  z->avail_out = priv->inflated->len;
+
+  while ((ret = inflate (z, Z_NO_FLUSH)) != Z_STREAM_END)
+    {
+      if ((ret != Z_OK && ret != Z_BUF_ERROR) || z->avail_out > 0)
+        {
+          /* corrupted or truncated */
+          DEBUG ("Failed to decompress stanza: %s",
+              z->msg != NULL ? z->msg : "truncated data");
+          return NULL;
+        }
+
+      if (priv->inflated->len >= MAX_INFLATED_SIZE)
+        {
+          DEBUG ("Compressed stanza is too big");
+          return NULL;
+        }
+
+      g_byte_array_set_size (priv->inflated,
+          MIN (2 * priv->inflated->len, MAX_INFLATED_SIZE));
+      z->next_out = priv->inflated->data + z->total_out;
+      z->avail_out = priv->inflated->len - z->total_out;
+    }
+
+  *inflated_length = z->total_out;
+  return priv->inflated->data;
 }
 
-void
-gibber_muc_connection_free_stream (GibberMucConnection *self,
-                                   guint16 stream_id)
+static void
+receive_stanzas (GibberMucConnection *self,
+    const gchar *sender,
+    const guint8 *data,
+    gsize length)
 {
   GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
-  guint i;
+  WockyStanza *stanza;
+  GError *error = NULL;
+  guint received = 0;
 
-  g_assert (stream_id != 0);
+  if (priv->sender_filter != NULL &&
+      !priv->sender_filter (self, sender, priv->sender_filter_data))
+    {
+      DEBUG ("dropping data from filtered sender %s", sender);
+      return;
+    }
 
-  for (i = 0; i < priv->streams_used->len; i++)
+  if (length > 0 && data[0] == COMPRESSED_MARKER)
     {
-      guint16 tmp;
+      data = inflate_stanza (self, data, length, &length);
 
-      tmp = g_array_index (priv->streams_used, guint16, i);
-      if (tmp == stream_id)
+      if (data == NULL)
         {
-          g_array_remove_index_fast (priv->streams_used, i);
+          g_signal_emit (self, signals[PARSE_ERROR], 0,
+              "invalid compressed data");
           return;
         }
     }
+
+  if (priv->filter_to != NULL &&
+      addressed_elsewhere (priv->filter_to, data, length))
+    {
+      DEBUG ("dropping stanza from %s to another room", sender);
+      return;
+    }
+
+  /* senders write their stanzas as standalone documents, whose XML
+   * declaration can't appear in the middle of our stream */
+  if (length >= 5 && memcmp (data, "<?xml", 5) == 0)
+    {
+      const guint8 *p = skip_until (data, data + length, "?>");
+
+      if (p != NULL)
+        {
+          length -= p - data;
+          data = p;
+        }
+    }
+
+  if (length == 0)
+    return;
+
+  g_object_ref (self);
+
+  wocky_xmpp_reader_push (priv->reader, data, length);
+
+  /* a buffer may carry several stanzas */
+  while ((stanza = wocky_xmpp_reader_pop_stanza (priv->reader)) != NULL)
+    {
+      received++;
+      g_signal_emit (self, signals[RECEIVED_STANZA], 0, sender, stanza);
+      g_object_unref (stanza);
+    }
+
+  error = wocky_xmpp_reader_get_error (priv->reader);
+
+  if (error != NULL)
+    {
+      DEBUG ("reader error: %s", error->message);
+      g_signal_emit (self, signals[PARSE_ERROR], 0, error->message);
+      g_clear_error (&error);
+
+      reopen_reader (self);
+    }
+  else if (received == 0 ||
+      wocky_xmpp_reader_get_state (priv->reader) !=
+        WOCKY_XMPP_READER_STATE_OPENED)
+    {
+      /* Buffers are made of complete stanzas; don't let what's left of this
+       * one get mixed with the next sender's data */
+      DEBUG ("incomplete or unexpected data from %s", sender);
+      g_signal_emit (self, signals[PARSE_ERROR], 0,
+          "incomplete or unexpected data");
+
+      reopen_reader (self);
+    }
+
+  g_object_unref (self);
+}
+
+static void
+_connection_received_data (GibberTransport *transport, GibberBuffer *buffer,
+    gpointer user_data)
+{
+  GibberMucConnection *self = GIBBER_MUC_CONNECTION (user_data);
+  GibberRMulticastBuffer *rmbuffer = (GibberRMulticastBuffer *) buffer;
+
+  g_assert (buffer->length > 0);
+
+  if (rmbuffer->stream_id != GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM)
+    {
+      g_signal_emit (self, signals[RECEIVED_DATA], 0,
+          rmbuffer->sender, (guint) rmbuffer->stream_id,
+          buffer->data, buffer->length);
+      return;
+    }
+
+  receive_stanzas (self, rmbuffer->sender, buffer->data, buffer->length);
+}
+
+void
+_gibber_muc_connection_TEST_receive (GibberMucConnection *connection,
+    const gchar *sender,
+    const guint8 *data,
+    gsize length)
+{
+  receive_stanzas (connection, sender, data, length);
+}
+
+void
+_gibber_muc_connection_TEST_set_send_func (GibberMucConnection *connection,
+    GibberTimerWheel *timers,
+    GibberMucConnectionTestSendFunc func,
+    gpointer user_data)
+{
+  GibberMucConnectionPrivate *priv =
+      GIBBER_MUC_CONNECTION_GET_PRIVATE (connection);
+
+  g_assert (priv->schedule_timer == 0);
+
+  priv->timers = timers;
+  priv->tokens_updated = gibber_timer_wheel_get_time (timers);
+  priv->test_send_func = func;
+  priv->test_send_data = user_data;
+}
+
+static void
+refill_tokens (GibberMucConnection *self)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  gint64 now = gibber_timer_wheel_get_time (priv->timers);
+
+  if (priv->send_rate == 0)
+    {
+      priv->tokens = SEND_BURST;
+    }
+  else
+    {
+      priv->tokens += (now - priv->tokens_updated) * priv->send_rate / 1000;
+      priv->tokens = MIN (priv->tokens, SEND_BURST);
+    }
+
+  priv->tokens_updated = now;
+}
+
+static void
+count_sent (GibberMucConnection *self,
+    MucStream *stream,
+    gsize size,
+    gint64 queued)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  guint64 latency = gibber_timer_wheel_get_time (priv->timers) - queued;
+
+  stream->stats.bytes_sent += size;
+  stream->stats.messages_sent++;
+  stream->stats.total_latency += latency;
+  stream->stats.max_latency = MAX (stream->stats.max_latency, latency);
+}
+
+static gboolean
+transmit (GibberMucConnection *self,
+    MucStream *stream,
+    const guint8 *data,
+    gsize size,
+    gint64 queued,
+    GError **error)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  if (priv->send_rate != 0)
+    priv->tokens -= size;
+
+  count_sent (self, stream, size, queued);
+
+  if (priv->test_send_func != NULL)
+    return priv->test_send_func (self, stream->id, data, size,
+        priv->test_send_data);
+
+  return gibber_r_multicast_transport_send (priv->rmtransport, stream->id,
+      data, size, error);
+}
+
+static gboolean
+is_streamed (guint16 stream_id,
+    gsize size)
+{
+  return stream_id != GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM
+      && size > STREAM_THRESHOLD;
+}
+
+/* Puts stream at the end of the turn order */
+static void
+stream_activate (GibberMucConnection *self,
+    MucStream *stream)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  stream->active = TRUE;
+  g_queue_push_tail (&priv->active_streams, stream);
+}
+
+/* Takes stream out of the turns, until something is queued on it again */
+static void
+stream_deactivate (GibberMucConnection *self,
+    MucStream *stream)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  if (stream->active)
+    g_queue_remove (&priv->active_streams, stream);
+
+  if (stream->waiting)
+    g_queue_remove (&priv->waiting_streams, stream);
+
+  stream->active = FALSE;
+  stream->waiting = FALSE;
+  /* nothing left to use the rest of the quantum on */
+  stream->deficit = 0;
+  stream->in_turn = FALSE;
+}
+
+/* Takes stream out of the turns until wake_streams () is called */
+static void
+stream_wait (GibberMucConnection *self,
+    MucStream *stream)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  stream_deactivate (self, stream);
+  stream->waiting = TRUE;
+  g_queue_push_tail (&priv->waiting_streams, stream);
+}
+
+static void
+wake_streams (GibberMucConnection *self)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  MucStream *stream;
+
+  while ((stream = g_queue_pop_head (&priv->waiting_streams)) != NULL)
+    {
+      stream->waiting = FALSE;
+      stream_activate (self, stream);
+    }
+}
+
+/* Sends the next part of the streamed message msg of stream, as much of it
+ * as the acks, and if paced its turn and the rate, allow. Returns FALSE if
+ * some of it is left. */
+static gboolean
+transmit_part (GibberMucConnection *self,
+    MucStream *stream,
+    QueuedMessage *msg,
+    gboolean paced,
+    GError **error)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  gsize size = msg->size - msg->sent;
+
+  if (!msg->started)
+    {
+      if (!gibber_r_multicast_transport_send_start (priv->rmtransport,
+            stream->id, msg->size, error))
+        return TRUE;
+
+      msg->started = TRUE;
+      priv->streaming = stream;
+    }
+
+  if (paced)
+    {
+      size = MIN (size,
+          gibber_r_multicast_transport_get_stream_room (priv->rmtransport));
+      size = MIN (size, (gsize) MAX (stream->deficit, 0));
+
+      if (priv->send_rate != 0)
+        size = MIN (size, (gsize) MAX (priv->tokens, 0));
+    }
+
+  if (size == 0)
+    return FALSE;
+
+  if (priv->send_rate != 0)
+    priv->tokens -= size;
+
+  /* Packets that couldn't be written are repaired like lost ones, so we
+   * go on regardless */
+  gibber_r_multicast_transport_send_chunk (priv->rmtransport,
+      msg->data + msg->sent, size, error);
+  msg->sent += size;
+
+  if (msg->sent < msg->size)
+    return FALSE;
+
+  count_sent (self, stream, msg->size, msg->queued);
+
+  /* The streams waiting for their turn to stream can go on */
+  priv->streaming = NULL;
+  wake_streams (self);
+
+  return TRUE;
+}
+
+/* Sends the first message queued on stream, or as much of it as we may if
+ * it's streamed and paced. Returns the number of bytes sent and sets done if
+ * the message was taken off the queue. */
+static gsize
+send_head (GibberMucConnection *self,
+    MucStream *stream,
+    gboolean paced,
+    gboolean *done)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  QueuedMessage *msg = g_queue_peek_head (&stream->queue);
+  GError *error = NULL;
+  gsize sent;
+
+  if (is_streamed (stream->id, msg->size))
+    {
+      sent = msg->sent;
+      *done = transmit_part (self, stream, msg, paced, &error);
+      sent = msg->sent - sent;
+    }
+  else
+    {
+      transmit (self, stream, msg->data, msg->size, msg->queued, &error);
+      *done = TRUE;
+      sent = msg->size;
+    }
+
+  if (error != NULL)
+    {
+      DEBUG ("sending queued data on stream %u failed: %s", stream->id,
+          error->message);
+
+      if (priv->send_error == NULL)
+        priv->send_error = error;
+      else
+        g_error_free (error);
+    }
+
+  if (*done)
+    {
+      g_queue_pop_head (&stream->queue);
+      stream->stats.bytes_queued -= msg->size;
+      stream->stats.messages_queued--;
+      queued_message_free (msg);
+    }
+
+  return sent;
+}
+
+/* Gives the turn to the next stream; this one will get its quantum again */
+static void
+next_turn (GibberMucConnection *self)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  MucStream *stream = g_queue_pop_head (&priv->active_streams);
+
+  stream->in_turn = FALSE;
+  g_queue_push_tail (&priv->active_streams, stream);
+}
+
+static gboolean schedule_cb (gpointer user_data);
+
+/* Sends queued messages, as many as the rate allows */
+static void
+run_scheduler (GibberMucConnection *self)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  refill_tokens (self);
+
+  while (priv->tokens > 0 && !g_queue_is_empty (&priv->active_streams))
+    {
+      MucStream *stream = g_queue_peek_head (&priv->active_streams);
+      QueuedMessage *msg = g_queue_peek_head (&stream->queue);
+      gboolean streamed = is_streamed (stream->id, msg->size);
+      gboolean done;
+
+      if (streamed && priv->streaming != NULL && priv->streaming != stream)
+        {
+          /* Woken up once that one is done */
+          stream_wait (self, stream);
+          continue;
+        }
+
+      if (!stream->in_turn)
+        {
+          stream->deficit += priority_quantums[stream->priority];
+          stream->in_turn = TRUE;
+        }
+
+      /* Streamed messages go in parts as big as the deficit allows */
+      if (!streamed && (gssize) msg->size > stream->deficit)
+        {
+          next_turn (self);
+          continue;
+        }
+
+      stream->deficit -= send_head (self, stream, TRUE, &done);
+
+      if (g_queue_is_empty (&stream->queue))
+        {
+          stream_deactivate (self, stream);
+        }
+      else if (!done && gibber_r_multicast_transport_get_stream_room (
+            priv->rmtransport) == 0)
+        {
+          /* Woken up by stream-room once the acks came in */
+          stream_wait (self, stream);
+        }
+      else if (!done && stream->deficit <= 0)
+        {
+          next_turn (self);
+        }
+    }
+
+  if (!g_queue_is_empty (&priv->active_streams))
+    {
+      if (priv->schedule_timer == 0)
+        priv->schedule_timer = gibber_timer_wheel_add (priv->timers,
+            SCHEDULE_INTERVAL, schedule_cb, self);
+    }
+  else if (priv->schedule_timer != 0)
+    {
+      gibber_timer_wheel_remove (priv->timers, priv->schedule_timer);
+      priv->schedule_timer = 0;
+    }
+}
+
+static gboolean
+schedule_cb (gpointer user_data)
+{
+  GibberMucConnection *self = GIBBER_MUC_CONNECTION (user_data);
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  priv->schedule_timer = 0;
+  run_scheduler (self);
+
+  return FALSE;
+}
+
+/* The acks let the message being streamed go on */
+static void
+_rmctransport_stream_room_cb (GibberRMulticastCausalTransport *transport,
+    gpointer user_data)
+{
+  GibberMucConnection *self = GIBBER_MUC_CONNECTION (user_data);
+
+  wake_streams (self);
+  run_scheduler (self);
+}
+
+/* Sends everything that's queued on stream regardless of the turns, the
+ * rate and the acks, or drops it if the room can't be sent to anymore */
+static void
+flush_stream (GibberMucConnection *self,
+    MucStream *stream)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  MucStream *streaming = priv->streaming;
+  gboolean done;
+
+  if (g_queue_is_empty (&stream->queue))
+    return;
+
+  if (priv->test_send_func == NULL
+      && gibber_transport_get_state (GIBBER_TRANSPORT (priv->rmtransport))
+      != GIBBER_TRANSPORT_CONNECTED)
+    {
+      DEBUG ("Not connected anymore, dropping %u messages queued on stream "
+          "%u", g_queue_get_length (&stream->queue), stream->id);
+
+      g_queue_foreach (&stream->queue, (GFunc) queued_message_free, NULL);
+      g_queue_clear (&stream->queue);
+      stream->stats.bytes_queued = 0;
+      stream->stats.messages_queued = 0;
+      stream_deactivate (self, stream);
+
+      if (priv->streaming == stream)
+        {
+          priv->streaming = NULL;
+          wake_streams (self);
+        }
+
+      return;
+    }
+
+  /* Only one message can be streamed at a time */
+  if (streaming != NULL && streaming != stream)
+    {
+      send_head (self, streaming, FALSE, &done);
+
+      if (g_queue_is_empty (&streaming->queue))
+        stream_deactivate (self, streaming);
+    }
+
+  while (!g_queue_is_empty (&stream->queue))
+    send_head (self, stream, FALSE, &done);
+
+  stream_deactivate (self, stream);
+}
+
+/* Flushes every stream, the default one last as what's sent on it may refer
+ * to the others */
+static void
+flush_streams (GibberMucConnection *self)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, priv->streams);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      MucStream *stream = value;
+
+      if (stream->id != GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM)
+        flush_stream (self, stream);
+    }
+
+  flush_stream (self,
+      muc_stream_lookup (self, GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM));
+
+  if (priv->schedule_timer != 0)
+    {
+      gibber_timer_wheel_remove (priv->timers, priv->schedule_timer);
+      priv->schedule_timer = 0;
+    }
+}
+
+/* Sends right away if nothing is waiting and the rate allows it, queues
+ * otherwise, as do big messages, which are then streamed out. An error
+ * sending a queued message is reported by the next call, which doesn't send
+ * anything then. */
+static gboolean
+stream_send (GibberMucConnection *self,
+    MucStream *stream,
+    const guint8 *data,
+    gsize size,
+    GError **error)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  QueuedMessage *msg;
+
+  if (priv->send_error != NULL)
+    {
+      g_propagate_error (error, priv->send_error);
+      priv->send_error = NULL;
+      return FALSE;
+    }
+
+  refill_tokens (self);
+
+  if (g_queue_is_empty (&priv->active_streams)
+      && g_queue_is_empty (&stream->queue) && priv->tokens > 0
+      && !is_streamed (stream->id, size))
+    return transmit (self, stream, data, size,
+        gibber_timer_wheel_get_time (priv->timers), error);
+
+  msg = g_slice_new0 (QueuedMessage);
+  msg->data = g_memdup (data, size);
+  msg->size = size;
+  msg->queued = gibber_timer_wheel_get_time (priv->timers);
+  g_queue_push_tail (&stream->queue, msg);
+
+  stream->stats.bytes_queued += size;
+  stream->stats.messages_queued++;
+
+  /* A waiting one is woken up when it can go on */
+  if (!stream->active && !stream->waiting)
+    stream_activate (self, stream);
+
+  run_scheduler (self);
+  return TRUE;
+}
+
+gboolean
+gibber_muc_connection_send (GibberMucConnection *connection,
+    WockyStanza *stanza, GError **error)
+{
+  GibberMucConnectionPrivate *priv =
+    GIBBER_MUC_CONNECTION_GET_PRIVATE (connection);
+  const guint8 *data;
+  gsize length;
+
+  wocky_xmpp_writer_write_stanza (priv->writer, stanza,
+      &data, &length);
+
+  if (priv->compress)
+    {
+      const guint8 *deflated;
+      gsize deflated_length;
+
+      deflated = deflate_stanza (connection, data, length, &deflated_length);
+
+      if (deflated != NULL)
+        {
+          data = deflated;
+          length = deflated_length;
+        }
+    }
+
+  return stream_send (connection,
+      muc_stream_lookup (connection, GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM),
+      data, length, error);
+}
+
+static gboolean
+stream_is_used (GibberMucConnection *self,
+                guint16 stream_id)
+{
+  return muc_stream_lookup (self, stream_id) != NULL;
+}
+
+gboolean
+gibber_muc_connection_send_raw (GibberMucConnection *connection,
+    guint16 stream_id, const guint8 *data, gsize size, GError **error)
+{
+  MucStream *stream = muc_stream_lookup (connection, stream_id);
+
+  g_assert (stream != NULL);
+
+  return stream_send (connection, stream, data, size, error);
+}
+
+guint16
+gibber_muc_connection_new_stream (GibberMucConnection *self,
+    GibberRMulticastOrdering ordering)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  guint16 stream_id;
+
+  if (g_hash_table_size (priv->streams) >= G_MAXUINT16)
+    /* All streams are allocated */
+    return 0;
+
+  /* in pathological cases (nearly running out of streams) that function
+   * will be O(n**2) */
+  stream_id = priv->last_stream_allocated + 1;
+  while (stream_is_used (self, stream_id))
+    {
+      if (stream_id == G_MAXUINT16)
+        stream_id = 1;
+      else
+        stream_id++;
+    }
+
+  priv->last_stream_allocated = stream_id;
+  muc_stream_add (self, stream_id, GIBBER_MUC_CONNECTION_PRIORITY_NORMAL);
+  gibber_r_multicast_causal_transport_set_stream_ordering (priv->rmctransport,
+      stream_id, ordering);
+
+  return stream_id;
+}
+
+void
+gibber_muc_connection_free_stream (GibberMucConnection *self,
+                                   guint16 stream_id)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+  MucStream *stream;
+
+  g_assert (stream_id != 0);
+
+  stream = muc_stream_lookup (self, stream_id);
+  if (stream == NULL)
+    return;
+
+  /* What was sent on it still has to go out, before the others are told
+   * it's gone */
+  flush_stream (self, stream);
+
+  DEBUG ("stream %u: %" G_GUINT64_FORMAT " bytes in %" G_GUINT64_FORMAT
+      " messages, latency avg %" G_GUINT64_FORMAT "ms max %" G_GUINT64_FORMAT
+      "ms", stream_id, stream->stats.bytes_sent, stream->stats.messages_sent,
+      stream->stats.messages_sent > 0 ?
+        stream->stats.total_latency / stream->stats.messages_sent : 0,
+      stream->stats.max_latency);
+
+  g_hash_table_remove (priv->streams, GUINT_TO_POINTER (stream_id));
+
+  if (!priv->dispose_has_run)
+    {
+      gibber_r_multicast_causal_transport_set_stream_ordering (
+          priv->rmctransport, stream_id, GIBBER_R_MULTICAST_ORDERING_CAUSAL);
+      /* Flushing it may have let others go on */
+      run_scheduler (self);
+    }
+}
+
+void
+gibber_muc_connection_set_stream_priority (GibberMucConnection *self,
+    guint16 stream_id,
+    GibberMucConnectionPriority priority)
+{
+  MucStream *stream = muc_stream_lookup (self, stream_id);
+
+  g_return_if_fail (stream != NULL);
+  g_return_if_fail (priority < G_N_ELEMENTS (priority_quantums));
+
+  stream->priority = priority;
+}
+
+gboolean
+gibber_muc_connection_get_stream_stats (GibberMucConnection *self,
+    guint16 stream_id,
+    GibberMucConnectionStreamStats *stats)
+{
+  MucStream *stream = muc_stream_lookup (self, stream_id);
+
+  if (stream == NULL)
+    return FALSE;
+
+  *stats = stream->stats;
+  return TRUE;
+}
+
+void
+gibber_muc_connection_set_send_rate (GibberMucConnection *self,
+    gsize rate)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  priv->send_rate = rate;
+  run_scheduler (self);
+}
+
+void
+gibber_muc_connection_set_fec (GibberMucConnection *self,
+    guint k,
+    guint r)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  g_return_if_fail (priv->parameters == NULL);
+  g_return_if_fail (k <= G_MAXUINT8);
+  g_return_if_fail (k == 0 || (r >= 1 && r <= k));
+
+  gibber_r_multicast_causal_transport_set_fec (priv->rmctransport, k, r);
+
+  g_free (priv->fec);
+  priv->fec = k == 0 ? NULL : g_strdup_printf ("%u,%u", k, r);
+}
+
+gboolean
+gibber_muc_connection_parse_fec (const gchar *fec,
+    guint *k,
+    guint *r)
+{
+  gchar garbage;
+
+  /* the trailing %c only matches if there's something after r */
+  return sscanf (fec, "%u,%u%c", k, r, &garbage) == 2 && *k >= 1 &&
+      *k <= G_MAXUINT8 && *r >= 1 && *r <= *k;
+}
+
+void
+gibber_muc_connection_get_fec_counters (GibberMucConnection *self,
+    guint *recovered,
+    guint *repaired)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  gibber_r_multicast_causal_transport_get_fec_counters (priv->rmctransport,
+      recovered, repaired);
+}
+
+void
+gibber_muc_connection_get_join_times (GibberMucConnection *self,
+    guint *connecting,
+    guint *gathering,
+    guint *joining)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  gibber_r_multicast_transport_get_join_times (priv->rmtransport, connecting,
+      gathering, joining);
+}
+
+void
+gibber_muc_connection_set_cache_budget (GibberMucConnection *self,
+    gsize budget)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  gibber_r_multicast_causal_transport_set_cache_budget (priv->rmctransport,
+      budget);
+}
+
+void
+gibber_muc_connection_get_cache_stats (GibberMucConnection *self,
+    gsize *bytes,
+    guint *evictions,
+    guint *oldest_unstable)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  gibber_r_multicast_causal_transport_get_cache_stats (priv->rmctransport,
+      bytes, evictions, oldest_unstable);
+}
+
+void
+gibber_muc_connection_set_compression (GibberMucConnection *self,
+    gboolean compress)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  g_return_if_fail (priv->parameters == NULL);
+
+  priv->compress = compress;
+}
+
+void
+gibber_muc_connection_set_receive_thread (GibberMucConnection *self,
+    gboolean use_thread)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  gibber_multicast_transport_set_receive_thread (priv->mtransport,
+      use_thread);
+}
+
+void
+gibber_muc_connection_get_receive_stats (GibberMucConnection *self,
+    guint *high_water,
+    guint *queue_drops,
+    guint *kernel_drops)
+{
+  GibberMucConnectionPrivate *priv = GIBBER_MUC_CONNECTION_GET_PRIVATE (self);
+
+  gibber_multicast_transport_get_receive_stats (priv->mtransport, high_water,
+      queue_drops, kernel_drops);
 }
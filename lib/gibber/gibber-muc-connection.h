@@ -48,6 +48,26 @@ typedef enum
   GIBBER_MUC_CONNECTION_DISCONNECTING,
 } GibberMucConnectionState;
 
+/* Streams are sent in proportion to their priority when there's more to send
+ * than the room can take */
+typedef enum
+{
+  GIBBER_MUC_CONNECTION_PRIORITY_HIGH = 0,
+  GIBBER_MUC_CONNECTION_PRIORITY_NORMAL,
+  GIBBER_MUC_CONNECTION_PRIORITY_BULK,
+} GibberMucConnectionPriority;
+
+typedef struct {
+  /* handed to the r-multicast transport */
+  guint64 bytes_sent;
+  guint64 messages_sent;
+  /* waiting for their turn */
+  gsize bytes_queued;
+  guint messages_queued;
+  /* time spent in the queue, in ms */
+  guint64 total_latency;
+  guint64 max_latency;
+} GibberMucConnectionStreamStats;
 
 typedef struct _GibberMucConnection GibberMucConnection;
 typedef struct _GibberMucConnectionClass GibberMucConnectionClass;
@@ -83,6 +103,9 @@ const gchar ** gibber_muc_connection_get_protocols (void);
 const gchar ** gibber_muc_connection_get_required_parameters (
     const gchar *protocol);
 
+const gchar ** gibber_muc_connection_get_optional_parameters (
+    const gchar *protocol);
+
 GibberMucConnection * gibber_muc_connection_new (const gchar *name,
     const gchar *protocol, GHashTable *parameters, GError **error);
 
@@ -107,11 +130,97 @@ gboolean
 gibber_muc_connection_send_raw (GibberMucConnection *connection,
     guint16 stream_id, const guint8 *data, gsize size, GError **error);
 
-guint16 gibber_muc_connection_new_stream (GibberMucConnection *connection);
+/* The default stream is always causally ordered, new streams can relax that
+ * so they don't hold up, or get held up by, the other streams */
+guint16 gibber_muc_connection_new_stream (GibberMucConnection *connection,
+    GibberRMulticastOrdering ordering);
 
 void gibber_muc_connection_free_stream (GibberMucConnection *connection,
     guint16 stream_id);
 
+/* The default stream has a high priority, new ones a normal one */
+void gibber_muc_connection_set_stream_priority (
+    GibberMucConnection *connection, guint16 stream_id,
+    GibberMucConnectionPriority priority);
+
+gboolean gibber_muc_connection_get_stream_stats (
+    GibberMucConnection *connection, guint16 stream_id,
+    GibberMucConnectionStreamStats *stats);
+
+/* Bytes per second sent to the room, 0 for no limit, the default. What
+ * can't be sent right away is queued, in order for each stream, and an
+ * error sending it is reported by the next send. */
+void gibber_muc_connection_set_send_rate (GibberMucConnection *connection,
+    gsize rate);
+
+/* Parity packets for lossy networks, see
+ * gibber_r_multicast_causal_transport_set_fec (). Rooms given a fec
+ * parameter use what it says, and the setting is shared with others in the
+ * parameters, so it has to be made before they are. */
+void gibber_muc_connection_set_fec (GibberMucConnection *connection,
+    guint k, guint r);
+
+/* Parses "k,r" as found in the fec parameter of rooms, with k at most 255
+ * and r between 1 and k */
+gboolean gibber_muc_connection_parse_fec (const gchar *fec, guint *k,
+    guint *r);
+
+void gibber_muc_connection_get_fec_counters (GibberMucConnection *connection,
+    guint *recovered, guint *repaired);
+
+/* See gibber_r_multicast_transport_get_join_times () */
+void gibber_muc_connection_get_join_times (GibberMucConnection *connection,
+    guint *connecting, guint *gathering, guint *joining);
+
+/* See gibber_r_multicast_causal_transport_set_cache_budget () */
+void gibber_muc_connection_set_cache_budget (GibberMucConnection *connection,
+    gsize budget);
+
+void gibber_muc_connection_get_cache_stats (GibberMucConnection *connection,
+    gsize *bytes, guint *evictions, guint *oldest_unstable);
+
+/* Compress the stanzas we send to a room we create, before its parameters
+ * are shared with others so that they know to expect it. Off by default, as
+ * older versions can't read them. Rooms we join are compressed if their
+ * parameters say so. */
+void gibber_muc_connection_set_compression (GibberMucConnection *connection,
+    gboolean compress);
+
+/* Before connecting, see gibber_multicast_transport_set_receive_thread () */
+void gibber_muc_connection_set_receive_thread (
+    GibberMucConnection *connection, gboolean use_thread);
+
+void gibber_muc_connection_get_receive_stats (GibberMucConnection *connection,
+    guint *high_water, guint *queue_drops, guint *kernel_drops);
+
+/* Returns FALSE if stanzas from sender should be dropped */
+typedef gboolean (* GibberMucConnectionSenderFilterFunc) (
+    GibberMucConnection *connection, const gchar *sender, gpointer user_data);
+
+/* Stanzas on the default stream addressed to something else than to, or
+ * coming from senders rejected by sender_filter, are dropped before being
+ * parsed. Both to and sender_filter may be NULL. */
+void gibber_muc_connection_set_filter (GibberMucConnection *connection,
+    const gchar *to, GibberMucConnectionSenderFilterFunc sender_filter,
+    gpointer user_data);
+
+/* Handle data as if it was received on the default stream, for testing and
+ * benchmarking only */
+void _gibber_muc_connection_TEST_receive (GibberMucConnection *connection,
+    const gchar *sender, const guint8 *data, gsize length);
+
+/* Returns FALSE if sending failed */
+typedef gboolean (* GibberMucConnectionTestSendFunc) (
+    GibberMucConnection *connection, guint16 stream_id, const guint8 *data,
+    gsize size, gpointer user_data);
+
+/* Before sending anything: pace with timers, which has to outlive the
+ * connection, and hand what would be sent to the room to func, for testing
+ * only. Streamed messages still go to the room. */
+void _gibber_muc_connection_TEST_set_send_func (
+    GibberMucConnection *connection, GibberTimerWheel *timers,
+    GibberMucConnectionTestSendFunc func, gpointer user_data);
+
 G_END_DECLS
 
 #endif /* #ifndef __GIBBER_MUC_CONNECTION_H__*/
@@ -26,6 +26,13 @@
 #include <errno.h>
 #include <string.h>
 
+#ifdef G_OS_UNIX
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #include "gibber-sockets.h"
 
 #define DEBUG_FLAG DEBUG_NET
@@ -34,6 +41,23 @@
 #define BUFSIZE 1500
 #define MAX_PACKET_SIZE 1440
 
+/* Datagrams the receive thread can queue up for the main loop */
+#define RING_SIZE 256
+
+typedef struct {
+  gssize length;
+  guint8 data[BUFSIZE + 1];
+} Datagram;
+
+/* Filled by the receive thread and drained by the main loop. Only the
+ * receive thread moves tail and only the main loop moves head, they count up
+ * and wrap around. */
+typedef struct {
+  Datagram slots[RING_SIZE];
+  volatile gint head;
+  volatile gint tail;
+} Ring;
+
 static gboolean gibber_multicast_transport_send (GibberTransport *transport,
     const guint8 *data, gsize size, GError **error);
 
@@ -55,6 +79,27 @@ struct _GibberMulticastTransportPrivate
   guint watch_err;
   struct sockaddr_storage address;
   socklen_t addrlen;
+
+  gboolean use_thread;
+  GThread *thread;
+  Ring *ring;
+  /* Wake up the main loop when the ring gets filled and the receive thread
+   * when it should stop, the read end first. Both ends are the same fd for
+   * an eventfd. */
+  int wakeup[2];
+  int stop[2];
+
+  /* Most datagrams that were in the ring at once, datagrams dropped because
+   * it was full and datagrams the kernel dropped as the socket buffer was */
+  volatile gint high_water;
+  volatile gint queue_drops;
+  volatile gint kernel_drops;
+  /* Calls that failed in the receive thread and the errno of the last one,
+   * logged from the main loop as the debug functions aren't thread-safe,
+   * and how many of them were logged so far */
+  volatile gint thread_errors;
+  volatile gint thread_errno;
+  gint reported_thread_errors;
 };
 
 #define GIBBER_MULTICAST_TRANSPORT_GET_PRIVATE(o) \
@@ -82,6 +127,8 @@ gibber_multicast_transport_init (GibberMulticastTransport *obj)
   priv->watch_in = 0;
   priv->watch_err = 0;
   priv->channel = NULL;
+  priv->wakeup[0] = priv->wakeup[1] = -1;
+  priv->stop[0] = priv->stop[1] = -1;
   GIBBER_TRANSPORT (obj)->max_packet_size = MAX_PACKET_SIZE;
 }
 
@@ -138,6 +185,70 @@ gibber_multicast_transport_finalize (GObject *object)
   G_OBJECT_CLASS (gibber_multicast_transport_parent_class)->finalize (object);
 }
 
+/* Called from the receive thread too */
+static gssize
+receive_datagram (GibberMulticastTransportPrivate *priv,
+    guint8 *buf)
+{
+  struct sockaddr_storage from;
+  gssize ret;
+#ifdef G_OS_UNIX
+  struct msghdr msg;
+  struct iovec iov;
+#ifdef SO_RXQ_OVFL
+  union {
+    struct cmsghdr cmsg;
+    char buf[CMSG_SPACE (sizeof (guint32))];
+  } control;
+  struct cmsghdr *cmsg;
+#endif
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = buf;
+  iov.iov_len = BUFSIZE;
+  msg.msg_name = &from;
+  msg.msg_namelen = sizeof (from);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+#ifdef SO_RXQ_OVFL
+  msg.msg_control = &control;
+  msg.msg_controllen = sizeof (control);
+#endif
+
+  ret = recvmsg (priv->fd, &msg, 0);
+
+  if (ret < 0)
+    return ret;
+
+#ifdef SO_RXQ_OVFL
+  /* The number of datagrams the kernel dropped for this socket so far */
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL;
+      cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+      guint32 drops;
+
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL)
+        continue;
+
+      memcpy (&drops, CMSG_DATA (cmsg), sizeof (drops));
+      g_atomic_int_set (&priv->kernel_drops, drops);
+    }
+#endif
+#else
+  socklen_t len = sizeof (struct sockaddr_storage);
+
+  ret = recvfrom (priv->fd, (char *) buf, BUFSIZE, 0,
+      (struct sockaddr *) &from, &len);
+
+  if (ret < 0)
+    return ret;
+#endif
+
+  buf[ret] = '\0';
+
+  return ret;
+}
+
 static gboolean
 _channel_io_in (GIOChannel *source, GIOCondition condition, gpointer data)
 {
@@ -146,12 +257,9 @@ _channel_io_in (GIOChannel *source, GIOCondition condition, gpointer data)
   GibberMulticastTransportPrivate *priv =
     GIBBER_MULTICAST_TRANSPORT_GET_PRIVATE (self);
   guint8 buf[BUFSIZE + 1];
+  gssize ret;
 
-  struct sockaddr_storage from;
-  int ret;
-  socklen_t len = sizeof (struct sockaddr_storage);
-
-  ret = recvfrom (priv->fd, (char *) buf, BUFSIZE, 0, (struct sockaddr *) &from, &len);
+  ret = receive_datagram (priv, buf);
 
   if (ret < 0)
     {
@@ -160,14 +268,261 @@ _channel_io_in (GIOChannel *source, GIOCondition condition, gpointer data)
       return TRUE;
     }
 
-  buf[ret] = '\0';
-  DEBUG ("Received %d bytes", ret);
+  DEBUG ("Received %" G_GSSIZE_FORMAT " bytes", ret);
 
   gibber_transport_received_data (GIBBER_TRANSPORT (self), buf, ret);
 
   return TRUE;
 }
 
+#ifdef G_OS_UNIX
+
+static gboolean
+wakeup_open (int fds[2])
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  fds[0] = fds[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  return fds[0] >= 0;
+#else
+  if (pipe (fds) != 0)
+    return FALSE;
+
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  fcntl (fds[1], F_SETFL, O_NONBLOCK);
+
+  return TRUE;
+#endif
+}
+
+static void
+wakeup_close (int fds[2])
+{
+  if (fds[0] >= 0)
+    close (fds[0]);
+
+  if (fds[1] >= 0 && fds[1] != fds[0])
+    close (fds[1]);
+
+  fds[0] = fds[1] = -1;
+}
+
+/* Returns FALSE with errno set if it failed */
+static gboolean
+wakeup_signal (int fds[2])
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  guint64 one = 1;
+
+  return write (fds[1], &one, sizeof (one)) >= 0;
+#else
+  /* A full pipe wakes up the other side just as well */
+  return write (fds[1], "", 1) >= 0 || errno == EAGAIN;
+#endif
+}
+
+static void
+wakeup_clear (int fds[2])
+{
+  guint8 buf[64];
+
+  while (read (fds[0], buf, sizeof (buf)) > 0)
+    ;
+}
+
+/* Called from the receive thread when a call failed */
+static void
+thread_error (GibberMulticastTransportPrivate *priv)
+{
+  g_atomic_int_set (&priv->thread_errno, errno);
+  g_atomic_int_inc (&priv->thread_errors);
+}
+
+static void
+report_thread_errors (GibberMulticastTransportPrivate *priv)
+{
+  gint errors = g_atomic_int_get (&priv->thread_errors);
+
+  if (errors == priv->reported_thread_errors)
+    return;
+
+  DEBUG ("%d calls failed in the receive thread, the last one with: %s",
+      errors - priv->reported_thread_errors,
+      strerror (g_atomic_int_get (&priv->thread_errno)));
+  priv->reported_thread_errors = errors;
+}
+
+static gpointer
+receive_thread (gpointer data)
+{
+  GibberMulticastTransportPrivate *priv = data;
+  Ring *ring = priv->ring;
+  struct pollfd fds[2];
+
+  fds[0].fd = priv->fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = priv->stop[0];
+  fds[1].events = POLLIN;
+
+  for (;;)
+    {
+      gint tail = ring->tail;
+      guint queued;
+      Datagram *d;
+
+      if (poll (fds, 2, -1) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          thread_error (priv);
+          break;
+        }
+
+      if (fds[1].revents != 0)
+        break;
+
+      if (fds[0].revents == 0)
+        continue;
+
+      queued = (guint) (tail - g_atomic_int_get (&ring->head));
+
+      if (queued == RING_SIZE)
+        {
+          /* Keep draining the socket so the kernel doesn't drop the newer
+           * ones instead */
+          guint8 buf[BUFSIZE + 1];
+
+          if (receive_datagram (priv, buf) >= 0)
+            g_atomic_int_inc (&priv->queue_drops);
+          continue;
+        }
+
+      d = &ring->slots[(guint) tail % RING_SIZE];
+      d->length = receive_datagram (priv, d->data);
+
+      if (d->length < 0)
+        {
+          thread_error (priv);
+          continue;
+        }
+
+      g_atomic_int_set (&ring->tail, tail + 1);
+
+      if (queued + 1 > (guint) g_atomic_int_get (&priv->high_water))
+        g_atomic_int_set (&priv->high_water, queued + 1);
+
+      /* Every datagram needs a wakeup: however many were queued when we
+       * looked, the main loop might have found the ring empty by now,
+       * before we published the new tail. Pending ones coalesce. */
+      if (!wakeup_signal (priv->wakeup))
+        thread_error (priv);
+    }
+
+  return NULL;
+}
+
+static gboolean
+_wakeup_io_in (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+  GibberMulticastTransport *self =
+    GIBBER_MULTICAST_TRANSPORT (data);
+  GibberMulticastTransportPrivate *priv =
+    GIBBER_MULTICAST_TRANSPORT_GET_PRIVATE (self);
+
+  wakeup_clear (priv->wakeup);
+  report_thread_errors (priv);
+
+  /* A handler might disconnect us, which takes the ring away */
+  g_object_ref (self);
+
+  while (priv->ring != NULL)
+    {
+      Ring *ring = priv->ring;
+      gint head = ring->head;
+      Datagram *d;
+
+      if (head == g_atomic_int_get (&ring->tail))
+        break;
+
+      d = &ring->slots[(guint) head % RING_SIZE];
+      gibber_transport_received_data (GIBBER_TRANSPORT (self), d->data,
+          d->length);
+
+      if (priv->ring == ring)
+        g_atomic_int_set (&ring->head, head + 1);
+    }
+
+  g_object_unref (self);
+
+  return TRUE;
+}
+
+static gboolean
+start_receive_thread (GibberMulticastTransport *self,
+    GError **error)
+{
+  GibberMulticastTransportPrivate *priv =
+    GIBBER_MULTICAST_TRANSPORT_GET_PRIVATE (self);
+  GIOChannel *channel;
+
+  if (!wakeup_open (priv->wakeup) || !wakeup_open (priv->stop))
+    {
+      g_set_error (error, GIBBER_MULTICAST_TRANSPORT_ERROR,
+          GIBBER_MULTICAST_TRANSPORT_ERROR_JOIN_FAILED,
+          "Couldn't set up the receive thread: %s", strerror (errno));
+      goto err;
+    }
+
+  priv->ring = g_slice_new0 (Ring);
+  priv->thread = g_thread_try_new ("gibber-multicast", receive_thread, priv,
+      error);
+
+  if (priv->thread == NULL)
+    {
+      g_slice_free (Ring, priv->ring);
+      priv->ring = NULL;
+      goto err;
+    }
+
+  channel = g_io_channel_unix_new (priv->wakeup[0]);
+  priv->watch_in = g_io_add_watch (channel, G_IO_IN, _wakeup_io_in, self);
+  g_io_channel_unref (channel);
+
+  return TRUE;
+
+err:
+  wakeup_close (priv->wakeup);
+  wakeup_close (priv->stop);
+  return FALSE;
+}
+
+static void
+stop_receive_thread (GibberMulticastTransport *self)
+{
+  GibberMulticastTransportPrivate *priv =
+    GIBBER_MULTICAST_TRANSPORT_GET_PRIVATE (self);
+
+  if (!wakeup_signal (priv->stop))
+    DEBUG ("stopping the receive thread failed: %s", strerror (errno));
+
+  g_thread_join (priv->thread);
+  priv->thread = NULL;
+  report_thread_errors (priv);
+
+  DEBUG ("At most %d datagrams were queued, %d dropped as the queue was "
+      "full, %d by the kernel", priv->high_water, priv->queue_drops,
+      priv->kernel_drops);
+
+  g_slice_free (Ring, priv->ring);
+  priv->ring = NULL;
+
+  wakeup_close (priv->wakeup);
+  wakeup_close (priv->stop);
+}
+
+#endif /* G_OS_UNIX */
+
 static gboolean
 _channel_io_err (GIOChannel *source, GIOCondition condition, gpointer data)
 {
@@ -227,6 +582,10 @@ _open_multicast (GibberMulticastTransport *self, GError **error)
           mreq.imr_interface.s_addr = htonl (INADDR_ANY);
 
           SETSOCKOPT (fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *) &mreq, sizeof (mreq));
+#ifdef SO_RXQ_OVFL
+          /* Only for the statistics, so don't mind if it's not there */
+          setsockopt (fd, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof (yes));
+#endif
 
           memset (&baddr, 0, sizeof (baddr));
           baddr.sin_family = AF_INET;
@@ -262,6 +621,9 @@ _open_multicast (GibberMulticastTransport *self, GError **error)
 
           SETSOCKOPT (fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, (char *) &mreq6,
             sizeof (mreq6));
+#ifdef SO_RXQ_OVFL
+          setsockopt (fd, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof (yes));
+#endif
 
           if (bind (fd, (struct sockaddr *) &(priv->address), priv->addrlen)
               != 0)
@@ -356,6 +718,45 @@ err:
   return FALSE;
 }
 
+static void
+connect_fd (GibberMulticastTransport *mtransport,
+    int fd)
+{
+  GibberMulticastTransportPrivate *priv =
+    GIBBER_MULTICAST_TRANSPORT_GET_PRIVATE (mtransport);
+#ifdef G_OS_UNIX
+  GError *error = NULL;
+#endif
+
+  g_assert (priv->channel == NULL);
+
+  priv->fd = fd;
+
+  priv->channel = g_io_channel_unix_new (fd);
+
+  g_io_channel_set_close_on_unref (priv->channel, TRUE);
+  g_io_channel_set_encoding (priv->channel, NULL, NULL);
+  g_io_channel_set_buffered (priv->channel, FALSE);
+
+#ifdef G_OS_UNIX
+  if (priv->use_thread && !start_receive_thread (mtransport, &error))
+    {
+      DEBUG ("Reading in the main loop instead: %s", error->message);
+      g_clear_error (&error);
+    }
+#endif
+
+  if (priv->watch_in == 0)
+    priv->watch_in =
+      g_io_add_watch (priv->channel, G_IO_IN, _channel_io_in, mtransport);
+  priv->watch_err =
+      g_io_add_watch (priv->channel, G_IO_ERR|G_IO_HUP, _channel_io_err,
+          mtransport);
+
+  gibber_transport_set_state (GIBBER_TRANSPORT(mtransport),
+      GIBBER_TRANSPORT_CONNECTED);
+}
+
 gboolean
 gibber_multicast_transport_connect (GibberMulticastTransport *mtransport,
                                    const gchar *address, const gchar *port)
@@ -381,24 +782,7 @@ gibber_multicast_transport_connect (GibberMulticastTransport *mtransport,
       goto failed;
     }
 
-  g_assert (priv->channel == NULL);
-
-  priv->fd = fd;
-
-  priv->channel = g_io_channel_unix_new (fd);
-
-  g_io_channel_set_close_on_unref (priv->channel, TRUE);
-  g_io_channel_set_encoding (priv->channel, NULL, NULL);
-  g_io_channel_set_buffered (priv->channel, FALSE);
-
-  priv->watch_in =
-    g_io_add_watch (priv->channel, G_IO_IN, _channel_io_in, mtransport);
-  priv->watch_err =
-      g_io_add_watch (priv->channel, G_IO_ERR|G_IO_HUP, _channel_io_err,
-          mtransport);
-
-  gibber_transport_set_state (GIBBER_TRANSPORT(mtransport),
-      GIBBER_TRANSPORT_CONNECTED);
+  connect_fd (mtransport, fd);
 
   return TRUE;
 
@@ -413,6 +797,16 @@ failed:
   return FALSE;
 }
 
+void
+_gibber_multicast_transport_TEST_connect_fd (
+    GibberMulticastTransport *mtransport,
+    int fd)
+{
+  gibber_transport_set_state (GIBBER_TRANSPORT(mtransport),
+      GIBBER_TRANSPORT_CONNECTING);
+  connect_fd (mtransport, fd);
+}
+
 void
 gibber_multicast_transport_disconnect (GibberTransport *transport)
 {
@@ -436,6 +830,12 @@ gibber_multicast_transport_disconnect (GibberTransport *transport)
       priv->watch_err = 0;
     }
 
+#ifdef G_OS_UNIX
+  /* before the socket goes away under it */
+  if (priv->thread != NULL)
+    stop_receive_thread (self);
+#endif
+
   if (priv->channel)
     {
       g_io_channel_shutdown (priv->channel, TRUE, NULL);
@@ -483,6 +883,37 @@ gibber_multicast_transport_send (GibberTransport *transport,
   return TRUE;
 }
 
+void
+gibber_multicast_transport_set_receive_thread (
+    GibberMulticastTransport *mtransport,
+    gboolean use_thread)
+{
+  GibberMulticastTransportPrivate *priv =
+    GIBBER_MULTICAST_TRANSPORT_GET_PRIVATE (mtransport);
+
+  priv->use_thread = use_thread;
+}
+
+void
+gibber_multicast_transport_get_receive_stats (
+    GibberMulticastTransport *mtransport,
+    guint *high_water,
+    guint *queue_drops,
+    guint *kernel_drops)
+{
+  GibberMulticastTransportPrivate *priv =
+    GIBBER_MULTICAST_TRANSPORT_GET_PRIVATE (mtransport);
+
+  if (high_water != NULL)
+    *high_water = g_atomic_int_get (&priv->high_water);
+
+  if (queue_drops != NULL)
+    *queue_drops = g_atomic_int_get (&priv->queue_drops);
+
+  if (kernel_drops != NULL)
+    *kernel_drops = g_atomic_int_get (&priv->kernel_drops);
+}
+
 GibberMulticastTransport *
 gibber_multicast_transport_new (void)
 {
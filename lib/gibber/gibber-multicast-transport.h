@@ -60,6 +60,25 @@ gsize
 gibber_multicast_transport_get_max_packet_size (
   GibberMulticastTransport *mtransport);
 
+/* Before connecting: read the socket from a thread of its own, so that
+ * datagrams are taken off it while the main loop is busy with something else
+ * and are handed to the main loop through a queue. Only on Unix, elsewhere
+ * the socket is always read from the main loop. */
+void gibber_multicast_transport_set_receive_thread (
+  GibberMulticastTransport *mtransport, gboolean use_thread);
+
+/* The most datagrams the receive thread had queued at once, the ones it
+ * dropped because the queue was full and the ones the kernel dropped because
+ * the socket buffer was, where the kernel reports those */
+void gibber_multicast_transport_get_receive_stats (
+  GibberMulticastTransport *mtransport, guint *high_water,
+  guint *queue_drops, guint *kernel_drops);
+
+/* Use fd, a connected datagram socket, instead of joining a group, for
+ * testing only */
+void _gibber_multicast_transport_TEST_connect_fd (
+  GibberMulticastTransport *mtransport, int fd);
+
 GType gibber_multicast_transport_get_type (void);
 
 /* TYPE MACROS */
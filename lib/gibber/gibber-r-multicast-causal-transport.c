@@ -36,6 +36,21 @@
 #define SESSION_TIMEOUT_MIN 1500
 #define SESSION_TIMEOUT_MAX 3000
 
+/* Session messages report on at most this many senders, in larger groups
+ * they take turns */
+#define SESSION_MAX_SENDERS 32
+
+/* Bytes per second the session messages of the whole group should take at
+ * most, as with RTCP. Members that haven't sent anything lately stretch the
+ * session interval past SESSION_TIMEOUT_MAX as the group grows to stay
+ * under it. */
+#define SESSION_BANDWIDTH 8192
+
+/* Session messages are the heartbeats the failure detectors of the others
+ * go by, so we send one at least this often even if the ones of others
+ * already said it all */
+#define SESSION_HEARTBEAT_INTERVAL 6000
+
 #define NR_JOIN_REQUESTS_TO_SEND 3
 #define PASSIVE_JOIN_TIME  500
 #define ACTIVE_JOIN_INTERVAL 250
@@ -48,6 +63,19 @@
 #define NR_BYE_TO_SEND 3
 #define BYE_INTERVAL 500
 
+/* Send the parity packets of an incomplete block after this many ms without
+ * new packets to protect */
+#define FEC_FLUSH_TIMEOUT 40
+
+/* A streamed message only gets this many packets ahead of what every member
+ * acked, so that we don't have to keep all of it around for repairs. While
+ * it can't go on, the acks are checked again every STREAM_RETRY_INTERVAL ms
+ * besides whenever a packet comes in. Members that still hold it back after
+ * STREAM_STALL_TIMEOUT ms are failed. */
+#define STREAM_WINDOW 64
+#define STREAM_RETRY_INTERVAL 100
+#define STREAM_STALL_TIMEOUT 30000
+
 #define DEBUG_TRANSPORT(transport, format,...) \
   DEBUG("%s (%x): " format, \
       GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE(transport)->name, \
@@ -78,6 +106,7 @@ enum
     SENDER_FAILED,
     RECEIVED_CONTROL_PACKET,
     RECEIVED_FOREIGN_PACKET,
+    STREAM_ROOM,
     LAST_SIGNAL
 };
 
@@ -87,6 +116,7 @@ static guint signals[LAST_SIGNAL] = {0};
 enum {
   PROP_NAME = 1,
   PROP_TRANSPORT,
+  PROP_TIMER_WHEEL,
   LAST_PROPERTY
 };
 
@@ -101,6 +131,11 @@ struct _GibberRMulticastCausalTransportPrivate
   guint32 packet_id;
   GibberRMulticastSenderGroup *sender_group;
   GibberRMulticastSender *self;
+  /* runs our timers, the senders' and the ones of the GibberRMulticastTransport
+   * on top of us */
+  GibberTimerWheel *timers;
+  /* FALSE if it was given to us */
+  gboolean owns_timers;
   guint timer;
   guint keepalive_timer;
   gchar *name;
@@ -111,19 +146,95 @@ struct _GibberRMulticastCausalTransportPrivate
   gint nr_bye;
 
   gboolean resetting;
+
+  /* stream id => GibberRMulticastOrdering, for the streams that aren't
+   * causally ordered */
+  GHashTable *stream_ordering;
+  /* stream ids of the chunked streams, shared with the sender group */
+  GHashTable *chunked_streams;
+
+  /* Message being sent with gibber_r_multicast_causal_transport_send_start
+   * (). stream_left are the bytes of it that weren't sent out yet, some of
+   * which may be waiting in stream_buffer for a packet to fill up. When
+   * stream_dropped the rest of it is thrown away as it comes in */
+  gboolean streaming;
+  gboolean stream_dropped;
+  gboolean stream_first;
+  guint16 stream_id;
+  guint8 stream_flags;
+  guint32 stream_total;
+  gsize stream_left;
+  GByteArray *stream_buffer;
+  /* owned QueuedMessage, sent on the same stream while streaming, to go
+   * out after it. Messages on other streams go right away, and the next
+   * packet of the streamed message is flagged as resumed after them. */
+  GQueue stream_queue;
+  gboolean stream_resumed;
+  /* TRUE while the streamed message is waiting for acks to go on, since
+   * stream_blocked_since */
+  gboolean stream_blocked;
+  gint64 stream_blocked_since;
+  guint stream_timer;
+
+  /* Session messages that don't fit all the senders go on from the first
+   * sender id after this one */
+  guint32 session_cursor;
+  /* Running average of the size of the session messages in the group */
+  gsize session_avg_size;
+  /* Our packet_id when we sent out our last session message, and when */
+  guint32 session_packet_id;
+  gint64 session_sent;
+  /* The session timer was stretched for the size of the group */
+  gboolean session_stretched;
+
+  /* When we started to connect, and how long it took the last time */
+  gint64 connect_started;
+  guint connect_time;
+
+  /* fec_r parity packets are sent for every fec_k of our reliable packets.
+   * fec_k is 0 when FEC is off */
+  guint fec_k;
+  guint fec_r;
+  /* owned GibberRMulticastPacket, consecutive packets of the current block */
+  GPtrArray *fec_block;
+  guint fec_timer;
+  /* Last packet that went into a block, later sends of it are repairs */
+  gboolean fec_started;
+  guint32 fec_last_id;
+
+  /* Applied to every sender group, see
+   * gibber_r_multicast_sender_group_set_budget () */
+  gsize cache_budget;
+
+  /* What the sender groups we dropped when reconnecting had counted */
+  guint fec_recovered;
+  guint repaired;
+  guint evictions;
 };
 
+typedef struct {
+  guint16 stream_id;
+  GByteArray *data;
+} QueuedMessage;
+
+static void
+queued_message_free (QueuedMessage *message)
+{
+  g_byte_array_unref (message->data);
+  g_slice_free (QueuedMessage, message);
+}
+
 #define GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE(o) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((o), GIBBER_TYPE_R_MULTICAST_CAUSAL_TRANSPORT,\
    GibberRMulticastCausalTransportPrivate))
 
 static guint32
-_random_nonzero_uint (void)
+_random_nonzero_uint (GibberTimerWheel *timers)
 {
   guint32 result;
 
   do {
-      result = g_random_int ();
+      result = gibber_timer_wheel_random_int (timers);
   } while (result == 0);
 
   return result;
@@ -148,6 +259,9 @@ gibber_r_multicast_causal_transport_set_property (GObject *object,
     case PROP_TRANSPORT:
       priv->transport = GIBBER_TRANSPORT (g_value_dup_object (value));
       break;
+    case PROP_TIMER_WHEEL:
+      priv->timers = g_value_get_pointer (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -172,6 +286,9 @@ gibber_r_multicast_causal_transport_get_property (GObject *object,
     case PROP_TRANSPORT:
       g_value_set_object (value, priv->transport);
       break;
+    case PROP_TIMER_WHEEL:
+      g_value_set_pointer (value, priv->timers);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -186,8 +303,35 @@ gibber_r_multicast_causal_transport_init (GibberRMulticastCausalTransport *obj)
       GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (obj);
 
   /* allocate any data required by the object here */
-  priv->sender_group = gibber_r_multicast_sender_group_new ();
-  priv->packet_id = g_random_int ();
+  priv->stream_ordering = g_hash_table_new (NULL, NULL);
+  priv->chunked_streams = g_hash_table_new (NULL, NULL);
+  priv->stream_buffer = g_byte_array_new ();
+  g_queue_init (&priv->stream_queue);
+  priv->fec_block = g_ptr_array_new_with_free_func (g_object_unref);
+}
+
+static void
+gibber_r_multicast_causal_transport_constructed (GObject *object)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+      GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (object);
+
+  if (G_OBJECT_CLASS (
+      gibber_r_multicast_causal_transport_parent_class)->constructed != NULL)
+    G_OBJECT_CLASS (
+        gibber_r_multicast_causal_transport_parent_class)->constructed (object);
+
+  if (priv->timers == NULL)
+    {
+      priv->timers = gibber_timer_wheel_new ();
+      priv->owns_timers = TRUE;
+    }
+
+  priv->sender_group = gibber_r_multicast_sender_group_new (priv->timers);
+  priv->sender_group->chunked_streams = priv->chunked_streams;
+  priv->packet_id = gibber_timer_wheel_random_int (priv->timers);
+  /* so that members don't all report on the same senders */
+  priv->session_cursor = gibber_timer_wheel_random_int (priv->timers);
 }
 
 static void gibber_r_multicast_causal_transport_dispose (GObject *object);
@@ -214,6 +358,7 @@ gibber_r_multicast_causal_transport_class_init (
   g_type_class_add_private (gibber_r_multicast_causal_transport_class,
       sizeof (GibberRMulticastCausalTransportPrivate));
 
+  object_class->constructed = gibber_r_multicast_causal_transport_constructed;
   object_class->dispose = gibber_r_multicast_causal_transport_dispose;
   object_class->finalize = gibber_r_multicast_causal_transport_finalize;
 
@@ -241,6 +386,14 @@ gibber_r_multicast_causal_transport_class_init (
         g_cclosure_marshal_VOID__OBJECT,
         G_TYPE_NONE, 1, GIBBER_TYPE_R_MULTICAST_PACKET);
 
+  signals[STREAM_ROOM] = g_signal_new ("stream-room",
+        G_OBJECT_CLASS_TYPE (gibber_r_multicast_causal_transport_class),
+        G_SIGNAL_RUN_LAST,
+        0,
+        NULL, NULL,
+        g_cclosure_marshal_VOID__VOID,
+        G_TYPE_NONE, 0);
+
   object_class->set_property =
       gibber_r_multicast_causal_transport_set_property;
   object_class->get_property =
@@ -256,6 +409,12 @@ gibber_r_multicast_causal_transport_class_init (
       G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
   g_object_class_install_property (object_class, PROP_NAME, param_spec);
 
+  param_spec = g_param_spec_pointer ("timer-wheel", "timer wheel",
+      "The GibberTimerWheel to run the timers on, or NULL for one of our own",
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_TIMER_WHEEL,
+      param_spec);
+
   transport_class->send = gibber_r_multicast_causal_transport_do_send;
   transport_class->disconnect = gibber_r_multicast_causal_transport_disconnect;
 }
@@ -280,15 +439,29 @@ gibber_r_multicast_causal_transport_dispose (GObject *object)
 
   if (priv->timer != 0)
     {
-      g_source_remove (priv->timer);
+      gibber_timer_wheel_remove (priv->timers, priv->timer);
     }
 
   if (priv->keepalive_timer != 0)
     {
-      g_source_remove (priv->keepalive_timer);
+      gibber_timer_wheel_remove (priv->timers, priv->keepalive_timer);
       priv->keepalive_timer = 0;
     }
 
+  if (priv->fec_timer != 0)
+    {
+      gibber_timer_wheel_remove (priv->timers, priv->fec_timer);
+      priv->fec_timer = 0;
+    }
+
+  if (priv->stream_timer != 0)
+    {
+      gibber_timer_wheel_remove (priv->timers, priv->stream_timer);
+      priv->stream_timer = 0;
+    }
+
+  g_ptr_array_set_size (priv->fec_block, 0);
+
   if (priv->self != NULL)
     {
       g_object_unref (priv->self);
@@ -316,11 +489,138 @@ gibber_r_multicast_causal_transport_finalize (GObject *object)
 
   /* free any data held directly by the object here */
   g_free (priv->name);
+  g_hash_table_unref (priv->stream_ordering);
+  g_hash_table_unref (priv->chunked_streams);
+  g_ptr_array_unref (priv->fec_block);
+  g_byte_array_unref (priv->stream_buffer);
+
+  while (!g_queue_is_empty (&priv->stream_queue))
+    queued_message_free (g_queue_pop_head (&priv->stream_queue));
+
+  /* Freed this late as the GibberRMulticastTransport using it can only
+   * have been disposed by now */
+  if (priv->owns_timers)
+    gibber_timer_wheel_free (priv->timers);
 
   G_OBJECT_CLASS (
       gibber_r_multicast_causal_transport_parent_class)->finalize (object);
 }
 
+/* Room for our reliable packets, which have to leave space for the parity
+ * header when FEC is on */
+static gsize
+reliable_packet_size (GibberRMulticastCausalTransport *transport)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  if (priv->fec_k == 0)
+    return priv->transport->max_packet_size;
+
+  return priv->transport->max_packet_size
+      - GIBBER_R_MULTICAST_PARITY_PACKET_OVERHEAD;
+}
+
+static void
+fec_flush (GibberRMulticastCausalTransport *transport)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+  GibberRMulticastPacket *first;
+  guint8 count, stride, n;
+
+  if (priv->fec_timer != 0)
+    {
+      gibber_timer_wheel_remove (priv->timers, priv->fec_timer);
+      priv->fec_timer = 0;
+    }
+
+  if (priv->fec_block->len == 0 || priv->self == NULL)
+    goto out;
+
+  first = g_ptr_array_index (priv->fec_block, 0);
+  count = priv->fec_block->len;
+  stride = MIN (priv->fec_r, count);
+
+  DEBUG_TRANSPORT (transport, "Sending %u parity packets for 0x%x -> 0x%x",
+      stride, first->packet_id, first->packet_id + count - 1);
+
+  for (n = 0; n < stride; n++)
+    {
+      GibberRMulticastPacket *parity;
+      guint8 *rawdata;
+      gsize rawsize;
+      guint i;
+
+      parity = gibber_r_multicast_packet_new (PACKET_TYPE_PARITY,
+          priv->self->id, priv->transport->max_packet_size);
+      gibber_r_multicast_packet_set_parity_info (parity, first->packet_id,
+          count, stride, n);
+
+      for (i = n; i < count; i += stride)
+        {
+          rawdata = gibber_r_multicast_packet_get_raw_data (
+              g_ptr_array_index (priv->fec_block, i), &rawsize);
+          gibber_r_multicast_packet_parity_add (parity, rawdata, rawsize);
+        }
+
+      rawdata = gibber_r_multicast_packet_get_raw_data (parity, &rawsize);
+      gibber_transport_send (GIBBER_TRANSPORT (priv->transport),
+          rawdata, rawsize, NULL);
+      g_object_unref (parity);
+    }
+
+out:
+  g_ptr_array_set_size (priv->fec_block, 0);
+}
+
+static gboolean
+fec_flush_cb (gpointer data)
+{
+  GibberRMulticastCausalTransport *self =
+      GIBBER_R_MULTICAST_CAUSAL_TRANSPORT (data);
+  GibberRMulticastCausalTransportPrivate *priv =
+      GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+
+  priv->fec_timer = 0;
+  fec_flush (self);
+
+  return FALSE;
+}
+
+/* Adds a packet we just sent out for the first time to the current block */
+static void
+fec_protect (GibberRMulticastCausalTransport *transport,
+    GibberRMulticastPacket *packet)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+  gsize rawsize;
+
+  if (priv->fec_started && packet->packet_id == priv->fec_last_id)
+    return;
+
+  if (priv->fec_last_id + 1 != packet->packet_id)
+    fec_flush (transport);
+
+  priv->fec_started = TRUE;
+  priv->fec_last_id = packet->packet_id;
+
+  /* Built before FEC was turned on */
+  gibber_r_multicast_packet_get_raw_data (packet, &rawsize);
+  if (rawsize + GIBBER_R_MULTICAST_PARITY_PACKET_OVERHEAD
+      > priv->transport->max_packet_size)
+    return;
+
+  g_ptr_array_add (priv->fec_block, g_object_ref (packet));
+
+  if (priv->fec_block->len >= priv->fec_k)
+    fec_flush (transport);
+  else if (priv->fec_timer == 0)
+    priv->fec_timer = gibber_timer_wheel_add (priv->timers,
+        FEC_FLUSH_TIMEOUT, fec_flush_cb, transport);
+}
+
 static gboolean
 sendout_packet (GibberRMulticastCausalTransport *transport,
                 GibberRMulticastPacket *packet,
@@ -330,6 +630,7 @@ sendout_packet (GibberRMulticastCausalTransport *transport,
     GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
   guint8 *rawdata;
   gsize rawsize;
+  gboolean ret;
 
   if (GIBBER_R_MULTICAST_PACKET_IS_RELIABLE_PACKET (packet)
       && (packet->depends->len != 0
@@ -337,8 +638,26 @@ sendout_packet (GibberRMulticastCausalTransport *transport,
     schedule_keepalive_message (transport);
 
   rawdata = gibber_r_multicast_packet_get_raw_data (packet, &rawsize);
-  return gibber_transport_send (GIBBER_TRANSPORT(priv->transport),
+  ret = gibber_transport_send (GIBBER_TRANSPORT(priv->transport),
       rawdata, rawsize, error);
+
+  /* Only our own packets as we send them out the first time, not the repairs
+   * and not the byes, which all have the same id */
+  if (GIBBER_R_MULTICAST_PACKET_IS_RELIABLE_PACKET (packet)
+      && packet->type != PACKET_TYPE_BYE
+      && priv->self != NULL
+      && packet->sender == priv->self->id
+      && packet->packet_id == priv->packet_id - 1)
+    {
+      if (priv->fec_k > 0)
+        fec_protect (transport, packet);
+
+      /* Others have to hear about it soon to notice if they lost it */
+      if (priv->session_stretched)
+        schedule_session_message (transport);
+    }
+
+  return ret;
 }
 
 static gchar *
@@ -364,21 +683,108 @@ g_array_uint32_to_str (GArray *array)
 }
 
 static void
-add_sender_info (gpointer key, gpointer value, gpointer user_data)
+collect_session_sender (gpointer key, gpointer value, gpointer user_data)
 {
   GibberRMulticastSender *sender = GIBBER_R_MULTICAST_SENDER (value);
-  GibberRMulticastPacket *packet = GIBBER_R_MULTICAST_PACKET (user_data);
-  gboolean r;
+  GPtrArray *senders = user_data;
 
   if (sender->state == GIBBER_R_MULTICAST_SENDER_STATE_NEW ||
       sender->state >= GIBBER_R_MULTICAST_SENDER_STATE_FAILED)
     return;
 
+  g_ptr_array_add (senders, sender);
+}
+
+static gint
+compare_sender_ids (gconstpointer a, gconstpointer b)
+{
+  guint32 id_a = (*(GibberRMulticastSender **) a)->id;
+  guint32 id_b = (*(GibberRMulticastSender **) b)->id;
+
+  return id_a < id_b ? -1 : id_a > id_b;
+}
+
+static void
+add_session_sender (GibberRMulticastPacket *packet,
+    GibberRMulticastSender *sender)
+{
+  gboolean r;
+
   r = gibber_r_multicast_packet_add_sender_info (packet, sender->id,
                sender->next_input_packet, NULL);
   g_assert (r);
 }
 
+/* All the senders if they fit, else ourselves and the next ones in the order
+ * of their ids */
+static void
+add_session_senders (GibberRMulticastCausalTransport *self,
+    GibberRMulticastPacket *packet)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+      GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+  GPtrArray *senders = g_ptr_array_new ();
+  guint max, start, i;
+
+  g_hash_table_foreach (priv->sender_group->senders, collect_session_sender,
+      senders);
+
+  max = SESSION_MAX_SENDERS;
+  while (max > 1 && GIBBER_R_MULTICAST_SESSION_PACKET_SIZE (max)
+      > priv->transport->max_packet_size)
+    max--;
+
+  if (senders->len <= max)
+    {
+      for (i = 0; i < senders->len; i++)
+        add_session_sender (packet, g_ptr_array_index (senders, i));
+      goto out;
+    }
+
+  g_ptr_array_sort (senders, compare_sender_ids);
+
+  /* Others should hear about our own packets in every one of them */
+  if (priv->self != NULL && g_ptr_array_remove (senders, priv->self))
+    add_session_sender (packet, priv->self);
+
+  for (start = 0; start < senders->len; start++)
+    {
+      GibberRMulticastSender *s = g_ptr_array_index (senders, start);
+
+      if (s->id > priv->session_cursor)
+        break;
+    }
+
+  for (i = 0; packet->depends->len < max && i < senders->len; i++)
+    {
+      GibberRMulticastSender *s =
+          g_ptr_array_index (senders, (start + i) % senders->len);
+
+      add_session_sender (packet, s);
+      priv->session_cursor = s->id;
+    }
+
+out:
+  g_ptr_array_unref (senders);
+}
+
+static void
+update_session_avg_size (GibberRMulticastCausalTransport *self,
+    GibberRMulticastPacket *packet)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+      GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+  gsize size;
+
+  gibber_r_multicast_packet_get_raw_data (packet, &size);
+
+  /* As RTCP does */
+  if (priv->session_avg_size == 0)
+    priv->session_avg_size = size;
+  else
+    priv->session_avg_size = (15 * priv->session_avg_size + size) / 16;
+}
+
 static gboolean
 sendout_session_cb (gpointer data)
 {
@@ -392,12 +798,15 @@ sendout_session_cb (gpointer data)
           priv->transport->max_packet_size);
 
   DEBUG_TRANSPORT (self, "Preparing session message");
-  g_hash_table_foreach (priv->sender_group->senders, add_sender_info, packet);
+  add_session_senders (self, packet);
   DEBUG_TRANSPORT (self, "Sending out session message");
   sendout_packet (self, packet, NULL);
+  update_session_avg_size (self, packet);
   g_object_unref (packet);
 
   priv->timer = 0;
+  priv->session_packet_id = priv->packet_id;
+  priv->session_sent = gibber_timer_wheel_get_time (priv->timers);
   schedule_session_message (self);
 
   return FALSE;
@@ -408,14 +817,33 @@ schedule_session_message (GibberRMulticastCausalTransport *transport)
 {
   GibberRMulticastCausalTransportPrivate *priv =
       GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+  guint64 interval;
+  guint min = SESSION_TIMEOUT_MIN, max = SESSION_TIMEOUT_MAX;
 
   if (priv->timer != 0)
-    g_source_remove (priv->timer);
+    gibber_timer_wheel_remove (priv->timers, priv->timer);
 
-  priv->timer =
-      g_timeout_add (
-          g_random_int_range (SESSION_TIMEOUT_MIN, SESSION_TIMEOUT_MAX),
-          sendout_session_cb, transport);
+  /* Time it takes for every member to send one within the bandwidth */
+  interval = (guint64) g_hash_table_size (priv->sender_group->senders)
+      * priv->session_avg_size * 1000 / SESSION_BANDWIDTH;
+
+  /* Like RTCP senders, members that sent something since their last session
+   * message keep the short interval */
+  priv->session_stretched = FALSE;
+  if (priv->session_packet_id == priv->packet_id
+      && interval > (SESSION_TIMEOUT_MIN + SESSION_TIMEOUT_MAX) / 2)
+    {
+      /* Same spread around the new average */
+      min = interval * 2 * SESSION_TIMEOUT_MIN
+          / (SESSION_TIMEOUT_MIN + SESSION_TIMEOUT_MAX);
+      max = interval * 2 * SESSION_TIMEOUT_MAX
+          / (SESSION_TIMEOUT_MIN + SESSION_TIMEOUT_MAX);
+      priv->session_stretched = TRUE;
+    }
+
+  priv->timer = gibber_timer_wheel_add (priv->timers,
+      gibber_timer_wheel_random_int_range (priv->timers, min, max),
+      sendout_session_cb, transport);
 }
 
 static void
@@ -425,7 +853,10 @@ connected (GibberRMulticastCausalTransport *transport)
       GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE(transport);
   GibberRMulticastPacket *packet;
 
-  DEBUG_TRANSPORT (transport, "Connected to group");
+  priv->connect_time = gibber_timer_wheel_get_time (priv->timers)
+      - priv->connect_started;
+  DEBUG_TRANSPORT (transport, "Connected to group after %u ms",
+      priv->connect_time);
 
   priv->self = gibber_r_multicast_sender_new (transport->sender_id, priv->name,
       priv->sender_group);
@@ -433,6 +864,7 @@ connected (GibberRMulticastCausalTransport *transport)
   gibber_r_multicast_sender_set_data_start (priv->self, priv->packet_id);
 
   gibber_r_multicast_sender_group_add (priv->sender_group, priv->self);
+  priv->sender_group->self = priv->self;
 
   g_object_ref (priv->self);
 
@@ -483,8 +915,8 @@ next_join_step (gpointer data)
       sendout_packet (transport, packet, NULL);
       g_object_unref (packet);
 
-      priv->timer = g_timeout_add (ACTIVE_JOIN_INTERVAL,
-          next_join_step, transport);
+      priv->timer = gibber_timer_wheel_add (priv->timers,
+          ACTIVE_JOIN_INTERVAL, next_join_step, transport);
     }
   else
     {
@@ -501,7 +933,7 @@ start_joining (GibberRMulticastCausalTransport *transport)
   GibberRMulticastCausalTransportPrivate *priv =
     GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
 
-  transport->sender_id = _random_nonzero_uint ();
+  transport->sender_id = _random_nonzero_uint (priv->timers);
   priv->nr_join_requests = 0;
   priv->nr_join_requests_seen = 0;
 
@@ -509,10 +941,10 @@ start_joining (GibberRMulticastCausalTransport *transport)
 
   if (priv->timer != 0)
   {
-    g_source_remove (priv->timer);
+    gibber_timer_wheel_remove (priv->timers, priv->timer);
   }
 
-  priv->timer = g_timeout_add (PASSIVE_JOIN_TIME,
+  priv->timer = gibber_timer_wheel_add (priv->timers, PASSIVE_JOIN_TIME,
     next_join_step, transport);
 }
 
@@ -529,6 +961,32 @@ data_received_cb (GibberRMulticastSender *sender,
   rmbuffer.buffer.length = size;
   rmbuffer.sender = sender->name;
   rmbuffer.stream_id = stream_id;
+  rmbuffer.flags = GIBBER_R_MULTICAST_DATA_PACKET_START
+      | GIBBER_R_MULTICAST_DATA_PACKET_END;
+  rmbuffer.total_size = size;
+  rmbuffer.sender_id = sender->id;
+
+  gibber_transport_received_data_custom (GIBBER_TRANSPORT (user_data),
+      (GibberBuffer *) &rmbuffer);
+}
+
+static void
+data_chunk_received_cb (GibberRMulticastSender *sender,
+                        guint16 stream_id,
+                        guint flags,
+                        guint total_size,
+                        guint8 *data,
+                        gsize size,
+                        gpointer user_data)
+{
+  GibberRMulticastCausalBuffer rmbuffer;
+
+  rmbuffer.buffer.data = data;
+  rmbuffer.buffer.length = size;
+  rmbuffer.sender = sender->name;
+  rmbuffer.stream_id = stream_id;
+  rmbuffer.flags = flags;
+  rmbuffer.total_size = total_size;
   rmbuffer.sender_id = sender->id;
 
   gibber_transport_received_data_custom (GIBBER_TRANSPORT (user_data),
@@ -643,6 +1101,8 @@ gibber_r_multicast_causal_transport_add_sender (
 
   g_signal_connect (sender, "received-data",
       G_CALLBACK (data_received_cb), transport);
+  g_signal_connect (sender, "received-data-chunk",
+      G_CALLBACK (data_chunk_received_cb), transport);
 
   g_signal_connect (sender, "received-control-packet",
       G_CALLBACK (control_packet_received_cb), transport);
@@ -686,11 +1146,19 @@ handle_session_message (GibberRMulticastCausalTransport *self,
 {
   GibberRMulticastCausalTransportPrivate *priv =
       GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+  GibberRMulticastSender *from;
   guint i;
   gboolean outdated = FALSE;
 
   g_assert (packet->type == PACKET_TYPE_SESSION);
 
+  update_session_avg_size (self, packet);
+
+  from = gibber_r_multicast_sender_group_lookup (priv->sender_group,
+      packet->sender);
+  if (from != NULL)
+    gibber_r_multicast_sender_heard (from);
+
   for (i = 0; i < packet->depends->len ; i++)
     {
       GibberRMulticastPacketSenderInfo *sender_info =
@@ -720,7 +1188,9 @@ handle_session_message (GibberRMulticastCausalTransport *self,
    * message was at least as up to date as us */
   if (!outdated &&
         g_hash_table_size (priv->sender_group->senders)
-            == packet->depends->len)
+            == packet->depends->len &&
+        gibber_timer_wheel_get_time (priv->timers) - priv->session_sent
+            < SESSION_HEARTBEAT_INTERVAL)
     {
       DEBUG_TRANSPORT (self, "Rescheduling session message");
       schedule_session_message (self);
@@ -799,6 +1269,8 @@ joined_multicast_receive (GibberRMulticastCausalTransport *self,
 {
   GibberRMulticastCausalTransportPrivate *priv =
       GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+  GibberRMulticastSender *sender;
+  gboolean keepalive = FALSE;
 
   if (packet->sender == 0)
     {
@@ -824,6 +1296,17 @@ joined_multicast_receive (GibberRMulticastCausalTransport *self,
   DEBUG_TRANSPORT (self, "Received packet type: 0x%x from %x",
       packet->type, packet->sender);
 
+  /* Keepalives count as heartbeats, but not when someone else repeats them
+   * for a repair */
+  if (packet->type == PACKET_TYPE_NO_DATA)
+    {
+      sender = gibber_r_multicast_sender_group_lookup (priv->sender_group,
+          packet->sender);
+      keepalive = sender == NULL
+          || gibber_r_multicast_packet_diff (sender->next_input_packet,
+              packet->packet_id) >= 0;
+    }
+
   if (!gibber_r_multicast_sender_group_push_packet (priv->sender_group,
         packet))
     {
@@ -847,6 +1330,7 @@ joined_multicast_receive (GibberRMulticastCausalTransport *self,
       case PACKET_TYPE_WHOIS_REQUEST:
       case PACKET_TYPE_WHOIS_REPLY:
       case PACKET_TYPE_REPAIR_REQUEST:
+      case PACKET_TYPE_PARITY:
          /* No postprocessing needed */
          break;
       case PACKET_TYPE_SESSION:
@@ -863,6 +1347,14 @@ joined_multicast_receive (GibberRMulticastCausalTransport *self,
                 "Received unhandled packet type!!, ignoring");
           }
     }
+
+  if (keepalive)
+    {
+      sender = gibber_r_multicast_sender_group_lookup (priv->sender_group,
+          packet->sender);
+      if (sender != NULL)
+        gibber_r_multicast_sender_heard (sender);
+    }
 }
 
 /* Packet received while disconnecting. Only react on repair requests and
@@ -902,6 +1394,8 @@ disconnecting_multicast_receive (GibberRMulticastCausalTransport *self,
 
 
 
+static void stream_check_room (GibberRMulticastCausalTransport *self);
+
 static void
 r_multicast_receive (GibberTransport *transport,
                      GibberBuffer *buffer,
@@ -942,11 +1436,24 @@ r_multicast_receive (GibberTransport *transport,
 
   if (packet != NULL)
     g_object_unref (packet);
+
+  /* It might have acked some of the message we're streaming */
+  stream_check_room (self);
 }
 
 GibberRMulticastCausalTransport *
 gibber_r_multicast_causal_transport_new (GibberTransport *transport,
                                          const gchar *name)
+{
+  return gibber_r_multicast_causal_transport_new_with_timers (transport,
+      name, NULL);
+}
+
+GibberRMulticastCausalTransport *
+gibber_r_multicast_causal_transport_new_with_timers (
+    GibberTransport *transport,
+    const gchar *name,
+    GibberTimerWheel *timers)
 {
   GibberRMulticastCausalTransport *result;
 
@@ -955,6 +1462,7 @@ gibber_r_multicast_causal_transport_new (GibberTransport *transport,
   result = g_object_new (GIBBER_TYPE_R_MULTICAST_CAUSAL_TRANSPORT,
       "name", name,
       "transport", transport,
+      "timer-wheel", timers,
       NULL);
 
   gibber_transport_set_handler (GIBBER_TRANSPORT (transport),
@@ -977,6 +1485,7 @@ gibber_r_multicast_causal_transport_connect (
   gibber_transport_set_state (GIBBER_TRANSPORT (transport),
          GIBBER_TRANSPORT_CONNECTING);
 
+  priv->connect_started = gibber_timer_wheel_get_time (priv->timers);
   start_joining (transport);
 
   return TRUE;
@@ -1030,7 +1539,7 @@ send_keepalive_cb (gpointer data)
 
   DEBUG ("Sending out keepalive");
   packet = gibber_r_multicast_packet_new (PACKET_TYPE_NO_DATA,
-      priv->self->id, priv->transport->max_packet_size);
+      priv->self->id, reliable_packet_size (self));
 
   gibber_r_multicast_packet_set_packet_id (packet, priv->packet_id++);
   add_packet_depends (self, packet);
@@ -1050,12 +1559,30 @@ schedule_keepalive_message (GibberRMulticastCausalTransport *transport)
       GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
 
   if (priv->keepalive_timer != 0)
-    g_source_remove (priv->keepalive_timer);
+    gibber_timer_wheel_remove (priv->timers, priv->keepalive_timer);
 
-  priv->keepalive_timer =
-      g_timeout_add (KEEPALIVE_TIMEOUT, send_keepalive_cb, transport);
+  priv->keepalive_timer = gibber_timer_wheel_add (priv->timers,
+      KEEPALIVE_TIMEOUT, send_keepalive_cb, transport);
 }
 
+static guint8
+stream_ordering_flags (GibberRMulticastCausalTransport *self,
+                       guint16 stream_id)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+
+  switch (GPOINTER_TO_UINT (g_hash_table_lookup (priv->stream_ordering,
+      GUINT_TO_POINTER (stream_id))))
+    {
+      case GIBBER_R_MULTICAST_ORDERING_FIFO:
+        return GIBBER_R_MULTICAST_DATA_PACKET_FIFO;
+      case GIBBER_R_MULTICAST_ORDERING_UNORDERED:
+        return GIBBER_R_MULTICAST_DATA_PACKET_UNORDERED;
+      default:
+        return 0;
+    }
+}
 
 gboolean
 gibber_r_multicast_causal_transport_send (
@@ -1072,19 +1599,42 @@ gibber_r_multicast_causal_transport_send (
   GibberRMulticastPacket *packet;
   gsize payloaded;
   gboolean ret = TRUE;
+  guint8 flags;
 
   if (priv->resetting)
     return TRUE;
 
+  if (priv->streaming && !priv->stream_dropped
+      && stream_id == priv->stream_id)
+    {
+      QueuedMessage *message = g_slice_new (QueuedMessage);
+
+      message->stream_id = stream_id;
+      message->data = g_byte_array_sized_new (size);
+      g_byte_array_append (message->data, data, size);
+      g_queue_push_tail (&priv->stream_queue, message);
+
+      return TRUE;
+    }
+
   g_assert (priv->self != NULL);
 
+  /* Receivers can't assume a gap between the packets of the streamed
+   * message only hides more of it anymore */
+  if (priv->streaming && !priv->stream_first)
+    priv->stream_resumed = TRUE;
+
+  flags = stream_ordering_flags (self, stream_id);
+
   packet = gibber_r_multicast_packet_new (PACKET_TYPE_DATA, priv->self->id,
-      priv->transport->max_packet_size);
+      reliable_packet_size (self));
 
+  /* All the fragments of a message are sent out back to back, receivers
+   * rely on this to reason about fragments they haven't seen yet */
   add_packet_depends (self, packet);
   payloaded = gibber_r_multicast_packet_add_payload (packet, data, size);
   gibber_r_multicast_packet_set_data_info (packet, stream_id,
-        GIBBER_R_MULTICAST_DATA_PACKET_START, size);
+        flags | GIBBER_R_MULTICAST_DATA_PACKET_START, size);
 
   if (payloaded < size)
     {
@@ -1096,18 +1646,19 @@ gibber_r_multicast_causal_transport_send (
           g_object_unref (packet);
 
           packet = gibber_r_multicast_packet_new (PACKET_TYPE_DATA,
-              priv->self->id, priv->transport->max_packet_size);
+              priv->self->id, reliable_packet_size (self));
           payloaded += gibber_r_multicast_packet_add_payload (packet,
               data + payloaded, size - payloaded);
-          gibber_r_multicast_packet_set_data_info (packet, stream_id, 0, size);
+          gibber_r_multicast_packet_set_data_info (packet, stream_id, flags,
+              size);
       } while (payloaded < size);
      gibber_r_multicast_packet_set_data_info (packet, stream_id,
-        GIBBER_R_MULTICAST_DATA_PACKET_END, size);
+        flags | GIBBER_R_MULTICAST_DATA_PACKET_END, size);
    }
   else
     {
       gibber_r_multicast_packet_set_data_info (packet, stream_id,
-        GIBBER_R_MULTICAST_DATA_PACKET_START
+        flags | GIBBER_R_MULTICAST_DATA_PACKET_START
         | GIBBER_R_MULTICAST_DATA_PACKET_END, size);
 
     }
@@ -1119,6 +1670,399 @@ gibber_r_multicast_causal_transport_send (
   return ret;
 }
 
+gsize
+gibber_r_multicast_causal_transport_get_stream_room (
+    GibberRMulticastCausalTransport *transport)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+  gsize left, room;
+  guint unstable;
+
+  if (!priv->streaming)
+    return 0;
+
+  left = priv->stream_left - priv->stream_buffer->len;
+
+  if (priv->stream_dropped)
+    return left;
+
+  unstable = gibber_r_multicast_sender_unstable_packets (priv->self);
+  if (unstable >= STREAM_WINDOW)
+    return 0;
+
+  /* What's held back is less than a packet, so there's always room left
+   * as long as a packet can go out */
+  room = (STREAM_WINDOW - unstable) * reliable_packet_size (transport)
+      - priv->stream_buffer->len;
+
+  return MIN (room, left);
+}
+
+static gboolean
+stream_timer_cb (gpointer user_data)
+{
+  GibberRMulticastCausalTransport *self =
+      GIBBER_R_MULTICAST_CAUSAL_TRANSPORT (user_data);
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+
+  priv->stream_timer = 0;
+  stream_check_room (self);
+
+  if (!priv->stream_blocked)
+    return FALSE;
+
+  if (gibber_timer_wheel_get_time (priv->timers) - priv->stream_blocked_since
+      >= STREAM_STALL_TIMEOUT)
+    {
+      DEBUG_TRANSPORT (self, "Streamed message stalled for %u ms",
+          STREAM_STALL_TIMEOUT);
+
+      /* Their failure is agreed on as usual, and whoever is left may be
+       * slow in turn */
+      priv->stream_blocked_since = gibber_timer_wheel_get_time (priv->timers);
+      gibber_r_multicast_sender_fail_laggards (priv->self);
+    }
+
+  /* Unless the failure handlers got it going again */
+  if (priv->stream_blocked && priv->stream_timer == 0)
+    priv->stream_timer = gibber_timer_wheel_add (priv->timers,
+        STREAM_RETRY_INTERVAL, stream_timer_cb, self);
+
+  return FALSE;
+}
+
+static void
+stream_block (GibberRMulticastCausalTransport *self)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+
+  if (!priv->stream_blocked)
+    priv->stream_blocked_since = gibber_timer_wheel_get_time (priv->timers);
+
+  priv->stream_blocked = TRUE;
+
+  if (priv->stream_timer == 0)
+    priv->stream_timer = gibber_timer_wheel_add (priv->timers,
+        STREAM_RETRY_INTERVAL, stream_timer_cb, self);
+}
+
+/* Signals stream-room once the message being streamed can go on */
+static void
+stream_check_room (GibberRMulticastCausalTransport *self)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+
+  if (!priv->stream_blocked)
+    return;
+
+  if (priv->streaming &&
+      gibber_r_multicast_causal_transport_get_stream_room (self) == 0)
+    return;
+
+  priv->stream_blocked = FALSE;
+
+  if (priv->stream_timer != 0)
+    {
+      gibber_timer_wheel_remove (priv->timers, priv->stream_timer);
+      priv->stream_timer = 0;
+    }
+
+  if (priv->streaming)
+    g_signal_emit (self, signals[STREAM_ROOM], 0);
+}
+
+/* Sends out the next packet of the message being streamed with as much of
+ * data as fits in, and returns how much that was */
+static gsize
+stream_send_packet (GibberRMulticastCausalTransport *self,
+                    const guint8 *data,
+                    gsize size,
+                    gboolean *ret,
+                    GError **error)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+  GibberRMulticastPacket *packet;
+  guint8 flags = priv->stream_flags;
+  gsize payloaded;
+
+  packet = gibber_r_multicast_packet_new (PACKET_TYPE_DATA, priv->self->id,
+      reliable_packet_size (self));
+
+  if (priv->stream_first)
+    {
+      add_packet_depends (self, packet);
+      flags |= GIBBER_R_MULTICAST_DATA_PACKET_START;
+      priv->stream_first = FALSE;
+    }
+  else if (priv->stream_resumed)
+    {
+      flags |= GIBBER_R_MULTICAST_DATA_PACKET_RESUMED;
+    }
+
+  priv->stream_resumed = FALSE;
+
+  payloaded = gibber_r_multicast_packet_add_payload (packet, data, size);
+  priv->stream_left -= payloaded;
+
+  if (priv->stream_left == 0)
+    {
+      flags |= GIBBER_R_MULTICAST_DATA_PACKET_END;
+      priv->streaming = FALSE;
+    }
+
+  gibber_r_multicast_packet_set_data_info (packet, priv->stream_id, flags,
+      priv->stream_total);
+  gibber_r_multicast_packet_set_packet_id (packet, priv->packet_id++);
+  gibber_r_multicast_sender_push (priv->self, packet);
+
+  if (!sendout_packet (self, packet, *ret ? error : NULL))
+    *ret = FALSE;
+
+  g_object_unref (packet);
+
+  return payloaded;
+}
+
+/* Sends out the packets that can be filled up with data and what was held
+ * back before, holding back the rest */
+static gboolean
+stream_write (GibberRMulticastCausalTransport *self,
+              const guint8 *data,
+              gsize size,
+              GError **error)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+  /* More than what fits in a packet */
+  gsize threshold = reliable_packet_size (self);
+  gboolean ret = TRUE;
+
+  while (priv->streaming)
+    {
+      GByteArray *buffer = priv->stream_buffer;
+      gsize sent;
+
+      if (buffer->len == 0)
+        {
+          if (size < threshold && size < priv->stream_left)
+            {
+              if (size > 0)
+                g_byte_array_append (buffer, data, size);
+              break;
+            }
+
+          sent = stream_send_packet (self, data, size, &ret, error);
+          data += sent;
+          size -= sent;
+          continue;
+        }
+
+      /* What was held back is always less than threshold */
+      if (size > 0)
+        {
+          gsize room = MIN (size, threshold - buffer->len);
+
+          g_byte_array_append (buffer, data, room);
+          data += room;
+          size -= room;
+        }
+
+      if (buffer->len < threshold && buffer->len < priv->stream_left)
+        break;
+
+      sent = stream_send_packet (self, buffer->data, buffer->len, &ret,
+          error);
+      g_byte_array_remove_range (buffer, 0, sent);
+    }
+
+  /* The ones sent in the meantime can go now. Their callers were told they
+   * were sent, so a failure is reported to ours. */
+  while (!priv->streaming && !g_queue_is_empty (&priv->stream_queue))
+    {
+      QueuedMessage *message = g_queue_pop_head (&priv->stream_queue);
+
+      if (!gibber_r_multicast_causal_transport_send (self, message->stream_id,
+            message->data->data, message->data->len, ret ? error : NULL))
+        ret = FALSE;
+
+      queued_message_free (message);
+    }
+
+  if (priv->streaming && gibber_r_multicast_causal_transport_get_stream_room (
+        self) == 0)
+    stream_block (self);
+
+  return ret;
+}
+
+gboolean
+gibber_r_multicast_causal_transport_send_start (
+    GibberRMulticastCausalTransport *transport,
+    guint16 stream_id,
+    gsize total_size,
+    GError **error)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  g_return_val_if_fail (!priv->streaming, FALSE);
+  g_return_val_if_fail (total_size <= G_MAXUINT32, FALSE);
+
+  priv->streaming = TRUE;
+  priv->stream_dropped = priv->resetting;
+  priv->stream_first = TRUE;
+  priv->stream_resumed = FALSE;
+  priv->stream_id = stream_id;
+  priv->stream_flags = stream_ordering_flags (transport, stream_id);
+  priv->stream_total = total_size;
+  priv->stream_left = total_size;
+
+  if (priv->stream_dropped)
+    {
+      priv->streaming = (total_size > 0);
+      return TRUE;
+    }
+
+  g_assert (priv->self != NULL);
+
+  /* Sends an empty message right away */
+  return stream_write (transport, NULL, 0, error);
+}
+
+gboolean
+gibber_r_multicast_causal_transport_send_chunk (
+    GibberRMulticastCausalTransport *transport,
+    const guint8 *data,
+    gsize size,
+    GError **error)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  g_return_val_if_fail (priv->streaming, FALSE);
+  g_return_val_if_fail (
+      size <= priv->stream_left - priv->stream_buffer->len, FALSE);
+
+  if (priv->stream_dropped)
+    {
+      priv->stream_left -= size;
+      priv->streaming = (priv->stream_left > 0);
+      return TRUE;
+    }
+
+  return stream_write (transport, data, size, error);
+}
+
+void
+gibber_r_multicast_causal_transport_set_stream_chunked (
+    GibberRMulticastCausalTransport *transport,
+    guint16 stream_id,
+    gboolean chunked)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  /* The XMPP traffic on the default stream is parsed as whole stanzas */
+  g_return_if_fail (stream_id != GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM);
+
+  if (chunked)
+    g_hash_table_insert (priv->chunked_streams, GUINT_TO_POINTER (stream_id),
+        GUINT_TO_POINTER (stream_id));
+  else
+    g_hash_table_remove (priv->chunked_streams, GUINT_TO_POINTER (stream_id));
+}
+
+void
+gibber_r_multicast_causal_transport_set_stream_ordering (
+    GibberRMulticastCausalTransport *transport,
+    guint16 stream_id,
+    GibberRMulticastOrdering ordering)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  /* The default stream carries the XMPP traffic, which has to stay in causal
+   * order */
+  g_return_if_fail (stream_id != GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM);
+
+  if (ordering == GIBBER_R_MULTICAST_ORDERING_CAUSAL)
+    g_hash_table_remove (priv->stream_ordering, GUINT_TO_POINTER (stream_id));
+  else
+    g_hash_table_insert (priv->stream_ordering, GUINT_TO_POINTER (stream_id),
+        GUINT_TO_POINTER (ordering));
+}
+
+void
+gibber_r_multicast_causal_transport_set_fec (
+    GibberRMulticastCausalTransport *transport,
+    guint k,
+    guint r)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  g_return_if_fail (k <= G_MAXUINT8);
+  g_return_if_fail (k == 0 || (r >= 1 && r <= k));
+
+  fec_flush (transport);
+
+  priv->fec_k = k;
+  priv->fec_r = r;
+}
+
+void
+gibber_r_multicast_causal_transport_set_cache_budget (
+    GibberRMulticastCausalTransport *transport,
+    gsize budget)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  priv->cache_budget = budget;
+  gibber_r_multicast_sender_group_set_budget (priv->sender_group, budget);
+}
+
+void
+gibber_r_multicast_causal_transport_get_cache_stats (
+    GibberRMulticastCausalTransport *transport,
+    gsize *bytes,
+    guint *evictions,
+    guint *oldest_unstable)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  gibber_r_multicast_sender_group_get_cache_stats (priv->sender_group, bytes,
+      evictions, oldest_unstable);
+
+  if (evictions != NULL)
+    *evictions += priv->evictions;
+}
+
+void
+gibber_r_multicast_causal_transport_get_fec_counters (
+    GibberRMulticastCausalTransport *transport,
+    guint *recovered,
+    guint *repaired)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+    GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  gibber_r_multicast_sender_group_get_fec_counters (priv->sender_group,
+      recovered, repaired);
+
+  if (recovered != NULL)
+    *recovered += priv->fec_recovered;
+
+  if (repaired != NULL)
+    *repaired += priv->repaired;
+}
+
 static gboolean
 gibber_r_multicast_causal_transport_do_send (GibberTransport *transport,
     const guint8 *data, gsize size, GError **error)
@@ -1134,11 +2078,24 @@ reconnect (GibberRMulticastCausalTransport *self)
 {
   GibberRMulticastCausalTransportPrivate *priv =
     GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (self);
+  guint fec_recovered, repaired, evictions;
+
+  /* Keep the counters going */
+  gibber_r_multicast_sender_group_get_fec_counters (priv->sender_group,
+      &fec_recovered, &repaired);
+  gibber_r_multicast_sender_group_get_cache_stats (priv->sender_group, NULL,
+      &evictions, NULL);
+  priv->fec_recovered += fec_recovered;
+  priv->repaired += repaired;
+  priv->evictions += evictions;
 
   /* Remove all data and start connection phase */
   gibber_r_multicast_sender_group_free (priv->sender_group);
-  priv->sender_group = gibber_r_multicast_sender_group_new ();
-  priv->packet_id = g_random_int ();
+  priv->sender_group = gibber_r_multicast_sender_group_new (priv->timers);
+  gibber_r_multicast_sender_group_set_budget (priv->sender_group,
+      priv->cache_budget);
+  priv->sender_group->chunked_streams = priv->chunked_streams;
+  priv->packet_id = gibber_timer_wheel_random_int (priv->timers);
   priv->resetting = FALSE;
 
   g_assert (gibber_r_multicast_causal_transport_connect (self, FALSE, NULL));
@@ -1152,9 +2109,11 @@ disconnect_done (GibberRMulticastCausalTransport *self)
 
   if (priv->timer != 0)
     {
-      g_source_remove (priv->timer);
+      gibber_timer_wheel_remove (priv->timers, priv->timer);
     }
 
+  fec_flush (self);
+
   gibber_transport_disconnect (GIBBER_TRANSPORT (priv->transport));
 
   if (priv->self != NULL)
@@ -1189,7 +2148,7 @@ send_next_bye (gpointer data)
 
   if (priv->nr_bye < NR_BYE_TO_SEND)
     {
-      priv->timer = g_timeout_add (BYE_INTERVAL,
+      priv->timer = gibber_timer_wheel_add (priv->timers, BYE_INTERVAL,
           send_next_bye, self);
     }
   else if (priv->resetting)
@@ -1218,12 +2177,12 @@ do_disconnect (GibberRMulticastCausalTransport *transport)
 
   if (priv->timer != 0)
     {
-      g_source_remove (priv->timer);
+      gibber_timer_wheel_remove (priv->timers, priv->timer);
     }
 
   if (priv->keepalive_timer != 0)
     {
-      g_source_remove (priv->keepalive_timer);
+      gibber_timer_wheel_remove (priv->timers, priv->keepalive_timer);
       priv->keepalive_timer = 0;
     }
 
@@ -1264,6 +2223,21 @@ gibber_r_multicast_causal_transport_reset (
     GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
 
   priv->resetting = TRUE;
+
+  /* What's left of the message being sent goes the way of the ones sent
+   * while resetting, so do the ones waiting for it */
+  if (priv->streaming && !priv->stream_dropped)
+    {
+      DEBUG_TRANSPORT (transport, "Dropping the rest of the message on "
+          "stream %x", priv->stream_id);
+      priv->stream_dropped = TRUE;
+      priv->stream_left -= priv->stream_buffer->len;
+      g_byte_array_set_size (priv->stream_buffer, 0);
+    }
+
+  while (!g_queue_is_empty (&priv->stream_queue))
+    queued_message_free (g_queue_pop_head (&priv->stream_queue));
+
   do_disconnect (transport);
 }
 
@@ -1280,7 +2254,7 @@ gibber_r_multicast_causal_transport_send_attempt_join (
   guint32 packet_id;
 
   packet = gibber_r_multicast_packet_new (PACKET_TYPE_ATTEMPT_JOIN,
-      priv->self->id, priv->transport->max_packet_size);
+      priv->self->id, reliable_packet_size (transport));
 
   gibber_r_multicast_packet_set_packet_id (packet, priv->packet_id++);
   gibber_r_multicast_packet_attempt_join_add_senders (packet, new_senders,
@@ -1326,7 +2300,7 @@ gibber_r_multicast_causal_transport_send_failure (
   gchar *str;
 
   packet = gibber_r_multicast_packet_new (PACKET_TYPE_FAILURE,
-      priv->self->id, priv->transport->max_packet_size);
+      priv->self->id, reliable_packet_size (transport));
 
   gibber_r_multicast_packet_set_packet_id (packet, priv->packet_id++);
   gibber_r_multicast_packet_failure_add_senders (packet, failures,
@@ -1351,7 +2325,7 @@ gibber_r_multicast_causal_transport_send_join (
   GibberRMulticastPacket *packet;
 
   packet = gibber_r_multicast_packet_new (PACKET_TYPE_JOIN,
-      priv->self->id, priv->transport->max_packet_size);
+      priv->self->id, reliable_packet_size (transport));
 
   gibber_r_multicast_packet_set_packet_id (packet, priv->packet_id++);
   add_packet_depends (transport, packet);
@@ -1400,3 +2374,40 @@ gibber_r_multicast_causal_transport_remove_sender (
   gibber_r_multicast_sender_group_remove (priv->sender_group, sender_id);
 }
 
+GibberTimerWheel *
+gibber_r_multicast_causal_transport_get_timers (
+    GibberRMulticastCausalTransport *transport)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+      GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  return priv->timers;
+}
+
+gdouble
+gibber_r_multicast_causal_transport_get_suspicion (
+    GibberRMulticastCausalTransport *transport,
+    guint32 sender_id)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+      GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+  GibberRMulticastSender *sender;
+
+  sender = gibber_r_multicast_sender_group_lookup (priv->sender_group,
+      sender_id);
+
+  if (sender == NULL)
+    return 0;
+
+  return gibber_r_multicast_sender_get_suspicion (sender);
+}
+
+guint
+gibber_r_multicast_causal_transport_get_connect_time (
+    GibberRMulticastCausalTransport *transport)
+{
+  GibberRMulticastCausalTransportPrivate *priv =
+      GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_GET_PRIVATE (transport);
+
+  return priv->connect_time;
+}
@@ -46,11 +46,24 @@ typedef struct {
   GibberBuffer buffer;
   const gchar *sender;
   guint16 stream_id;
+  /* GIBBER_R_MULTICAST_DATA_PACKET_START and _END, both of them unless the
+   * stream is chunked. total_size is the size of the whole message */
+  guint8 flags;
+  guint32 total_size;
   guint32 sender_id;
 } GibberRMulticastCausalBuffer;
 
 #define GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM 0
 
+typedef enum {
+  /* delivered after everything the sender had seen when sending it */
+  GIBBER_R_MULTICAST_ORDERING_CAUSAL = 0,
+  /* delivered in the order of the sender, regardless of other senders */
+  GIBBER_R_MULTICAST_ORDERING_FIFO,
+  /* delivered reliably as soon as a complete message is received */
+  GIBBER_R_MULTICAST_ORDERING_UNORDERED
+} GibberRMulticastOrdering;
+
 /* TYPE MACROS */
 #define GIBBER_TYPE_R_MULTICAST_CAUSAL_TRANSPORT \
   (gibber_r_multicast_causal_transport_get_type ())
@@ -76,6 +89,13 @@ typedef struct {
 GibberRMulticastCausalTransport *gibber_r_multicast_causal_transport_new (
     GibberTransport *transport, const gchar *name);
 
+/* Runs the timers on timers, which has to outlive the transport, and takes
+ * the random numbers from it too. Mostly for tests and simulations, which
+ * can share a virtual wheel between several transports. */
+GibberRMulticastCausalTransport *
+gibber_r_multicast_causal_transport_new_with_timers (
+    GibberTransport *transport, const gchar *name, GibberTimerWheel *timers);
+
 gboolean gibber_r_multicast_causal_transport_connect (
     GibberRMulticastCausalTransport *transport, gboolean initial,
     GError **error);
@@ -84,6 +104,67 @@ gboolean gibber_r_multicast_causal_transport_send (
     GibberRMulticastCausalTransport *transport, guint16 stream_id,
     const guint8 *data, gsize size, GError **error);
 
+void gibber_r_multicast_causal_transport_set_stream_ordering (
+    GibberRMulticastCausalTransport *transport, guint16 stream_id,
+    GibberRMulticastOrdering ordering);
+
+/* Sends a message of total_size bytes whose data is passed in pieces of any
+ * size to gibber_r_multicast_causal_transport_send_chunk (), which sends out
+ * the packets as they fill up, so that the message is never kept in full.
+ * Other messages sent in the meantime on the same stream go out after it,
+ * those on other streams right away.
+ *
+ * The packets we sent are kept until every member acked them, so callers
+ * should only pass as much data as
+ * gibber_r_multicast_causal_transport_get_stream_room () allows, and wait
+ * for the stream-room signal when it gets to 0. The packets of a message are
+ * then never more than a few dozen ahead of the acks, and members that keep
+ * it from going on for too long are failed. Failures to send messages
+ * queued behind the streamed one are reported by the call that sent them
+ * out. */
+gboolean gibber_r_multicast_causal_transport_send_start (
+    GibberRMulticastCausalTransport *transport, guint16 stream_id,
+    gsize total_size, GError **error);
+
+gboolean gibber_r_multicast_causal_transport_send_chunk (
+    GibberRMulticastCausalTransport *transport, const guint8 *data,
+    gsize size, GError **error);
+
+/* Bytes of the message being streamed that can be sent right now */
+gsize gibber_r_multicast_causal_transport_get_stream_room (
+    GibberRMulticastCausalTransport *transport);
+
+/* Messages received on a chunked stream are handed over in pieces as soon as
+ * they can be delivered, with START set in the flags of the buffer of the
+ * first piece and END in the one of the last */
+void gibber_r_multicast_causal_transport_set_stream_chunked (
+    GibberRMulticastCausalTransport *transport, guint16 stream_id,
+    gboolean chunked);
+
+/* Sends r parity packets for every block of k of our reliable packets. The
+ * i-th one covers every r-th packet of the block from the i-th on, so that
+ * receivers can rebuild a burst of up to r lost packets without asking for
+ * repairs. k == 0 turns it off, which is the default. */
+void gibber_r_multicast_causal_transport_set_fec (
+    GibberRMulticastCausalTransport *transport, guint k, guint r);
+
+/* Lost packets of others that were rebuilt from parity packets, and the ones
+ * that only came in after a repair request */
+void gibber_r_multicast_causal_transport_get_fec_counters (
+    GibberRMulticastCausalTransport *transport, guint *recovered,
+    guint *repaired);
+
+/* Limit on the bytes the packets kept around for repairs take, see
+ * gibber_r_multicast_sender_group_set_budget (). 0 for no limit, which is
+ * the default. */
+void gibber_r_multicast_causal_transport_set_cache_budget (
+    GibberRMulticastCausalTransport *transport, gsize budget);
+
+/* See gibber_r_multicast_sender_group_get_cache_stats () */
+void gibber_r_multicast_causal_transport_get_cache_stats (
+    GibberRMulticastCausalTransport *transport, gsize *bytes,
+    guint *evictions, guint *oldest_unstable);
+
 GibberRMulticastSender *gibber_r_multicast_causal_transport_add_sender (
     GibberRMulticastCausalTransport *transport, guint32 sender_id);
 
@@ -116,6 +197,21 @@ void gibber_r_multicast_causal_transport_remove_sender (
 void gibber_r_multicast_causal_transport_reset (
     GibberRMulticastCausalTransport *transport);
 
+/* The timers of the transport and its senders, valid for as long as the
+ * transport is */
+GibberTimerWheel *gibber_r_multicast_causal_transport_get_timers (
+    GibberRMulticastCausalTransport *transport);
+
+/* How strongly we suspect the sender to have failed, see
+ * gibber_r_multicast_sender_get_suspicion (). 0 for unknown senders. */
+gdouble gibber_r_multicast_causal_transport_get_suspicion (
+    GibberRMulticastCausalTransport *transport, guint32 sender_id);
+
+/* In ms, from connecting to having picked a unique sender id the last time
+ * the transport connected, 0 if it didn't yet */
+guint gibber_r_multicast_causal_transport_get_connect_time (
+    GibberRMulticastCausalTransport *transport);
+
 G_END_DECLS
 
 #endif /* #ifndef __GIBBER_R_MULTICAST_CAUSAL_TRANSPORT_H__*/
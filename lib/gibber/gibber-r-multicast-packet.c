@@ -139,6 +139,9 @@ gibber_r_multicast_packet_finalize (GObject *object)
     case PACKET_TYPE_DATA:
       g_free (self->data.data.payload);
       break;
+    case PACKET_TYPE_PARITY:
+      g_free (self->data.parity.payload);
+      break;
     case PACKET_TYPE_ATTEMPT_JOIN:
       g_array_unref (self->data.attempt_join.senders);
       break;
@@ -259,6 +262,50 @@ gibber_r_multicast_packet_set_repair_request_info (
   packet->data.repair_request.sender_id = sender_id;
 }
 
+void
+gibber_r_multicast_packet_set_parity_info (GibberRMulticastPacket *packet,
+    guint32 first_packet_id,
+    guint8 count,
+    guint8 stride,
+    guint8 offset)
+{
+  g_assert (packet->type == PACKET_TYPE_PARITY);
+  g_assert (stride > 0 && offset < stride && offset < count);
+
+  packet->data.parity.first_packet_id = first_packet_id;
+  packet->data.parity.count = count;
+  packet->data.parity.stride = stride;
+  packet->data.parity.index = offset;
+}
+
+void
+gibber_r_multicast_packet_parity_add (GibberRMulticastPacket *packet,
+    const guint8 *data,
+    gsize size)
+{
+  GibberRMulticastPacketPrivate *priv =
+     GIBBER_R_MULTICAST_PACKET_GET_PRIVATE (packet);
+  GibberRMulticastParityPacket *parity = &packet->data.parity;
+  gsize i;
+
+  g_assert (packet->type == PACKET_TYPE_PARITY);
+  g_assert (priv->data == NULL);
+  g_assert (size <= G_MAXUINT16);
+
+  if (size > parity->payload_size)
+    {
+      parity->payload = g_realloc (parity->payload, size);
+      memset (parity->payload + parity->payload_size, 0,
+          size - parity->payload_size);
+      parity->payload_size = size;
+    }
+
+  for (i = 0; i < size; i++)
+    parity->payload[i] ^= data[i];
+
+  parity->size ^= size;
+}
+
 void
 gibber_r_multicast_packet_set_whois_request_info (
     GibberRMulticastPacket *packet,
@@ -311,6 +358,10 @@ gibber_r_multicast_packet_calculate_size (GibberRMulticastPacket *packet)
       /* 32 bit packet id and 32 sender id*/
       result += 8;
       break;
+    case PACKET_TYPE_PARITY:
+      /* 32 bit first packet id, 8 bit count, stride and index, 16 bit size */
+      result += 9 + packet->data.parity.payload_size;
+      break;
     case PACKET_TYPE_ATTEMPT_JOIN:
       /* 8 bit nr of senders, 32 bit per sender */
       result += 1 + 4 * packet->data.attempt_join.senders->len;
@@ -552,6 +603,25 @@ gibber_r_multicast_packet_build (GibberRMulticastPacket *packet)
       add_guint32 (priv->data, priv->max_data, &(priv->size),
             packet->data.repair_request.packet_id);
       break;
+    case PACKET_TYPE_PARITY:
+      add_guint32 (priv->data, priv->max_data, &(priv->size),
+          packet->data.parity.first_packet_id);
+      add_guint8 (priv->data, priv->max_data, &(priv->size),
+          packet->data.parity.count);
+      add_guint8 (priv->data, priv->max_data, &(priv->size),
+          packet->data.parity.stride);
+      add_guint8 (priv->data, priv->max_data, &(priv->size),
+          packet->data.parity.index);
+      add_guint16 (priv->data, priv->max_data, &(priv->size),
+          packet->data.parity.size);
+
+      g_assert (priv->size + packet->data.parity.payload_size
+          == priv->max_data);
+
+      memcpy (priv->data + priv->size, packet->data.parity.payload,
+          packet->data.parity.payload_size);
+      priv->size += packet->data.parity.payload_size;
+      break;
     case PACKET_TYPE_ATTEMPT_JOIN: {
       guint i;
       add_guint8 (priv->data, priv->max_data, &(priv->size),
@@ -712,6 +782,23 @@ gibber_r_multicast_packet_parse (const guint8 *data, gsize size,
       GET_GUINT32 (result->data.repair_request.sender_id);
       GET_GUINT32 (result->data.repair_request.packet_id);
       break;
+    case PACKET_TYPE_PARITY:
+      GET_GUINT32 (result->data.parity.first_packet_id);
+      GET_GUINT8 (result->data.parity.count);
+      GET_GUINT8 (result->data.parity.stride);
+      GET_GUINT8 (result->data.parity.index);
+      GET_GUINT16 (result->data.parity.size);
+
+      if (result->data.parity.stride == 0
+          || result->data.parity.index >= result->data.parity.stride
+          || result->data.parity.index >= result->data.parity.count)
+        goto parse_error;
+
+      result->data.parity.payload_size = priv->max_data - priv->size;
+      result->data.parity.payload = g_memdup (priv->data + priv->size,
+          result->data.parity.payload_size);
+      priv->size += result->data.parity.payload_size;
+      break;
     case PACKET_TYPE_ATTEMPT_JOIN:
       {
         guint8 nr;
@@ -39,6 +39,9 @@ typedef enum {
   PACKET_TYPE_WHOIS_REPLY,
   PACKET_TYPE_REPAIR_REQUEST,
   PACKET_TYPE_SESSION,
+  /* XOR of some reliable packets of the sender, to recover one of them
+   * without a repair */
+  PACKET_TYPE_PARITY,
   /* Reliable packets */
   FIRST_RELIABLE_PACKET = 0xf,
   PACKET_TYPE_DATA = FIRST_RELIABLE_PACKET,
@@ -82,6 +85,13 @@ struct _GibberRMulticastWhoisReplyPacket {
 
 #define GIBBER_R_MULTICAST_DATA_PACKET_START 0x1
 #define GIBBER_R_MULTICAST_DATA_PACKET_END  0x2
+/* Data on streams which don't take part in the causal ordering. Receivers
+ * that don't know these flags deliver the data in causal order */
+#define GIBBER_R_MULTICAST_DATA_PACKET_FIFO 0x4
+#define GIBBER_R_MULTICAST_DATA_PACKET_UNORDERED 0x8
+/* Other messages were sent since the previous packet of this message, which
+ * otherwise directly precedes it */
+#define GIBBER_R_MULTICAST_DATA_PACKET_RESUMED 0x10
 
 typedef struct _GibberRMulticastDataPacket GibberRMulticastDataPacket;
 struct _GibberRMulticastDataPacket {
@@ -106,6 +116,28 @@ struct _GibberRMulticastRepairRequestPacket {
     guint32 packet_id;
 };
 
+/* Size of a parity packet on top of the packets it covers */
+#define GIBBER_R_MULTICAST_PARITY_PACKET_OVERHEAD 21
+
+/* Size of a session packet reporting on n senders */
+#define GIBBER_R_MULTICAST_SESSION_PACKET_SIZE(n) (13 + 8 * (n))
+
+typedef struct _GibberRMulticastParityPacket GibberRMulticastParityPacket;
+struct _GibberRMulticastParityPacket {
+    /* Covers the packets first_packet_id + index + n * stride that come
+     * before first_packet_id + count */
+    guint32 first_packet_id;
+    guint8 count;
+    guint8 stride;
+    guint8 index;
+
+    /* XOR of the sizes of the covered packets */
+    guint16 size;
+    /* XOR of the raw covered packets, padded with zeros */
+    guint8 *payload;
+    gsize payload_size;
+};
+
 typedef struct _GibberRMulticastAttemptJoinPacket
     GibberRMulticastAttemptJoinPacket;
 struct _GibberRMulticastAttemptJoinPacket {
@@ -149,6 +181,7 @@ struct _GibberRMulticastPacket {
       GibberRMulticastWhoisReplyPacket whois_reply;
       GibberRMulticastDataPacket data;
       GibberRMulticastRepairRequestPacket repair_request;
+      GibberRMulticastParityPacket parity;
       GibberRMulticastAttemptJoinPacket attempt_join;
       GibberRMulticastJoinPacket join;
       GibberRMulticastFailurePacket failure;
@@ -192,6 +225,14 @@ void gibber_r_multicast_packet_set_data_info (GibberRMulticastPacket *packet,
 void gibber_r_multicast_packet_set_repair_request_info (
     GibberRMulticastPacket *packet, guint32 sender_id, guint32 packet_id);
 
+/* Set info for PACKET_TYPE_PARITY packets */
+void gibber_r_multicast_packet_set_parity_info (GibberRMulticastPacket *packet,
+    guint32 first_packet_id, guint8 count, guint8 stride, guint8 offset);
+
+/* XOR the raw data of a covered packet into a PACKET_TYPE_PARITY packet */
+void gibber_r_multicast_packet_parity_add (GibberRMulticastPacket *packet,
+    const guint8 *data, gsize size);
+
 /* Set the info for PACKET_TYPE_WHOIS_REQUEST packets */
 void gibber_r_multicast_packet_set_whois_request_info (
     GibberRMulticastPacket *packet, const guint32 sender_id);
@@ -21,6 +21,7 @@
 #include "config.h"
 #include "gibber-r-multicast-sender.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +36,15 @@
 
 #define PACKET_CACHE_SIZE 256
 
+/* Parity packets kept around waiting for the packets they cover */
+#define MAX_PARITIES 64
+
+/* Data packets of streams that don't take part in the causal ordering */
+#define IS_NON_CAUSAL_DATA(p) \
+  ((p)->type == PACKET_TYPE_DATA \
+    && ((p)->data.data.flags & (GIBBER_R_MULTICAST_DATA_PACKET_FIFO \
+        | GIBBER_R_MULTICAST_DATA_PACKET_UNORDERED)) != 0)
+
 #define MIN_DO_REPAIR_TIMEOUT 50
 #define MAX_DO_REPAIR_TIMEOUT 100
 
@@ -61,6 +71,27 @@
  * fauly */
 #define NAME_DISCOVERY_TIME  10000
 
+/* Number of intervals between the heartbeats of a sender the failure detector
+ * bases its suspicion on */
+#define HEARTBEAT_WINDOW 32
+/* Before the first intervals are in, as if they were about this long */
+#define FIRST_HEARTBEAT_ESTIMATE 10000
+/* So that very regular heartbeats don't make a slight delay suspicious */
+#define MIN_HEARTBEAT_DEVIATION 500
+/* ...nor a pause of a couple of heartbeats, as when their datagrams were
+ * lost: with a deviation of at least this much of the mean, a sender is only
+ * failed after 1 + 5.612 * 0.4, over 3, mean intervals */
+#define MIN_HEARTBEAT_DEVIATION_RATIO 0.4
+/* Standard deviations past the mean interval after which the suspicion
+ * reaches GIBBER_R_MULTICAST_SENDER_PHI_FAILED, as
+ * -log10 (0.5 * erfc (5.612 / sqrt (2))) is 8 */
+#define PHI_FAILED_DEVIATIONS 5.612
+
+/* Members that still haven't acked a packet after this many ms while the
+ * sender group is over its budget are failed, so that the packets they hold
+ * back can go */
+#define UNSTABLE_FAIL_AGE 30000
+
 #define GIBBER_R_MULTICAST_SENDER_GET_PRIVATE(o)  \
   (G_TYPE_INSTANCE_GET_PRIVATE ((o), GIBBER_TYPE_R_MULTICAST_SENDER, \
     GibberRMulticastSenderPrivate))
@@ -70,6 +101,7 @@ typedef struct _GibberRMulticastSenderPrivate GibberRMulticastSenderPrivate;
 
 static void set_state (GibberRMulticastSender *sender,
    GibberRMulticastSenderState state);
+static void signal_failure (GibberRMulticastSender *sender);
 
 struct _GibberRMulticastSenderPrivate
 {
@@ -103,6 +135,47 @@ struct _GibberRMulticastSenderPrivate
 
   /* Endpoint is just there in case we are in failure mode */
   guint32 end_point;
+
+  /* Whether we've seen data on an unordered stream */
+  gboolean has_unordered;
+
+  /* owned PACKET_TYPE_PARITY packets that can still rebuild a packet, oldest
+   * first */
+  GQueue parities;
+  gboolean trying_parities;
+  /* Inserting a packet rebuilt from a parity packet */
+  gboolean recovering;
+
+  /* Failure detector: when we last heard from the sender, 0 if never, and
+   * the intervals before that in ms, in a ring */
+  gint64 last_heard;
+  guint32 intervals[HEARTBEAT_WINDOW];
+  guint n_intervals;
+  guint next_interval;
+  guint64 interval_sum;
+  guint64 interval_sum_sq;
+  /* fires once the suspicion reaches GIBBER_R_MULTICAST_SENDER_PHI_FAILED */
+  guint suspicion_timer;
+
+  /* Raw size of the packets in packet_cache */
+  gsize cached_bytes;
+  /* We failed it for holding back packet escalated_packet of the sender
+   * escalated_sender when over the budget, until it acks past it */
+  gboolean escalated;
+  guint32 escalated_sender;
+  guint32 escalated_packet;
+
+  /* Message on a chunked stream that is delivered as it comes in. Its START
+   * packet is only popped with the END, so that pop_data_packet still finds
+   * it. chunk_next is the next packet to deliver and chunk_offset the bytes
+   * delivered so far, out of the chunk_total the START packet claimed */
+  gboolean chunking;
+  /* The checks pop_data_packet does on the START packet passed */
+  gboolean chunk_started;
+  guint32 chunk_start;
+  guint32 chunk_next;
+  guint32 chunk_total;
+  guint32 chunk_offset;
 };
 
 typedef struct {
@@ -139,11 +212,12 @@ gibber_r_multicast_sender_get_ackinfo (GibberRMulticastSender *sender,
     guint32 sender_id);
 
 GibberRMulticastSenderGroup *
-gibber_r_multicast_sender_group_new (void)
+gibber_r_multicast_sender_group_new (GibberTimerWheel *timers)
 {
   GibberRMulticastSenderGroup *result;
   result = g_slice_new0 (GibberRMulticastSenderGroup);
 
+  result->timers = timers;
   result->senders = g_hash_table_new_full (g_direct_hash, g_direct_equal,
       NULL, g_object_unref);
   result->pop_queue = g_queue_new ();
@@ -151,6 +225,14 @@ gibber_r_multicast_sender_group_new (void)
   return result;
 }
 
+void
+gibber_r_multicast_sender_group_set_budget (
+    GibberRMulticastSenderGroup *group,
+    gsize budget)
+{
+  group->budget = budget;
+}
+
 void
 gibber_r_multicast_sender_group_free (GibberRMulticastSenderGroup *group)
 {
@@ -552,6 +634,14 @@ gibber_r_multicast_sender_group_push_packet (
       if (sender != NULL)
         handled = TRUE;
       break;
+    case PACKET_TYPE_PARITY:
+      if (sender != NULL
+          && sender->state > GIBBER_R_MULTICAST_SENDER_STATE_NEW)
+        {
+          gibber_r_multicast_sender_push_parity (sender, packet);
+          handled = TRUE;
+        }
+      break;
     default:
       if (GIBBER_R_MULTICAST_PACKET_IS_RELIABLE_PACKET (packet))
         {
@@ -606,6 +696,7 @@ enum
     WHOIS_REQUEST,
     NAME_DISCOVERED,
     RECEIVED_DATA,
+    RECEIVED_DATA_CHUNK,
     RECEIVED_CONTROL_PACKET,
     FAILED,
     LAST_SIGNAL
@@ -627,6 +718,13 @@ typedef struct {
   GibberRMulticastSender *sender;
   gboolean acked;
   gboolean popped;
+  /* Start of an unordered message that was delivered ahead of its turn */
+  gboolean delivered;
+  /* We sent out a repair request for it */
+  gboolean requested;
+  /* Raw size of the packet and when it came in */
+  gsize size;
+  gint64 received;
 } PacketInfo;
 
 static void
@@ -634,11 +732,18 @@ packet_info_free (gpointer data)
 {
   PacketInfo *p = (PacketInfo *) data;
   if (p->packet != NULL) {
+    GibberRMulticastSenderPrivate *priv =
+        GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (p->sender);
+
+    priv->cached_bytes -= p->size;
     g_object_unref (p->packet);
   }
 
   if (p->timeout != 0) {
-    g_source_remove (p->timeout);
+    GibberRMulticastSenderPrivate *priv =
+        GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (p->sender);
+
+    gibber_timer_wheel_remove (priv->group->timers, p->timeout);
   }
   g_slice_free (PacketInfo, data);
 }
@@ -665,6 +770,8 @@ gibber_r_multicast_sender_init (GibberRMulticastSender *obj)
 
   priv->acks = g_hash_table_new_full (g_int_hash, g_int_equal,
       NULL, ack_info_free);
+
+  g_queue_init (&priv->parities);
 }
 
 static void gibber_r_multicast_sender_dispose (GObject *object);
@@ -728,6 +835,15 @@ gibber_r_multicast_sender_class_init (
       NULL, NULL, NULL,
       G_TYPE_NONE, 3, G_TYPE_UINT, G_TYPE_POINTER, G_TYPE_ULONG);
 
+  /* stream id, START/END flags, total size of the message, data, size */
+  signals[RECEIVED_DATA_CHUNK] = g_signal_new ("received-data-chunk",
+      G_OBJECT_CLASS_TYPE(gibber_r_multicast_sender_class),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+      0,
+      NULL, NULL, NULL,
+      G_TYPE_NONE, 5, G_TYPE_UINT, G_TYPE_UINT, G_TYPE_UINT, G_TYPE_POINTER,
+      G_TYPE_ULONG);
+
   signals[RECEIVED_CONTROL_PACKET] = g_signal_new ("received-control-packet",
       G_OBJECT_CLASS_TYPE(gibber_r_multicast_sender_class),
       G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
@@ -795,18 +911,27 @@ gibber_r_multicast_sender_dispose (GObject *object)
   g_hash_table_unref (priv->packet_cache);
   g_hash_table_unref (priv->acks);
 
+  while (!g_queue_is_empty (&priv->parities))
+    g_object_unref (g_queue_pop_head (&priv->parities));
+
   if (priv->whois_timer != 0)
     {
-      g_source_remove (priv->whois_timer);
+      gibber_timer_wheel_remove (priv->group->timers, priv->whois_timer);
       priv->whois_timer = 0;
     }
 
   if (priv->fail_timer != 0)
     {
-      g_source_remove (priv->fail_timer);
+      gibber_timer_wheel_remove (priv->group->timers, priv->fail_timer);
       priv->fail_timer = 0;
     }
 
+  if (priv->suspicion_timer != 0)
+    {
+      gibber_timer_wheel_remove (priv->group->timers, priv->suspicion_timer);
+      priv->suspicion_timer = 0;
+    }
+
   if (G_OBJECT_CLASS (gibber_r_multicast_sender_parent_class)->dispose)
     G_OBJECT_CLASS (gibber_r_multicast_sender_parent_class)->dispose (object);
 }
@@ -853,8 +978,8 @@ gibber_r_multicast_sender_new (guint32 id, const gchar *name,
   if (sender->name == NULL)
     {
       schedule_whois_request (sender, FALSE);
-      priv->fail_timer = g_timeout_add (NAME_DISCOVERY_TIME,
-        name_discovery_failed_cb, sender);
+      priv->fail_timer = gibber_timer_wheel_add (priv->group->timers,
+          NAME_DISCOVERY_TIME, name_discovery_failed_cb, sender);
     }
   else
    {
@@ -865,15 +990,12 @@ gibber_r_multicast_sender_new (guint32 id, const gchar *name,
 }
 
 static void
-packet_info_try_gc (GibberRMulticastSender *sender, PacketInfo *info)
+packet_info_remove (GibberRMulticastSender *sender, PacketInfo *info)
 {
   GibberRMulticastSenderPrivate *priv =
       GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
   guint32 packet_id, i;
 
-  if (!info->acked || !info->popped || info->repeating)
-    return;
-
   packet_id = info->packet_id;
   g_hash_table_remove (priv->packet_cache, &packet_id);
 
@@ -887,6 +1009,229 @@ packet_info_try_gc (GibberRMulticastSender *sender, PacketInfo *info)
     }
 }
 
+static void
+packet_info_try_gc (GibberRMulticastSender *sender, PacketInfo *info)
+{
+  if (!info->acked || !info->popped || info->repeating)
+    return;
+
+  packet_info_remove (sender, info);
+}
+
+/* Packets we delivered are only kept around for repairing them to others,
+ * so those can go when over the budget */
+static PacketInfo *
+oldest_evictable (GibberRMulticastSender *sender, guint32 until)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  guint32 i;
+
+  for (i = priv->first_packet;
+      gibber_r_multicast_packet_diff (i, until) > 0; i++)
+    {
+      PacketInfo *info = g_hash_table_lookup (priv->packet_cache, &i);
+
+      if (info != NULL && info->packet != NULL && info->popped
+          && !info->repeating)
+        return info;
+    }
+
+  return NULL;
+}
+
+static gboolean
+is_member (GibberRMulticastSenderGroup *group,
+    GibberRMulticastSender *member,
+    GibberRMulticastSender *sender)
+{
+  return member != sender && member != group->self
+      && member->state < GIBBER_R_MULTICAST_SENDER_STATE_FAILED;
+}
+
+/* Packets of sender before the returned one were acked by every member that
+ * hasn't failed, so they shouldn't need them anymore */
+static guint32
+stable_point (GibberRMulticastSenderGroup *group,
+    GibberRMulticastSender *sender)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  guint32 result = sender->next_output_packet;
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, group->senders);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      GibberRMulticastSender *member = value;
+      AckInfo *ack;
+
+      if (!is_member (group, member, sender))
+        continue;
+
+      ack = gibber_r_multicast_sender_get_ackinfo (member, sender->id);
+
+      if (ack == NULL)
+        return priv->first_packet;
+
+      if (gibber_r_multicast_packet_diff (ack->packet_id, result) > 0)
+        result = ack->packet_id;
+    }
+
+  return result;
+}
+
+/* Adds the members that haven't acked the oldest packet of sender for too
+ * long to laggards, to be failed */
+static void
+collect_laggards (GibberRMulticastSenderGroup *group,
+    GibberRMulticastSender *sender,
+    gint64 now,
+    GPtrArray *laggards)
+{
+  PacketInfo *info;
+  GHashTableIter iter;
+  gpointer value;
+
+  info = oldest_evictable (sender, sender->next_output_packet);
+
+  if (info == NULL || now - info->received < UNSTABLE_FAIL_AGE)
+    return;
+
+  g_hash_table_iter_init (&iter, group->senders);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      GibberRMulticastSender *member = value;
+      GibberRMulticastSenderPrivate *mpriv =
+          GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (member);
+      AckInfo *ack;
+
+      if (!is_member (group, member, sender) || mpriv->escalated)
+        continue;
+
+      ack = gibber_r_multicast_sender_get_ackinfo (member, sender->id);
+
+      /* Members that just joined didn't tell us what they have yet */
+      if (ack == NULL)
+        continue;
+
+      if (gibber_r_multicast_packet_diff (info->packet_id,
+            ack->packet_id) > 0)
+        continue;
+
+      DEBUG_SENDER (member, "Failing it for holding back packet 0x%x of %s "
+          "for %" G_GINT64_FORMAT " ms", info->packet_id, sender->name,
+          now - info->received);
+      mpriv->escalated = TRUE;
+      mpriv->escalated_sender = sender->id;
+      mpriv->escalated_packet = info->packet_id;
+      g_ptr_array_add (laggards, g_object_ref (member));
+    }
+}
+
+static GPtrArray *
+group_all_senders (GibberRMulticastSenderGroup *group)
+{
+  GPtrArray *senders = g_ptr_array_new ();
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  g_hash_table_iter_init (&iter, group->senders);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (senders, value);
+
+  for (i = 0; i < group->pending_removal->len; i++)
+    g_ptr_array_add (senders, g_ptr_array_index (group->pending_removal, i));
+
+  return senders;
+}
+
+static gsize
+group_cached_bytes (GPtrArray *senders)
+{
+  gsize bytes = 0;
+  guint i;
+
+  for (i = 0; i < senders->len; i++)
+    {
+      GibberRMulticastSenderPrivate *priv =
+          GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (
+              g_ptr_array_index (senders, i));
+
+      bytes += priv->cached_bytes;
+    }
+
+  return bytes;
+}
+
+static gsize
+evict (GibberRMulticastSenderGroup *group,
+    PacketInfo *info)
+{
+  gsize size = info->size;
+
+  group->evictions++;
+  packet_info_remove (info->sender, info);
+
+  return size;
+}
+
+/* Only packets that every member acked can go, as the others might still
+ * need them repaired. If those aren't enough, the members holding back the
+ * oldest packets for too long are failed, which makes their packets stable
+ * once the others agreed on it. Until then the cache outgrows the budget. */
+static void
+group_enforce_budget (GibberRMulticastSenderGroup *group)
+{
+  GPtrArray *senders, *laggards;
+  guint evictions = group->evictions;
+  gsize bytes;
+  guint i;
+
+  if (group->budget == 0 || group->popping || group->stopped)
+    return;
+
+  senders = group_all_senders (group);
+  bytes = group_cached_bytes (senders);
+
+  for (i = 0; i < senders->len && bytes > group->budget; i++)
+    {
+      GibberRMulticastSender *s = g_ptr_array_index (senders, i);
+      guint32 stable = stable_point (group, s);
+      PacketInfo *info;
+
+      while (bytes > group->budget
+          && (info = oldest_evictable (s, stable)) != NULL)
+        bytes -= evict (group, info);
+    }
+
+  if (group->evictions != evictions)
+    DEBUG ("Evicted %u stable packets to stay within %" G_GSIZE_FORMAT
+        " bytes", group->evictions - evictions, group->budget);
+
+  if (bytes <= group->budget)
+    {
+      g_ptr_array_unref (senders);
+      return;
+    }
+
+  laggards = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (i = 0; i < senders->len; i++)
+    collect_laggards (group, g_ptr_array_index (senders, i),
+        gibber_timer_wheel_get_time (group->timers), laggards);
+
+  g_ptr_array_unref (senders);
+
+  /* The handlers might change the group, so only now */
+  for (i = 0; i < laggards->len; i++)
+    signal_failure (g_ptr_array_index (laggards, i));
+
+  g_ptr_array_unref (laggards);
+}
+
 static void
 cancel_failure_timers (GibberRMulticastSender *sender)
 {
@@ -896,14 +1241,20 @@ cancel_failure_timers (GibberRMulticastSender *sender)
   /* Cancel timers that are not needed anymore now the sender has failed */
   if (priv->fail_timer != 0)
     {
-      g_source_remove (priv->fail_timer);
+      gibber_timer_wheel_remove (priv->group->timers, priv->fail_timer);
       priv->fail_timer = 0;
     }
 
+  if (priv->suspicion_timer != 0)
+    {
+      gibber_timer_wheel_remove (priv->group->timers, priv->suspicion_timer);
+      priv->suspicion_timer = 0;
+    }
+
   /* failed, no need to get our name anymore */
   if (priv->whois_timer != 0)
     {
-      g_source_remove (priv->whois_timer);
+      gibber_timer_wheel_remove (priv->group->timers, priv->whois_timer);
       priv->whois_timer = 0;
     }
 }
@@ -918,6 +1269,24 @@ signal_data (GibberRMulticastSender *sender, guint16 stream_id,
   g_signal_emit (sender, signals[RECEIVED_DATA], 0, stream_id, data, size);
 }
 
+static void
+signal_data_chunk (GibberRMulticastSender *sender,
+    GibberRMulticastPacket *packet, guint8 flags)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  guint8 *data;
+  gsize size;
+
+  data = gibber_r_multicast_packet_get_payload (packet, &size);
+
+  set_state (sender,
+    MAX(GIBBER_R_MULTICAST_SENDER_STATE_DATA_RUNNING, sender->state));
+
+  g_signal_emit (sender, signals[RECEIVED_DATA_CHUNK], 0,
+      packet->data.data.stream_id, flags, priv->chunk_total, data, size);
+}
+
 static void
 signal_control_packet (GibberRMulticastSender *sender,
     GibberRMulticastPacket *packet)
@@ -950,7 +1319,7 @@ name_discovery_failed_cb (gpointer data)
 
   g_assert (priv->whois_timer != 0);
 
-  g_source_remove (priv->whois_timer);
+  gibber_timer_wheel_remove (priv->group->timers, priv->whois_timer);
   priv->whois_timer = 0;
   priv->fail_timer = 0;
 
@@ -990,10 +1359,130 @@ schedule_progress_timer (GibberRMulticastSender *self)
     return;
 
   if (priv->fail_timer != 0)
-    g_source_remove (priv->fail_timer);
+    gibber_timer_wheel_remove (priv->group->timers, priv->fail_timer);
+
+  priv->fail_timer = gibber_timer_wheel_add (priv->group->timers,
+      MAX_PROGRESS_TIMEOUT, progress_failed_cb, self);
+}
+
+static void
+heartbeat_stats (GibberRMulticastSender *self,
+    gdouble *mean,
+    gdouble *deviation)
+{
+  GibberRMulticastSenderPrivate *priv =
+    GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (self);
+  gdouble variance;
+
+  g_assert (priv->n_intervals > 0);
+
+  *mean = (gdouble) priv->interval_sum / priv->n_intervals;
+  variance = (gdouble) priv->interval_sum_sq / priv->n_intervals
+      - *mean * *mean;
+
+  *deviation = MAX (sqrt (MAX (variance, 0)),
+      MAX (MIN_HEARTBEAT_DEVIATION, *mean * MIN_HEARTBEAT_DEVIATION_RATIO));
+}
+
+static void
+add_heartbeat_interval (GibberRMulticastSender *self,
+    guint32 interval)
+{
+  GibberRMulticastSenderPrivate *priv =
+    GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (self);
+
+  if (priv->n_intervals == HEARTBEAT_WINDOW)
+    {
+      guint32 oldest = priv->intervals[priv->next_interval];
+
+      priv->interval_sum -= oldest;
+      priv->interval_sum_sq -= (guint64) oldest * oldest;
+    }
+  else
+    {
+      priv->n_intervals++;
+    }
+
+  priv->intervals[priv->next_interval] = interval;
+  priv->next_interval = (priv->next_interval + 1) % HEARTBEAT_WINDOW;
+  priv->interval_sum += interval;
+  priv->interval_sum_sq += (guint64) interval * interval;
+}
+
+static gboolean
+suspicion_failed_cb (gpointer data)
+{
+  GibberRMulticastSender *self = GIBBER_R_MULTICAST_SENDER (data);
+  GibberRMulticastSenderPrivate *priv =
+    GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (self);
+
+  DEBUG_SENDER (self, "Not heard from in %" G_GINT64_FORMAT " ms, suspicion "
+      "%.1f", gibber_timer_wheel_get_time (priv->group->timers)
+          - priv->last_heard,
+      gibber_r_multicast_sender_get_suspicion (self));
+
+  priv->suspicion_timer = 0;
+
+  signal_failure (self);
+
+  return FALSE;
+}
+
+void
+gibber_r_multicast_sender_heard (GibberRMulticastSender *sender)
+{
+  GibberRMulticastSenderPrivate *priv =
+    GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  gint64 now = gibber_timer_wheel_get_time (priv->group->timers);
+  gdouble mean, deviation;
 
-  priv->fail_timer = g_timeout_add (MAX_PROGRESS_TIMEOUT,
-      progress_failed_cb, self);
+  if (sender->state >= GIBBER_R_MULTICAST_SENDER_STATE_FAILED)
+    return;
+
+  if (priv->last_heard == 0)
+    {
+      /* mean FIRST_HEARTBEAT_ESTIMATE, deviation a quarter of that */
+      add_heartbeat_interval (sender, FIRST_HEARTBEAT_ESTIMATE * 3 / 4);
+      add_heartbeat_interval (sender, FIRST_HEARTBEAT_ESTIMATE * 5 / 4);
+    }
+  else
+    {
+      /* a few minutes at most, so the sums can't overflow */
+      add_heartbeat_interval (sender,
+          MIN (now - priv->last_heard, G_MAXUINT16 * 16));
+    }
+
+  /* 0 is never */
+  priv->last_heard = MAX (now, 1);
+
+  if (priv->suspicion_timer != 0)
+    gibber_timer_wheel_remove (priv->group->timers, priv->suspicion_timer);
+
+  heartbeat_stats (sender, &mean, &deviation);
+  priv->suspicion_timer = gibber_timer_wheel_add (priv->group->timers,
+      mean + PHI_FAILED_DEVIATIONS * deviation, suspicion_failed_cb, sender);
+}
+
+gdouble
+gibber_r_multicast_sender_get_suspicion (GibberRMulticastSender *sender)
+{
+  GibberRMulticastSenderPrivate *priv =
+    GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  gdouble mean, deviation, p_later;
+  gint64 since;
+
+  if (priv->last_heard == 0)
+    return 0;
+
+  since = gibber_timer_wheel_get_time (priv->group->timers)
+      - priv->last_heard;
+  heartbeat_stats (sender, &mean, &deviation);
+
+  /* Chance of the next heartbeat still turning up if the intervals are
+   * distributed normally */
+  p_later = 0.5 * erfc ((since - mean) / (deviation * G_SQRT2));
+
+  return -log10 (MAX (p_later, G_MINDOUBLE));
 }
 
 static void
@@ -1004,13 +1493,13 @@ stop_whois_discovery (GibberRMulticastSender *self)
 
   if (priv->whois_timer != 0)
     {
-      g_source_remove (priv->whois_timer);
+      gibber_timer_wheel_remove (priv->group->timers, priv->whois_timer);
       priv->whois_timer = 0;
     }
 
   if (priv->fail_timer != 0)
     {
-      g_source_remove (priv->fail_timer);
+      gibber_timer_wheel_remove (priv->group->timers, priv->fail_timer);
       priv->fail_timer = 0;
     }
 
@@ -1037,6 +1526,7 @@ request_repair (gpointer data)
     info->packet_id);
 
   info->timeout = 0;
+  info->requested = TRUE;
   g_signal_emit (info->sender, signals[REPAIR_REQUEST], 0, info->packet_id);
   schedule_repair (info->sender, info->packet_id);
 
@@ -1065,15 +1555,17 @@ schedule_repair (GibberRMulticastSender *sender, guint32 id)
     {
       info = packet_info_new (sender, id);
       g_hash_table_insert (priv->packet_cache, &info->packet_id, info);
-      timeout = g_random_int_range (MIN_INITIAL_REPAIR_TIMEOUT,
-          MAX_INITIAL_REPAIR_TIMEOUT);
+      timeout = gibber_timer_wheel_random_int_range (priv->group->timers,
+          MIN_INITIAL_REPAIR_TIMEOUT, MAX_INITIAL_REPAIR_TIMEOUT);
     }
   else
     {
-      timeout = g_random_int_range (MIN_REPAIR_TIMEOUT, MAX_REPAIR_TIMEOUT);
+      timeout = gibber_timer_wheel_random_int_range (priv->group->timers,
+          MIN_REPAIR_TIMEOUT, MAX_REPAIR_TIMEOUT);
     }
 
-  info->timeout = g_timeout_add (timeout, request_repair, info);
+  info->timeout = gibber_timer_wheel_add (priv->group->timers, timeout,
+      request_repair, info);
   DEBUG_SENDER (sender,
     "Scheduled repair request for 0x%x in %d ms", id, timeout);
 }
@@ -1116,8 +1608,10 @@ schedule_do_repair (GibberRMulticastSender *sender, guint32 id)
       return;
     }
 
-  timeout = g_random_int_range (MIN_DO_REPAIR_TIMEOUT, MAX_DO_REPAIR_TIMEOUT);
-  info->timeout = g_timeout_add (timeout, do_repair, info);
+  timeout = gibber_timer_wheel_random_int_range (priv->group->timers,
+      MIN_DO_REPAIR_TIMEOUT, MAX_DO_REPAIR_TIMEOUT);
+  info->timeout = gibber_timer_wheel_add (priv->group->timers, timeout,
+      do_repair, info);
   DEBUG_SENDER (sender, "Scheduled repair for 0x%x in %d ms", id, timeout);
 }
 
@@ -1159,17 +1653,78 @@ schedule_whois_request (GibberRMulticastSender *sender, gboolean rescheduled)
      return;
 
    if (rescheduled)
-    timeout = g_random_int_range (MIN_WHOIS_TIMEOUT, MAX_WHOIS_TIMEOUT);
+    timeout = gibber_timer_wheel_random_int_range (priv->group->timers,
+        MIN_WHOIS_TIMEOUT, MAX_WHOIS_TIMEOUT);
    else
-    timeout = g_random_int_range (MIN_FIRST_WHOIS_TIMEOUT,
-        MAX_FIRST_WHOIS_TIMEOUT);
+    timeout = gibber_timer_wheel_random_int_range (priv->group->timers,
+        MIN_FIRST_WHOIS_TIMEOUT, MAX_FIRST_WHOIS_TIMEOUT);
 
    DEBUG_SENDER (sender, "(Re)Scheduled whois request in %d ms", timeout);
 
    if (priv->whois_timer != 0)
-     g_source_remove (priv->whois_timer);
+     gibber_timer_wheel_remove (priv->group->timers, priv->whois_timer);
+
+   priv->whois_timer = gibber_timer_wheel_add (priv->group->timers, timeout,
+       do_whois_request, sender);
+}
+
+/* Whether the packets from up to to are all data on streams that aren't
+ * causally ordered. Missing packets only qualify if they sit between two
+ * fragments of the same message, as the fragments of a message are sent
+ * back to back unless the later one says it was resumed */
+static gboolean
+only_non_causal_data (GibberRMulticastSender *sender, guint32 from,
+    guint32 to)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  GibberRMulticastPacket *last = NULL;
+  gboolean gap = FALSE;
+  PacketInfo *info;
+  guint32 i;
+
+  if (gibber_r_multicast_packet_diff (from, to) > PACKET_CACHE_SIZE)
+    return FALSE;
+
+  i = from - 1;
+  info = g_hash_table_lookup (priv->packet_cache, &i);
+  if (info != NULL && info->packet != NULL
+      && IS_NON_CAUSAL_DATA (info->packet))
+    last = info->packet;
 
-   priv->whois_timer = g_timeout_add (timeout, do_whois_request, sender);
+  /* A gap at the end is fine if a later packet closes it */
+  for (i = from; gap || gibber_r_multicast_packet_diff (i, to) > 0; i++)
+    {
+      if (gibber_r_multicast_packet_diff (i, sender->next_input_packet) <= 0)
+        return FALSE;
+
+      info = g_hash_table_lookup (priv->packet_cache, &i);
+
+      if (info == NULL || info->packet == NULL)
+        {
+          if (last == NULL
+              || (last->data.data.flags & GIBBER_R_MULTICAST_DATA_PACKET_END))
+            return FALSE;
+
+          gap = TRUE;
+          continue;
+        }
+
+      if (!IS_NON_CAUSAL_DATA (info->packet))
+        return FALSE;
+
+      if (gap && (info->packet->data.data.stream_id
+              != last->data.data.stream_id
+            || (info->packet->data.data.flags
+              & (GIBBER_R_MULTICAST_DATA_PACKET_START
+                | GIBBER_R_MULTICAST_DATA_PACKET_RESUMED))))
+        return FALSE;
+
+      gap = FALSE;
+      last = info->packet;
+    }
+
+  return TRUE;
 }
 
 static gboolean
@@ -1211,6 +1766,17 @@ check_depends (GibberRMulticastSender *sender, GibberRMulticastPacket *packet,
 
       if (gibber_r_multicast_packet_diff (sender_info->packet_id, other) < 0)
         {
+          /* Data doesn't have to wait for data of the other node that isn't
+           * causally ordered anyway */
+          if (packet->type == PACKET_TYPE_DATA
+              && only_non_causal_data (s, other, sender_info->packet_id))
+            {
+              DEBUG_SENDER (sender, "Not waiting for non-causal data of "
+                  "node %x up to %x", sender_info->sender_id,
+                  sender_info->packet_id);
+              continue;
+            }
+
           DEBUG_SENDER (sender,
               "Waiting node %x to complete it's messages up to %x",
               sender_info->sender_id, sender_info->packet_id);
@@ -1254,23 +1820,186 @@ update_next_data_output_state (GibberRMulticastSender *self)
     }
 }
 
+/* Counts the payload of packet in with the bytes delivered of the message
+ * being chunked. FALSE if that's more than the message claimed to have or,
+ * for its last packet, less */
 static gboolean
-pop_data_packet (GibberRMulticastSender *sender)
+chunk_fits (GibberRMulticastSender *sender, GibberRMulticastPacket *packet,
+    gboolean last)
 {
   GibberRMulticastSenderPrivate *priv =
       GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
-  PacketInfo *p;
-  guint16 stream_id;
+  gsize size;
 
-  /* If we're holding before this, skip */
-  if (priv->holding_data &&
-    gibber_r_multicast_packet_diff (sender->next_output_data_packet,
-      priv->holding_point)
-      <= 0)
-    {
-      DEBUG_SENDER (sender, "Holding back data finishing at %x",
-        sender->next_output_data_packet);
-      return FALSE;
+  gibber_r_multicast_packet_get_payload (packet, &size);
+
+  if (priv->chunk_offset + size > priv->chunk_total
+      || (last && priv->chunk_offset + size != priv->chunk_total))
+    return FALSE;
+
+  priv->chunk_offset += size;
+  return TRUE;
+}
+
+/* Deliver the packets of the message being chunked that were popped since the
+ * last time, up to but not including its END */
+static void
+pop_chunks (GibberRMulticastSender *sender)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  PacketInfo *start;
+  guint32 i;
+
+  /* Behind an END that couldn't be popped yet */
+  if (sender->next_output_data_packet != sender->next_output_packet)
+    return;
+
+  start = g_hash_table_lookup (priv->packet_cache, &priv->chunk_start);
+  if (start == NULL)
+    {
+      priv->chunking = FALSE;
+      return;
+    }
+
+  if (!priv->chunk_started)
+    {
+      /* Same as for complete messages in pop_data_packet, which deals with
+       * the ones that have to be ignored once their END comes in */
+      if (sender->state != GIBBER_R_MULTICAST_SENDER_STATE_DATA_RUNNING
+          && !priv->start_data)
+        return;
+
+      if (priv->start_data &&
+          gibber_r_multicast_packet_diff (priv->start_point,
+            priv->chunk_start) < 0)
+        return;
+
+      if (!IS_NON_CAUSAL_DATA (start->packet)
+          && !check_depends (sender, start->packet, TRUE))
+        return;
+
+      priv->chunk_started = TRUE;
+    }
+
+  for (i = priv->chunk_next; i != sender->next_output_packet; i++)
+    {
+      PacketInfo *tp;
+
+      if (priv->holding_data &&
+          gibber_r_multicast_packet_diff (i, priv->holding_point) <= 0)
+        return;
+
+      /* Control packets in between are popped and possibly gone already */
+      tp = g_hash_table_lookup (priv->packet_cache, &i);
+      priv->chunk_next = i + 1;
+
+      if (tp == NULL || tp->packet->type != PACKET_TYPE_DATA
+          || tp->packet->data.data.stream_id
+              != start->packet->data.data.stream_id)
+        continue;
+
+      if (!chunk_fits (sender, tp->packet, FALSE))
+        {
+          DEBUG_SENDER (sender,
+              "Data packet didn't have the claimed amount of data");
+          priv->chunking = FALSE;
+          signal_failure (sender);
+          return;
+        }
+
+      signal_data_chunk (sender, tp->packet,
+          i == priv->chunk_start ? GIBBER_R_MULTICAST_DATA_PACKET_START : 0);
+
+      if (i != priv->chunk_start)
+        {
+          tp->popped = TRUE;
+          packet_info_try_gc (sender, tp);
+        }
+
+      if (priv->group->stopped || !priv->chunking)
+        return;
+    }
+}
+
+/* The END of the message being chunked can be popped, deliver what's left of
+ * it. start is the PacketInfo of its START packet */
+static gboolean
+pop_last_chunks (GibberRMulticastSender *sender, PacketInfo *start)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  guint32 i, end = sender->next_output_data_packet;
+  PacketInfo *last;
+
+  DEBUG_SENDER (sender, "Popping the last chunks 0x%x -> 0x%x stream_id: %x",
+      priv->chunk_next, end, start->packet->data.data.stream_id);
+
+  for (i = priv->chunk_next; i != end; i++)
+    {
+      PacketInfo *tp = g_hash_table_lookup (priv->packet_cache, &i);
+
+      if (tp == NULL || tp->packet->type != PACKET_TYPE_DATA
+          || tp->packet->data.data.stream_id
+              != start->packet->data.data.stream_id)
+        continue;
+
+      if (!chunk_fits (sender, tp->packet, FALSE))
+        goto incorrect_data_size;
+
+      signal_data_chunk (sender, tp->packet,
+          tp == start ? GIBBER_R_MULTICAST_DATA_PACKET_START : 0);
+
+      if (tp != start)
+        {
+          tp->popped = TRUE;
+          packet_info_try_gc (sender, tp);
+        }
+
+      if (priv->group->stopped)
+        return FALSE;
+    }
+
+  last = g_hash_table_lookup (priv->packet_cache, &end);
+
+  if (!chunk_fits (sender, last->packet, TRUE))
+    goto incorrect_data_size;
+
+  update_next_data_output_state (sender);
+  signal_data_chunk (sender, last->packet,
+      GIBBER_R_MULTICAST_DATA_PACKET_END);
+
+  last->popped = TRUE;
+  packet_info_try_gc (sender, last);
+  start->popped = TRUE;
+  packet_info_try_gc (sender, start);
+
+  return TRUE;
+
+incorrect_data_size:
+
+  DEBUG_SENDER (sender, "Data packet didn't have the claimed amount of data");
+  signal_failure (sender);
+  return FALSE;
+}
+
+static gboolean
+pop_data_packet (GibberRMulticastSender *sender)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  PacketInfo *p;
+  guint16 stream_id;
+
+  /* If we're holding before this, skip */
+  if (priv->holding_data &&
+    gibber_r_multicast_packet_diff (sender->next_output_data_packet,
+      priv->holding_point)
+      <= 0)
+    {
+      DEBUG_SENDER (sender, "Holding back data finishing at %x",
+        sender->next_output_data_packet);
+      return FALSE;
     }
 
   DEBUG_SENDER (sender, "Trying to pop data finishing at %x",
@@ -1320,6 +2049,37 @@ pop_data_packet (GibberRMulticastSender *sender)
 
   /* p is guaranteed to be the PacketInfo of the first packet */
 
+  if (priv->chunking && p->packet_id == priv->chunk_start)
+    {
+      priv->chunking = FALSE;
+
+      /* Otherwise it never got going and is delivered as a whole */
+      if (priv->chunk_started)
+        return pop_last_chunks (sender, p);
+    }
+
+  if (p->delivered)
+    {
+      guint32 i, start = p->packet_id;
+
+      DEBUG_SENDER (sender, "Data 0x%x -> 0x%x was already delivered",
+          start, sender->next_output_data_packet);
+
+      for (i = start; i != sender->next_output_data_packet + 1; i++)
+        {
+          PacketInfo *tp = g_hash_table_lookup (priv->packet_cache, &i);
+
+          if (tp != NULL)
+            {
+              tp->popped = TRUE;
+              packet_info_try_gc (sender, tp);
+            }
+        }
+
+      update_next_data_output_state (sender);
+      return TRUE;
+    }
+
   /* If there is data from before our startpoint, ignore it */
   if (sender->state != GIBBER_R_MULTICAST_SENDER_STATE_DATA_RUNNING
       && !priv->start_data)
@@ -1340,7 +2100,8 @@ pop_data_packet (GibberRMulticastSender *sender)
     }
 
 
-  if (!check_depends (sender, p->packet, TRUE))
+  if (!IS_NON_CAUSAL_DATA (p->packet) && !check_depends (sender, p->packet,
+        TRUE))
     {
       return FALSE;
     }
@@ -1466,6 +2227,15 @@ update_acks (GibberRMulticastSender *sender, GibberRMulticastPacket *packet)
           info->first_packet_id = packet->packet_id;
           updated = TRUE;
         }
+
+      if (priv->escalated && priv->escalated_sender == info->sender_id
+          && gibber_r_multicast_packet_diff (priv->escalated_packet,
+              info->packet_id) > 0)
+        {
+          DEBUG_SENDER (sender, "Acked packet 0x%x it was failed for",
+              priv->escalated_packet);
+          priv->escalated = FALSE;
+        }
     }
 
     if (updated)
@@ -1515,7 +2285,8 @@ pop_packet (GibberRMulticastSender *sender)
 
   update_acks (sender, p->packet);
 
-  if (!check_depends (sender, p->packet, FALSE))
+  if (!IS_NON_CAUSAL_DATA (p->packet) && !check_depends (sender, p->packet,
+        FALSE))
     {
       return FALSE;
     }
@@ -1539,6 +2310,25 @@ pop_packet (GibberRMulticastSender *sender)
           else
             {
               sender->next_output_data_packet++;
+
+              /* Messages sent in the middle of the one being chunked are
+               * delivered whole */
+              if ((p->packet->data.data.flags
+                    & (GIBBER_R_MULTICAST_DATA_PACKET_START
+                      | GIBBER_R_MULTICAST_DATA_PACKET_UNORDERED))
+                      == GIBBER_R_MULTICAST_DATA_PACKET_START
+                  && !priv->chunking
+                  && priv->group->chunked_streams != NULL
+                  && g_hash_table_contains (priv->group->chunked_streams,
+                      GUINT_TO_POINTER (p->packet->data.data.stream_id)))
+                {
+                  priv->chunking = TRUE;
+                  priv->chunk_started = FALSE;
+                  priv->chunk_start = p->packet_id;
+                  priv->chunk_next = p->packet_id;
+                  priv->chunk_total = p->packet->data.data.total_size;
+                  priv->chunk_offset = 0;
+                }
             }
         }
       else
@@ -1568,6 +2358,118 @@ pop_packet (GibberRMulticastSender *sender)
   return TRUE;
 }
 
+/* Deliver the unordered message from start to end ahead of its turn.
+ * Returns FALSE if nothing after it should be delivered either */
+static gboolean
+deliver_unordered (GibberRMulticastSender *sender, guint32 start, guint32 end)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  PacketInfo *p;
+  guint8 *data;
+  guint32 total_size, i;
+  guint16 stream_id;
+  gsize off = 0;
+
+  if (priv->holding_data &&
+      gibber_r_multicast_packet_diff (end, priv->holding_point) <= 0)
+    return FALSE;
+
+  /* Leave data from before the startpoint to pop_data_packet, which will
+   * ignore it */
+  if (priv->start_data &&
+      gibber_r_multicast_packet_diff (priv->start_point, start) < 0)
+    return TRUE;
+
+  p = g_hash_table_lookup (priv->packet_cache, &start);
+  stream_id = p->packet->data.data.stream_id;
+  total_size = p->packet->data.data.total_size;
+  data = g_malloc (total_size);
+
+  for (i = start; i != end + 1; i++)
+    {
+      PacketInfo *tp = g_hash_table_lookup (priv->packet_cache, &i);
+      guint8 *d;
+      gsize size;
+
+      d = gibber_r_multicast_packet_get_payload (tp->packet, &size);
+      if (off + size > total_size)
+        {
+          off += size;
+          break;
+        }
+
+      memcpy (data + off, d, size);
+      off += size;
+    }
+
+  if (off != total_size)
+    {
+      /* pop_data_packet will notice this as well once it gets there */
+      g_free (data);
+      return TRUE;
+    }
+
+  DEBUG_SENDER (sender, "Popping unordered data 0x%x -> 0x%x stream_id: %x",
+      start, end, stream_id);
+
+  p->delivered = TRUE;
+  signal_data (sender, stream_id, data, total_size);
+  g_free (data);
+
+  return sender->state < GIBBER_R_MULTICAST_SENDER_STATE_FAILED
+      && !priv->group->stopped;
+}
+
+/* Deliver complete messages on unordered streams that are stuck behind
+ * packets of this sender which are still missing */
+static void
+pop_unordered_data (GibberRMulticastSender *sender)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  gboolean in_message = FALSE;
+  guint32 i, start = 0;
+
+  if (sender->state >= GIBBER_R_MULTICAST_SENDER_STATE_FAILED)
+    return;
+
+  if (sender->state != GIBBER_R_MULTICAST_SENDER_STATE_DATA_RUNNING
+      && !priv->start_data)
+    return;
+
+  for (i = sender->next_output_packet; i != sender->next_input_packet; i++)
+    {
+      PacketInfo *info = g_hash_table_lookup (priv->packet_cache, &i);
+      guint8 flags;
+
+      if (info == NULL || info->packet == NULL
+          || info->packet->type != PACKET_TYPE_DATA
+          || !(info->packet->data.data.flags &
+              GIBBER_R_MULTICAST_DATA_PACKET_UNORDERED))
+        {
+          in_message = FALSE;
+          continue;
+        }
+
+      flags = info->packet->data.data.flags;
+
+      if (flags & GIBBER_R_MULTICAST_DATA_PACKET_START)
+        {
+          in_message = !info->delivered;
+          start = i;
+        }
+
+      if (in_message && (flags & GIBBER_R_MULTICAST_DATA_PACKET_END))
+        {
+          in_message = FALSE;
+
+          if (!deliver_unordered (sender, start, i))
+            return;
+        }
+    }
+}
+
 static gboolean
 do_pop_packets (GibberRMulticastSender *sender)
 {
@@ -1596,6 +2498,12 @@ do_pop_packets (GibberRMulticastSender *sender)
       popped = TRUE;
     }
 
+  if (priv->chunking && !priv->group->stopped)
+    pop_chunks (sender);
+
+  if (priv->has_unordered && !priv->group->stopped)
+    pop_unordered_data (sender);
+
   g_object_unref (sender);
 
   return popped;
@@ -1690,12 +2598,24 @@ insert_packet (GibberRMulticastSender *sender, GibberRMulticastPacket *packet)
 
   if (info->timeout != 0)
     {
-      g_source_remove (info->timeout);
+      gibber_timer_wheel_remove (priv->group->timers, info->timeout);
       info->timeout = 0;
     }
 
   DEBUG_SENDER (sender, "Inserting packet 0x%x", packet->packet_id);
   info->packet = g_object_ref (packet);
+  gibber_r_multicast_packet_get_raw_data (packet, &info->size);
+  info->received = gibber_timer_wheel_get_time (priv->group->timers);
+  priv->cached_bytes += info->size;
+
+  if (priv->recovering)
+    priv->group->fec_recovered++;
+  else if (info->requested)
+    priv->group->repaired++;
+
+  if (packet->type == PACKET_TYPE_DATA
+      && (packet->data.data.flags & GIBBER_R_MULTICAST_DATA_PACKET_UNORDERED))
+    priv->has_unordered = TRUE;
 
   if (gibber_r_multicast_packet_diff (sender->next_input_packet,
                  packet->packet_id) >= 0)
@@ -1712,7 +2632,7 @@ insert_packet (GibberRMulticastSender *sender, GibberRMulticastPacket *packet)
   /* pop out as many packets as we can */
   pop_packets (sender);
 
-  return;
+  group_enforce_budget (priv->group);
 }
 
 
@@ -1748,7 +2668,7 @@ gibber_r_multicast_sender_update_start (GibberRMulticastSender *sender,
           info = g_hash_table_lookup (priv->packet_cache, &i);
           if (info != NULL && info->packet == NULL && info->timeout != 0)
             {
-              g_source_remove (info->timeout);
+              gibber_timer_wheel_remove (priv->group->timers, info->timeout);
               info->timeout = 0;
             }
         }
@@ -1799,6 +2719,9 @@ gibber_r_multicast_sender_set_failed (GibberRMulticastSender *sender)
     }
 
   cancel_failure_timers (sender);
+
+  /* Packets only it hadn't acked yet can go now */
+  group_enforce_budget (priv->group);
 }
 
 void
@@ -1840,6 +2763,9 @@ gibber_r_multicast_sender_push (GibberRMulticastSender *sender,
 
   if (diff >= 0 && diff < PACKET_CACHE_SIZE) {
     insert_packet (sender, packet);
+
+    if (!g_queue_is_empty (&priv->parities))
+      try_parities (sender);
     return;
   }
 
@@ -1857,6 +2783,169 @@ gibber_r_multicast_sender_push (GibberRMulticastSender *sender,
       sender->next_output_packet, sender->next_input_packet);
 }
 
+/* Returns TRUE once the parity packet is of no more use, with *recovered set
+ * to the packet it rebuilt if any */
+static gboolean
+try_parity (GibberRMulticastSender *sender, GibberRMulticastPacket *parity,
+    GibberRMulticastPacket **recovered)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  GibberRMulticastParityPacket *p = &parity->data.parity;
+  PacketInfo *info;
+  guint8 *data;
+  guint16 size;
+  guint32 i, end, missing = 0;
+  guint nr_missing = 0;
+
+  *recovered = NULL;
+  end = p->first_packet_id + p->count;
+
+  for (i = p->first_packet_id + p->index;
+      gibber_r_multicast_packet_diff (i, end) > 0; i += p->stride)
+    {
+      info = g_hash_table_lookup (priv->packet_cache, &i);
+      if (info != NULL && info->packet != NULL)
+        continue;
+
+      /* Either garbage collected or from before we knew the sender */
+      if (gibber_r_multicast_packet_diff (i, sender->next_output_packet) > 0)
+        return TRUE;
+
+      nr_missing++;
+      missing = i;
+    }
+
+  if (nr_missing == 0)
+    return TRUE;
+
+  if (nr_missing > 1)
+    return FALSE;
+
+  data = g_memdup (p->payload, p->payload_size);
+  size = p->size;
+
+  for (i = p->first_packet_id + p->index;
+      gibber_r_multicast_packet_diff (i, end) > 0; i += p->stride)
+    {
+      guint8 *raw;
+      gsize raw_size, j;
+
+      if (i == missing)
+        continue;
+
+      info = g_hash_table_lookup (priv->packet_cache, &i);
+      raw = gibber_r_multicast_packet_get_raw_data (info->packet, &raw_size);
+
+      if (raw_size > p->payload_size)
+        goto corrupt;
+
+      for (j = 0; j < raw_size; j++)
+        data[j] ^= raw[j];
+
+      size ^= raw_size;
+    }
+
+  if (size > p->payload_size)
+    goto corrupt;
+
+  *recovered = gibber_r_multicast_packet_parse (data, size, NULL);
+
+  if (*recovered == NULL
+      || !GIBBER_R_MULTICAST_PACKET_IS_RELIABLE_PACKET (*recovered)
+      || (*recovered)->sender != sender->id
+      || (*recovered)->packet_id != missing)
+    goto corrupt;
+
+  DEBUG_SENDER (sender, "Rebuilt packet 0x%x from parity", missing);
+  g_free (data);
+  return TRUE;
+
+corrupt:
+  DEBUG_SENDER (sender, "Parity doesn't match the packets 0x%x -> 0x%x",
+      p->first_packet_id, end - 1);
+
+  if (*recovered != NULL)
+    g_object_unref (*recovered);
+  *recovered = NULL;
+
+  g_free (data);
+  return TRUE;
+}
+
+static void
+try_parities (GibberRMulticastSender *sender)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  gboolean again = TRUE;
+
+  /* Rebuilding a packet inserts it, which brings us back here */
+  if (priv->trying_parities)
+    return;
+
+  priv->trying_parities = TRUE;
+  g_object_ref (sender);
+
+  while (again && !priv->dispose_has_run)
+    {
+      GList *l, *next;
+
+      again = FALSE;
+
+      for (l = priv->parities.head; l != NULL; l = next)
+        {
+          GibberRMulticastPacket *parity = l->data;
+          GibberRMulticastPacket *recovered;
+
+          next = l->next;
+
+          if (!try_parity (sender, parity, &recovered))
+            continue;
+
+          g_queue_delete_link (&priv->parities, l);
+          g_object_unref (parity);
+
+          if (recovered != NULL)
+            {
+              /* Anything can happen while it's popped, so start over */
+              priv->recovering = TRUE;
+              gibber_r_multicast_sender_push (sender, recovered);
+              priv->recovering = FALSE;
+              g_object_unref (recovered);
+
+              again = TRUE;
+              break;
+            }
+        }
+    }
+
+  priv->trying_parities = FALSE;
+  g_object_unref (sender);
+}
+
+void
+gibber_r_multicast_sender_push_parity (GibberRMulticastSender *sender,
+    GibberRMulticastPacket *packet)
+{
+  GibberRMulticastSenderPrivate *priv =
+      GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+
+  g_assert (packet->type == PACKET_TYPE_PARITY);
+  g_assert (sender->id == packet->sender);
+
+  if (sender->state < GIBBER_R_MULTICAST_SENDER_STATE_PREPARING
+      || sender->state > GIBBER_R_MULTICAST_SENDER_STATE_FAILED)
+    return;
+
+  g_queue_push_tail (&priv->parities, g_object_ref (packet));
+
+  if (g_queue_get_length (&priv->parities) > MAX_PARITIES)
+    g_object_unref (g_queue_pop_head (&priv->parities));
+
+  try_parities (sender);
+}
+
 gboolean
 gibber_r_multicast_sender_repair_request (GibberRMulticastSender *sender,
     guint32 id)
@@ -1903,7 +2992,7 @@ gibber_r_multicast_sender_repair_request (GibberRMulticastSender *sender,
            running */
            g_assert (info->timeout != 0);
            /* Reschedule the repair */
-           g_source_remove (info->timeout);
+           gibber_timer_wheel_remove (priv->group->timers, info->timeout);
            info->timeout = 0;
            schedule_repair (sender, id);
         }
@@ -1969,10 +3058,11 @@ gibber_r_multicast_sender_whois_push (GibberRMulticastSender *sender,
         {
           if (priv->whois_timer == 0)
             {
-              gint timeout = g_random_int_range (MIN_WHOIS_REPLY_TIMEOUT,
-                   MAX_WHOIS_REPLY_TIMEOUT);
-              priv->whois_timer =
-                g_timeout_add (timeout, do_whois_reply, sender);
+              gint timeout = gibber_timer_wheel_random_int_range (
+                  priv->group->timers, MIN_WHOIS_REPLY_TIMEOUT,
+                  MAX_WHOIS_REPLY_TIMEOUT);
+              priv->whois_timer = gibber_timer_wheel_add (
+                  priv->group->timers, timeout, do_whois_reply, sender);
               DEBUG_SENDER (sender, "Scheduled whois reply in %d ms", timeout);
             }
         }
@@ -2051,6 +3141,69 @@ gibber_r_multicast_sender_packet_cache_size ( GibberRMulticastSender *sender)
       sender->next_input_packet);
 }
 
+guint
+gibber_r_multicast_sender_fail_laggards (GibberRMulticastSender *sender)
+{
+  GibberRMulticastSenderPrivate *priv =
+    GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+  GibberRMulticastSenderGroup *group = priv->group;
+  guint32 stable = stable_point (group, sender);
+  GPtrArray *laggards;
+  GHashTableIter iter;
+  gpointer value;
+  guint i, failed;
+
+  laggards = g_ptr_array_new_with_free_func (g_object_unref);
+
+  g_hash_table_iter_init (&iter, group->senders);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      GibberRMulticastSender *member = value;
+      GibberRMulticastSenderPrivate *mpriv =
+          GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (member);
+      AckInfo *ack;
+
+      if (!is_member (group, member, sender) || mpriv->escalated)
+        continue;
+
+      ack = gibber_r_multicast_sender_get_ackinfo (member, sender->id);
+
+      /* Only the ones the stable point waits for */
+      if (ack != NULL
+          && gibber_r_multicast_packet_diff (stable, ack->packet_id) > 0)
+        continue;
+
+      DEBUG_SENDER (member, "Failing it for holding back packet 0x%x of %s",
+          stable, sender->name);
+      mpriv->escalated = TRUE;
+      mpriv->escalated_sender = sender->id;
+      mpriv->escalated_packet = stable;
+      g_ptr_array_add (laggards, g_object_ref (member));
+    }
+
+  failed = laggards->len;
+
+  /* The handlers might change the group, so only now */
+  for (i = 0; i < laggards->len; i++)
+    signal_failure (g_ptr_array_index (laggards, i));
+
+  g_ptr_array_unref (laggards);
+
+  return failed;
+}
+
+guint
+gibber_r_multicast_sender_unstable_packets (GibberRMulticastSender *sender)
+{
+  GibberRMulticastSenderPrivate *priv =
+    GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (sender);
+
+  gint32 diff = gibber_r_multicast_packet_diff (
+      stable_point (priv->group, sender), sender->next_input_packet);
+
+  return MAX (diff, 0);
+}
+
 static AckInfo *
 gibber_r_multicast_sender_get_ackinfo (GibberRMulticastSender *sender,
     guint32 sender_id)
@@ -2120,10 +3273,11 @@ static void
 stop_packet (gpointer key, gpointer value, gpointer user_data)
 {
   PacketInfo *p = (PacketInfo *) value;
+  GibberTimerWheel *timers = user_data;
 
   if (p->timeout != 0)
     {
-      g_source_remove (p->timeout);
+      gibber_timer_wheel_remove (timers, p->timeout);
       p->timeout = 0;
     }
 }
@@ -2139,17 +3293,79 @@ gibber_r_multicast_sender_stop (GibberRMulticastSender *sender)
 
   if (priv->whois_timer != 0)
     {
-      g_source_remove (priv->whois_timer);
+      gibber_timer_wheel_remove (priv->group->timers, priv->whois_timer);
       priv->whois_timer = 0;
     }
 
-  g_hash_table_foreach (priv->packet_cache, stop_packet, NULL);
+  if (priv->suspicion_timer != 0)
+    {
+      gibber_timer_wheel_remove (priv->group->timers, priv->suspicion_timer);
+      priv->suspicion_timer = 0;
+    }
+
+  g_hash_table_foreach (priv->packet_cache, stop_packet, priv->group->timers);
   set_state (sender, GIBBER_R_MULTICAST_SENDER_STATE_STOPPED);
 }
 
+void
+gibber_r_multicast_sender_group_get_cache_stats (
+    GibberRMulticastSenderGroup *group,
+    gsize *bytes,
+    guint *evictions,
+    guint *oldest_unstable)
+{
+  GPtrArray *senders = group_all_senders (group);
+  gint64 now = gibber_timer_wheel_get_time (group->timers);
+  gint64 oldest = now;
+  guint i;
+
+  for (i = 0; i < senders->len; i++)
+    {
+      GibberRMulticastSender *s = g_ptr_array_index (senders, i);
+      GibberRMulticastSenderPrivate *priv =
+          GIBBER_R_MULTICAST_SENDER_GET_PRIVATE (s);
+      guint32 j;
+
+      for (j = priv->first_packet;
+          gibber_r_multicast_packet_diff (j, s->next_input_packet) > 0; j++)
+        {
+          PacketInfo *info = g_hash_table_lookup (priv->packet_cache, &j);
+
+          if (info != NULL && info->packet != NULL && !info->acked)
+            {
+              oldest = MIN (oldest, info->received);
+              break;
+            }
+        }
+    }
+
+  if (bytes != NULL)
+    *bytes = group_cached_bytes (senders);
+
+  if (evictions != NULL)
+    *evictions = group->evictions;
+
+  if (oldest_unstable != NULL)
+    *oldest_unstable = now - oldest;
+
+  g_ptr_array_unref (senders);
+}
+
 void
 _gibber_r_multicast_TEST_sender_fail (GibberRMulticastSender *sender)
 {
   signal_failure (sender);
 }
 
+void
+gibber_r_multicast_sender_group_get_fec_counters (
+    GibberRMulticastSenderGroup *group,
+    guint *recovered,
+    guint *repaired)
+{
+  if (recovered != NULL)
+    *recovered = group->fec_recovered;
+
+  if (repaired != NULL)
+    *repaired = group->repaired;
+}
@@ -24,6 +24,7 @@
 #include <glib-object.h>
 
 #include "gibber-r-multicast-packet.h"
+#include "gibber-timer-wheel.h"
 
 G_BEGIN_DECLS
 
@@ -40,6 +41,25 @@ struct _GibberRMulticastSenderGroup {
   GQueue *pop_queue;
   /* GArray of pending removal GibberRMulticastSenders */
   GPtrArray *pending_removal;
+  /* borrowed, runs the timers of all the senders */
+  GibberTimerWheel *timers;
+  /* Bytes the cached packets of all senders may take, 0 for no limit */
+  gsize budget;
+  /* Lost packets rebuilt from parity packets and ones that came in after
+   * we asked for a repair */
+  guint fec_recovered;
+  guint repaired;
+  /* Cached packets dropped to stay within the budget */
+  guint evictions;
+  /* <public>
+   * borrowed, our own sender once there is one. Whether it acked packets
+   * doesn't matter for evicting them, as we have them all. */
+  struct _GibberRMulticastSender *self;
+  /* borrowed, may be NULL. GUINT_TO_POINTER (stream_id) of the streams whose
+   * messages are signalled with received-data-chunk as their packets become
+   * deliverable, instead of with received-data once they are complete.
+   * Messages on unordered streams are always delivered whole. */
+  GHashTable *chunked_streams;
 };
 
 typedef struct _GibberRMulticastSender GibberRMulticastSender;
@@ -105,9 +125,33 @@ GType gibber_r_multicast_sender_get_type (void);
   (G_TYPE_INSTANCE_GET_CLASS ((obj), GIBBER_TYPE_R_MULTICAST_SENDER, \
    GibberRMulticastSenderClass))
 
-GibberRMulticastSenderGroup *gibber_r_multicast_sender_group_new (void);
+/* timers has to outlive the group */
+GibberRMulticastSenderGroup *gibber_r_multicast_sender_group_new (
+    GibberTimerWheel *timers);
 
 void gibber_r_multicast_sender_group_free (GibberRMulticastSenderGroup *group);
+
+/* Packets are kept around until every member acked them, so that they can be
+ * repaired to the ones that missed them. When they take more than budget
+ * bytes, the packets we already delivered that every member acked are
+ * dropped. Packets a member still needs are never dropped: members that
+ * haven't acked a packet for half a minute are failed instead, and their
+ * packets can go once the failure was agreed on and set with
+ * gibber_r_multicast_sender_set_failed (). 0 for no limit, the default. */
+void gibber_r_multicast_sender_group_set_budget (
+    GibberRMulticastSenderGroup *group, gsize budget);
+
+/* Bytes the cached packets take, how many were evicted to stay within the
+ * budget and the age in ms of the oldest packet not everyone acked yet */
+void gibber_r_multicast_sender_group_get_cache_stats (
+    GibberRMulticastSenderGroup *group, gsize *bytes, guint *evictions,
+    guint *oldest_unstable);
+
+/* Lost packets rebuilt from parity packets, and the ones that only came in
+ * after we asked for a repair */
+void gibber_r_multicast_sender_group_get_fec_counters (
+    GibberRMulticastSenderGroup *group, guint *recovered, guint *repaired);
+
 void gibber_r_multicast_sender_group_stop (GibberRMulticastSenderGroup *group);
 void gibber_r_multicast_sender_group_add (GibberRMulticastSenderGroup *group,
     GibberRMulticastSender *sender);
@@ -150,6 +194,11 @@ void gibber_r_multicast_sender_release_data (GibberRMulticastSender *sender);
 void gibber_r_multicast_sender_push (GibberRMulticastSender *sender,
      GibberRMulticastPacket *packet);
 
+/* Use a PACKET_TYPE_PARITY packet of the sender to rebuild one of the packets
+ * it covers, if that's the only one missing */
+void gibber_r_multicast_sender_push_parity (GibberRMulticastSender *sender,
+     GibberRMulticastPacket *packet);
+
 void
 gibber_r_multicast_senders_updated (GibberRMulticastSender *sender);
 
@@ -170,6 +219,17 @@ void gibber_r_multicast_sender_set_packet_repeat (
 guint gibber_r_multicast_sender_packet_cache_size (
     GibberRMulticastSender *sender);
 
+/* Returns the amount of packets not every member that hasn't failed acked
+ * yet */
+guint gibber_r_multicast_sender_unstable_packets (
+    GibberRMulticastSender *sender);
+
+/* Fails the members that the oldest unstable packet of sender waits for,
+ * whatever the budget, so that it becomes stable once the others agreed on
+ * their failure. Returns how many were failed */
+guint gibber_r_multicast_sender_fail_laggards (
+    GibberRMulticastSender *sender);
+
 /* Ack management */
 void gibber_r_multicast_sender_ack (GibberRMulticastSender *sender,
     guint32 ack);
@@ -177,6 +237,21 @@ void gibber_r_multicast_sender_ack (GibberRMulticastSender *sender,
 /* Stop all pending requests, only reply to repair requests */
 void gibber_r_multicast_sender_stop (GibberRMulticastSender *sender);
 
+/* Failure detection. The sender keeps track of the intervals between the
+ * times it was heard from, and the suspicion that it failed grows with the
+ * time since it was last heard from compared to those: a suspicion of n
+ * means a chance of 10^-n that it would still be heard from, if the
+ * intervals are distributed normally. The sender signals its failure once
+ * the suspicion reaches GIBBER_R_MULTICAST_SENDER_PHI_FAILED. */
+#define GIBBER_R_MULTICAST_SENDER_PHI_SUSPECTED 4.0
+#define GIBBER_R_MULTICAST_SENDER_PHI_FAILED 8.0
+
+void gibber_r_multicast_sender_heard (GibberRMulticastSender *sender);
+
+/* 0 until the sender was heard from */
+gdouble gibber_r_multicast_sender_get_suspicion (
+    GibberRMulticastSender *sender);
+
 /* Trigger failure detection, for testing only */
 void _gibber_r_multicast_TEST_sender_fail (GibberRMulticastSender *sender);
 
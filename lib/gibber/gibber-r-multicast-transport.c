@@ -39,6 +39,12 @@
 #define MIN_JOINING_START_TIMEOUT 4800
 #define MAX_JOINING_START_TIMEOUT 5200
 
+/* The same once everybody we know about has answered our attempt joins and
+ * knows our start point, as when joining a stable group. Anyone still
+ * turning up puts us back on the timeout above. */
+#define MIN_FAST_JOINING_START_TIMEOUT 200
+#define MAX_FAST_JOINING_START_TIMEOUT 400
+
 /* Time-out before within which we should have complete a failure */
 #define FAILURE_TIMEOUT 60000
 
@@ -93,6 +99,8 @@ struct _GibberRMulticastTransportPrivate
 {
   gboolean dispose_has_run;
   GibberRMulticastCausalTransport *transport;
+  /* borrowed from transport */
+  GibberTimerWheel *timers;
   GHashTable *members;
 
   guint32 attempt_join_id;
@@ -112,6 +120,16 @@ struct _GibberRMulticastTransportPrivate
   State state;
 
   gulong reconnect_handler;
+
+  /* Bytes still to come of a message that was started while resetting */
+  gsize stream_dropped;
+
+  /* When the current gathering and joining phases started, and how long they
+   * took the last time */
+  gint64 gathering_started;
+  gint64 joining_started;
+  guint gathering_time;
+  guint joining_time;
 };
 
 typedef enum {
@@ -181,6 +199,8 @@ gibber_r_multicast_transport_set_property (GObject *object,
     case PROP_TRANSPORT:
       priv->transport = GIBBER_R_MULTICAST_CAUSAL_TRANSPORT (
           g_value_dup_object (value));
+      priv->timers = gibber_r_multicast_causal_transport_get_timers (
+          priv->transport);
       break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -288,13 +308,13 @@ gibber_r_multicast_transport_flush_state (GibberRMulticastTransport *self)
 
   if (priv->timeout != 0)
     {
-      g_source_remove (priv->timeout);
+      gibber_timer_wheel_remove (priv->timers, priv->timeout);
       priv->timeout = 0;
     }
 
   if (priv->joining_timeout != 0)
     {
-      g_source_remove (priv->joining_timeout);
+      gibber_timer_wheel_remove (priv->timers, priv->joining_timeout);
       priv->joining_timeout = 0;
     }
 
@@ -445,9 +465,11 @@ static void
 free_member_info (gpointer data)
 {
   MemberInfo *info = (MemberInfo *) data;
+  GibberRMulticastTransportPrivate *priv =
+      GIBBER_R_MULTICAST_TRANSPORT_GET_PRIVATE (info->transport);
 
   if (info->fail_timeout != 0)
-    g_source_remove (info->fail_timeout);
+    gibber_timer_wheel_remove (priv->timers, info->fail_timeout);
   g_array_unref (info->failures);
   g_slice_free (MemberInfo, info);
 }
@@ -617,6 +639,17 @@ check_join_state (gpointer key, MemberInfo *value, gpointer user_data)
       value->state = MEMBER_STATE_FAILING;
       g_array_append_val (priv->pending_failures, value->id);
     }
+  else if (gibber_r_multicast_sender_get_suspicion (sender)
+      >= GIBBER_R_MULTICAST_SENDER_PHI_SUSPECTED)
+    {
+      /* Probably gone already, don't hold up the join waiting for it. It can
+       * join again if it isn't */
+      DEBUG ("Leaving out %x, suspicion %.1f", value->id,
+          gibber_r_multicast_sender_get_suspicion (sender));
+      value->state = value->state == MEMBER_STATE_MEMBER
+          ? MEMBER_STATE_MEMBER_FAILING : MEMBER_STATE_FAILING;
+      g_array_append_val (priv->pending_failures, value->id);
+    }
   else if (value->state < MEMBER_STATE_MEMBER)
    {
      /* Check if any other members has the same name, if so fail it.
@@ -636,8 +669,11 @@ setup_joining_phase (GibberRMulticastTransport *self)
 
   if (priv->state == STATE_GATHERING)
     {
+      priv->joining_started = gibber_timer_wheel_get_time (priv->timers);
+      priv->gathering_time = priv->joining_started - priv->gathering_started;
+
       stop_send_attempt_join (self);
-      g_source_remove (priv->joining_timeout);
+      gibber_timer_wheel_remove (priv->timers, priv->joining_timeout);
       priv->joining_timeout = 0;
       /* every member with state >= MEMBER_STATE_ATTEMPT_JOIN_REPEAT, will be
        * in our join */
@@ -727,9 +763,9 @@ start_joining_phase (GibberRMulticastTransport *self)
     }
 
   if (priv->timeout != 0)
-    g_source_remove (priv->timeout);
+    gibber_timer_wheel_remove (priv->timers, priv->timeout);
 
-  priv->timeout = g_timeout_add (JOIN_TIMEOUT,
+  priv->timeout = gibber_timer_wheel_add (priv->timers, JOIN_TIMEOUT,
     join_timeout_cb, self);
 }
 
@@ -744,23 +780,62 @@ do_start_joining_phase (gpointer user_data)
   return FALSE;
 }
 
+static gboolean
+member_unsettled (gpointer key, gpointer value, gpointer user_data)
+{
+  MemberInfo *info = (MemberInfo *) value;
+
+  return info->state < MEMBER_STATE_ATTEMPT_JOIN_DONE
+      || info->state > MEMBER_STATE_MEMBER;
+}
+
+/* Whether we know the start points of everybody and they know ours, with no
+ * attempt join of ours still to go out */
+static gboolean
+gathering_settled (GibberRMulticastTransport *self)
+{
+  GibberRMulticastTransportPrivate *priv =
+    GIBBER_R_MULTICAST_TRANSPORT_GET_PRIVATE (self);
+
+  if (priv->timeout != 0 || priv->repeating_join)
+    return FALSE;
+
+  if (g_hash_table_size (priv->members) == 0)
+    return FALSE;
+
+  return g_hash_table_find (priv->members, member_unsettled, NULL) == NULL;
+}
+
 static void
 continue_gathering_phase (GibberRMulticastTransport *self) {
   GibberRMulticastTransportPrivate *priv =
     GIBBER_R_MULTICAST_TRANSPORT_GET_PRIVATE (self);
+  guint timeout;
 
   g_assert (priv->state != STATE_JOINING);
 
   if (priv->state != STATE_GATHERING) {
     DEBUG ("Entering gathering state");
     priv->state = STATE_GATHERING;
+    priv->gathering_started = gibber_timer_wheel_get_time (priv->timers);
   }
 
   if (priv->joining_timeout != 0)
-    g_source_remove (priv->joining_timeout);
+    gibber_timer_wheel_remove (priv->timers, priv->joining_timeout);
+
+  if (gathering_settled (self))
+    {
+      DEBUG ("Gathering settled, starting the joining phase early");
+      timeout = gibber_timer_wheel_random_int_range (priv->timers,
+          MIN_FAST_JOINING_START_TIMEOUT, MAX_FAST_JOINING_START_TIMEOUT);
+    }
+  else
+    {
+      timeout = gibber_timer_wheel_random_int_range (priv->timers,
+          MIN_JOINING_START_TIMEOUT, MAX_JOINING_START_TIMEOUT);
+    }
 
-  priv->joining_timeout = g_timeout_add (
-    g_random_int_range (MIN_JOINING_START_TIMEOUT, MAX_JOINING_START_TIMEOUT),
+  priv->joining_timeout = gibber_timer_wheel_add (priv->timers, timeout,
     do_start_joining_phase, self);
 }
 
@@ -816,7 +891,7 @@ stop_send_attempt_join (GibberRMulticastTransport *self) {
   }
 
   if (priv->timeout != 0) {
-    g_source_remove (priv->timeout);
+    gibber_timer_wheel_remove (priv->timers, priv->timeout);
     priv->timeout = 0;
   }
 }
@@ -850,6 +925,10 @@ do_send_attempt_join (gpointer user_data) {
   }
   g_array_unref (data.senders);
 
+  /* That might have been the last thing we were waiting for */
+  if (gathering_settled (self))
+    continue_gathering_phase (self);
+
   return FALSE;
 }
 
@@ -868,8 +947,9 @@ send_attempt_join (GibberRMulticastTransport *self, gboolean send_empty) {
 
   if (priv->timeout == 0) {
     /* No send attempt scheduled yet, schedule one now */
-    priv->timeout = g_timeout_add (
-      g_random_int_range (MIN_ATTEMPT_JOIN_TIMEOUT, MAX_ATTEMPT_JOIN_TIMEOUT),
+    priv->timeout = gibber_timer_wheel_add (priv->timers,
+      gibber_timer_wheel_random_int_range (priv->timers,
+        MIN_ATTEMPT_JOIN_TIMEOUT, MAX_ATTEMPT_JOIN_TIMEOUT),
       do_send_attempt_join, self);
   }
 
@@ -1193,7 +1273,7 @@ check_failure_completion (GibberRMulticastTransport *self, guint32 id)
       info->state = MEMBER_STATE_INSTANT_FAILURE;
       if (info->fail_timeout != 0)
         {
-          g_source_remove (info->fail_timeout);
+          gibber_timer_wheel_remove (priv->timers, info->fail_timeout);
           info->fail_timeout = 0;
         }
       check_join_agreement (self);
@@ -1262,8 +1342,8 @@ fail_member (GibberRMulticastTransport *self, MemberInfo *info, guint32 id)
        else
          finfo->state = MEMBER_STATE_FAILING;
 
-       finfo->fail_timeout = g_timeout_add (FAILURE_TIMEOUT,
-           fail_member_timeout_cb, finfo);
+       finfo->fail_timeout = gibber_timer_wheel_add (priv->timers,
+           FAILURE_TIMEOUT, fail_member_timeout_cb, finfo);
        send_failure_packet (self);
     }
 
@@ -1433,7 +1513,11 @@ check_join_agreement (GibberRMulticastTransport *self)
         return;
     }
 
+  priv->joining_time = gibber_timer_wheel_get_time (priv->timers)
+      - priv->joining_started;
   DEBUG ("---Finished joining phase!!!!---");
+  DEBUG ("Gathering took %u ms, joining %u ms", priv->gathering_time,
+      priv->joining_time);
   new = g_array_new (FALSE, FALSE, sizeof (gchar *));
   lost = g_array_new (FALSE, FALSE, sizeof (gchar *));
 
@@ -1518,7 +1602,7 @@ check_join_agreement (GibberRMulticastTransport *self)
 
   if (priv->timeout != 0)
     {
-      g_source_remove (priv->timeout);
+      gibber_timer_wheel_remove (priv->timers, priv->timeout);
       priv->timeout = 0;
     }
   DEBUG ("--------------------------------");
@@ -1596,6 +1680,9 @@ received_control_packet_cb (GibberRMulticastCausalTransport *ctransport,
             send_attempt_join (self, FALSE);
           break;
       }
+
+      if (gathering_settled (self))
+        continue_gathering_phase (self);
       break;
     }
 
@@ -1716,6 +1803,57 @@ gibber_r_multicast_transport_send (GibberRMulticastTransport *transport,
      stream_id, data, size, error);
 }
 
+gboolean
+gibber_r_multicast_transport_send_start (GibberRMulticastTransport *transport,
+    guint16 stream_id, gsize total_size, GError **error)
+{
+  GibberRMulticastTransportPrivate *priv =
+    GIBBER_R_MULTICAST_TRANSPORT_GET_PRIVATE (transport);
+
+  if (priv->state == STATE_RESETTING)
+    {
+      /* Dropped like any other message sent while resetting */
+      priv->stream_dropped = total_size;
+      return TRUE;
+    }
+
+  return gibber_r_multicast_causal_transport_send_start (priv->transport,
+     stream_id, total_size, error);
+}
+
+gboolean
+gibber_r_multicast_transport_send_chunk (GibberRMulticastTransport *transport,
+    const guint8 *data, gsize size, GError **error)
+{
+  GibberRMulticastTransportPrivate *priv =
+    GIBBER_R_MULTICAST_TRANSPORT_GET_PRIVATE (transport);
+
+  if (priv->stream_dropped > 0)
+    {
+      priv->stream_dropped -= MIN (size, priv->stream_dropped);
+      return TRUE;
+    }
+
+  /* The causal transport drops the message itself if it was started before
+   * we began resetting */
+  return gibber_r_multicast_causal_transport_send_chunk (priv->transport,
+     data, size, error);
+}
+
+gsize
+gibber_r_multicast_transport_get_stream_room (
+    GibberRMulticastTransport *transport)
+{
+  GibberRMulticastTransportPrivate *priv =
+    GIBBER_R_MULTICAST_TRANSPORT_GET_PRIVATE (transport);
+
+  if (priv->stream_dropped > 0)
+    return priv->stream_dropped;
+
+  return gibber_r_multicast_causal_transport_get_stream_room (
+      priv->transport);
+}
+
 static gboolean
 gibber_r_multicast_transport_do_send (GibberTransport *transport,
     const guint8 *data, gsize size, GError **error)
@@ -1763,3 +1901,24 @@ gibber_r_multicast_transport_disconnect (GibberTransport *transport)
       G_CALLBACK(transport_disconnected), self);
   gibber_transport_disconnect (GIBBER_TRANSPORT (priv->transport));
 }
+
+void
+gibber_r_multicast_transport_get_join_times (
+    GibberRMulticastTransport *transport,
+    guint *connecting,
+    guint *gathering,
+    guint *joining)
+{
+  GibberRMulticastTransportPrivate *priv =
+    GIBBER_R_MULTICAST_TRANSPORT_GET_PRIVATE (transport);
+
+  if (connecting != NULL)
+    *connecting = gibber_r_multicast_causal_transport_get_connect_time (
+        priv->transport);
+
+  if (gathering != NULL)
+    *gathering = priv->gathering_time;
+
+  if (joining != NULL)
+    *joining = priv->joining_time;
+}
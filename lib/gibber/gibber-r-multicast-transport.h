@@ -42,6 +42,9 @@ typedef struct {
   GibberBuffer buffer;
   const gchar *sender;
   guint16 stream_id;
+  /* See GibberRMulticastCausalBuffer */
+  guint8 flags;
+  guint32 total_size;
 } GibberRMulticastBuffer;
 
 GType gibber_r_multicast_transport_get_type (void);
@@ -73,6 +76,25 @@ gboolean gibber_r_multicast_transport_send (
     GibberRMulticastTransport *transport, guint16 stream_id,
     const guint8 *data, gsize size, GError **error);
 
+/* See gibber_r_multicast_causal_transport_send_start () */
+gboolean gibber_r_multicast_transport_send_start (
+    GibberRMulticastTransport *transport, guint16 stream_id,
+    gsize total_size, GError **error);
+
+gboolean gibber_r_multicast_transport_send_chunk (
+    GibberRMulticastTransport *transport, const guint8 *data, gsize size,
+    GError **error);
+
+gsize gibber_r_multicast_transport_get_stream_room (
+    GibberRMulticastTransport *transport);
+
+/* In ms, how long the phases of the last join into the group took: picking a
+ * unique sender id, exchanging start points with the members we found and
+ * agreeing on the new membership. 0 for the ones that didn't finish yet. */
+void gibber_r_multicast_transport_get_join_times (
+    GibberRMulticastTransport *transport, guint *connecting,
+    guint *gathering, guint *joining);
+
 G_END_DECLS
 
 #endif /* #ifndef __GIBBER_R_MULTICAST_TRANSPORT_H__*/
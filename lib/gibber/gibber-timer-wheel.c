@@ -0,0 +1,483 @@
+/*
+ * gibber-timer-wheel.c - Source for GibberTimerWheel
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "gibber-timer-wheel.h"
+
+/* The first level has a slot for each of the next 256 ticks. Each slot of
+ * the next levels covers all the slots of the level below, and its timers
+ * are moved down (cascaded) when the level below wraps around. With four
+ * levels, timers up to 2^26 ticks (about a week) ahead are placed exactly;
+ * later ones are parked in the last level and placed again when they come
+ * round. */
+#define LEVEL0_BITS 8
+#define LEVEL_BITS 6
+#define N_LEVELS 4
+
+#define LEVEL0_SIZE (1 << LEVEL0_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define LEVEL0_MASK (LEVEL0_SIZE - 1)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+
+#define LEVEL_SHIFT(l) (LEVEL0_BITS + ((l) - 1) * LEVEL_BITS)
+#define MAX_DELTA \
+  ((G_GUINT64_CONSTANT (1) << LEVEL_SHIFT (N_LEVELS)) - 1)
+
+typedef struct {
+  guint id;
+  /* tick at which it fires */
+  guint64 expires;
+  guint interval;
+  GSourceFunc function;
+  gpointer data;
+  /* the slot it's in, or NULL while it's being called */
+  GQueue *slot;
+  GList link;
+  /* removed while it was being called */
+  gboolean removed;
+} Timer;
+
+struct _GibberTimerWheel {
+  GQueue level0[LEVEL0_SIZE];
+  GQueue levels[N_LEVELS - 1][LEVEL_SIZE];
+
+  /* next tick to be processed */
+  guint64 current;
+
+  /* id => owned Timer, except the one being called if it was removed */
+  GHashTable *timers;
+  guint last_id;
+
+  guint source;
+  /* tick the source fires at */
+  guint64 armed;
+
+  gboolean dispatching;
+  Timer *running;
+  /* freed by one of its timers, to be finished when that returns */
+  gboolean freed;
+
+  /* time only moves when gibber_timer_wheel_advance () is called */
+  gboolean virtual;
+  /* ms */
+  gint64 virtual_now;
+
+  GRand *rand;
+};
+
+static gint64
+now_ms (GibberTimerWheel *wheel)
+{
+  if (wheel->virtual)
+    return wheel->virtual_now;
+
+  return g_get_monotonic_time () / 1000;
+}
+
+static guint64
+now_ticks (GibberTimerWheel *wheel)
+{
+  return now_ms (wheel) / GIBBER_TIMER_WHEEL_TICK;
+}
+
+/* The first tick at which interval ms will have passed. Never the tick
+ * we're in, so that a timer added by a timer doesn't run in the same
+ * dispatch. */
+static guint64
+expiry (GibberTimerWheel *wheel,
+    guint interval)
+{
+  gint64 now = now_ms (wheel);
+
+  return MAX (now / GIBBER_TIMER_WHEEL_TICK + 1,
+      (now + interval + GIBBER_TIMER_WHEEL_TICK - 1)
+        / GIBBER_TIMER_WHEEL_TICK);
+}
+
+static void
+timer_free (gpointer data)
+{
+  g_slice_free (Timer, data);
+}
+
+/* Puts the timer in its slot and returns the tick at which the wheel has to
+ * look at that slot */
+static guint64
+place (GibberTimerWheel *wheel,
+    Timer *timer)
+{
+  guint64 expires = MAX (timer->expires, wheel->current);
+  guint64 delta = expires - wheel->current;
+  guint level;
+  guint shift;
+
+  if (delta < LEVEL0_SIZE)
+    {
+      timer->slot = &wheel->level0[expires & LEVEL0_MASK];
+      g_queue_push_tail_link (timer->slot, &timer->link);
+      return expires;
+    }
+
+  if (delta > MAX_DELTA)
+    expires = wheel->current + MAX_DELTA;
+
+  for (level = 1; level < N_LEVELS - 1; level++)
+    {
+      if (delta < (G_GUINT64_CONSTANT (1) << LEVEL_SHIFT (level + 1)))
+        break;
+    }
+
+  shift = LEVEL_SHIFT (level);
+  timer->slot = &wheel->levels[level - 1][(expires >> shift) & LEVEL_MASK];
+  g_queue_push_tail_link (timer->slot, &timer->link);
+
+  return (expires >> shift) << shift;
+}
+
+static void
+cascade (GibberTimerWheel *wheel,
+    GQueue *slot)
+{
+  GList *link;
+
+  while ((link = g_queue_pop_head_link (slot)) != NULL)
+    place (wheel, link->data);
+}
+
+/* The first tick at which there's something to do */
+static guint64
+next_deadline (GibberTimerWheel *wheel)
+{
+  guint64 deadline = G_MAXUINT64;
+  guint level, i;
+
+  for (i = 0; i < LEVEL0_SIZE; i++)
+    {
+      if (wheel->level0[(wheel->current + i) & LEVEL0_MASK].length > 0)
+        {
+          deadline = wheel->current + i;
+          break;
+        }
+    }
+
+  for (level = 1; level < N_LEVELS; level++)
+    {
+      guint shift = LEVEL_SHIFT (level);
+      guint64 base = wheel->current >> shift;
+
+      /* The slot the wheel is in has already been cascaded, unless the
+       * wheel is right at its start */
+      i = (wheel->current & ((G_GUINT64_CONSTANT (1) << shift) - 1)) == 0
+          ? 0 : 1;
+
+      for (; i <= LEVEL_SIZE; i++)
+        {
+          if (wheel->levels[level - 1][(base + i) & LEVEL_MASK].length > 0)
+            {
+              deadline = MIN (deadline, (base + i) << shift);
+              break;
+            }
+        }
+    }
+
+  return deadline;
+}
+
+static gboolean dispatch_cb (gpointer user_data);
+
+static void
+arm (GibberTimerWheel *wheel,
+    guint64 deadline)
+{
+  gint64 now = now_ms (wheel);
+  gint64 at = deadline * GIBBER_TIMER_WHEEL_TICK;
+
+  if (wheel->virtual)
+    return;
+
+  if (wheel->source != 0)
+    {
+      if (wheel->armed <= deadline)
+        return;
+
+      g_source_remove (wheel->source);
+    }
+
+  wheel->armed = deadline;
+  wheel->source = g_timeout_add (at > now ? at - now : 0,
+      dispatch_cb, wheel);
+}
+
+/* Calls the timers of the current tick */
+static void
+run_tick (GibberTimerWheel *wheel)
+{
+  GQueue *slot = &wheel->level0[wheel->current & LEVEL0_MASK];
+  GList *link;
+
+  if ((wheel->current & LEVEL0_MASK) == 0)
+    {
+      guint level;
+
+      for (level = 1; level < N_LEVELS; level++)
+        {
+          guint i = (wheel->current >> LEVEL_SHIFT (level)) & LEVEL_MASK;
+
+          cascade (wheel, &wheel->levels[level - 1][i]);
+
+          if (i != 0)
+            break;
+        }
+    }
+
+  while ((link = g_queue_pop_head_link (slot)) != NULL)
+    {
+      Timer *timer = link->data;
+      gboolean again;
+
+      timer->slot = NULL;
+      wheel->running = timer;
+      again = timer->function (timer->data);
+      wheel->running = NULL;
+
+      if (timer->removed)
+        {
+          timer_free (timer);
+        }
+      else if (!again)
+        {
+          g_hash_table_remove (wheel->timers, GUINT_TO_POINTER (timer->id));
+        }
+      else
+        {
+          timer->expires = expiry (wheel, timer->interval);
+          place (wheel, timer);
+        }
+
+      if (wheel->freed)
+        return;
+    }
+}
+
+/* Runs the ticks up to and including target. Returns FALSE if one of the
+ * timers freed the wheel. */
+static gboolean
+run_ticks (GibberTimerWheel *wheel,
+    guint64 target)
+{
+  wheel->dispatching = TRUE;
+
+  while (wheel->current <= target)
+    {
+      if (g_hash_table_size (wheel->timers) == 0)
+        {
+          wheel->current = target + 1;
+          break;
+        }
+
+      /* so that the timers see the time they were due at */
+      if (wheel->virtual)
+        wheel->virtual_now = MAX (wheel->virtual_now,
+            (gint64) wheel->current * GIBBER_TIMER_WHEEL_TICK);
+
+      run_tick (wheel);
+
+      if (wheel->freed)
+        {
+          g_slice_free (GibberTimerWheel, wheel);
+          return FALSE;
+        }
+
+      wheel->current++;
+    }
+
+  wheel->dispatching = FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+dispatch_cb (gpointer user_data)
+{
+  GibberTimerWheel *wheel = user_data;
+
+  wheel->source = 0;
+
+  if (run_ticks (wheel, now_ticks (wheel)) &&
+      g_hash_table_size (wheel->timers) > 0)
+    arm (wheel, next_deadline (wheel));
+
+  return FALSE;
+}
+
+static GibberTimerWheel *
+wheel_new (gboolean virtual,
+    GRand *rand)
+{
+  GibberTimerWheel *wheel = g_slice_new0 (GibberTimerWheel);
+
+  wheel->timers = g_hash_table_new_full (NULL, NULL, NULL, timer_free);
+  wheel->virtual = virtual;
+  wheel->rand = rand;
+  wheel->current = now_ticks (wheel);
+
+  return wheel;
+}
+
+GibberTimerWheel *
+gibber_timer_wheel_new (void)
+{
+  return wheel_new (FALSE, g_rand_new ());
+}
+
+GibberTimerWheel *
+gibber_timer_wheel_new_virtual (guint32 seed)
+{
+  return wheel_new (TRUE, g_rand_new_with_seed (seed));
+}
+
+void
+gibber_timer_wheel_free (GibberTimerWheel *wheel)
+{
+  if (wheel->source != 0)
+    g_source_remove (wheel->source);
+
+  /* run_tick () frees the timer being called once it returns */
+  if (wheel->running != NULL && !wheel->running->removed)
+    {
+      g_hash_table_steal (wheel->timers,
+          GUINT_TO_POINTER (wheel->running->id));
+      wheel->running->removed = TRUE;
+    }
+
+  /* The slots only hold links embedded in the timers */
+  g_hash_table_unref (wheel->timers);
+  g_rand_free (wheel->rand);
+
+  if (wheel->dispatching)
+    wheel->freed = TRUE;
+  else
+    g_slice_free (GibberTimerWheel, wheel);
+}
+
+guint
+gibber_timer_wheel_add (GibberTimerWheel *wheel,
+    guint interval,
+    GSourceFunc function,
+    gpointer data)
+{
+  Timer *timer = g_slice_new0 (Timer);
+  guint64 deadline;
+
+  /* Nothing to catch up on, so don't make the next dispatch walk through
+   * all the ticks since the last one */
+  if (g_hash_table_size (wheel->timers) == 0 && !wheel->dispatching)
+    wheel->current = MAX (wheel->current, now_ticks (wheel));
+
+  do
+    wheel->last_id++;
+  while (wheel->last_id == 0 ||
+      g_hash_table_lookup (wheel->timers,
+          GUINT_TO_POINTER (wheel->last_id)) != NULL);
+
+  timer->id = wheel->last_id;
+  timer->interval = interval;
+  timer->function = function;
+  timer->data = data;
+  timer->link.data = timer;
+  timer->expires = expiry (wheel, interval);
+
+  g_hash_table_insert (wheel->timers, GUINT_TO_POINTER (timer->id), timer);
+  deadline = place (wheel, timer);
+
+  /* dispatch_cb () arms the source itself once it's done */
+  if (!wheel->dispatching)
+    arm (wheel, deadline);
+
+  return timer->id;
+}
+
+gboolean
+gibber_timer_wheel_remove (GibberTimerWheel *wheel,
+    guint id)
+{
+  Timer *timer = g_hash_table_lookup (wheel->timers, GUINT_TO_POINTER (id));
+
+  if (timer == NULL)
+    return FALSE;
+
+  if (timer->slot == NULL)
+    {
+      /* being called, run_tick () frees it once it returns */
+      g_hash_table_steal (wheel->timers, GUINT_TO_POINTER (id));
+      timer->removed = TRUE;
+      return TRUE;
+    }
+
+  g_queue_unlink (timer->slot, &timer->link);
+  g_hash_table_remove (wheel->timers, GUINT_TO_POINTER (id));
+
+  /* The source is left armed: it finds nothing to do and re-arms for the
+   * next timer, which is cheaper than working out the next deadline on
+   * every removal */
+  return TRUE;
+}
+
+guint
+gibber_timer_wheel_size (GibberTimerWheel *wheel)
+{
+  return g_hash_table_size (wheel->timers);
+}
+
+void
+gibber_timer_wheel_advance (GibberTimerWheel *wheel,
+    guint ms)
+{
+  gint64 target;
+
+  g_return_if_fail (wheel->virtual);
+  g_return_if_fail (!wheel->dispatching);
+
+  target = wheel->virtual_now + ms;
+
+  if (!run_ticks (wheel, target / GIBBER_TIMER_WHEEL_TICK))
+    return;
+
+  wheel->virtual_now = target;
+}
+
+gint64
+gibber_timer_wheel_get_time (GibberTimerWheel *wheel)
+{
+  return now_ms (wheel);
+}
+
+guint32
+gibber_timer_wheel_random_int (GibberTimerWheel *wheel)
+{
+  return g_rand_int (wheel->rand);
+}
+
+gint32
+gibber_timer_wheel_random_int_range (GibberTimerWheel *wheel,
+    gint32 begin,
+    gint32 end)
+{
+  return g_rand_int_range (wheel->rand, begin, end);
+}
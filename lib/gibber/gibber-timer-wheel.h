@@ -0,0 +1,80 @@
+/*
+ * gibber-timer-wheel.h - Header for GibberTimerWheel
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GIBBER_TIMER_WHEEL_H__
+#define __GIBBER_TIMER_WHEEL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A set of timers driven by a single GSource in the default main context,
+ * for code that keeps many short-lived timers around, like the repair timers
+ * of r-multicast senders. Timers are kept in a hierarchical timing wheel, so
+ * adding and removing one doesn't depend on how many others there are.
+ *
+ * The functions mirror g_timeout_add () and g_source_remove (): a timer fires
+ * at least interval ms after being added, rounded up to the wheel's
+ * resolution of GIBBER_TIMER_WHEEL_TICK ms, and fires again if its function
+ * returns TRUE. Timer ids are never 0.
+ *
+ * The wheel is also where its users get their random numbers from, so that
+ * a virtual wheel, whose time only moves when it's told to and whose random
+ * numbers come from a given seed, makes them run the same way every time and
+ * as fast as the machine allows. */
+typedef struct _GibberTimerWheel GibberTimerWheel;
+
+#define GIBBER_TIMER_WHEEL_TICK 10
+
+GibberTimerWheel *gibber_timer_wheel_new (void);
+
+/* Its time starts at 0 and is only moved by gibber_timer_wheel_advance () */
+GibberTimerWheel *gibber_timer_wheel_new_virtual (guint32 seed);
+
+/* Drops the pending timers without calling them. Can be called from one of
+ * the wheel's own timers. */
+void gibber_timer_wheel_free (GibberTimerWheel *wheel);
+
+guint gibber_timer_wheel_add (GibberTimerWheel *wheel, guint interval,
+    GSourceFunc function, gpointer data);
+
+/* Returns FALSE if there was no such timer. Removing the timer that's being
+ * called is allowed, as with g_source_remove (). */
+gboolean gibber_timer_wheel_remove (GibberTimerWheel *wheel, guint id);
+
+/* Number of pending timers */
+guint gibber_timer_wheel_size (GibberTimerWheel *wheel);
+
+/* Moves the time of a virtual wheel ms forward, calling the timers that
+ * become due on the way, in order and with the time set to when they were
+ * due. Not to be called from one of its timers. */
+void gibber_timer_wheel_advance (GibberTimerWheel *wheel, guint ms);
+
+/* In ms, from an arbitrary point for real wheels */
+gint64 gibber_timer_wheel_get_time (GibberTimerWheel *wheel);
+
+guint32 gibber_timer_wheel_random_int (GibberTimerWheel *wheel);
+
+/* Like g_random_int_range (), end is excluded */
+gint32 gibber_timer_wheel_random_int_range (GibberTimerWheel *wheel,
+    gint32 begin, gint32 end);
+
+G_END_DECLS
+
+#endif /* #ifndef __GIBBER_TIMER_WHEEL_H__ */
@@ -0,0 +1,326 @@
+/*
+ * benchmark-muc-connection.c - Benchmark of the GibberMucConnection receive
+ * path
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Feeds MUC traffic to a GibberMucConnection and reports how many stanzas
+ * per second it gets through on one core. The same traffic is also run
+ * through the old receive path, which used a non-streaming reader that was
+ * reset after every stanza and parsed stanzas for other rooms too.
+ *
+ * Traffic is either generated or read from a file given on the command
+ * line, with one "sender:base64 data" line per buffer as printed by
+ * test-r-multicast-transport-io (an "OUTPUT:" prefix is ignored). */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+#include <gibber/gibber-muc-connection.h>
+
+#define ROOM "bench-room"
+#define N_GENERATED 20000
+#define N_SENDERS 16
+#define N_ITERATIONS 10
+
+typedef struct {
+  gchar *sender;
+  guint8 *data;
+  gsize length;
+} Buffer;
+
+static void
+buffer_free (gpointer data)
+{
+  Buffer *b = data;
+
+  g_free (b->sender);
+  g_free (b->data);
+  g_slice_free (Buffer, b);
+}
+
+static void
+add_buffer (GPtrArray *traffic,
+    const gchar *sender,
+    const guint8 *data,
+    gsize length)
+{
+  Buffer *b = g_slice_new (Buffer);
+
+  b->sender = g_strdup (sender);
+  b->data = g_memdup (data, length);
+  b->length = length;
+  g_ptr_array_add (traffic, b);
+}
+
+static GPtrArray *
+generate_traffic (void)
+{
+  GPtrArray *traffic = g_ptr_array_new_with_free_func (buffer_free);
+  WockyXmppWriter *writer = wocky_xmpp_writer_new_no_stream ();
+  GRand *rand = g_rand_new_with_seed (42);
+  guint i;
+
+  for (i = 0; i < N_GENERATED; i++)
+    {
+      gchar *sender = g_strdup_printf ("user%u",
+          g_rand_int_range (rand, 0, N_SENDERS));
+      /* a tenth of the traffic is for another room on the same group */
+      const gchar *to = (i % 10 == 0) ? "other-room" : ROOM;
+      WockyStanza *stanza;
+      const guint8 *data;
+      gsize length;
+
+      if (i % 8 == 0)
+        {
+          stanza = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+              WOCKY_STANZA_SUB_TYPE_GROUPCHAT, sender, to,
+              '(', "tubes",
+                ':', WOCKY_TELEPATHY_NS_TUBES,
+                '(', "tube",
+                  '@', "type", "dbus",
+                  '@', "service", "org.freedesktop.Telepathy.Bench",
+                  '@', "id", "42",
+                  '@', "initiator", sender,
+                  '(', "parameters",
+                    '(', "parameter",
+                      '@', "name", "name",
+                      '@', "type", "str",
+                      '$', "value",
+                    ')',
+                  ')',
+                ')',
+              ')', NULL);
+        }
+      else
+        {
+          guint len = g_rand_int_range (rand, 10, 400);
+          gchar *body = g_malloc (len + 1);
+
+          memset (body, 'a' + (i % 26), len);
+          body[len] = '\0';
+
+          stanza = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+              WOCKY_STANZA_SUB_TYPE_GROUPCHAT, sender, to,
+              '(', "body", '$', body, ')', NULL);
+          g_free (body);
+        }
+
+      wocky_xmpp_writer_write_stanza (writer, stanza, &data, &length);
+      add_buffer (traffic, sender, data, length);
+
+      g_object_unref (stanza);
+      g_free (sender);
+    }
+
+  g_rand_free (rand);
+  g_object_unref (writer);
+  return traffic;
+}
+
+static GPtrArray *
+load_traffic (const gchar *path)
+{
+  GPtrArray *traffic;
+  gchar *contents;
+  gchar **lines;
+  GError *error = NULL;
+  guint i;
+
+  if (!g_file_get_contents (path, &contents, NULL, &error))
+    {
+      fprintf (stderr, "%s\n", error->message);
+      exit (1);
+    }
+
+  traffic = g_ptr_array_new_with_free_func (buffer_free);
+  lines = g_strsplit (contents, "\n", -1);
+
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      gchar *line = lines[i];
+      gchar *colon;
+      guchar *data;
+      gsize length;
+
+      if (g_str_has_prefix (line, "OUTPUT:"))
+        line += strlen ("OUTPUT:");
+
+      colon = strchr (line, ':');
+      if (colon == NULL)
+        continue;
+
+      *colon = '\0';
+      data = g_base64_decode (colon + 1, &length);
+
+      if (length > 0)
+        add_buffer (traffic, line, data, length);
+
+      g_free (data);
+    }
+
+  g_strfreev (lines);
+  g_free (contents);
+  return traffic;
+}
+
+/* what the receive path used to do, along with the check on the 'to'
+ * attribute SalutMucChannel does on every stanza */
+static guint
+run_old (GPtrArray *traffic)
+{
+  WockyXmppReader *reader = wocky_xmpp_reader_new_no_stream ();
+  guint delivered = 0;
+  guint i;
+
+  for (i = 0; i < traffic->len; i++)
+    {
+      Buffer *b = g_ptr_array_index (traffic, i);
+      WockyStanza *stanza;
+      GError *error;
+
+      wocky_xmpp_reader_push (reader, b->data, b->length);
+
+      error = wocky_xmpp_reader_get_error (reader);
+      if (error != NULL)
+        {
+          g_error_free (error);
+          wocky_xmpp_reader_reset (reader);
+        }
+
+      stanza = wocky_xmpp_reader_pop_stanza (reader);
+      if (stanza != NULL)
+        {
+          const gchar *to = wocky_node_get_attribute (
+              wocky_stanza_get_top_node (stanza), "to");
+
+          if (!wocky_strdiff (to, ROOM))
+            delivered++;
+
+          g_object_unref (stanza);
+          wocky_xmpp_reader_reset (reader);
+        }
+    }
+
+  g_object_unref (reader);
+  return delivered;
+}
+
+static void
+received_stanza_cb (GibberMucConnection *connection,
+    const gchar *sender,
+    WockyStanza *stanza,
+    gpointer user_data)
+{
+  guint *delivered = user_data;
+
+  (*delivered)++;
+}
+
+static guint
+run_new (GibberMucConnection *connection,
+    GPtrArray *traffic)
+{
+  guint delivered = 0;
+  gulong id;
+  guint i;
+
+  id = g_signal_connect (connection, "received-stanza",
+      G_CALLBACK (received_stanza_cb), &delivered);
+
+  for (i = 0; i < traffic->len; i++)
+    {
+      Buffer *b = g_ptr_array_index (traffic, i);
+
+      _gibber_muc_connection_TEST_receive (connection, b->sender, b->data,
+          b->length);
+    }
+
+  g_signal_handler_disconnect (connection, id);
+  return delivered;
+}
+
+static gdouble
+measure (GibberMucConnection *connection,
+    GPtrArray *traffic,
+    guint *delivered)
+{
+  GTimer *timer = g_timer_new ();
+  gdouble elapsed;
+  guint i;
+
+  for (i = 0; i < N_ITERATIONS; i++)
+    {
+      if (connection == NULL)
+        *delivered = run_old (traffic);
+      else
+        *delivered = run_new (connection, traffic);
+    }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  return (traffic->len * N_ITERATIONS) / elapsed;
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  GibberMucConnection *connection;
+  GPtrArray *traffic;
+  GError *error = NULL;
+  guint old_delivered, new_delivered;
+  gdouble old_rate, new_rate;
+
+  g_type_init ();
+
+  if (argc > 1)
+    traffic = load_traffic (argv[1]);
+  else
+    traffic = generate_traffic ();
+
+  connection = gibber_muc_connection_new ("bench", NULL, NULL, &error);
+  g_assert_no_error (error);
+  gibber_muc_connection_set_filter (connection, ROOM, NULL, NULL);
+
+  old_rate = measure (NULL, traffic, &old_delivered);
+  new_rate = measure (connection, traffic, &new_delivered);
+
+  printf ("%u buffers, %u iterations\n", traffic->len, N_ITERATIONS);
+  printf ("%-8s %12s %12s\n", "path", "stanzas/s", "delivered");
+  printf ("%-8s %12.0f %12u\n", "old", old_rate, old_delivered);
+  printf ("%-8s %12.0f %12u\n", "new", new_rate, new_delivered);
+
+  if (old_delivered != new_delivered)
+    {
+      fprintf (stderr, "both paths should deliver the same stanzas\n");
+      return 1;
+    }
+
+  g_object_unref (connection);
+  g_ptr_array_unref (traffic);
+
+  return 0;
+}
@@ -0,0 +1,295 @@
+/*
+ * benchmark-r-multicast-ordering.c - Benchmark of r-multicast delivery
+ * latency under packet loss for the different stream orderings
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Two remote nodes share a room: one sends a large tube message on a raw
+ * stream every tick, the other sends a chat message on the default stream
+ * that causally follows everything the first one sent. Some of the tube
+ * fragments get lost and are only repaired a few ticks later. This program
+ * replays that traffic into a GibberRMulticastSenderGroup for each ordering
+ * of the tube stream and reports how many ticks it took for the messages to
+ * be delivered. Time is simulated, so the numbers don't depend on the
+ * machine. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <gibber/gibber-r-multicast-causal-transport.h>
+#include <gibber/gibber-r-multicast-sender.h>
+
+#define TUBE_NODE 0x100
+#define CHAT_NODE 0x200
+
+#define N_TICKS 5000
+#define FRAGMENTS 4
+#define TUBE_STREAM 1
+/* percentage of the tube fragments that get lost */
+#define LOSS 5
+/* ticks it takes to repair a lost fragment */
+#define REPAIR_TICKS 20
+
+typedef struct {
+  guint delivered;
+  guint64 total;
+  guint max;
+  /* latency => number of messages */
+  guint histogram[REPAIR_TICKS + 2];
+} Stats;
+
+typedef struct {
+  Stats tube;
+  Stats chat;
+  guint tick;
+} Run;
+
+static void
+stats_add (Stats *stats,
+    guint latency)
+{
+  stats->delivered++;
+  stats->total += latency;
+  stats->max = MAX (stats->max, latency);
+  stats->histogram[MIN (latency, REPAIR_TICKS + 1)]++;
+}
+
+static guint
+stats_percentile (Stats *stats,
+    guint percentile)
+{
+  guint seen = 0;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (stats->histogram); i++)
+    {
+      seen += stats->histogram[i];
+      if (seen * 100 >= stats->delivered * percentile)
+        return i;
+    }
+
+  return i;
+}
+
+static void
+received_data_cb (GibberRMulticastSender *sender,
+    guint16 stream_id,
+    guint8 *data,
+    gsize size,
+    gpointer user_data)
+{
+  Run *run = user_data;
+  guint sent;
+
+  /* every message starts with the tick it was sent in */
+  sent = atoi ((const gchar *) data);
+
+  if (stream_id == TUBE_STREAM)
+    stats_add (&run->tube, run->tick - sent);
+  else
+    stats_add (&run->chat, run->tick - sent);
+}
+
+static GibberRMulticastSender *
+add_sender (GibberRMulticastSenderGroup *group,
+    guint32 id,
+    const gchar *name,
+    Run *run)
+{
+  GibberRMulticastSender *sender;
+
+  sender = gibber_r_multicast_sender_new (id, name, group);
+  gibber_r_multicast_sender_update_start (sender, 1);
+  gibber_r_multicast_sender_set_data_start (sender, 1);
+  gibber_r_multicast_sender_group_add (group, sender);
+
+  g_signal_connect (sender, "received-data", G_CALLBACK (received_data_cb),
+      run);
+
+  return sender;
+}
+
+static GibberRMulticastPacket *
+new_packet (guint32 sender,
+    guint32 packet_id,
+    guint32 depend_sender,
+    guint32 depend_packet_id,
+    guint16 stream_id,
+    guint8 flags,
+    guint32 total_size,
+    const guint8 *payload,
+    gsize size)
+{
+  GibberRMulticastPacket *p;
+
+  p = gibber_r_multicast_packet_new (PACKET_TYPE_DATA, sender, 1500);
+  gibber_r_multicast_packet_set_packet_id (p, packet_id);
+  gibber_r_multicast_packet_add_sender_info (p, depend_sender,
+      depend_packet_id, NULL);
+  gibber_r_multicast_packet_set_data_info (p, stream_id, flags, total_size);
+  gibber_r_multicast_packet_add_payload (p, payload, size);
+
+  return p;
+}
+
+static void
+push_chat_message (GibberRMulticastSender *chat,
+    guint32 packet_id,
+    guint32 tube_id,
+    guint tick)
+{
+  GibberRMulticastPacket *p;
+  gchar *body = g_strdup_printf ("%u", tick);
+
+  p = new_packet (CHAT_NODE, packet_id, TUBE_NODE, tube_id,
+      GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM,
+      GIBBER_R_MULTICAST_DATA_PACKET_START
+      | GIBBER_R_MULTICAST_DATA_PACKET_END,
+      strlen (body) + 1, (guint8 *) body, strlen (body) + 1);
+  gibber_r_multicast_sender_push (chat, p);
+
+  g_object_unref (p);
+  g_free (body);
+}
+
+static void
+run_ordering (GibberRMulticastOrdering ordering,
+    Run *run)
+{
+  GibberTimerWheel *timers = gibber_timer_wheel_new ();
+  GibberRMulticastSenderGroup *group;
+  GibberRMulticastSender *tube, *chat;
+  /* tick => GSList of lost packets that get repaired in that tick */
+  GSList *repairs[REPAIR_TICKS] = { NULL, };
+  GRand *rand = g_rand_new_with_seed (42);
+  guint32 tube_id = 1, chat_id = 1;
+  guint8 stream_flags = 0;
+  guint8 fragment[1000];
+
+  if (ordering == GIBBER_R_MULTICAST_ORDERING_FIFO)
+    stream_flags = GIBBER_R_MULTICAST_DATA_PACKET_FIFO;
+  else if (ordering == GIBBER_R_MULTICAST_ORDERING_UNORDERED)
+    stream_flags = GIBBER_R_MULTICAST_DATA_PACKET_UNORDERED;
+
+  memset (run, 0, sizeof (Run));
+  group = gibber_r_multicast_sender_group_new (timers);
+  tube = add_sender (group, TUBE_NODE, "tube", run);
+  chat = add_sender (group, CHAT_NODE, "chat", run);
+
+  for (run->tick = 0; run->tick <= N_TICKS + REPAIR_TICKS; run->tick++)
+    {
+      GSList **repaired = repairs + (run->tick % REPAIR_TICKS);
+      GSList *l;
+      guint i;
+
+      for (l = *repaired; l != NULL; l = g_slist_next (l))
+        {
+          gibber_r_multicast_sender_push (tube, l->data);
+          g_object_unref (l->data);
+        }
+
+      g_slist_free (*repaired);
+      *repaired = NULL;
+
+      if (run->tick >= N_TICKS)
+        continue;
+
+      memset (fragment, ' ', sizeof (fragment));
+      g_snprintf ((gchar *) fragment, sizeof (fragment), "%u", run->tick);
+
+      for (i = 0; i < FRAGMENTS; i++)
+        {
+          GibberRMulticastPacket *p;
+          guint8 flags = stream_flags;
+
+          if (i == 0)
+            flags |= GIBBER_R_MULTICAST_DATA_PACKET_START;
+          if (i == FRAGMENTS - 1)
+            flags |= GIBBER_R_MULTICAST_DATA_PACKET_END;
+
+          p = new_packet (TUBE_NODE, tube_id++, CHAT_NODE, chat_id,
+              TUBE_STREAM, flags, FRAGMENTS * sizeof (fragment),
+              fragment, sizeof (fragment));
+
+          if (g_rand_int_range (rand, 0, 100) < LOSS)
+            *repaired = g_slist_prepend (*repaired, p);
+          else
+            {
+              gibber_r_multicast_sender_push (tube, p);
+              g_object_unref (p);
+            }
+        }
+
+      /* the chat message causally follows all of the tube message */
+      push_chat_message (chat, chat_id++, tube_id, run->tick);
+    }
+
+  /* lost packets were put in the slot that comes round again REPAIR_TICKS
+   * later, so they were all pushed by now */
+  gibber_r_multicast_sender_group_free (group);
+  gibber_timer_wheel_free (timers);
+  g_rand_free (rand);
+}
+
+static void
+print_stats (const gchar *name,
+    const gchar *stream,
+    Stats *stats)
+{
+  printf ("%-10s %-6s %10u %10.2f %6u %6u %6u\n", name, stream,
+      stats->delivered,
+      stats->delivered > 0 ? (gdouble) stats->total / stats->delivered : 0,
+      stats_percentile (stats, 50), stats_percentile (stats, 99), stats->max);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  const struct {
+    const gchar *name;
+    GibberRMulticastOrdering ordering;
+  } orderings[] = {
+    { "causal", GIBBER_R_MULTICAST_ORDERING_CAUSAL },
+    { "fifo", GIBBER_R_MULTICAST_ORDERING_FIFO },
+    { "unordered", GIBBER_R_MULTICAST_ORDERING_UNORDERED },
+  };
+  guint i;
+
+  g_type_init ();
+
+  printf ("%u ticks, %u%% of the tube fragments repaired after %u ticks\n",
+      N_TICKS, LOSS, REPAIR_TICKS);
+  printf ("%-10s %-6s %10s %10s %6s %6s %6s\n", "tube", "stream",
+      "delivered", "avg", "p50", "p99", "max");
+
+  for (i = 0; i < G_N_ELEMENTS (orderings); i++)
+    {
+      Run run;
+
+      run_ordering (orderings[i].ordering, &run);
+      print_stats (orderings[i].name, "tube", &run.tube);
+      print_stats (orderings[i].name, "chat", &run.chat);
+    }
+
+  return 0;
+}
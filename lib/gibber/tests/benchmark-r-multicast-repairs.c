@@ -0,0 +1,272 @@
+/*
+ * benchmark-r-multicast-repairs.c - Benchmark of the r-multicast repair
+ * timers
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* A room where N_SENDERS members each announce REPAIRS_PER_SENDER packets
+ * we haven't seen, so that the sender group ends up with N_SENDERS *
+ * REPAIRS_PER_SENDER pending repair requests. Reports how long it took to
+ * schedule them, to run them and to drop them again, and how late the
+ * repair requests went out.
+ *
+ * The same number of timers is then run as plain GSources and through a
+ * GibberTimerWheel directly, to compare the cost of the timers themselves. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include <gibber/gibber-r-multicast-sender.h>
+#include <gibber/gibber-timer-wheel.h>
+
+#define N_SENDERS 40
+/* Less than the 256 packets a sender keeps track of */
+#define REPAIRS_PER_SENDER 250
+#define N_TIMERS (N_SENDERS * REPAIRS_PER_SENDER)
+
+/* The initial repair timeout of the senders */
+#define MIN_INTERVAL 150
+#define MAX_INTERVAL 250
+
+typedef struct {
+  GMainLoop *loop;
+  guint fired;
+  guint expected;
+  gint64 started;
+  gint64 first;
+  gint64 last;
+} Run;
+
+typedef struct {
+  Run *run;
+  /* ms */
+  gint64 max_late;
+  gint64 total_late;
+} Timers;
+
+static Timers *current = NULL;
+
+static void
+fired (Run *run)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (run->fired == 0)
+    run->first = now;
+
+  run->last = now;
+
+  if (++run->fired == run->expected)
+    g_main_loop_quit (run->loop);
+}
+
+static void
+repair_request_cb (GibberRMulticastSender *sender,
+    guint id,
+    gpointer user_data)
+{
+  fired (user_data);
+}
+
+static gboolean
+timer_cb (gpointer user_data)
+{
+  gint64 *deadline = user_data;
+  gint64 late = (g_get_monotonic_time () - *deadline) / 1000;
+
+  current->total_late += late;
+  current->max_late = MAX (current->max_late, late);
+  fired (current->run);
+
+  return FALSE;
+}
+
+static gdouble
+ms_since (gint64 start)
+{
+  return (g_get_monotonic_time () - start) / 1000.0;
+}
+
+static void
+print_run (const gchar *name,
+    gdouble scheduling,
+    Run *run,
+    gdouble dropping)
+{
+  printf ("%-12s %12.2f %12.2f %12.2f %12.2f\n", name, scheduling,
+      (run->first - run->started) / 1000.0,
+      (run->last - run->started) / 1000.0,
+      dropping);
+}
+
+static void
+run_senders (GMainLoop *loop)
+{
+  GibberTimerWheel *timers = gibber_timer_wheel_new ();
+  GibberRMulticastSenderGroup *group;
+  Run run = { loop, 0, N_TIMERS, 0, 0, 0 };
+  gdouble scheduling, dropping;
+  gint64 start;
+  guint i;
+
+  group = gibber_r_multicast_sender_group_new (timers);
+
+  for (i = 0; i < N_SENDERS; i++)
+    {
+      GibberRMulticastSender *sender;
+      gchar *name = g_strdup_printf ("sender%u", i);
+
+      sender = gibber_r_multicast_sender_new (0x100 + i, name, group);
+      gibber_r_multicast_sender_update_start (sender, 1);
+      gibber_r_multicast_sender_set_data_start (sender, 1);
+      gibber_r_multicast_sender_group_add (group, sender);
+
+      g_signal_connect (sender, "repair-request",
+          G_CALLBACK (repair_request_cb), &run);
+
+      g_free (name);
+    }
+
+  start = g_get_monotonic_time ();
+  run.started = start;
+
+  for (i = 0; i < N_SENDERS; i++)
+    gibber_r_multicast_sender_seen (
+        gibber_r_multicast_sender_group_lookup (group, 0x100 + i),
+        1 + REPAIRS_PER_SENDER);
+
+  scheduling = ms_since (start);
+  /* the senders' own timers come on top of the repair requests */
+  g_assert (gibber_timer_wheel_size (timers) >= N_TIMERS);
+
+  g_main_loop_run (loop);
+
+  /* Every repair request was rescheduled after going out */
+  start = g_get_monotonic_time ();
+  gibber_r_multicast_sender_group_free (group);
+  dropping = ms_since (start);
+
+  g_assert (gibber_timer_wheel_size (timers) == 0);
+  gibber_timer_wheel_free (timers);
+
+  print_run ("senders", scheduling, &run, dropping);
+}
+
+static void
+run_timers (const gchar *name,
+    GMainLoop *loop,
+    GibberTimerWheel *wheel,
+    const guint *intervals)
+{
+  Run run = { loop, 0, N_TIMERS, 0, 0, 0 };
+  Timers t = { &run, 0, 0 };
+  gint64 *deadlines = g_new (gint64, N_TIMERS);
+  guint *ids = g_new (guint, N_TIMERS);
+  gdouble scheduling, dropping;
+  gint64 start;
+  guint i;
+
+  current = &t;
+
+  start = g_get_monotonic_time ();
+  run.started = start;
+
+  for (i = 0; i < N_TIMERS; i++)
+    {
+      deadlines[i] = start + intervals[i] * 1000;
+
+      if (wheel != NULL)
+        gibber_timer_wheel_add (wheel, intervals[i], timer_cb, deadlines + i);
+      else
+        g_timeout_add (intervals[i], timer_cb, deadlines + i);
+    }
+
+  scheduling = ms_since (start);
+
+  g_main_loop_run (loop);
+
+  /* Add them all again and drop them before they fire, like repair
+   * requests that are answered in time */
+  for (i = 0; i < N_TIMERS; i++)
+    {
+      if (wheel != NULL)
+        ids[i] = gibber_timer_wheel_add (wheel, intervals[i], timer_cb, NULL);
+      else
+        ids[i] = g_timeout_add (intervals[i], timer_cb, NULL);
+    }
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < N_TIMERS; i++)
+    {
+      if (wheel != NULL)
+        gibber_timer_wheel_remove (wheel, ids[i]);
+      else
+        g_source_remove (ids[i]);
+    }
+
+  dropping = ms_since (start);
+
+  print_run (name, scheduling, &run, dropping);
+  printf ("%-12s fired %.2f ms late on average, %" G_GINT64_FORMAT
+      " ms at most\n", "", (gdouble) t.total_late / N_TIMERS, t.max_late);
+
+  current = NULL;
+  g_free (deadlines);
+  g_free (ids);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  GMainLoop *loop;
+  GibberTimerWheel *wheel;
+  guint *intervals;
+  GRand *rand;
+  guint i;
+
+  g_type_init ();
+
+  loop = g_main_loop_new (NULL, FALSE);
+  rand = g_rand_new_with_seed (42);
+  intervals = g_new (guint, N_TIMERS);
+
+  for (i = 0; i < N_TIMERS; i++)
+    intervals[i] = g_rand_int_range (rand, MIN_INTERVAL, MAX_INTERVAL);
+
+  printf ("%u timers, all times in ms\n", N_TIMERS);
+  printf ("%-12s %12s %12s %12s %12s\n", "", "scheduling", "first fired",
+      "last fired", "dropping");
+
+  run_senders (loop);
+  run_timers ("GSource", loop, NULL, intervals);
+
+  wheel = gibber_timer_wheel_new ();
+  run_timers ("timer wheel", loop, wheel, intervals);
+  gibber_timer_wheel_free (wheel);
+
+  g_free (intervals);
+  g_rand_free (rand);
+  g_main_loop_unref (loop);
+
+  return 0;
+}
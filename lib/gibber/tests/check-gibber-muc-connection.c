@@ -0,0 +1,501 @@
+/*
+ * check-gibber-muc-connection.c - Test for GibberMucConnection
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gibber/gibber-muc-connection.h>
+
+/* 64 KiB/s, which 8 KiB tube messages every 10 ms more than fill */
+#define RATE (64 * 1024)
+#define CHAT_SIZE 200
+#define TUBE_SIZE (8 * 1024)
+#define CHAT_INTERVAL 100
+#define DURATION 10000
+/* the default stream and two others at most */
+#define N_STREAMS 3
+
+typedef struct {
+  guint16 stream_id;
+  guint32 seq;
+  gsize size;
+} Sent;
+
+typedef struct {
+  GibberTimerWheel *timers;
+  GibberMucConnection *connection;
+  /* Sent, in the order they were handed to the room */
+  GArray *sent;
+  /* next sequence number of each stream, by stream id */
+  guint32 seqs[N_STREAMS];
+} Test;
+
+static gboolean
+send_cb (GibberMucConnection *connection,
+    guint16 stream_id,
+    const guint8 *data,
+    gsize size,
+    gpointer user_data)
+{
+  Test *t = user_data;
+  Sent s;
+
+  s.stream_id = stream_id;
+  memcpy (&s.seq, data, sizeof (s.seq));
+  s.size = size;
+  g_array_append_val (t->sent, s);
+
+  return TRUE;
+}
+
+static Test *
+test_new (void)
+{
+  Test *t = g_slice_new0 (Test);
+  GError *error = NULL;
+
+  t->timers = gibber_timer_wheel_new_virtual (42);
+  t->sent = g_array_new (FALSE, FALSE, sizeof (Sent));
+
+  t->connection = gibber_muc_connection_new ("test", NULL, NULL, &error);
+  g_assert_no_error (error);
+  _gibber_muc_connection_TEST_set_send_func (t->connection, t->timers,
+      send_cb, t);
+  gibber_muc_connection_set_send_rate (t->connection, RATE);
+
+  return t;
+}
+
+static void
+test_free (Test *t)
+{
+  g_object_unref (t->connection);
+  gibber_timer_wheel_free (t->timers);
+  g_array_unref (t->sent);
+  g_slice_free (Test, t);
+}
+
+/* Sends a message of size bytes on stream_id, starting with its sequence
+ * number on that stream */
+static void
+send_message (Test *t,
+    guint16 stream_id,
+    gsize size)
+{
+  guint8 *data = g_malloc0 (size);
+  GError *error = NULL;
+
+  g_assert_cmpuint (stream_id, <, N_STREAMS);
+  memcpy (data, &t->seqs[stream_id], sizeof (guint32));
+  t->seqs[stream_id]++;
+
+  g_assert (gibber_muc_connection_send_raw (t->connection, stream_id, data,
+      size, &error));
+  g_assert_no_error (error);
+
+  g_free (data);
+}
+
+/* Chats for DURATION ms, and returns the stats of the default stream once
+ * the last message had time to go */
+static void
+chat (Test *t,
+    GibberMucConnectionStreamStats *stats)
+{
+  guint elapsed;
+
+  for (elapsed = 0; elapsed < DURATION; elapsed += CHAT_INTERVAL)
+    {
+      send_message (t, 0, CHAT_SIZE);
+      gibber_timer_wheel_advance (t->timers, CHAT_INTERVAL);
+    }
+
+  gibber_timer_wheel_advance (t->timers, 1000);
+
+  g_assert (gibber_muc_connection_get_stream_stats (t->connection, 0,
+      stats));
+}
+
+/* Each stream's messages were sent once and in order, returns how many of
+ * stream_id's were */
+static guint
+check_sent (Test *t,
+    guint16 stream_id)
+{
+  guint32 expected = 0;
+  guint i;
+
+  for (i = 0; i < t->sent->len; i++)
+    {
+      Sent *s = &g_array_index (t->sent, Sent, i);
+
+      if (s->stream_id == stream_id)
+        g_assert_cmpuint (s->seq, ==, expected++);
+    }
+
+  return expected;
+}
+
+/* A tube filling the link doesn't make chat messages wait longer than it
+ * takes to send one tube message */
+static void
+test_chat_latency (void)
+{
+  Test *t = test_new ();
+  GibberMucConnectionStreamStats idle, busy, tube;
+  guint16 tube_id;
+  guint i;
+
+  chat (t, &idle);
+  g_assert_cmpuint (idle.messages_sent, ==, DURATION / CHAT_INTERVAL);
+  g_assert_cmpuint (idle.max_latency, ==, 0);
+
+  /* Several times what the link can take in DURATION */
+  tube_id = gibber_muc_connection_new_stream (t->connection,
+      GIBBER_R_MULTICAST_ORDERING_CAUSAL);
+  for (i = 0; i < 4 * (RATE / TUBE_SIZE) * (DURATION / 1000); i++)
+    send_message (t, tube_id, TUBE_SIZE);
+
+  chat (t, &busy);
+  g_assert_cmpuint (busy.messages_sent, ==,
+      idle.messages_sent + DURATION / CHAT_INTERVAL);
+  g_assert_cmpuint (busy.max_latency, <=, 2 * TUBE_SIZE * 1000 / RATE);
+
+  /* while the tube did fill the link, and got most of it */
+  g_assert (gibber_muc_connection_get_stream_stats (t->connection, tube_id,
+      &tube));
+  g_assert_cmpuint (tube.messages_queued, >, 0);
+  g_assert_cmpuint (tube.max_latency, >, DURATION / 2);
+  g_assert_cmpuint (tube.bytes_sent, >, RATE * (DURATION / 1000) * 3 / 4);
+
+  check_sent (t, 0);
+  check_sent (t, tube_id);
+
+  test_free (t);
+}
+
+/* Streams that always have something queued share the link in proportion
+ * to their priority */
+static void
+test_priorities (void)
+{
+  Test *t = test_new ();
+  GibberMucConnectionStreamStats normal, bulk, normal_start, bulk_start;
+  guint16 normal_id, bulk_id;
+  guint i;
+
+  normal_id = gibber_muc_connection_new_stream (t->connection,
+      GIBBER_R_MULTICAST_ORDERING_CAUSAL);
+  bulk_id = gibber_muc_connection_new_stream (t->connection,
+      GIBBER_R_MULTICAST_ORDERING_CAUSAL);
+  gibber_muc_connection_set_stream_priority (t->connection, bulk_id,
+      GIBBER_MUC_CONNECTION_PRIORITY_BULK);
+
+  for (i = 0; i < 2 * RATE / 1000 * (DURATION / 1000); i++)
+    {
+      send_message (t, normal_id, 1000);
+      send_message (t, bulk_id, 1000);
+    }
+
+  /* Leave out what was sent right away, before there was anything to
+   * share */
+  g_assert (gibber_muc_connection_get_stream_stats (t->connection,
+      normal_id, &normal_start));
+  g_assert (gibber_muc_connection_get_stream_stats (t->connection,
+      bulk_id, &bulk_start));
+
+  gibber_timer_wheel_advance (t->timers, DURATION);
+
+  g_assert (gibber_muc_connection_get_stream_stats (t->connection,
+      normal_id, &normal));
+  g_assert (gibber_muc_connection_get_stream_stats (t->connection,
+      bulk_id, &bulk));
+  g_assert_cmpuint (normal.messages_queued, >, 0);
+  g_assert_cmpuint (bulk.messages_queued, >, 0);
+
+  normal.bytes_sent -= normal_start.bytes_sent;
+  bulk.bytes_sent -= bulk_start.bytes_sent;
+
+  /* twice as much, give or take a turn */
+  g_assert_cmpuint (normal.bytes_sent, >=, 2 * bulk.bytes_sent - 3000);
+  g_assert_cmpuint (normal.bytes_sent, <=, 2 * bulk.bytes_sent + 3000);
+
+  check_sent (t, normal_id);
+  check_sent (t, bulk_id);
+
+  test_free (t);
+}
+
+/* What's queued on a stream is sent when it's freed, before what's sent on
+ * the default stream afterwards to say it's gone */
+static void
+test_free_stream (void)
+{
+  Test *t = test_new ();
+  GibberMucConnectionStreamStats stats;
+  guint16 tube_id;
+  Sent *last;
+  guint i;
+
+  tube_id = gibber_muc_connection_new_stream (t->connection,
+      GIBBER_R_MULTICAST_ORDERING_CAUSAL);
+  for (i = 0; i < 100; i++)
+    send_message (t, tube_id, TUBE_SIZE);
+
+  gibber_timer_wheel_advance (t->timers, 100);
+  g_assert (gibber_muc_connection_get_stream_stats (t->connection, tube_id,
+      &stats));
+  g_assert_cmpuint (stats.messages_queued, >, 0);
+
+  gibber_muc_connection_free_stream (t->connection, tube_id);
+  g_assert (!gibber_muc_connection_get_stream_stats (t->connection, tube_id,
+      &stats));
+  g_assert_cmpuint (check_sent (t, tube_id), ==, 100);
+
+  /* once the flush is paid for */
+  send_message (t, 0, CHAT_SIZE);
+  gibber_timer_wheel_advance (t->timers,
+      100 * TUBE_SIZE / (RATE / 1000) + 1000);
+
+  last = &g_array_index (t->sent, Sent, t->sent->len - 1);
+  g_assert_cmpuint (last->stream_id, ==, 0);
+  g_assert_cmpuint (t->sent->len, ==, 101);
+
+  test_free (t);
+}
+
+typedef struct {
+  GibberMucConnection *connection;
+  /* owned bodies of the stanzas received, in order */
+  GPtrArray *bodies;
+  guint parse_errors;
+} Receiver;
+
+static void
+received_stanza_cb (GibberMucConnection *connection,
+    const gchar *sender,
+    WockyStanza *stanza,
+    gpointer user_data)
+{
+  Receiver *r = user_data;
+
+  g_ptr_array_add (r->bodies, g_strdup (wocky_node_get_content_from_child (
+          wocky_stanza_get_top_node (stanza), "body")));
+}
+
+static void
+parse_error_cb (GibberMucConnection *connection,
+    const gchar *message,
+    gpointer user_data)
+{
+  Receiver *r = user_data;
+
+  r->parse_errors++;
+}
+
+static void
+receiver_init (Receiver *r)
+{
+  GError *error = NULL;
+
+  r->connection = gibber_muc_connection_new ("test", NULL, NULL, &error);
+  g_assert_no_error (error);
+  r->bodies = g_ptr_array_new_with_free_func (g_free);
+  r->parse_errors = 0;
+
+  g_signal_connect (r->connection, "received-stanza",
+      G_CALLBACK (received_stanza_cb), r);
+  g_signal_connect (r->connection, "parse-error",
+      G_CALLBACK (parse_error_cb), r);
+}
+
+static void
+receiver_fini (Receiver *r)
+{
+  g_object_unref (r->connection);
+  g_ptr_array_unref (r->bodies);
+}
+
+static void
+receive (Receiver *r,
+    const gchar *sender,
+    const gchar *data,
+    gsize length)
+{
+  _gibber_muc_connection_TEST_receive (r->connection, sender,
+      (const guint8 *) data, length);
+}
+
+/* A datagram as senders write them, a standalone document */
+static void
+receive_message (Receiver *r,
+    const gchar *sender,
+    const gchar *to,
+    const gchar *body)
+{
+  gchar *data = g_strdup_printf ("<?xml version='1.0' encoding='UTF-8'?>\n"
+      "<message xmlns='jabber:client' from='%s' to='%s' type='groupchat'>"
+      "<body>%s</body></message>", sender, to, body);
+
+  receive (r, sender, data, strlen (data));
+  g_free (data);
+}
+
+static void
+check_bodies (Receiver *r,
+    guint n,
+    ...)
+{
+  va_list ap;
+  guint i;
+
+  g_assert_cmpuint (r->bodies->len, ==, n);
+
+  va_start (ap, n);
+  for (i = 0; i < n; i++)
+    g_assert_cmpstr (g_ptr_array_index (r->bodies, i), ==,
+        va_arg (ap, const gchar *));
+  va_end (ap);
+}
+
+/* Datagrams carry whole stanzas, as the transport puts fragments back
+ * together. Half a stanza in each of two datagrams is dropped, rather than
+ * mixed with what comes next, and doesn't stop the next one from being
+ * read. */
+static void
+test_split_stanza (void)
+{
+  Receiver r;
+  const gchar *stanza =
+      "<message xmlns='jabber:client' from='alice' to='room' "
+      "type='groupchat'><body>split</body></message>";
+  /* the second half has no element of its own either */
+  gsize half = strstr (stanza, "lit</body>") - stanza;
+
+  receiver_init (&r);
+
+  receive (&r, "alice", stanza, half);
+  g_assert_cmpuint (r.parse_errors, ==, 1);
+  receive (&r, "alice", stanza + half, strlen (stanza) - half);
+  g_assert_cmpuint (r.parse_errors, ==, 2);
+  check_bodies (&r, 0);
+
+  receive_message (&r, "alice", "room", "whole");
+  check_bodies (&r, 1, "whole");
+  g_assert_cmpuint (r.parse_errors, ==, 2);
+
+  receiver_fini (&r);
+}
+
+/* A malformed datagram resets the reader, so that the next ones are read
+ * normally */
+static void
+test_malformed (void)
+{
+  static const gchar * const malformed[] = {
+      "<message xmlns='jabber:client'><body>oops</bod></message>",
+      "</message>",
+      "\x01\x02 not XML at all",
+      NULL };
+  Receiver r;
+  guint i;
+
+  receiver_init (&r);
+
+  for (i = 0; malformed[i] != NULL; i++)
+    {
+      gchar *body = g_strdup_printf ("after %u", i);
+
+      receive (&r, "mallory", malformed[i], strlen (malformed[i]));
+      g_assert_cmpuint (r.parse_errors, ==, i + 1);
+
+      receive_message (&r, "alice", "room", body);
+      g_assert_cmpuint (r.bodies->len, ==, i + 1);
+      g_assert_cmpstr (g_ptr_array_index (r.bodies, i), ==, body);
+      g_free (body);
+    }
+
+  g_assert_cmpuint (r.parse_errors, ==, i);
+
+  receiver_fini (&r);
+}
+
+static gboolean
+sender_filter (GibberMucConnection *connection,
+    const gchar *sender,
+    gpointer user_data)
+{
+  return strcmp (sender, "mallory") != 0;
+}
+
+/* Stanzas to another room, or from filtered senders, are dropped without
+ * being parsed */
+static void
+test_filter (void)
+{
+  Receiver r;
+
+  receiver_init (&r);
+
+  receive_message (&r, "alice", "other-room", "elsewhere");
+  receive_message (&r, "alice", "room", "here");
+  check_bodies (&r, 2, "elsewhere", "here");
+
+  gibber_muc_connection_set_filter (r.connection, "room", sender_filter,
+      NULL);
+
+  receive_message (&r, "alice", "other-room", "elsewhere");
+  receive_message (&r, "alice", "room-2", "elsewhere");
+  receive_message (&r, "alice", "roo", "elsewhere");
+  receive_message (&r, "alice", "room", "here again");
+  receive_message (&r, "mallory", "room", "filtered");
+  check_bodies (&r, 3, "elsewhere", "here", "here again");
+
+  /* dropping them doesn't upset the reader */
+  g_assert_cmpuint (r.parse_errors, ==, 0);
+
+  gibber_muc_connection_set_filter (r.connection, NULL, NULL, NULL);
+  receive_message (&r, "mallory", "other-room", "anything");
+  check_bodies (&r, 4, "elsewhere", "here", "here again", "anything");
+
+  receiver_fini (&r);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_type_init ();
+
+  /* Kill this process after 20 seconds */
+  alarm (20);
+
+  g_test_add_func ("/gibber/muc-connection/chat-latency", test_chat_latency);
+  g_test_add_func ("/gibber/muc-connection/priorities", test_priorities);
+  g_test_add_func ("/gibber/muc-connection/free-stream", test_free_stream);
+  g_test_add_func ("/gibber/muc-connection/split-stanza", test_split_stanza);
+  g_test_add_func ("/gibber/muc-connection/malformed", test_malformed);
+  g_test_add_func ("/gibber/muc-connection/filter", test_filter);
+
+  return g_test_run ();
+}
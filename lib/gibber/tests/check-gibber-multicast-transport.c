@@ -0,0 +1,134 @@
+/*
+ * check-gibber-multicast-transport.c - Test for GibberMulticastTransport
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include <gibber/gibber-multicast-transport.h>
+
+#define NR_DATAGRAMS ((guint32) 2000)
+
+static GMainLoop *loop;
+static guint32 next;
+
+/* Slower than the main loop on average, so that the ring never fills up, but
+ * the datagrams often come in while the main loop is busy with the last one
+ * it had */
+static gpointer
+writer_thread (gpointer data)
+{
+  int fd = GPOINTER_TO_INT (data);
+  guint32 i;
+
+  for (i = 0; i < NR_DATAGRAMS; i++)
+    {
+      g_assert (send (fd, &i, sizeof (i), 0) == sizeof (i));
+      g_usleep (100);
+    }
+
+  return NULL;
+}
+
+static void
+received_cb (GibberTransport *transport,
+    GibberBuffer *buffer,
+    gpointer user_data)
+{
+  guint32 i;
+
+  g_assert_cmpuint (buffer->length, ==, sizeof (i));
+  memcpy (&i, buffer->data, sizeof (i));
+  g_assert_cmpuint (i, ==, next);
+  next++;
+
+  g_usleep (10);
+
+  if (next == NR_DATAGRAMS)
+    g_main_loop_quit (loop);
+}
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  g_main_loop_quit (loop);
+  return FALSE;
+}
+
+/* The main loop has to be woken up for every datagram the receive thread
+ * queues, even when it raced with the main loop emptying the queue */
+static void
+test_receive_thread (void)
+{
+  GibberMulticastTransport *transport;
+  GThread *writer;
+  guint high_water, queue_drops;
+  guint timeout;
+  int fds[2];
+
+  g_assert (socketpair (AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+
+  loop = g_main_loop_new (NULL, FALSE);
+  next = 0;
+
+  transport = gibber_multicast_transport_new ();
+  gibber_multicast_transport_set_receive_thread (transport, TRUE);
+  gibber_transport_set_handler (GIBBER_TRANSPORT (transport), received_cb,
+      NULL);
+  _gibber_multicast_transport_TEST_connect_fd (transport, fds[0]);
+
+  writer = g_thread_new ("writer", writer_thread, GINT_TO_POINTER (fds[1]));
+  timeout = g_timeout_add_seconds (10, timeout_cb, NULL);
+
+  g_main_loop_run (loop);
+
+  g_thread_join (writer);
+  g_assert_cmpuint (next, ==, NR_DATAGRAMS);
+  g_source_remove (timeout);
+
+  gibber_multicast_transport_get_receive_stats (transport, &high_water,
+      &queue_drops, NULL);
+  g_assert_cmpuint (high_water, >=, 1);
+  g_assert_cmpuint (queue_drops, ==, 0);
+
+  gibber_transport_disconnect (GIBBER_TRANSPORT (transport));
+  g_object_unref (transport);
+  close (fds[1]);
+  g_main_loop_unref (loop);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_type_init ();
+
+  alarm (30);
+
+  g_test_add_func ("/gibber/multicast-transport/receive-thread",
+      test_receive_thread);
+
+  return g_test_run ();
+}
@@ -345,6 +345,168 @@ test_fragmentation (void)
 }
 
 
+/* test streaming */
+#define STREAMING_STREAM 5
+#define STREAMING_QUEUED_SIZE 10
+
+typedef struct {
+  gsize bytes;
+  guint8 next_byte;
+  gboolean ended;
+  /* the message on another stream went out in the middle of it */
+  gboolean interleaved;
+  gboolean resumed;
+} streaming_test_t;
+
+static gboolean
+streaming_send_hook (GibberTransport *transport,
+                     const guint8 *data,
+                     gsize length,
+                     GError **error,
+                     gpointer user_data)
+{
+  streaming_test_t *test = user_data;
+  GibberRMulticastPacket *packet;
+  guint8 expected_flags = 0;
+  gsize i;
+  gsize size;
+  guint8 *payload;
+
+  packet = gibber_r_multicast_packet_parse (data, length, NULL);
+  g_assert (packet != NULL);
+
+  if (packet->type != PACKET_TYPE_DATA)
+    goto out;
+
+  payload = gibber_r_multicast_packet_get_payload (packet, &size);
+
+  if (packet->data.data.stream_id == GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM)
+    {
+      /* Sent halfway through, and doesn't wait for the streamed message */
+      g_assert (!test->ended);
+      g_assert (!test->interleaved);
+      g_assert_cmpuint (test->bytes, >, 0);
+      g_assert_cmpuint (packet->data.data.flags, ==,
+          GIBBER_R_MULTICAST_DATA_PACKET_START
+          | GIBBER_R_MULTICAST_DATA_PACKET_END);
+      g_assert_cmpuint (size, ==, STREAMING_QUEUED_SIZE);
+      test->interleaved = TRUE;
+      goto out;
+    }
+
+  g_assert_cmpuint (packet->data.data.stream_id, ==, STREAMING_STREAM);
+
+  if (packet->data.data.total_size == STREAMING_QUEUED_SIZE)
+    {
+      /* Sent halfway through on the same stream, so it has to wait */
+      g_assert (test->ended);
+      g_assert (test->resumed);
+      g_assert_cmpuint (size, ==, STREAMING_QUEUED_SIZE);
+      g_main_loop_quit (loop);
+      goto out;
+    }
+
+  g_assert_cmpuint (packet->data.data.total_size, ==, TEST_DATA_SIZE);
+  g_assert (!test->ended);
+
+  if (test->bytes == 0)
+    expected_flags |= GIBBER_R_MULTICAST_DATA_PACKET_START;
+  if (test->bytes + size == TEST_DATA_SIZE)
+    expected_flags |= GIBBER_R_MULTICAST_DATA_PACKET_END;
+  /* The first packet after the other message says so */
+  if (test->interleaved && !test->resumed)
+    {
+      expected_flags |= GIBBER_R_MULTICAST_DATA_PACKET_RESUMED;
+      test->resumed = TRUE;
+    }
+  g_assert_cmpuint (packet->data.data.flags, ==, expected_flags);
+
+  /* only the first one carries the depends */
+  if (test->bytes != 0)
+    g_assert_cmpuint (packet->depends->len, ==, 0);
+
+  test->bytes += size;
+  g_assert (test->bytes <= TEST_DATA_SIZE);
+
+  for (i = 0; i < size; i++)
+    {
+      g_assert (payload[i] == test->next_byte);
+      test->next_byte++;
+    }
+
+  test->ended = (test->bytes == TEST_DATA_SIZE);
+
+out:
+  g_object_unref (packet);
+  return TRUE;
+}
+
+static void
+streaming_connected (GibberTransport *transport,
+                     gpointer user_data)
+{
+  GibberRMulticastCausalTransport *rmctransport
+      = GIBBER_R_MULTICAST_CAUSAL_TRANSPORT (transport);
+  guint8 testdata[TEST_DATA_SIZE];
+  guint8 queued[STREAMING_QUEUED_SIZE] = { 0, };
+  /* Neither a multiple of the packet size nor smaller than it, so that
+   * packets are filled from several chunks and chunks fill several packets */
+  gsize sizes[] = { 1, 7, 300, 13, 1000 };
+  gsize off = 0;
+  guint i;
+
+  for (i = 0; i < TEST_DATA_SIZE; i++)
+    {
+      testdata[i] = (guint8) (i & 0xff);
+    }
+
+  g_assert (gibber_r_multicast_causal_transport_send_start (rmctransport,
+      STREAMING_STREAM, TEST_DATA_SIZE, NULL));
+
+  for (i = 0; off < TEST_DATA_SIZE; i++)
+    {
+      gsize size = MIN (sizes[i % G_N_ELEMENTS (sizes)],
+          TEST_DATA_SIZE - off);
+
+      g_assert (gibber_r_multicast_causal_transport_send_chunk (rmctransport,
+          testdata + off, size, NULL));
+      off += size;
+
+      if (i == 2)
+        {
+          g_assert (gibber_r_multicast_causal_transport_send (rmctransport,
+              STREAMING_STREAM, queued, STREAMING_QUEUED_SIZE, NULL));
+          g_assert (gibber_transport_send (GIBBER_TRANSPORT (rmctransport),
+              queued, STREAMING_QUEUED_SIZE, NULL));
+        }
+    }
+}
+
+static void
+test_streaming (void)
+{
+  GibberRMulticastCausalTransport *rmctransport;
+  streaming_test_t test = { 0, 0, FALSE, FALSE, FALSE };
+
+  loop = g_main_loop_new (NULL, FALSE);
+
+  rmctransport = create_rmulticast_transport (NULL, "test123",
+       streaming_send_hook, &test);
+
+  g_signal_connect (rmctransport, "connected",
+      G_CALLBACK (streaming_connected), NULL);
+
+  rmulticast_connect (rmctransport);
+
+  g_main_loop_run (loop);
+  g_main_loop_unref (loop);
+
+  g_assert (test.ended);
+  g_assert (test.interleaved);
+
+  g_object_unref (rmctransport);
+}
+
 /* test unique id */
 static gboolean
 unique_id_send_hook (GibberTransport *transport,
@@ -547,6 +709,108 @@ test_id_generation_conflict_loop (void)
     test_id_generation_conflict (i);
 }
 
+/* test session messages in a large group */
+#define SESSION_SENDERS 200
+/* of virtual time, less than the keepalive interval */
+#define SESSION_RUN_TIME (120 * 1000)
+
+typedef struct {
+  /* sender id => itself, for the ones session messages reported on */
+  GHashTable *reported;
+  guint sessions;
+} session_test_t;
+
+static gboolean
+session_send_hook (GibberTransport *transport,
+                   const guint8 *data,
+                   gsize length,
+                   GError **error,
+                   gpointer user_data)
+{
+  session_test_t *test = user_data;
+  GibberRMulticastPacket *packet;
+  guint i;
+
+  packet = gibber_r_multicast_packet_parse (data, length, NULL);
+  g_assert (packet != NULL);
+
+  if (packet->type == PACKET_TYPE_SESSION)
+    {
+      /* no more than 32 of them at a time */
+      g_assert_cmpuint (packet->depends->len, >, 0);
+      g_assert_cmpuint (packet->depends->len, <=, 32);
+
+      /* our own state comes first in every one of them */
+      g_assert_cmpuint (g_array_index (packet->depends,
+          GibberRMulticastPacketSenderInfo *, 0)->sender_id, ==,
+          packet->sender);
+
+      for (i = 0; i < packet->depends->len; i++)
+        {
+          guint32 id = g_array_index (packet->depends,
+              GibberRMulticastPacketSenderInfo *, i)->sender_id;
+
+          g_hash_table_insert (test->reported, GUINT_TO_POINTER (id),
+              GUINT_TO_POINTER (id));
+        }
+
+      test->sessions++;
+    }
+
+  g_object_unref (packet);
+  return TRUE;
+}
+
+static void
+test_session_scaling (void)
+{
+  GibberTimerWheel *wheel = gibber_timer_wheel_new_virtual (42);
+  GibberRMulticastCausalTransport *rmctransport;
+  session_test_t test = { g_hash_table_new (NULL, NULL), 0 };
+  TestTransport *t;
+  guint32 i;
+
+  t = test_transport_new (session_send_hook, &test);
+  GIBBER_TRANSPORT (t)->max_packet_size = 1500;
+
+  rmctransport = gibber_r_multicast_causal_transport_new_with_timers (
+      GIBBER_TRANSPORT (t), "test123", wheel);
+  g_object_unref (t);
+
+  rmulticast_connect (rmctransport);
+
+  /* Nobody else around, so it's on its own after the join requests */
+  gibber_timer_wheel_advance (wheel, 2000);
+  g_assert_cmpuint (
+      gibber_transport_get_state (GIBBER_TRANSPORT (rmctransport)), ==,
+      GIBBER_TRANSPORT_CONNECTED);
+
+  for (i = 1; i <= SESSION_SENDERS; i++)
+    {
+      gibber_r_multicast_causal_transport_add_sender (rmctransport, i);
+      gibber_r_multicast_causal_transport_update_sender_start (rmctransport,
+          i, 0x1000);
+    }
+
+  test.sessions = 0;
+  g_hash_table_remove_all (test.reported);
+
+  gibber_timer_wheel_advance (wheel, SESSION_RUN_TIME);
+
+  /* Everyone was reported on in turn... */
+  for (i = 1; i <= SESSION_SENDERS; i++)
+    g_assert (g_hash_table_lookup (test.reported, GUINT_TO_POINTER (i))
+        != NULL);
+
+  /* ...while the interval grew past the 1.5 to 3 seconds of small groups */
+  g_assert_cmpuint (test.sessions, >, 0);
+  g_assert_cmpuint (test.sessions, <, SESSION_RUN_TIME / 3000);
+
+  g_object_unref (rmctransport);
+  g_hash_table_unref (test.reported);
+  gibber_timer_wheel_free (wheel);
+}
+
 int
 main (int argc,
       char **argv)
@@ -561,8 +825,12 @@ main (int argc,
       test_id_generation_conflict_loop);
   g_test_add_func ("/gibber/r-multicast-casual-transport/fragmentation",
       test_fragmentation);
+  g_test_add_func ("/gibber/r-multicast-casual-transport/streaming",
+      test_streaming);
   g_test_add_func ("/gibber/r-multicast-casual-transport/depends",
       test_depends);
+  g_test_add_func ("/gibber/r-multicast-casual-transport/session-scaling",
+      test_session_scaling);
 
   return g_test_run ();
 }
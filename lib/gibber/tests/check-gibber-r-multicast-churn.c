@@ -0,0 +1,563 @@
+/*
+ * check-gibber-r-multicast-churn.c - Simulated r-multicast group with churn
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <gibber/gibber-r-multicast-transport.h>
+#include <gibber/gibber-r-multicast-causal-transport.h>
+#include <gibber/gibber-timer-wheel.h>
+
+/* Members come and go on a simulated network for an hour of virtual time,
+ * all on one virtual timer wheel. The network loses LOSS_PERCENT of the
+ * packets and delays the others by up to MAX_DELAY ms, with its own random
+ * numbers from the same seed. */
+#define N_SLOTS 6
+#define SIM_DURATION (3600 * 1000)
+/* No more churn for the last part, so that the group settles */
+#define SETTLE_TIME (5 * 60 * 1000)
+#define STEP 100
+#define LOSS_PERCENT 5
+#define MAX_DELAY 50
+#define MIN_CHURN_INTERVAL (20 * 1000)
+#define MAX_CHURN_INTERVAL (90 * 1000)
+#define MIN_SEND_INTERVAL 200
+#define MAX_SEND_INTERVAL 2000
+
+/* What gathering takes at least when it isn't cut short because everybody
+ * answered, MIN_JOINING_START_TIMEOUT in gibber-r-multicast-transport.c */
+#define SLOW_GATHERING_TIME 4800
+#define MAX_JOIN_TIME (30 * 1000)
+
+typedef struct _Simulation Simulation;
+
+/* A GibberTransport that sends into the simulated network */
+typedef struct {
+  GibberTransport parent;
+  Simulation *sim;
+  guint slot;
+} SimTransport;
+
+typedef struct {
+  GibberTransportClass parent_class;
+} SimTransportClass;
+
+GType sim_transport_get_type (void);
+
+G_DEFINE_TYPE (SimTransport, sim_transport, GIBBER_TYPE_TRANSPORT)
+
+typedef struct {
+  /* NULL while the slot is empty */
+  GibberRMulticastCausalTransport *rmctransport;
+  GibberRMulticastTransport *rmtransport;
+  /* borrowed, owned by rmctransport */
+  GibberTransport *transport;
+  /* bumped every time a member takes the slot, so that packets still on the
+   * way to its previous member are dropped */
+  guint incarnation;
+  gchar *name;
+  guint32 next_seq;
+  guint send_timer;
+  /* sender name => GUINT_TO_POINTER (last seq + 1) */
+  GHashTable *last_seen;
+  /* senders heard from once the group had settled */
+  GHashTable *settled_seen;
+  /* names of the members it agreed to be in the group with */
+  GHashTable *joined;
+} Member;
+
+struct _Simulation {
+  GibberTimerWheel *wheel;
+  GRand *network;
+  guint loss_percent;
+  Member members[N_SLOTS];
+  gboolean settled;
+  guint delivered;
+  /* what every member got and when */
+  GString *trace;
+};
+
+typedef struct {
+  Simulation *sim;
+  guint slot;
+  guint incarnation;
+  guint8 *data;
+  gsize size;
+} InFlight;
+
+static gboolean
+deliver_cb (gpointer user_data)
+{
+  InFlight *p = user_data;
+  Member *m = p->sim->members + p->slot;
+
+  if (m->rmctransport != NULL && m->incarnation == p->incarnation)
+    gibber_transport_received_data (m->transport, p->data, p->size);
+
+  g_free (p->data);
+  g_slice_free (InFlight, p);
+  return FALSE;
+}
+
+static void
+network_send (Simulation *sim,
+    const guint8 *data,
+    gsize size)
+{
+  guint i;
+
+  /* Multicast is looped back to the sender too */
+  for (i = 0; i < N_SLOTS; i++)
+    {
+      Member *m = sim->members + i;
+      InFlight *p;
+
+      if (m->rmctransport == NULL)
+        continue;
+
+      if (g_rand_int_range (sim->network, 0, 100) < sim->loss_percent)
+        continue;
+
+      p = g_slice_new (InFlight);
+      p->sim = sim;
+      p->slot = i;
+      p->incarnation = m->incarnation;
+      p->data = g_memdup (data, size);
+      p->size = size;
+
+      gibber_timer_wheel_add (sim->wheel,
+          g_rand_int_range (sim->network, 1, MAX_DELAY + 1), deliver_cb, p);
+    }
+}
+
+static gboolean
+sim_transport_send (GibberTransport *transport,
+    const guint8 *data,
+    gsize size,
+    GError **error)
+{
+  network_send (((SimTransport *) transport)->sim, data, size);
+  return TRUE;
+}
+
+static void
+sim_transport_disconnect (GibberTransport *transport)
+{
+  gibber_transport_set_state (transport, GIBBER_TRANSPORT_DISCONNECTED);
+}
+
+static void
+sim_transport_init (SimTransport *self)
+{
+}
+
+static void
+sim_transport_class_init (SimTransportClass *klass)
+{
+  GibberTransportClass *transport_class = GIBBER_TRANSPORT_CLASS (klass);
+
+  transport_class->send = sim_transport_send;
+  transport_class->disconnect = sim_transport_disconnect;
+}
+
+static void
+received_cb (GibberTransport *transport,
+    GibberBuffer *buffer,
+    gpointer user_data)
+{
+  Member *m = user_data;
+  Simulation *sim = ((SimTransport *) m->transport)->sim;
+  GibberRMulticastBuffer *rmbuffer = (GibberRMulticastBuffer *) buffer;
+  gchar *text = g_strndup ((const gchar *) buffer->data, buffer->length);
+  guint seq, last;
+
+  g_assert (sscanf (text, "%u", &seq) == 1);
+  g_free (text);
+
+  /* Every sender's messages come in order and only once. Messages sent
+   * while the group was being reset are dropped, so there may be gaps. */
+  last = GPOINTER_TO_UINT (g_hash_table_lookup (m->last_seen,
+          rmbuffer->sender));
+  g_assert_cmpuint (seq + 1, >, last);
+  g_hash_table_insert (m->last_seen, g_strdup (rmbuffer->sender),
+      GUINT_TO_POINTER (seq + 1));
+
+  if (sim->settled)
+    g_hash_table_insert (m->settled_seen, g_strdup (rmbuffer->sender),
+        GUINT_TO_POINTER (TRUE));
+
+  g_string_append_printf (sim->trace, "%" G_GINT64_FORMAT " %s %s %u\n",
+      gibber_timer_wheel_get_time (sim->wheel), m->name, rmbuffer->sender,
+      seq);
+  sim->delivered++;
+}
+
+static gboolean
+send_cb (gpointer user_data)
+{
+  Member *m = user_data;
+  Simulation *sim = ((SimTransport *) m->transport)->sim;
+  gchar *text;
+
+  if (gibber_transport_get_state (GIBBER_TRANSPORT (m->rmtransport))
+      == GIBBER_TRANSPORT_CONNECTED)
+    {
+      text = g_strdup_printf ("%u", m->next_seq++);
+      g_assert (gibber_r_multicast_transport_send (m->rmtransport,
+          GIBBER_R_MULTICAST_CAUSAL_DEFAULT_STREAM, (guint8 *) text,
+          strlen (text), NULL));
+      g_free (text);
+    }
+
+  m->send_timer = gibber_timer_wheel_add (sim->wheel,
+      gibber_timer_wheel_random_int_range (sim->wheel, MIN_SEND_INTERVAL,
+          MAX_SEND_INTERVAL), send_cb, m);
+  return FALSE;
+}
+
+static void
+new_senders_cb (GibberRMulticastTransport *transport,
+    GArray *names,
+    gpointer user_data)
+{
+  Member *m = user_data;
+  guint i;
+
+  for (i = 0; i < names->len; i++)
+    g_hash_table_insert (m->joined,
+        g_strdup (g_array_index (names, gchar *, i)), GUINT_TO_POINTER (TRUE));
+}
+
+static void
+lost_senders_cb (GibberRMulticastTransport *transport,
+    GArray *names,
+    gpointer user_data)
+{
+  Member *m = user_data;
+  guint i;
+
+  for (i = 0; i < names->len; i++)
+    g_hash_table_remove (m->joined, g_array_index (names, gchar *, i));
+}
+
+static void
+rmc_connected_cb (GibberTransport *transport,
+    gpointer user_data)
+{
+  Member *m = user_data;
+
+  if (gibber_transport_get_state (GIBBER_TRANSPORT (m->rmtransport))
+      != GIBBER_TRANSPORT_CONNECTED)
+    g_assert (gibber_r_multicast_transport_connect (m->rmtransport, NULL));
+}
+
+static void
+member_start (Simulation *sim,
+    guint slot)
+{
+  Member *m = sim->members + slot;
+  SimTransport *t;
+
+  g_assert (m->rmctransport == NULL);
+
+  m->incarnation++;
+  m->name = g_strdup_printf ("member%u-%u", slot, m->incarnation);
+  m->next_seq = 0;
+  m->last_seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      NULL);
+  m->settled_seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      NULL);
+  m->joined = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  t = g_object_new (sim_transport_get_type (), NULL);
+  t->sim = sim;
+  t->slot = slot;
+  m->transport = GIBBER_TRANSPORT (t);
+  m->transport->max_packet_size = 1400;
+  gibber_transport_set_state (m->transport, GIBBER_TRANSPORT_CONNECTED);
+
+  m->rmctransport = gibber_r_multicast_causal_transport_new_with_timers (
+      m->transport, m->name, sim->wheel);
+  g_object_unref (t);
+  m->rmtransport = gibber_r_multicast_transport_new (m->rmctransport);
+
+  gibber_transport_set_handler (GIBBER_TRANSPORT (m->rmtransport),
+      received_cb, m);
+  g_signal_connect (m->rmctransport, "connected",
+      G_CALLBACK (rmc_connected_cb), m);
+  g_signal_connect (m->rmtransport, "new-senders",
+      G_CALLBACK (new_senders_cb), m);
+  g_signal_connect (m->rmtransport, "lost-senders",
+      G_CALLBACK (lost_senders_cb), m);
+
+  g_assert (gibber_r_multicast_causal_transport_connect (m->rmctransport,
+      TRUE, NULL));
+
+  m->send_timer = gibber_timer_wheel_add (sim->wheel,
+      gibber_timer_wheel_random_int_range (sim->wheel, MIN_SEND_INTERVAL,
+          MAX_SEND_INTERVAL), send_cb, m);
+}
+
+/* The member just goes away, without saying goodbye */
+static void
+member_crash (Simulation *sim,
+    guint slot)
+{
+  Member *m = sim->members + slot;
+
+  g_assert (m->rmctransport != NULL);
+
+  gibber_timer_wheel_remove (sim->wheel, m->send_timer);
+  m->send_timer = 0;
+
+  g_object_unref (m->rmtransport);
+  m->rmtransport = NULL;
+  g_object_unref (m->rmctransport);
+  m->rmctransport = NULL;
+  m->transport = NULL;
+
+  g_free (m->name);
+  m->name = NULL;
+  g_hash_table_unref (m->last_seen);
+  g_hash_table_unref (m->settled_seen);
+  g_hash_table_unref (m->joined);
+}
+
+static guint
+count_members (Simulation *sim)
+{
+  guint i, n = 0;
+
+  for (i = 0; i < N_SLOTS; i++)
+    if (sim->members[i].rmctransport != NULL)
+      n++;
+
+  return n;
+}
+
+static gboolean
+churn_cb (gpointer user_data)
+{
+  Simulation *sim = user_data;
+  guint slot = gibber_timer_wheel_random_int_range (sim->wheel, 0, N_SLOTS);
+
+  if (sim->members[slot].rmctransport == NULL)
+    member_start (sim, slot);
+  else if (count_members (sim) > 2)
+    member_crash (sim, slot);
+
+  if (gibber_timer_wheel_get_time (sim->wheel) <
+      SIM_DURATION - SETTLE_TIME - MAX_CHURN_INTERVAL)
+    gibber_timer_wheel_add (sim->wheel,
+        gibber_timer_wheel_random_int_range (sim->wheel, MIN_CHURN_INTERVAL,
+            MAX_CHURN_INTERVAL), churn_cb, sim);
+
+  return FALSE;
+}
+
+/* Returns what the members got */
+static GString *
+run_simulation (guint32 seed)
+{
+  Simulation sim;
+  GString *trace;
+  guint i, j;
+
+  memset (&sim, 0, sizeof (sim));
+  sim.wheel = gibber_timer_wheel_new_virtual (seed);
+  sim.network = g_rand_new_with_seed (seed);
+  sim.loss_percent = LOSS_PERCENT;
+  sim.trace = g_string_new ("");
+
+  /* Half of the slots start out taken, the first ones a bit apart */
+  for (i = 0; i < N_SLOTS / 2; i++)
+    {
+      member_start (&sim, i);
+      gibber_timer_wheel_advance (sim.wheel, 5000);
+    }
+
+  gibber_timer_wheel_add (sim.wheel, MIN_CHURN_INTERVAL, churn_cb, &sim);
+
+  while (gibber_timer_wheel_get_time (sim.wheel) < SIM_DURATION)
+    {
+      if (!sim.settled && gibber_timer_wheel_get_time (sim.wheel) >=
+          SIM_DURATION - SETTLE_TIME / 2)
+        sim.settled = TRUE;
+
+      gibber_timer_wheel_advance (sim.wheel, STEP);
+    }
+
+  g_assert_cmpuint (sim.delivered, >, 0);
+
+  /* Once the churn stopped, everyone hears from everyone else */
+  for (i = 0; i < N_SLOTS; i++)
+    {
+      Member *m = sim.members + i;
+
+      if (m->rmctransport == NULL)
+        continue;
+
+      for (j = 0; j < N_SLOTS; j++)
+        {
+          if (j == i || sim.members[j].rmctransport == NULL)
+            continue;
+
+          g_assert (g_hash_table_lookup (m->settled_seen,
+                sim.members[j].name) != NULL);
+        }
+    }
+
+  for (i = 0; i < N_SLOTS; i++)
+    if (sim.members[i].rmctransport != NULL)
+      member_crash (&sim, i);
+
+  /* What's still on the way is dropped */
+  gibber_timer_wheel_advance (sim.wheel, MAX_DELAY + STEP);
+
+  trace = sim.trace;
+  g_rand_free (sim.network);
+  gibber_timer_wheel_free (sim.wheel);
+
+  return trace;
+}
+
+/* The same seed gives the same run, so that failures can be reproduced */
+static void
+test_churn (void)
+{
+  GString *a = run_simulation (1);
+  GString *b = run_simulation (1);
+  GString *c = run_simulation (2);
+
+  g_assert_cmpuint (a->len, ==, b->len);
+  g_assert (memcmp (a->str, b->str, a->len) == 0);
+  g_assert (strcmp (a->str, c->str) != 0);
+
+  g_string_free (a, TRUE);
+  g_string_free (b, TRUE);
+  g_string_free (c, TRUE);
+}
+
+/* Whether every member agreed on a join with every other one */
+static gboolean
+all_joined (Simulation *sim)
+{
+  guint i, j;
+
+  for (i = 0; i < N_SLOTS; i++)
+    {
+      Member *m = sim->members + i;
+
+      if (m->rmctransport == NULL)
+        continue;
+
+      for (j = 0; j < N_SLOTS; j++)
+        {
+          if (j == i || sim->members[j].rmctransport == NULL)
+            continue;
+
+          if (g_hash_table_lookup (m->joined, sim->members[j].name) == NULL)
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Starts the members in slots first to last at the same time, and checks
+ * that they all got in without waiting for the gathering phase to time out,
+ * as everybody answered their attempt joins */
+static void
+join_together (Simulation *sim,
+    guint first,
+    guint last)
+{
+  gint64 started = gibber_timer_wheel_get_time (sim->wheel);
+  guint i;
+
+  for (i = first; i <= last; i++)
+    member_start (sim, i);
+
+  while (!all_joined (sim))
+    {
+      g_assert_cmpint (gibber_timer_wheel_get_time (sim->wheel) - started,
+          <, MAX_JOIN_TIME);
+      gibber_timer_wheel_advance (sim->wheel, STEP);
+    }
+
+  for (i = first; i <= last; i++)
+    {
+      guint gathering, joining;
+
+      gibber_r_multicast_transport_get_join_times (
+          sim->members[i].rmtransport, NULL, &gathering, &joining);
+      g_assert_cmpuint (gathering, >, 0);
+      g_assert_cmpuint (gathering, <, SLOW_GATHERING_TIME);
+      g_assert_cmpuint (joining, >, 0);
+    }
+}
+
+/* On a network that loses nothing, newcomers to a group and newcomers
+ * turning up together start joining as soon as they heard from everyone */
+static void
+test_simultaneous_join (void)
+{
+  Simulation sim;
+  guint i;
+
+  memset (&sim, 0, sizeof (sim));
+  sim.wheel = gibber_timer_wheel_new_virtual (3);
+  sim.network = g_rand_new_with_seed (3);
+  sim.trace = g_string_new ("");
+
+  /* Alone on the network, there is nobody to gather */
+  member_start (&sim, 0);
+  gibber_timer_wheel_advance (sim.wheel, 5000);
+
+  /* One newcomer to a stable group, then a few at once */
+  join_together (&sim, 1, 1);
+  join_together (&sim, 2, N_SLOTS - 1);
+
+  for (i = 0; i < N_SLOTS; i++)
+    member_crash (&sim, i);
+
+  gibber_timer_wheel_advance (sim.wheel, MAX_DELAY + STEP);
+
+  g_string_free (sim.trace, TRUE);
+  g_rand_free (sim.network);
+  gibber_timer_wheel_free (sim.wheel);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_type_init ();
+
+  g_test_add_func ("/gibber/r-multicast/churn", test_churn);
+  g_test_add_func ("/gibber/r-multicast/simultaneous-join",
+      test_simultaneous_join);
+
+  return g_test_run ();
+}
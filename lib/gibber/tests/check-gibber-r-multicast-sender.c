@@ -192,6 +192,7 @@ test_sender (gint _i)
 {
   GibberRMulticastSender *s;
   GibberRMulticastSenderGroup *group;
+  GibberTimerWheel *timers;
   test_t tests[NUMBER_OF_TESTS] = {
     { (guint32)(~0 - NR_PACKETS/2), TRUE },
     { 0xff, TRUE },
@@ -200,7 +201,8 @@ test_sender (gint _i)
   int i;
 
   g_type_init ();
-  group = gibber_r_multicast_sender_group_new ();
+  timers = gibber_timer_wheel_new ();
+  group = gibber_r_multicast_sender_group_new (timers);
   loop = g_main_loop_new (NULL, FALSE);
 
   serial_offset = tests[_i].serial_offset;
@@ -247,6 +249,788 @@ test_sender (gint _i)
   g_main_loop_run (loop);
 
   gibber_r_multicast_sender_group_free (group);
+  gibber_timer_wheel_free (timers);
+}
+
+static void
+fec_repair_request_cb (GibberRMulticastSender *sender,
+    guint id,
+    gpointer data)
+{
+  g_assert_not_reached ();
+}
+
+/* Every fifth packet is lost, but the parity packets make up for it without
+ * any repair requests */
+static void
+test_fec (void)
+{
+  GibberRMulticastSender *s;
+  GibberRMulticastSenderGroup *group;
+  GibberTimerWheel *timers;
+  guint32 i, j;
+  guint recovered, repaired;
+  int r;
+
+  timers = gibber_timer_wheel_new_virtual (42);
+  group = gibber_r_multicast_sender_group_new (timers);
+  loop = g_main_loop_new (NULL, FALSE);
+
+  serial_offset = 0xff;
+  expected = serial_offset;
+
+  for (r = 0 ; receivers[r].receiver_id != 0; r++)
+    {
+      s = gibber_r_multicast_sender_new (receivers[r].receiver_id,
+          receivers[r].name, group);
+      gibber_r_multicast_sender_update_start (s, receivers[r].packet_id);
+      gibber_r_multicast_sender_seen (s, receivers[r].packet_id + 1);
+      gibber_r_multicast_sender_group_add (group, s);
+    }
+
+  s = gibber_r_multicast_sender_new (SENDER, SENDER_NAME, group);
+  gibber_r_multicast_sender_group_add (group, s);
+  g_signal_connect (s, "received-data", G_CALLBACK (data_received_cb), loop);
+  g_signal_connect (s, "repair-request", G_CALLBACK (fec_repair_request_cb),
+      NULL);
+
+  gibber_r_multicast_sender_update_start (s, serial_offset);
+  gibber_r_multicast_sender_set_data_start (s, serial_offset);
+
+  for (i = 0; i < NR_PACKETS; i += 5)
+    {
+      GibberRMulticastPacket *parity, *parsed;
+      guint8 *data;
+      gsize len;
+
+      parity = gibber_r_multicast_packet_new (PACKET_TYPE_PARITY, SENDER,
+          1500);
+      gibber_r_multicast_packet_set_parity_info (parity, serial_offset + i,
+          5, 1, 0);
+
+      for (j = i; j < i + 5; j++)
+        {
+          GibberRMulticastPacket *p = generate_packet (j + serial_offset);
+
+          data = gibber_r_multicast_packet_get_raw_data (p, &len);
+          gibber_r_multicast_packet_parity_add (parity, data, len);
+
+          if (j % 5 != 3)
+            gibber_r_multicast_sender_push (s, p);
+
+          g_object_unref (p);
+        }
+
+      data = gibber_r_multicast_packet_get_raw_data (parity, &len);
+      parsed = gibber_r_multicast_packet_parse (data, len, NULL);
+      g_assert (parsed != NULL);
+      g_object_unref (parity);
+
+      g_assert (gibber_r_multicast_sender_group_push_packet (group, parsed));
+      g_object_unref (parsed);
+    }
+
+  /* Long enough for any repair request to go out */
+  gibber_timer_wheel_advance (timers, 5000);
+
+  g_assert_cmpuint (expected, ==, serial_offset + NR_PACKETS);
+  gibber_r_multicast_sender_group_get_fec_counters (group, &recovered,
+      &repaired);
+  g_assert_cmpuint (recovered, ==, NR_PACKETS / 5);
+  g_assert_cmpuint (repaired, ==, 0);
+
+  gibber_r_multicast_sender_group_free (group);
+  gibber_timer_wheel_free (timers);
+  g_main_loop_unref (loop);
+}
+
+typedef struct {
+  GibberTimerWheel *timers;
+  gint64 failed;
+} failure_t;
+
+static void
+failed_cb (GibberRMulticastSender *sender,
+    gpointer user_data)
+{
+  failure_t *f = user_data;
+
+  g_assert_cmpint (f->failed, ==, 0);
+  f->failed = gibber_timer_wheel_get_time (f->timers);
+}
+
+/* Heartbeats every 2 seconds or so, until they stop */
+static void
+test_failure_detection (void)
+{
+  GibberRMulticastSender *s;
+  GibberRMulticastSenderGroup *group;
+  GibberTimerWheel *timers;
+  failure_t f = { NULL, 0 };
+  gdouble suspicion, last = 0;
+  gint64 last_heard;
+  int i;
+
+  timers = gibber_timer_wheel_new_virtual (42);
+  group = gibber_r_multicast_sender_group_new (timers);
+  f.timers = timers;
+
+  s = gibber_r_multicast_sender_new (SENDER, SENDER_NAME, group);
+  gibber_r_multicast_sender_group_add (group, s);
+  gibber_r_multicast_sender_update_start (s, 0xff);
+  g_signal_connect (s, "failed", G_CALLBACK (failed_cb), &f);
+
+  g_assert (gibber_r_multicast_sender_get_suspicion (s) == 0);
+
+  for (i = 0; i < 40; i++)
+    {
+      gibber_timer_wheel_advance (timers,
+          gibber_timer_wheel_random_int_range (timers, 1800, 2200));
+      gibber_r_multicast_sender_heard (s);
+
+      g_assert (gibber_r_multicast_sender_get_suspicion (s) < 1);
+    }
+
+  last_heard = gibber_timer_wheel_get_time (timers);
+
+  /* A little late isn't suspicious yet */
+  gibber_timer_wheel_advance (timers, 2500);
+  g_assert (gibber_r_multicast_sender_get_suspicion (s)
+      < GIBBER_R_MULTICAST_SENDER_PHI_SUSPECTED);
+
+  while (f.failed == 0)
+    {
+      suspicion = gibber_r_multicast_sender_get_suspicion (s);
+      g_assert (suspicion >= last);
+      last = suspicion;
+
+      gibber_timer_wheel_advance (timers, 100);
+    }
+
+  g_assert (last >= GIBBER_R_MULTICAST_SENDER_PHI_SUSPECTED);
+  g_assert (gibber_r_multicast_sender_get_suspicion (s)
+      >= GIBBER_R_MULTICAST_SENDER_PHI_FAILED - 0.5);
+
+  /* Much sooner than the progress timeout */
+  g_assert_cmpint (f.failed - last_heard, <, 10000);
+
+  gibber_r_multicast_sender_group_free (group);
+  gibber_timer_wheel_free (timers);
+}
+
+/* Heartbeats every 2 seconds or so, one or two of which are lost now and
+ * then, don't get it failed */
+static void
+test_missed_heartbeats (void)
+{
+  GibberRMulticastSender *s;
+  GibberRMulticastSenderGroup *group;
+  GibberTimerWheel *timers;
+  failure_t f = { NULL, 0 };
+  int i;
+
+  timers = gibber_timer_wheel_new_virtual (42);
+  group = gibber_r_multicast_sender_group_new (timers);
+  f.timers = timers;
+
+  s = gibber_r_multicast_sender_new (SENDER, SENDER_NAME, group);
+  gibber_r_multicast_sender_group_add (group, s);
+  gibber_r_multicast_sender_update_start (s, 0xff);
+  g_signal_connect (s, "failed", G_CALLBACK (failed_cb), &f);
+
+  for (i = 0; i < 40; i++)
+    {
+      gibber_timer_wheel_advance (timers,
+          gibber_timer_wheel_random_int_range (timers, 1800, 2200));
+      gibber_r_multicast_sender_heard (s);
+    }
+
+  /* One lost */
+  gibber_timer_wheel_advance (timers, 3900);
+  g_assert (gibber_r_multicast_sender_get_suspicion (s)
+      < GIBBER_R_MULTICAST_SENDER_PHI_SUSPECTED);
+  gibber_timer_wheel_advance (timers, 100);
+  gibber_r_multicast_sender_heard (s);
+
+  for (i = 0; i < 5; i++)
+    {
+      gibber_timer_wheel_advance (timers, 2000);
+      gibber_r_multicast_sender_heard (s);
+    }
+
+  /* Two in a row */
+  gibber_timer_wheel_advance (timers, 5900);
+  g_assert (gibber_r_multicast_sender_get_suspicion (s)
+      < GIBBER_R_MULTICAST_SENDER_PHI_FAILED);
+  gibber_timer_wheel_advance (timers, 100);
+  gibber_r_multicast_sender_heard (s);
+
+  gibber_timer_wheel_advance (timers, 2000);
+  gibber_r_multicast_sender_heard (s);
+  g_assert_cmpint (f.failed, ==, 0);
+
+  gibber_r_multicast_sender_group_free (group);
+  gibber_timer_wheel_free (timers);
+}
+
+static void
+escalated_cb (GibberRMulticastSender *sender,
+    gpointer user_data)
+{
+  guint *failures = user_data;
+
+  (*failures)++;
+}
+
+/* Each receiver sends its packet number seq, acking the sender's packets
+ * before packet_id */
+static void
+ack_packets (GibberRMulticastSenderGroup *group, guint32 packet_id,
+    guint32 seq)
+{
+  int r;
+
+  for (r = 0 ; receivers[r].receiver_id != 0; r++)
+    {
+      GibberRMulticastSender *s;
+      GibberRMulticastPacket *p;
+
+      s = gibber_r_multicast_sender_group_lookup (group,
+          receivers[r].receiver_id);
+
+      p = gibber_r_multicast_packet_new (PACKET_TYPE_NO_DATA,
+          receivers[r].receiver_id, 1500);
+      gibber_r_multicast_packet_set_packet_id (p,
+          receivers[r].packet_id + seq);
+      gibber_r_multicast_packet_add_sender_info (p, SENDER, packet_id, NULL);
+
+      gibber_r_multicast_sender_push (s, p);
+      g_object_unref (p);
+    }
+}
+
+/* The receivers only ack the first half of the packets, so only those may be
+ * evicted to keep the budget. The others are kept until the receivers are
+ * failed for holding them back */
+static void
+test_budget (void)
+{
+  GibberRMulticastSender *s;
+  GibberRMulticastSenderGroup *group;
+  GibberTimerWheel *timers;
+  GibberRMulticastPacket *p;
+  guint failures = 0, evictions, oldest_unstable;
+  gsize size, bytes;
+  guint32 i;
+  int r;
+
+  timers = gibber_timer_wheel_new_virtual (42);
+  group = gibber_r_multicast_sender_group_new (timers);
+  loop = g_main_loop_new (NULL, FALSE);
+
+  serial_offset = 0xff;
+  expected = serial_offset;
+
+  /* they're all the same size */
+  p = generate_packet (serial_offset);
+  gibber_r_multicast_packet_get_raw_data (p, &size);
+  g_object_unref (p);
+
+  gibber_r_multicast_sender_group_set_budget (group, 10 * size);
+
+  for (r = 0 ; receivers[r].receiver_id != 0; r++)
+    {
+      s = gibber_r_multicast_sender_new (receivers[r].receiver_id,
+          receivers[r].name, group);
+      gibber_r_multicast_sender_update_start (s, receivers[r].packet_id);
+      gibber_r_multicast_sender_seen (s, receivers[r].packet_id + 1);
+      gibber_r_multicast_sender_group_add (group, s);
+      g_signal_connect (s, "failed", G_CALLBACK (escalated_cb), &failures);
+    }
+
+  s = gibber_r_multicast_sender_new (SENDER, SENDER_NAME, group);
+  gibber_r_multicast_sender_group_add (group, s);
+  g_signal_connect (s, "received-data", G_CALLBACK (data_received_cb), loop);
+
+  gibber_r_multicast_sender_update_start (s, serial_offset);
+  gibber_r_multicast_sender_set_data_start (s, serial_offset);
+
+  for (i = 0; i < NR_PACKETS; i++)
+    {
+      p = generate_packet (i + serial_offset);
+      gibber_r_multicast_sender_push (s, p);
+      g_object_unref (p);
+    }
+
+  /* Delivered, but nobody acked them */
+  g_assert_cmpuint (expected, ==, serial_offset + NR_PACKETS);
+  gibber_r_multicast_sender_group_get_cache_stats (group, &bytes,
+      &evictions, NULL);
+  g_assert_cmpuint (evictions, ==, 0);
+  g_assert_cmpuint (bytes, ==, NR_PACKETS * size);
+
+  ack_packets (group, serial_offset + NR_PACKETS / 2, 0);
+
+  gibber_r_multicast_sender_group_get_cache_stats (group, &bytes,
+      &evictions, NULL);
+  g_assert_cmpuint (evictions, ==, NR_PACKETS / 2);
+  g_assert_cmpuint (bytes, >, 10 * size);
+  g_assert_cmpuint (failures, ==, 0);
+
+  gibber_timer_wheel_advance (timers, 31000);
+  gibber_r_multicast_sender_group_get_cache_stats (group, NULL, NULL,
+      &oldest_unstable);
+  g_assert_cmpuint (oldest_unstable, >=, 31000);
+
+  /* A whole message, so that its packets are delivered and can go too */
+  for (i = NR_PACKETS; i < NR_PACKETS + 2; i++)
+    {
+      p = generate_packet (i + serial_offset);
+      gibber_r_multicast_sender_push (s, p);
+      g_object_unref (p);
+    }
+
+  /* both receivers, once, but their packets stay until that's agreed on */
+  g_assert_cmpuint (failures, ==, 2);
+  gibber_r_multicast_sender_group_get_cache_stats (group, &bytes,
+      &evictions, NULL);
+  g_assert_cmpuint (evictions, ==, NR_PACKETS / 2);
+  g_assert_cmpuint (bytes, >, 10 * size);
+
+  for (r = 0 ; receivers[r].receiver_id != 0; r++)
+    gibber_r_multicast_sender_set_failed (
+        gibber_r_multicast_sender_group_lookup (group,
+            receivers[r].receiver_id));
+
+  gibber_r_multicast_sender_group_get_cache_stats (group, &bytes,
+      &evictions, NULL);
+  g_assert_cmpuint (evictions, >, NR_PACKETS / 2);
+  g_assert_cmpuint (bytes, <=, 10 * size);
+  g_assert_cmpuint (failures, ==, 2);
+
+  gibber_r_multicast_sender_group_free (group);
+  gibber_timer_wheel_free (timers);
+  g_main_loop_unref (loop);
+}
+
+static void
+push_packets (GibberRMulticastSender *s,
+    guint32 from,
+    guint32 to)
+{
+  guint32 i;
+
+  for (i = from; i < to; i++)
+    {
+      GibberRMulticastPacket *p = generate_packet (i + serial_offset);
+
+      gibber_r_multicast_sender_push (s, p);
+      g_object_unref (p);
+    }
+}
+
+/* A member that joined and didn't ack anything yet isn't failed for holding
+ * back packets, and the ones that were can be failed again for later
+ * packets once they acked the earlier ones */
+static void
+test_budget_laggards (void)
+{
+  GibberRMulticastSender *s, *newcomer;
+  GibberRMulticastSenderGroup *group;
+  GibberTimerWheel *timers;
+  GibberRMulticastPacket *p;
+  guint failures = 0, newcomer_failures = 0;
+  gsize size;
+  int r;
+
+  timers = gibber_timer_wheel_new_virtual (42);
+  group = gibber_r_multicast_sender_group_new (timers);
+  loop = g_main_loop_new (NULL, FALSE);
+
+  serial_offset = 0xff;
+  expected = serial_offset;
+
+  p = generate_packet (serial_offset);
+  gibber_r_multicast_packet_get_raw_data (p, &size);
+  g_object_unref (p);
+
+  gibber_r_multicast_sender_group_set_budget (group, 10 * size);
+
+  for (r = 0 ; receivers[r].receiver_id != 0; r++)
+    {
+      s = gibber_r_multicast_sender_new (receivers[r].receiver_id,
+          receivers[r].name, group);
+      gibber_r_multicast_sender_update_start (s, receivers[r].packet_id);
+      gibber_r_multicast_sender_seen (s, receivers[r].packet_id + 1);
+      gibber_r_multicast_sender_group_add (group, s);
+      g_signal_connect (s, "failed", G_CALLBACK (escalated_cb), &failures);
+    }
+
+  newcomer = gibber_r_multicast_sender_new (0x700, "sender3", group);
+  gibber_r_multicast_sender_update_start (newcomer, 700);
+  gibber_r_multicast_sender_group_add (group, newcomer);
+  g_signal_connect (newcomer, "failed", G_CALLBACK (escalated_cb),
+      &newcomer_failures);
+
+  s = gibber_r_multicast_sender_new (SENDER, SENDER_NAME, group);
+  gibber_r_multicast_sender_group_add (group, s);
+  g_signal_connect (s, "received-data", G_CALLBACK (data_received_cb), loop);
+
+  gibber_r_multicast_sender_update_start (s, serial_offset);
+  gibber_r_multicast_sender_set_data_start (s, serial_offset);
+
+  /* The receivers tell what they have, the newcomer doesn't */
+  ack_packets (group, serial_offset, 0);
+  push_packets (s, 0, NR_PACKETS);
+  gibber_timer_wheel_advance (timers, 31000);
+  /* A whole message, for the budget to be checked again */
+  push_packets (s, NR_PACKETS, NR_PACKETS + 2);
+
+  g_assert_cmpuint (failures, ==, 2);
+  g_assert_cmpuint (newcomer_failures, ==, 0);
+
+  /* It went away, and the receivers ack the oldest packet, which can then
+   * go, but not the next one, which they hold back for too long again */
+  gibber_r_multicast_sender_set_failed (newcomer);
+  ack_packets (group, serial_offset + 1, 1);
+  gibber_timer_wheel_advance (timers, 1000);
+  push_packets (s, NR_PACKETS + 2, NR_PACKETS + 5);
+
+  g_assert_cmpuint (failures, ==, 4);
+  g_assert_cmpuint (newcomer_failures, ==, 0);
+
+  gibber_r_multicast_sender_group_free (group);
+  gibber_timer_wheel_free (timers);
+  g_main_loop_unref (loop);
+}
+
+/* Whatever the budget, the members the stable point waits for can be failed,
+ * including ones that didn't ack anything yet, but not the ones ahead */
+static void
+test_stream_laggards (void)
+{
+  GibberRMulticastSender *s, *newcomer;
+  GibberRMulticastSenderGroup *group;
+  GibberTimerWheel *timers;
+  guint failures = 0, newcomer_failures = 0;
+  int r;
+
+  timers = gibber_timer_wheel_new_virtual (42);
+  group = gibber_r_multicast_sender_group_new (timers);
+  loop = g_main_loop_new (NULL, FALSE);
+
+  serial_offset = 0xff;
+  expected = serial_offset;
+
+  for (r = 0 ; receivers[r].receiver_id != 0; r++)
+    {
+      s = gibber_r_multicast_sender_new (receivers[r].receiver_id,
+          receivers[r].name, group);
+      gibber_r_multicast_sender_update_start (s, receivers[r].packet_id);
+      gibber_r_multicast_sender_seen (s, receivers[r].packet_id + 1);
+      gibber_r_multicast_sender_group_add (group, s);
+      g_signal_connect (s, "failed", G_CALLBACK (escalated_cb), &failures);
+    }
+
+  newcomer = gibber_r_multicast_sender_new (0x700, "sender3", group);
+  gibber_r_multicast_sender_update_start (newcomer, 700);
+  gibber_r_multicast_sender_group_add (group, newcomer);
+  g_signal_connect (newcomer, "failed", G_CALLBACK (escalated_cb),
+      &newcomer_failures);
+
+  s = gibber_r_multicast_sender_new (SENDER, SENDER_NAME, group);
+  gibber_r_multicast_sender_group_add (group, s);
+  g_signal_connect (s, "received-data", G_CALLBACK (data_received_cb), loop);
+
+  gibber_r_multicast_sender_update_start (s, serial_offset);
+  gibber_r_multicast_sender_set_data_start (s, serial_offset);
+
+  /* The receivers acked everything, the newcomer nothing */
+  push_packets (s, 0, NR_PACKETS);
+  ack_packets (group, serial_offset + NR_PACKETS, 0);
+  g_assert_cmpuint (gibber_r_multicast_sender_unstable_packets (s), ==,
+      NR_PACKETS);
+
+  g_assert_cmpuint (gibber_r_multicast_sender_fail_laggards (s), ==, 1);
+  g_assert_cmpuint (failures, ==, 0);
+  g_assert_cmpuint (newcomer_failures, ==, 1);
+
+  /* Not again while its failure is being agreed on */
+  g_assert_cmpuint (gibber_r_multicast_sender_fail_laggards (s), ==, 0);
+
+  gibber_r_multicast_sender_set_failed (newcomer);
+  g_assert_cmpuint (gibber_r_multicast_sender_unstable_packets (s), ==, 0);
+
+  /* Now the receivers are the ones holding the next packets back */
+  push_packets (s, NR_PACKETS, NR_PACKETS + 2);
+  g_assert_cmpuint (gibber_r_multicast_sender_unstable_packets (s), ==, 2);
+  g_assert_cmpuint (gibber_r_multicast_sender_fail_laggards (s), ==, 2);
+  g_assert_cmpuint (failures, ==, 2);
+  g_assert_cmpuint (newcomer_failures, ==, 1);
+
+  gibber_r_multicast_sender_group_free (group);
+  gibber_timer_wheel_free (timers);
+  g_main_loop_unref (loop);
+}
+
+/* test chunked delivery */
+#define CHUNKED_STREAM 7
+#define OTHER_STREAM 8
+/* data packets in the chunked message, with a control packet in between */
+#define NR_CHUNKS 6
+
+typedef struct {
+  guint32 next_serial;
+  guint chunks;
+  guint whole;
+} chunked_test_t;
+
+static GibberRMulticastPacket *
+generate_chunk_packet (guint32 serial,
+    guint16 stream_id,
+    guint8 flags,
+    guint32 total_size)
+{
+  GibberRMulticastPacket *p;
+  gchar *payload;
+
+  p = gibber_r_multicast_packet_new (PACKET_TYPE_DATA, SENDER, 1500);
+  gibber_r_multicast_packet_set_packet_id (p, serial);
+  gibber_r_multicast_packet_set_data_info (p, stream_id, flags, total_size);
+
+  payload = g_strdup_printf ("%010d\n", serial);
+  gibber_r_multicast_packet_add_payload (p, (guint8 *) payload,
+      strlen (payload));
+  g_free (payload);
+
+  return p;
+}
+
+static void
+push_chunk_packet (GibberRMulticastSender *s,
+    guint32 serial,
+    guint16 stream_id,
+    guint8 flags,
+    guint32 total_size)
+{
+  GibberRMulticastPacket *p;
+
+  p = generate_chunk_packet (serial, stream_id, flags, total_size);
+  gibber_r_multicast_sender_push (s, p);
+  g_object_unref (p);
+}
+
+static void
+chunk_received_cb (GibberRMulticastSender *sender,
+    guint16 stream_id,
+    guint flags,
+    guint total_size,
+    guint8 *data,
+    gsize size,
+    gpointer user_data)
+{
+  chunked_test_t *test = user_data;
+  guint expected_flags = 0;
+  gchar *str;
+
+  g_assert_cmpuint (stream_id, ==, CHUNKED_STREAM);
+  g_assert_cmpuint (total_size, ==, NR_CHUNKS * 11);
+  g_assert_cmpuint (size, ==, 11);
+
+  if (test->chunks == 0)
+    expected_flags |= GIBBER_R_MULTICAST_DATA_PACKET_START;
+  if (test->chunks == NR_CHUNKS - 1)
+    expected_flags |= GIBBER_R_MULTICAST_DATA_PACKET_END;
+  g_assert_cmpuint (flags, ==, expected_flags);
+
+  str = g_strndup ((const gchar *) data, size);
+  g_assert_cmpuint (atoi (str), ==, test->next_serial);
+  g_free (str);
+
+  test->chunks++;
+  test->next_serial++;
+}
+
+static void
+whole_received_cb (GibberRMulticastSender *sender,
+    guint16 stream_id,
+    guint8 *data,
+    gsize size,
+    gpointer user_data)
+{
+  chunked_test_t *test = user_data;
+
+  g_assert_cmpuint (size, ==, 11);
+  test->whole++;
+}
+
+static void
+test_chunked (void)
+{
+  GibberTimerWheel *timers = gibber_timer_wheel_new_virtual (42);
+  GibberRMulticastSenderGroup *group;
+  GHashTable *chunked_streams = g_hash_table_new (NULL, NULL);
+  GibberRMulticastSender *s;
+  GibberRMulticastPacket *p;
+  chunked_test_t test = { 0, 0, 0 };
+  guint32 start = 0x100;
+  guint32 total = NR_CHUNKS * 11;
+
+  g_hash_table_insert (chunked_streams, GUINT_TO_POINTER (CHUNKED_STREAM),
+      GUINT_TO_POINTER (CHUNKED_STREAM));
+
+  group = gibber_r_multicast_sender_group_new (timers);
+  group->chunked_streams = chunked_streams;
+
+  s = gibber_r_multicast_sender_new (SENDER, SENDER_NAME, group);
+  gibber_r_multicast_sender_group_add (group, s);
+  g_signal_connect (s, "received-data-chunk",
+      G_CALLBACK (chunk_received_cb), &test);
+  g_signal_connect (s, "received-data", G_CALLBACK (whole_received_cb),
+      &test);
+
+  gibber_r_multicast_sender_update_start (s, start);
+  gibber_r_multicast_sender_set_data_start (s, start);
+
+  test.next_serial = start;
+
+  push_chunk_packet (s, start, CHUNKED_STREAM,
+      GIBBER_R_MULTICAST_DATA_PACKET_START, total);
+  g_assert_cmpuint (test.chunks, ==, 1);
+
+  push_chunk_packet (s, start + 1, CHUNKED_STREAM, 0, total);
+  g_assert_cmpuint (test.chunks, ==, 2);
+
+  /* Nothing past a missing packet */
+  push_chunk_packet (s, start + 3, CHUNKED_STREAM, 0, total);
+  g_assert_cmpuint (test.chunks, ==, 2);
+
+  /* The control packet in between isn't a chunk */
+  test.next_serial = start + 3;
+
+  p = gibber_r_multicast_packet_new (PACKET_TYPE_NO_DATA, SENDER, 1500);
+  gibber_r_multicast_packet_set_packet_id (p, start + 2);
+  gibber_r_multicast_sender_push (s, p);
+  g_object_unref (p);
+  g_assert_cmpuint (test.chunks, ==, 3);
+
+  /* Nothing past the holding point */
+  gibber_r_multicast_sender_hold_data (s, start + 5);
+  push_chunk_packet (s, start + 4, CHUNKED_STREAM, 0, total);
+  push_chunk_packet (s, start + 5, CHUNKED_STREAM, 0, total);
+  g_assert_cmpuint (test.chunks, ==, 4);
+
+  gibber_r_multicast_sender_release_data (s);
+  g_assert_cmpuint (test.chunks, ==, 5);
+
+  push_chunk_packet (s, start + 6, CHUNKED_STREAM,
+      GIBBER_R_MULTICAST_DATA_PACKET_END, total);
+  g_assert_cmpuint (test.chunks, ==, NR_CHUNKS);
+  g_assert_cmpuint (test.whole, ==, 0);
+
+  /* Messages on other streams and ones that fit in a single packet are
+   * delivered whole */
+  push_chunk_packet (s, start + 7, OTHER_STREAM,
+      GIBBER_R_MULTICAST_DATA_PACKET_START
+      | GIBBER_R_MULTICAST_DATA_PACKET_END, 11);
+  push_chunk_packet (s, start + 8, CHUNKED_STREAM,
+      GIBBER_R_MULTICAST_DATA_PACKET_START
+      | GIBBER_R_MULTICAST_DATA_PACKET_END, 11);
+  g_assert_cmpuint (test.whole, ==, 2);
+  g_assert_cmpuint (test.chunks, ==, NR_CHUNKS);
+
+  gibber_r_multicast_sender_group_free (group);
+  g_hash_table_unref (chunked_streams);
+  gibber_timer_wheel_free (timers);
+}
+
+#define OTHER_CHUNKED_STREAM 9
+
+static void
+interleaved_chunk_cb (GibberRMulticastSender *sender,
+    guint16 stream_id,
+    guint flags,
+    guint total_size,
+    guint8 *data,
+    gsize size,
+    gpointer user_data)
+{
+  chunked_test_t *test = user_data;
+
+  g_assert_cmpuint (stream_id, ==, CHUNKED_STREAM);
+  g_assert_cmpuint (total_size, ==, 3 * 11);
+  test->chunks++;
+}
+
+static void
+interleaved_whole_cb (GibberRMulticastSender *sender,
+    guint16 stream_id,
+    guint8 *data,
+    gsize size,
+    gpointer user_data)
+{
+  chunked_test_t *test = user_data;
+
+  g_assert_cmpuint (stream_id, ==, OTHER_CHUNKED_STREAM);
+  g_assert_cmpuint (size, ==, 2 * 11);
+  test->whole++;
+}
+
+/* A message sent while another is being streamed comes in between its
+ * packets, and is delivered whole as soon as it's complete, even on a
+ * chunked stream */
+static void
+test_interleaved (void)
+{
+  GibberTimerWheel *timers = gibber_timer_wheel_new_virtual (42);
+  GibberRMulticastSenderGroup *group;
+  GHashTable *chunked_streams = g_hash_table_new (NULL, NULL);
+  GibberRMulticastSender *s;
+  chunked_test_t test = { 0, 0, 0 };
+  guint32 start = 0x100;
+
+  g_hash_table_insert (chunked_streams, GUINT_TO_POINTER (CHUNKED_STREAM),
+      GUINT_TO_POINTER (CHUNKED_STREAM));
+  g_hash_table_insert (chunked_streams,
+      GUINT_TO_POINTER (OTHER_CHUNKED_STREAM),
+      GUINT_TO_POINTER (OTHER_CHUNKED_STREAM));
+
+  group = gibber_r_multicast_sender_group_new (timers);
+  group->chunked_streams = chunked_streams;
+
+  s = gibber_r_multicast_sender_new (SENDER, SENDER_NAME, group);
+  gibber_r_multicast_sender_group_add (group, s);
+  g_signal_connect (s, "received-data-chunk",
+      G_CALLBACK (interleaved_chunk_cb), &test);
+  g_signal_connect (s, "received-data", G_CALLBACK (interleaved_whole_cb),
+      &test);
+
+  gibber_r_multicast_sender_update_start (s, start);
+  gibber_r_multicast_sender_set_data_start (s, start);
+
+  push_chunk_packet (s, start, CHUNKED_STREAM,
+      GIBBER_R_MULTICAST_DATA_PACKET_START, 3 * 11);
+  g_assert_cmpuint (test.chunks, ==, 1);
+
+  push_chunk_packet (s, start + 1, OTHER_CHUNKED_STREAM,
+      GIBBER_R_MULTICAST_DATA_PACKET_START, 2 * 11);
+  push_chunk_packet (s, start + 2, OTHER_CHUNKED_STREAM,
+      GIBBER_R_MULTICAST_DATA_PACKET_END, 2 * 11);
+  g_assert_cmpuint (test.whole, ==, 1);
+  g_assert_cmpuint (test.chunks, ==, 1);
+
+  push_chunk_packet (s, start + 3, CHUNKED_STREAM,
+      GIBBER_R_MULTICAST_DATA_PACKET_RESUMED, 3 * 11);
+  g_assert_cmpuint (test.chunks, ==, 2);
+
+  push_chunk_packet (s, start + 4, CHUNKED_STREAM,
+      GIBBER_R_MULTICAST_DATA_PACKET_END, 3 * 11);
+  g_assert_cmpuint (test.chunks, ==, 3);
+  g_assert_cmpuint (test.whole, ==, 1);
+
+  gibber_r_multicast_sender_group_free (group);
+  g_hash_table_unref (chunked_streams);
+  gibber_timer_wheel_free (timers);
 }
 
 static void
@@ -565,7 +1349,41 @@ h_expect_t h_expectation5[] = {
    { DONE }
 };
 
-#define NUMBER_OF_H_TESTS 6
+/* Data that isn't causally ordered shouldn't hold up data depending on it.
+ * Packet 0x2 of node0 never arrives, but it must be the middle of the
+ * stream 1 message so node1 doesn't need to wait for it */
+h_setup_t h_setup6[] =  {
+    { "node0", 0x1, PACKET_TYPE_DATA,         "001",  NULL,    0x0, 1, 5, 9 },
+    { "node0", 0x3, PACKET_TYPE_DATA,         "001",  NULL,    0x0, 1, 6, 9 },
+    { "node1", 0x1, PACKET_TYPE_DATA,         "001",  "node0", 0x3, 0, 3, 3 },
+    { NULL },
+};
+
+h_expect_t h_expectation6[] = {
+   { START_DATA, "node0", PACKET_TYPE_INVALID, 0x1 },
+   { START_DATA, "node1", PACKET_TYPE_INVALID, 0x1 },
+   { UNHOLD, "node0" },
+   { UNHOLD, "node1" },
+   { EXPECT, "node1", PACKET_TYPE_DATA, 0, 0 },
+   { DONE }
+};
+
+/* Complete unordered messages are delivered even though an earlier packet of
+ * the same node is still missing */
+h_setup_t h_setup7[] =  {
+    { "node0", 0x1, PACKET_TYPE_DATA,         "001",  NULL,    0x0, 1, 5, 6 },
+    { "node0", 0x3, PACKET_TYPE_DATA,         "001",  NULL,    0x0, 2, 11, 3 },
+    { NULL },
+};
+
+h_expect_t h_expectation7[] = {
+   { START_DATA, "node0", PACKET_TYPE_INVALID, 0x1 },
+   { UNHOLD, "node0" },
+   { EXPECT, "node0", PACKET_TYPE_DATA, 0, 2 },
+   { DONE }
+};
+
+#define NUMBER_OF_H_TESTS 8
 h_test_t h_tests[NUMBER_OF_H_TESTS] = {
     { h_setup0, h_expectation0 },
     { h_setup1, h_expectation1 },
@@ -573,6 +1391,8 @@ h_test_t h_tests[NUMBER_OF_H_TESTS] = {
     { h_setup3, h_expectation3 },
     { h_setup4, h_expectation4 },
     { h_setup5, h_expectation5 },
+    { h_setup6, h_expectation6 },
+    { h_setup7, h_expectation7 },
   };
 
 
@@ -597,6 +1417,7 @@ static void
 test_holding (gint _i)
 {
   GibberRMulticastSenderGroup *group;
+  GibberTimerWheel *timers;
   guint32 sender_offset = 0xf00;
      /* control packets aren't hold back, thus we get them interleaved at first
       */
@@ -607,7 +1428,8 @@ test_holding (gint _i)
   g_type_init ();
   loop = g_main_loop_new (NULL, FALSE);
 
-  group = gibber_r_multicast_sender_group_new ();
+  timers = gibber_timer_wheel_new ();
+  group = gibber_r_multicast_sender_group_new (timers);
   data.group = group;
 
   for (i = 0; test->setup[i].name != NULL; i++)
@@ -668,6 +1490,10 @@ test_holding (gint _i)
     while (data.expectation[data.test_step].type != DONE);
 
   g_assert (idle_timer == 0);
+
+  gibber_r_multicast_sender_group_free (group);
+  gibber_timer_wheel_free (timers);
+  g_main_loop_unref (loop);
 }
 
 static void
@@ -690,6 +1516,19 @@ main (int argc,
 
   g_test_add_func ("/gibber/r-multicast-sender/sender", test_sender_loop);
   g_test_add_func ("/gibber/r-multicast-sender/holding", test_holding_loop);
+  g_test_add_func ("/gibber/r-multicast-sender/fec", test_fec);
+  g_test_add_func ("/gibber/r-multicast-sender/failure-detection",
+      test_failure_detection);
+  g_test_add_func ("/gibber/r-multicast-sender/missed-heartbeats",
+      test_missed_heartbeats);
+  g_test_add_func ("/gibber/r-multicast-sender/budget", test_budget);
+  g_test_add_func ("/gibber/r-multicast-sender/budget-laggards",
+      test_budget_laggards);
+  g_test_add_func ("/gibber/r-multicast-sender/stream-laggards",
+      test_stream_laggards);
+  g_test_add_func ("/gibber/r-multicast-sender/chunked", test_chunked);
+  g_test_add_func ("/gibber/r-multicast-sender/interleaved",
+      test_interleaved);
 
   return g_test_run ();
 }
@@ -0,0 +1,226 @@
+/*
+ * check-gibber-timer-wheel.c - Test for GibberTimerWheel
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <gibber/gibber-r-multicast-sender.h>
+#include <gibber/gibber-timer-wheel.h>
+
+#define N_TIMERS 2000
+
+typedef struct {
+  GibberTimerWheel *wheel;
+  gint64 due;
+  guint interval;
+  gint repeat;
+  guint fired;
+} Timer;
+
+static gboolean
+timer_cb (gpointer user_data)
+{
+  Timer *t = user_data;
+  gint64 now = gibber_timer_wheel_get_time (t->wheel);
+
+  /* due, rounded up to the next tick */
+  g_assert_cmpint (now, >=, t->due);
+  g_assert_cmpint (now, <=, t->due + GIBBER_TIMER_WHEEL_TICK);
+
+  t->fired++;
+
+  if (t->repeat-- > 0)
+    {
+      t->due = now + t->interval;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+test_virtual_time (void)
+{
+  GibberTimerWheel *wheel = gibber_timer_wheel_new_virtual (42);
+  Timer *timers = g_new0 (Timer, N_TIMERS);
+  guint i;
+
+  g_assert_cmpint (gibber_timer_wheel_get_time (wheel), ==, 0);
+
+  for (i = 0; i < N_TIMERS; i++)
+    {
+      Timer *t = timers + i;
+
+      t->wheel = wheel;
+      /* up to about 18 minutes, so that some of them have to be cascaded
+       * down from the higher levels */
+      t->interval = (i % 10 == 0) ? i * 547 : i % 1000;
+      t->due = t->interval;
+      t->repeat = i % 3;
+
+      gibber_timer_wheel_add (wheel, t->interval, timer_cb, t);
+    }
+
+  /* An hour in uneven steps */
+  while (gibber_timer_wheel_get_time (wheel) < 3600 * 1000)
+    gibber_timer_wheel_advance (wheel, 777);
+
+  for (i = 0; i < N_TIMERS; i++)
+    g_assert_cmpuint (timers[i].fired, ==, i % 3 + 1);
+
+  g_assert_cmpuint (gibber_timer_wheel_size (wheel), ==, 0);
+
+  g_free (timers);
+  gibber_timer_wheel_free (wheel);
+}
+
+static gboolean
+never_cb (gpointer user_data)
+{
+  g_assert_not_reached ();
+  return FALSE;
+}
+
+typedef struct {
+  GibberTimerWheel *wheel;
+  guint other;
+  guint fired;
+} RemoveData;
+
+static gboolean
+remove_other_cb (gpointer user_data)
+{
+  RemoveData *data = user_data;
+
+  g_assert (gibber_timer_wheel_remove (data->wheel, data->other));
+  data->fired++;
+
+  return TRUE;
+}
+
+static void
+test_remove (void)
+{
+  GibberTimerWheel *wheel = gibber_timer_wheel_new_virtual (42);
+  RemoveData data = { wheel, 0, 0 };
+  guint id;
+
+  id = gibber_timer_wheel_add (wheel, 100, never_cb, NULL);
+  g_assert (gibber_timer_wheel_remove (wheel, id));
+  g_assert (!gibber_timer_wheel_remove (wheel, id));
+
+  /* due in the same tick, but added after the first one */
+  id = gibber_timer_wheel_add (wheel, 100, remove_other_cb, &data);
+  data.other = gibber_timer_wheel_add (wheel, 100, never_cb, NULL);
+
+  gibber_timer_wheel_advance (wheel, 100);
+  g_assert_cmpuint (data.fired, ==, 1);
+
+  /* it repeats, so it can remove itself */
+  data.other = id;
+  gibber_timer_wheel_advance (wheel, 100);
+  g_assert_cmpuint (data.fired, ==, 2);
+  g_assert_cmpuint (gibber_timer_wheel_size (wheel), ==, 0);
+
+  gibber_timer_wheel_free (wheel);
+}
+
+typedef struct {
+  GibberTimerWheel *wheel;
+  /* (time, packet id) pairs */
+  GArray *requests;
+} RepairData;
+
+static void
+repair_request_cb (GibberRMulticastSender *sender,
+    guint id,
+    gpointer user_data)
+{
+  RepairData *data = user_data;
+  gint64 now = gibber_timer_wheel_get_time (data->wheel);
+  gint64 packet_id = id;
+
+  g_array_append_val (data->requests, now);
+  g_array_append_val (data->requests, packet_id);
+}
+
+/* The repair requests of a sender that is missing some packets */
+static GArray *
+run_repairs (guint32 seed)
+{
+  GibberTimerWheel *wheel = gibber_timer_wheel_new_virtual (seed);
+  GibberRMulticastSenderGroup *group;
+  GibberRMulticastSender *sender;
+  RepairData data = { wheel, g_array_new (FALSE, FALSE, sizeof (gint64)) };
+
+  group = gibber_r_multicast_sender_group_new (wheel);
+  sender = gibber_r_multicast_sender_new (0x100, "sender", group);
+  gibber_r_multicast_sender_update_start (sender, 1);
+  gibber_r_multicast_sender_set_data_start (sender, 1);
+  gibber_r_multicast_sender_group_add (group, sender);
+
+  g_signal_connect (sender, "repair-request", G_CALLBACK (repair_request_cb),
+      &data);
+
+  gibber_r_multicast_sender_seen (sender, 11);
+
+  /* The requests are repeated until the packets turn up */
+  gibber_timer_wheel_advance (wheel, 10 * 60 * 1000);
+
+  gibber_r_multicast_sender_group_free (group);
+  gibber_timer_wheel_free (wheel);
+
+  return data.requests;
+}
+
+static void
+test_reproducible (void)
+{
+  GArray *a = run_repairs (1);
+  GArray *b = run_repairs (1);
+  GArray *c = run_repairs (2);
+
+  g_assert_cmpuint (a->len, >, 0);
+  g_assert_cmpuint (a->len, ==, b->len);
+  g_assert (memcmp (a->data, b->data, a->len * sizeof (gint64)) == 0);
+
+  g_assert (a->len != c->len ||
+      memcmp (a->data, c->data, a->len * sizeof (gint64)) != 0);
+
+  g_array_free (a, TRUE);
+  g_array_free (b, TRUE);
+  g_array_free (c, TRUE);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_type_init ();
+
+  g_test_add_func ("/gibber/timer-wheel/virtual-time", test_virtual_time);
+  g_test_add_func ("/gibber/timer-wheel/remove", test_remove);
+  g_test_add_func ("/gibber/timer-wheel/reproducible", test_reproducible);
+
+  return g_test_run ();
+}
@@ -31,6 +31,11 @@ G_BEGIN_DECLS
  * GabbleCapabilitySet:
  *
  * A set of capabilities.
+ *
+ * Sets are reference-counted; gabble_capability_set_free() releases a
+ * reference. Sets returned by gabble_capability_set_intern() are shared and
+ * immutable: two interned sets are equal if and only if they are the same
+ * pointer.
  */
 typedef struct _GabbleCapabilitySet GabbleCapabilitySet;
 
@@ -39,6 +44,10 @@ GabbleCapabilitySet *gabble_capability_set_new_from_stanza (
     WockyNode *query_result);
 GabbleCapabilitySet *gabble_capability_set_copy (
     const GabbleCapabilitySet *caps);
+GabbleCapabilitySet *gabble_capability_set_ref (GabbleCapabilitySet *caps);
+GabbleCapabilitySet *gabble_capability_set_intern (
+    const GabbleCapabilitySet *caps);
+gboolean gabble_capability_set_is_interned (const GabbleCapabilitySet *caps);
 void gabble_capability_set_update (GabbleCapabilitySet *target,
     const GabbleCapabilitySet *source);
 void gabble_capability_set_add (GabbleCapabilitySet *caps,
@@ -58,6 +67,7 @@ gboolean gabble_capability_set_at_least (const GabbleCapabilitySet *caps,
     const GabbleCapabilitySet *query);
 gboolean gabble_capability_set_equals (const GabbleCapabilitySet *a,
     const GabbleCapabilitySet *b);
+guint gabble_capability_set_hash (const GabbleCapabilitySet *caps);
 void gabble_capability_set_clear (GabbleCapabilitySet *caps);
 void gabble_capability_set_free (GabbleCapabilitySet *caps);
 void gabble_capability_set_foreach (const GabbleCapabilitySet *caps,
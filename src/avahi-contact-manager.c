@@ -52,6 +52,9 @@ struct _SalutAvahiContactManagerPrivate
 {
   SalutAvahiDiscoveryClient *discovery_client;
   GaServiceBrowser *presence_browser;
+  /* Resolve contacts on demand rather than monitoring all of them on all
+   * interfaces and protocols, for networks with thousands of contacts */
+  gboolean scalable;
 
   gboolean dispose_has_run;
 };
@@ -122,7 +125,7 @@ salut_avahi_contact_manager_create_contact (SalutContactManager *mgr,
     SALUT_AVAHI_CONTACT_MANAGER_GET_PRIVATE (self);
 
   return SALUT_CONTACT (salut_avahi_contact_new (mgr->connection,
-      name, priv->discovery_client));
+      name, priv->discovery_client, priv->scalable));
 }
 
 static void
@@ -214,10 +217,36 @@ browser_failed (GaServiceBrowser *browser,
   g_warning ("browser failed -> %s", error->message);
 }
 
+static void
+report_memory_usage (SalutAvahiContactManager *self)
+{
+  SalutContactManager *mgr = SALUT_CONTACT_MANAGER (self);
+  GHashTableIter iter;
+  gpointer value;
+  guint n_contacts = 0, n_resolvers = 0;
+  gsize total = 0;
+
+  g_hash_table_iter_init (&iter, mgr->contacts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      guint resolvers;
+
+      total += salut_avahi_contact_get_memory_usage (
+          SALUT_AVAHI_CONTACT (value), &resolvers);
+      n_resolvers += resolvers;
+      n_contacts++;
+    }
+
+  DEBUG ("%u contacts, %u resolvers, ~%" G_GSIZE_FORMAT " bytes "
+      "(~%" G_GSIZE_FORMAT " per contact)", n_contacts, n_resolvers, total,
+      n_contacts > 0 ? total / n_contacts : 0);
+}
+
 static void
 browser_all_for_now (GaServiceBrowser *browser,
                      SalutAvahiContactManager *self)
 {
+  report_memory_usage (self);
   g_signal_emit_by_name (self, "all-for-now");
 }
 
@@ -290,6 +319,10 @@ salut_avahi_contact_manager_constructed (GObject *object)
 
   priv->presence_browser = ga_service_browser_new ((gchar *) dnssd_name);
 
+  priv->scalable = (g_getenv ("SALUT_SCALABLE_RESOLVING") != NULL);
+  if (priv->scalable)
+    DEBUG ("resolving contacts on demand");
+
   if (G_OBJECT_CLASS (salut_avahi_contact_manager_parent_class)->constructed)
     G_OBJECT_CLASS (salut_avahi_contact_manager_parent_class)->constructed (object);
 }
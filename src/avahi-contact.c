@@ -66,15 +66,42 @@
 
 #define PRESENCE_TIMEOUT (1200 * 1000)
 
+/* In scalable mode, for how long (in seconds) we trust what a one-shot
+ * resolution told us about a contact nobody is interested in. It's picked
+ * between SNAPSHOT_TTL and twice that, so that the contacts found at once
+ * aren't resolved again at once either. */
+#define SNAPSHOT_TTL (5 * 60)
+
+/* Rough cost of a live resolver or record browser, counting the objects
+ * avahi-client and avahi-daemon keep for it */
+#define RESOLVER_FOOTPRINT 2048
+
 G_DEFINE_TYPE (SalutAvahiContact, salut_avahi_contact,
     SALUT_TYPE_CONTACT);
 
 /* properties */
 enum {
   PROP_CLIENT = 1,
+  PROP_SCALABLE,
   LAST_PROP
 };
 
+/* A browsed instance of the contact's presence service */
+typedef struct {
+  AvahiIfIndex interface;
+  AvahiProtocol protocol;
+  gchar *name;
+  gchar *type;
+  gchar *domain;
+} ServiceInfo;
+
+/* Where a resolver found the contact */
+typedef struct {
+  AvahiIfIndex interface;
+  AvahiAddress address;
+  guint16 port;
+} ResolvedAddress;
+
 /* private structure */
 typedef struct _SalutAvahiContactPrivate SalutAvahiContactPrivate;
 
@@ -85,9 +112,22 @@ struct _SalutAvahiContactPrivate
   guint presence_resolver_failed_timer;
   GaRecordBrowser *record_browser;
 
+  /* In scalable mode we only keep track of the browsed services (a list of
+   * ServiceInfo) and resolve the first one of them: persistently while
+   * somebody is interested in the contact, once every SNAPSHOT_TTL to
+   * 2 * SNAPSHOT_TTL seconds otherwise. */
+  gboolean scalable;
+  GSList *services;
+  ResolvedAddress snapshot;
+  gboolean snapshot_valid;
+  guint snapshot_timer;
+  guint release_resolver_idle;
+
   gboolean dispose_has_run;
 };
 
+static void contact_start_resolver (SalutAvahiContact *self);
+
 static void
 salut_avahi_contact_init (SalutAvahiContact *self)
 {
@@ -113,6 +153,9 @@ salut_avahi_contact_get_property (GObject *object,
       case PROP_CLIENT:
         g_value_set_object (value, priv->discovery_client);
         break;
+      case PROP_SCALABLE:
+        g_value_set_boolean (value, priv->scalable);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -134,6 +177,9 @@ salut_avahi_contact_set_property (GObject *object,
         priv->discovery_client = g_value_get_object (value);
         g_object_ref (priv->discovery_client);
         break;
+      case PROP_SCALABLE:
+        priv->scalable = g_value_get_boolean (value);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -173,35 +219,62 @@ _avahi_address_to_sockaddr (AvahiAddress *address,
   }
 }
 
-static void
-_add_address (GaServiceResolver *resolver,
-              GArray *addresses)
+/* Returns an array of ResolvedAddress */
+static GArray *
+contact_dup_resolved_addresses (SalutAvahiContact *self)
 {
-  salut_contact_address_t s_address;
-  AvahiAddress address;
-  guint16 port;
-  AvahiIfIndex ifindex;
+  SalutAvahiContactPrivate *priv = self->priv;
+  GArray *addresses;
+  GSList *l;
+
+  addresses = g_array_new (FALSE, FALSE, sizeof (ResolvedAddress));
 
-  g_object_get (resolver, "interface", &ifindex, NULL);
-  if (ga_service_resolver_get_address (resolver, &address, &port))
+  if (priv->scalable)
     {
-      _avahi_address_to_sockaddr (&address, port, ifindex,
-          (struct sockaddr *) &s_address.address);
-      g_array_append_val (addresses, s_address);
+      /* our resolver, if any, keeps the snapshot up to date */
+      if (priv->snapshot_valid)
+        g_array_append_val (addresses, priv->snapshot);
+
+      return addresses;
+    }
+
+  for (l = priv->resolvers; l != NULL; l = l->next)
+    {
+      GaServiceResolver *resolver = l->data;
+      ResolvedAddress resolved;
+
+      g_object_get (resolver, "interface", &resolved.interface, NULL);
+      if (ga_service_resolver_get_address (resolver, &resolved.address,
+            &resolved.port))
+        g_array_append_val (addresses, resolved);
     }
+
+  return addresses;
 }
 
 static GArray *
 salut_avahi_contact_get_addresses (SalutContact *contact)
 {
   SalutAvahiContact *self = SALUT_AVAHI_CONTACT (contact);
-  SalutAvahiContactPrivate *priv = self->priv;
+  GArray *resolved;
   GArray *addresses;
+  guint i;
 
+  resolved = contact_dup_resolved_addresses (self);
   addresses = g_array_sized_new (TRUE, TRUE, sizeof (salut_contact_address_t),
-      g_slist_length (priv->resolvers));
-  g_slist_foreach (priv->resolvers, (GFunc) _add_address, addresses);
+      resolved->len);
+
+  for (i = 0; i < resolved->len; i++)
+    {
+      ResolvedAddress *r = &g_array_index (resolved, ResolvedAddress, i);
+      salut_contact_address_t s_address;
+
+      _avahi_address_to_sockaddr (&r->address, r->port, r->interface,
+          (struct sockaddr *) &s_address.address);
+      g_array_append_val (addresses, s_address);
+    }
 
+  g_array_unref (resolved);
   return addresses;
 }
 
@@ -217,47 +290,46 @@ static GList *
 salut_avahi_contact_ll_get_addresses (WockyLLContact *contact)
 {
   SalutAvahiContact *self = SALUT_AVAHI_CONTACT (contact);
-  SalutAvahiContactPrivate *priv = self->priv;
   /* omg, GQueue! */
   GQueue queue = G_QUEUE_INIT;
-  GSList *l;
+  GArray *resolved;
+  guint i;
 
-  for (l = priv->resolvers; l != NULL; l = l->next)
+  resolved = contact_dup_resolved_addresses (self);
+
+  for (i = 0; i < resolved->len; i++)
     {
-      GaServiceResolver *resolver = l->data;
-      AvahiAddress address;
-      guint16 port;
+      ResolvedAddress *r = &g_array_index (resolved, ResolvedAddress, i);
+      GInetAddress *addr;
+      GSocketAddress *socket_address;
 
-      if (ga_service_resolver_get_address (resolver, &address, &port))
+      if (r->address.proto == AVAHI_PROTO_INET)
         {
-          GInetAddress *addr;
-          GSocketAddress *socket_address;
-
-          if (address.proto == AVAHI_PROTO_INET)
-            {
-              addr = g_inet_address_new_from_bytes (
-                  (guint8 *) &(address.data.ipv4.address), G_SOCKET_FAMILY_IPV4);
-            }
-          else if (address.proto == AVAHI_PROTO_INET6)
-            {
-              addr = g_inet_address_new_from_bytes (
-                  (guint8 *) &(address.data.ipv6.address), G_SOCKET_FAMILY_IPV6);
-            }
-          else
-            g_assert_not_reached ();
+          addr = g_inet_address_new_from_bytes (
+              (guint8 *) &(r->address.data.ipv4.address),
+              G_SOCKET_FAMILY_IPV4);
+        }
+      else if (r->address.proto == AVAHI_PROTO_INET6)
+        {
+          addr = g_inet_address_new_from_bytes (
+              (guint8 *) &(r->address.data.ipv6.address),
+              G_SOCKET_FAMILY_IPV6);
+        }
+      else
+        g_assert_not_reached ();
 
-          socket_address = g_inet_socket_address_new (addr, port);
-          g_object_unref (addr);
+      socket_address = g_inet_socket_address_new (addr, r->port);
+      g_object_unref (addr);
 
-          g_queue_push_tail (&queue, socket_address);
-        }
+      g_queue_push_tail (&queue, socket_address);
     }
 
+  g_array_unref (resolved);
   return queue.head;
 }
 
 static gint
-_compare_address (GaServiceResolver *resolver,
+_compare_address (const ResolvedAddress *resolved,
                   struct sockaddr *addr_b)
 {
   union {
@@ -265,15 +337,9 @@ _compare_address (GaServiceResolver *resolver,
     struct sockaddr_in in;
     struct sockaddr_in6 in6;
   } addr_a;
-  AvahiIfIndex ifindex;
-  AvahiAddress address;
-  uint16_t port;
-
-  g_object_get (resolver, "interface", &ifindex, NULL);
-  if (!ga_service_resolver_get_address (resolver, &address, &port))
-    return -1;
+  AvahiAddress address = resolved->address;
 
-  _avahi_address_to_sockaddr (&address, port, ifindex,
+  _avahi_address_to_sockaddr (&address, resolved->port, resolved->interface,
       (struct sockaddr *) &addr_a);
 
   if (addr_a.storage.ss_family != addr_b->sa_family)
@@ -306,10 +372,18 @@ salut_avahi_contact_has_address (SalutContact *contact,
                                  guint size)
 {
   SalutAvahiContact *self = SALUT_AVAHI_CONTACT (contact);
-  SalutAvahiContactPrivate *priv = self->priv;
+  GArray *resolved;
+  gboolean found = FALSE;
+  guint i;
+
+  resolved = contact_dup_resolved_addresses (self);
 
-  return (g_slist_find_custom (priv->resolvers, address,
-        (GCompareFunc) _compare_address) != NULL);
+  for (i = 0; i < resolved->len && !found; i++)
+    found = (_compare_address (
+          &g_array_index (resolved, ResolvedAddress, i), address) == 0);
+
+  g_array_unref (resolved);
+  return found;
 }
 
 static void
@@ -412,6 +486,8 @@ salut_avahi_contact_retrieve_avatar (SalutContact *contact)
 }
 
 static void salut_avahi_contact_dispose (GObject *object);
+static void salut_avahi_contact_interest_changed (SalutContact *contact,
+    gboolean interesting);
 
 static void
 salut_avahi_contact_class_init (
@@ -437,6 +513,7 @@ salut_avahi_contact_class_init (
   contact_class->get_addresses = salut_avahi_contact_get_addresses;
   contact_class->has_address = salut_avahi_contact_has_address;
   contact_class->retrieve_avatar = salut_avahi_contact_retrieve_avatar;
+  contact_class->interest_changed = salut_avahi_contact_interest_changed;
 
   w_contact_class->dup_jid = salut_avahi_contact_dup_jid;
   ll_contact_class->get_addresses = salut_avahi_contact_ll_get_addresses;
@@ -450,6 +527,26 @@ salut_avahi_contact_class_init (
       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
   g_object_class_install_property (object_class, PROP_CLIENT,
       param_spec);
+
+  param_spec = g_param_spec_boolean (
+      "scalable",
+      "Scalable mode",
+      "Whether to resolve the contact on demand using a single resolver "
+      "rather than monitoring all its services all the time",
+      FALSE,
+      G_PARAM_CONSTRUCT_ONLY |
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_SCALABLE,
+      param_spec);
+}
+
+static void
+service_info_free (ServiceInfo *service)
+{
+  g_free (service->name);
+  g_free (service->type);
+  g_free (service->domain);
+  g_slice_free (ServiceInfo, service);
 }
 
 void
@@ -469,10 +566,26 @@ salut_avahi_contact_dispose (GObject *object)
       priv->presence_resolver_failed_timer = 0;
     }
 
+  if (priv->snapshot_timer > 0)
+    {
+      g_source_remove (priv->snapshot_timer);
+      priv->snapshot_timer = 0;
+    }
+
+  if (priv->release_resolver_idle > 0)
+    {
+      g_source_remove (priv->release_resolver_idle);
+      priv->release_resolver_idle = 0;
+    }
+
   g_slist_foreach (priv->resolvers, (GFunc) g_object_unref, NULL);
   g_slist_free (priv->resolvers);
   priv->resolvers = NULL;
 
+  g_slist_foreach (priv->services, (GFunc) service_info_free, NULL);
+  g_slist_free (priv->services);
+  priv->services = NULL;
+
   if (priv->discovery_client != NULL)
     {
       g_object_unref (priv->discovery_client);
@@ -487,7 +600,8 @@ salut_avahi_contact_dispose (GObject *object)
 SalutAvahiContact *
 salut_avahi_contact_new (SalutConnection *connection,
                          const gchar *name,
-                         SalutAvahiDiscoveryClient *discovery_client)
+                         SalutAvahiDiscoveryClient *discovery_client,
+                         gboolean scalable)
 {
   g_assert (connection != NULL);
   g_assert (name != NULL);
@@ -497,9 +611,54 @@ salut_avahi_contact_new (SalutConnection *connection,
       "connection", connection,
       "name", name,
       "discovery-client", discovery_client,
+      "scalable", scalable,
       NULL);
 }
 
+static gsize
+str_size (const gchar *s)
+{
+  return s != NULL ? strlen (s) + 1 : 0;
+}
+
+gsize
+salut_avahi_contact_get_memory_usage (SalutAvahiContact *self,
+                                      guint *n_resolvers)
+{
+  SalutAvahiContactPrivate *priv = self->priv;
+  SalutContact *contact = SALUT_CONTACT (self);
+  guint resolvers = g_slist_length (priv->resolvers);
+  gsize total;
+  GSList *l;
+
+  total = sizeof (SalutAvahiContact) + sizeof (SalutAvahiContactPrivate);
+  total += str_size (contact->name) + str_size (contact->avatar_token)
+    + str_size (contact->status_message) + str_size (contact->first)
+    + str_size (contact->last) + str_size (contact->full_name)
+    + str_size (contact->email) + str_size (contact->jid)
+    + str_size (contact->hash) + str_size (contact->node)
+    + str_size (contact->ver);
+
+  for (l = priv->services; l != NULL; l = l->next)
+    {
+      ServiceInfo *service = l->data;
+
+      total += sizeof (GSList) + sizeof (ServiceInfo)
+        + str_size (service->name) + str_size (service->type)
+        + str_size (service->domain);
+    }
+
+  total += resolvers * (sizeof (GSList) + RESOLVER_FOOTPRINT);
+
+  if (priv->record_browser != NULL)
+    total += RESOLVER_FOOTPRINT;
+
+  if (n_resolvers != NULL)
+    *n_resolvers = resolvers;
+
+  return total;
+}
+
 static void
 contact_drop_resolver (SalutAvahiContact *self,
                        GaServiceResolver *resolver)
@@ -585,6 +744,39 @@ find_resolver (SalutAvahiContact *contact,
   return ret ? GA_SERVICE_RESOLVER (ret->data) : NULL;
 }
 
+static gint
+compare_service (ServiceInfo *service,
+                 struct resolverinfo *info)
+{
+  if (service->interface == info->interface
+      && service->protocol == info->protocol
+      && !tp_strdiff (service->name, info->name)
+      && !tp_strdiff (service->type, info->type)
+      && !tp_strdiff (service->domain, info->domain))
+    return 0;
+
+  return 1;
+}
+
+static GSList *
+find_service (SalutAvahiContact *contact,
+              AvahiIfIndex interface, AvahiProtocol protocol,
+              const gchar *name,
+              const gchar *type,
+              const gchar *domain)
+{
+  SalutAvahiContactPrivate *priv = contact->priv;
+  struct resolverinfo info;
+
+  info.interface = interface;
+  info.protocol = protocol;
+  info.name = name;
+  info.type = type;
+  info.domain = domain;
+  return g_slist_find_custom (priv->services, &info,
+      (GCompareFunc) compare_service);
+}
+
 static void
 update_alias (SalutAvahiContact *self,
               const gchar *nick)
@@ -629,6 +821,75 @@ _avahi_txt_get_keyval (AvahiStringList *txt, const gchar *key)
   return _avahi_txt_get_keyval_with_size (txt, key, NULL);
 }
 
+static void
+contact_stop_resolver (SalutAvahiContact *self)
+{
+  SalutAvahiContactPrivate *priv = self->priv;
+
+  if (priv->release_resolver_idle != 0)
+    {
+      g_source_remove (priv->release_resolver_idle);
+      priv->release_resolver_idle = 0;
+    }
+
+  if (priv->resolvers == NULL)
+    return;
+
+  DEBUG_RESOLVER (self, priv->resolvers->data, "released");
+
+  g_slist_foreach (priv->resolvers, (GFunc) g_object_unref, NULL);
+  g_slist_free (priv->resolvers);
+  priv->resolvers = NULL;
+}
+
+static gboolean
+snapshot_expired_cb (gpointer user_data)
+{
+  SalutAvahiContact *self = user_data;
+  SalutAvahiContactPrivate *priv = self->priv;
+
+  priv->snapshot_timer = 0;
+
+  DEBUG_CONTACT (self, "snapshot expired, resolving again");
+  contact_start_resolver (self);
+
+  return FALSE;
+}
+
+static gboolean
+release_resolver_idle_cb (gpointer user_data)
+{
+  SalutAvahiContact *self = user_data;
+  SalutAvahiContactPrivate *priv = self->priv;
+
+  priv->release_resolver_idle = 0;
+
+  if (salut_contact_is_interesting (SALUT_CONTACT (self)))
+    return FALSE;
+
+  contact_stop_resolver (self);
+
+  if (priv->snapshot_timer == 0)
+    priv->snapshot_timer = g_timeout_add_seconds (
+        g_random_int_range (SNAPSHOT_TTL, 2 * SNAPSHOT_TTL + 1),
+        snapshot_expired_cb, self);
+
+  return FALSE;
+}
+
+/* Nobody is interested in the contact, so the information we just got will
+ * do until the snapshot expires */
+static void
+schedule_resolver_release (SalutAvahiContact *self)
+{
+  SalutAvahiContactPrivate *priv = self->priv;
+
+  /* This is called from the resolver's signal handlers, so it can't be
+   * dropped right away */
+  if (priv->release_resolver_idle == 0)
+    priv->release_resolver_idle = g_idle_add (release_resolver_idle_cb, self);
+}
+
 static void
 contact_resolved_cb (GaServiceResolver *resolver,
                      AvahiIfIndex interface,
@@ -657,6 +918,14 @@ contact_resolved_cb (GaServiceResolver *resolver,
 
   DEBUG_RESOLVER (self, resolver, "contact %s resolved", contact->name);
 
+  if (priv->scalable && address != NULL)
+    {
+      priv->snapshot.interface = interface;
+      priv->snapshot.address = *address;
+      priv->snapshot.port = port;
+      priv->snapshot_valid = TRUE;
+    }
+
   if (priv->presence_resolver_failed_timer != 0)
     {
       DEBUG_CONTACT (self, "remove presence resolver timer");
@@ -792,6 +1061,9 @@ contact_resolved_cb (GaServiceResolver *resolver,
 
   salut_contact_found (contact);
   salut_contact_thaw (contact);
+
+  if (priv->scalable && !salut_contact_is_interesting (contact))
+    schedule_resolver_release (self);
 }
 
 static gboolean
@@ -825,22 +1097,18 @@ contact_failed_cb (GaServiceResolver *resolver,
       self);
 }
 
-gboolean
-salut_avahi_contact_add_service (SalutAvahiContact *self,
-                                 AvahiIfIndex interface,
-                                 AvahiProtocol protocol,
-                                 const char *name,
-                                 const char *type,
-                                 const char *domain)
+static GaServiceResolver *
+contact_attach_resolver (SalutAvahiContact *self,
+                         AvahiIfIndex interface,
+                         AvahiProtocol protocol,
+                         const char *name,
+                         const char *type,
+                         const char *domain)
 {
   SalutAvahiContactPrivate *priv = self->priv;
   GaServiceResolver *resolver;
   GError *error = NULL;
 
-  resolver = find_resolver (self, interface, protocol, name, type, domain);
-  if (resolver != NULL)
-    return TRUE;
-
   resolver = ga_service_resolver_new (interface, protocol, name, type, domain,
       protocol, 0);
 
@@ -854,10 +1122,125 @@ salut_avahi_contact_add_service (SalutAvahiContact *self,
     {
       DEBUG_CONTACT(self, "Failed to attach resolver: %s", error->message);
       g_error_free (error);
-      return FALSE;
+      g_object_unref (resolver);
+      return NULL;
     }
 
   DEBUG_RESOLVER (self, resolver, "added");
+  return resolver;
+}
+
+/* Scalable mode: resolve the first of our services, unless we already are */
+static void
+contact_start_resolver (SalutAvahiContact *self)
+{
+  SalutAvahiContactPrivate *priv = self->priv;
+  ServiceInfo *service;
+  GaServiceResolver *resolver;
+
+  if (priv->resolvers != NULL || priv->services == NULL)
+    return;
+
+  if (priv->snapshot_timer != 0)
+    {
+      g_source_remove (priv->snapshot_timer);
+      priv->snapshot_timer = 0;
+    }
+
+  service = priv->services->data;
+  resolver = contact_attach_resolver (self, service->interface,
+      service->protocol, service->name, service->type, service->domain);
+
+  if (resolver == NULL)
+    return;
+
+  priv->resolvers = g_slist_prepend (NULL, resolver);
+}
+
+static void
+salut_avahi_contact_interest_changed (SalutContact *contact,
+                                      gboolean interesting)
+{
+  SalutAvahiContact *self = SALUT_AVAHI_CONTACT (contact);
+  SalutAvahiContactPrivate *priv = self->priv;
+
+  if (!priv->scalable)
+    return;
+
+  if (interesting)
+    {
+      DEBUG_CONTACT (self, "interesting, monitoring it");
+
+      if (priv->release_resolver_idle != 0)
+        {
+          g_source_remove (priv->release_resolver_idle);
+          priv->release_resolver_idle = 0;
+        }
+
+      contact_start_resolver (self);
+    }
+  else
+    {
+      DEBUG_CONTACT (self, "not interesting anymore");
+
+      /* If it hasn't been resolved yet, the resolver will be released once
+       * it has */
+      if (priv->snapshot_valid)
+        schedule_resolver_release (self);
+    }
+}
+
+gboolean
+salut_avahi_contact_add_service (SalutAvahiContact *self,
+                                 AvahiIfIndex interface,
+                                 AvahiProtocol protocol,
+                                 const char *name,
+                                 const char *type,
+                                 const char *domain)
+{
+  SalutAvahiContactPrivate *priv = self->priv;
+  GaServiceResolver *resolver;
+
+  if (priv->scalable)
+    {
+      ServiceInfo *service;
+
+      if (find_service (self, interface, protocol, name, type, domain) != NULL)
+        return TRUE;
+
+      service = g_slice_new (ServiceInfo);
+      service->interface = interface;
+      service->protocol = protocol;
+      service->name = g_strdup (name);
+      service->type = g_strdup (type);
+      service->domain = g_strdup (domain);
+      priv->services = g_slist_append (priv->services, service);
+
+      DEBUG_CONTACT (self, "service added (intf: %d proto: %d), %u known",
+          interface, protocol, g_slist_length (priv->services));
+
+      contact_start_resolver (self);
+
+      if (priv->resolvers == NULL && priv->services->next == NULL)
+        {
+          /* We couldn't resolve the only service we know about */
+          priv->services = g_slist_remove (priv->services, service);
+          service_info_free (service);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  resolver = find_resolver (self, interface, protocol, name, type, domain);
+  if (resolver != NULL)
+    return TRUE;
+
+  resolver = contact_attach_resolver (self, interface, protocol, name, type,
+      domain);
+  if (resolver == NULL)
+    return FALSE;
+
   priv->resolvers = g_slist_prepend (priv->resolvers, resolver);
 
   return TRUE;
@@ -871,8 +1254,51 @@ salut_avahi_contact_remove_service (SalutAvahiContact *self,
                                     const char *type,
                                     const char *domain)
 {
+  SalutAvahiContactPrivate *priv = self->priv;
   GaServiceResolver *resolver;
 
+  if (priv->scalable)
+    {
+      GSList *link;
+      gboolean resolving;
+
+      link = find_service (self, interface, protocol, name, type, domain);
+      if (link == NULL)
+        return;
+
+      /* the first service is the one we resolve */
+      resolving = (link == priv->services);
+
+      service_info_free (link->data);
+      priv->services = g_slist_delete_link (priv->services, link);
+
+      DEBUG_CONTACT (self, "service removed (intf: %d proto: %d), %u left",
+          interface, protocol, g_slist_length (priv->services));
+
+      if (resolving)
+        {
+          contact_stop_resolver (self);
+          priv->snapshot_valid = FALSE;
+        }
+
+      if (priv->services == NULL)
+        {
+          if (priv->snapshot_timer != 0)
+            {
+              g_source_remove (priv->snapshot_timer);
+              priv->snapshot_timer = 0;
+            }
+
+          salut_contact_lost (SALUT_CONTACT (self));
+        }
+      else if (resolving)
+        {
+          contact_start_resolver (self);
+        }
+
+      return;
+    }
+
   resolver =  find_resolver (self, interface, protocol, name, type, domain);
   if (resolver == NULL)
     return;
@@ -887,5 +1313,8 @@ salut_avahi_contact_has_services (SalutAvahiContact *self)
 {
   SalutAvahiContactPrivate *priv = self->priv;
 
+  if (priv->scalable)
+    return priv->services != NULL;
+
   return priv->resolvers != NULL;
 }
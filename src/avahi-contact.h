@@ -58,7 +58,7 @@ GType salut_avahi_contact_get_type (void);
 
 SalutAvahiContact *
 salut_avahi_contact_new (SalutConnection *connection, const gchar *name,
-    SalutAvahiDiscoveryClient *discovery_client);
+    SalutAvahiDiscoveryClient *discovery_client, gboolean scalable);
 
 gboolean salut_avahi_contact_add_service (SalutAvahiContact *contact,
     AvahiIfIndex interface, AvahiProtocol protocol, const char *name,
@@ -70,6 +70,11 @@ void salut_avahi_contact_remove_service (SalutAvahiContact *contact,
 
 gboolean salut_avahi_contact_has_services (SalutAvahiContact *contact);
 
+/* Approximation of the memory used for this contact, including what Avahi
+ * keeps for its resolvers */
+gsize salut_avahi_contact_get_memory_usage (SalutAvahiContact *contact,
+    guint *n_resolvers);
+
 G_END_DECLS
 
 #endif /* #ifndef __SALUT_AVAHI_CONTACT_H__*/
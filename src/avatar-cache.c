@@ -0,0 +1,518 @@
+/*
+ * avatar-cache.c - Source for SalutAvatarCache
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* On-disk cache of contacts' avatars.
+ *
+ * Link-local avatar tokens are the SHA-1 of the image data, so the cache is
+ * content-addressed: an avatar is stored in a file named after its token and
+ * can be shared by every contact advertising the same token. The total size
+ * of the directory is bounded; when it grows too big, the least recently used
+ * avatars are removed. Recency is persisted through the files' mtime so the
+ * LRU order survives restarts. */
+
+#include "config.h"
+#include "avatar-cache.h"
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "sha1/sha1-util.h"
+
+#define DEBUG_FLAG DEBUG_CONTACTS
+#include "debug.h"
+
+G_DEFINE_TYPE (SalutAvatarCache, salut_avatar_cache, G_TYPE_OBJECT);
+
+/* properties */
+enum
+{
+  PROP_DIRECTORY = 1,
+  PROP_MAX_SIZE,
+  LAST_PROPERTY
+};
+
+typedef struct
+{
+  /* file name in the cache directory, also the key in priv->entries */
+  gchar *key;
+  gsize size;
+  /* link in priv->lru, owned by the queue */
+  GList *link;
+} CacheEntry;
+
+struct _SalutAvatarCachePrivate
+{
+  gchar *directory;
+  gsize max_size;
+  gsize total_size;
+
+  /* gchar *key -> owned CacheEntry */
+  GHashTable *entries;
+  /* CacheEntry, most recently used first */
+  GQueue lru;
+
+  gboolean dispose_has_run;
+};
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_free (entry->key);
+  g_slice_free (CacheEntry, entry);
+}
+
+static gboolean
+token_is_sha1 (const gchar *token)
+{
+  guint i;
+
+  for (i = 0; token[i] != '\0'; i++)
+    {
+      if (!g_ascii_isxdigit (token[i]))
+        return FALSE;
+    }
+
+  return i == SHA1_HASH_SIZE * 2;
+}
+
+/* Avatar tokens are sent by remote contacts: only use them as file names
+ * when they look like a SHA-1, otherwise hash them */
+static gchar *
+token_to_key (const gchar *token)
+{
+  if (token_is_sha1 (token))
+    return g_ascii_strdown (token, -1);
+
+  return sha1_hex ((const guint8 *) token, strlen (token));
+}
+
+static void
+salut_avatar_cache_init (SalutAvatarCache *self)
+{
+  SalutAvatarCachePrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      SALUT_TYPE_AVATAR_CACHE, SalutAvatarCachePrivate);
+
+  self->priv = priv;
+
+  priv->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) cache_entry_free);
+  g_queue_init (&priv->lru);
+  priv->max_size = SALUT_AVATAR_CACHE_DEFAULT_MAX_SIZE;
+}
+
+static void
+remove_entry (SalutAvatarCache *self,
+    CacheEntry *entry,
+    gboolean unlink_file)
+{
+  SalutAvatarCachePrivate *priv = self->priv;
+
+  if (unlink_file)
+    {
+      gchar *path = g_build_filename (priv->directory, entry->key, NULL);
+
+      if (g_unlink (path) != 0)
+        DEBUG ("failed to remove %s", path);
+
+      g_free (path);
+    }
+
+  g_assert (priv->total_size >= entry->size);
+  priv->total_size -= entry->size;
+
+  g_queue_delete_link (&priv->lru, entry->link);
+  g_hash_table_remove (priv->entries, entry->key);
+}
+
+static void
+evict (SalutAvatarCache *self)
+{
+  SalutAvatarCachePrivate *priv = self->priv;
+
+  while (priv->total_size > priv->max_size &&
+      !g_queue_is_empty (&priv->lru))
+    {
+      CacheEntry *entry = g_queue_peek_tail (&priv->lru);
+
+      DEBUG ("evicting %s (%" G_GSIZE_FORMAT " bytes)", entry->key,
+          entry->size);
+      remove_entry (self, entry, TRUE);
+    }
+}
+
+static CacheEntry *
+add_entry (SalutAvatarCache *self,
+    const gchar *key,
+    gsize size)
+{
+  SalutAvatarCachePrivate *priv = self->priv;
+  CacheEntry *entry;
+
+  entry = g_slice_new0 (CacheEntry);
+  entry->key = g_strdup (key);
+  entry->size = size;
+
+  g_queue_push_head (&priv->lru, entry);
+  entry->link = g_queue_peek_head_link (&priv->lru);
+  g_hash_table_insert (priv->entries, entry->key, entry);
+  priv->total_size += size;
+
+  return entry;
+}
+
+typedef struct
+{
+  gchar *key;
+  gsize size;
+  time_t mtime;
+} ScannedFile;
+
+static gint
+scanned_file_compare_mtime (gconstpointer a,
+    gconstpointer b)
+{
+  const ScannedFile *fa = a;
+  const ScannedFile *fb = b;
+
+  /* oldest first: they are pushed at the head of the LRU in turn */
+  if (fa->mtime < fb->mtime)
+    return -1;
+
+  return fa->mtime > fb->mtime;
+}
+
+static void
+scan_directory (SalutAvatarCache *self)
+{
+  SalutAvatarCachePrivate *priv = self->priv;
+  GDir *dir;
+  GError *error = NULL;
+  const gchar *name;
+  GArray *files;
+  guint i;
+
+  if (g_mkdir_with_parents (priv->directory, 0700) != 0)
+    {
+      DEBUG ("failed to create %s", priv->directory);
+      return;
+    }
+
+  dir = g_dir_open (priv->directory, 0, &error);
+  if (dir == NULL)
+    {
+      DEBUG ("failed to open %s: %s", priv->directory, error->message);
+      g_error_free (error);
+      return;
+    }
+
+  files = g_array_new (FALSE, FALSE, sizeof (ScannedFile));
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      ScannedFile file;
+      GStatBuf st;
+      gchar *path;
+
+      /* skip temporary files left behind by g_file_set_contents */
+      if (!token_is_sha1 (name))
+        continue;
+
+      path = g_build_filename (priv->directory, name, NULL);
+
+      if (g_stat (path, &st) == 0 && S_ISREG (st.st_mode))
+        {
+          file.key = g_strdup (name);
+          file.size = st.st_size;
+          file.mtime = st.st_mtime;
+          g_array_append_val (files, file);
+        }
+
+      g_free (path);
+    }
+
+  g_dir_close (dir);
+
+  g_array_sort (files, scanned_file_compare_mtime);
+
+  for (i = 0; i < files->len; i++)
+    {
+      ScannedFile *file = &g_array_index (files, ScannedFile, i);
+
+      add_entry (self, file->key, file->size);
+      g_free (file->key);
+    }
+
+  g_array_unref (files);
+
+  DEBUG ("%u avatars (%" G_GSIZE_FORMAT " bytes) in %s",
+      g_queue_get_length (&priv->lru), priv->total_size, priv->directory);
+
+  evict (self);
+}
+
+static void
+salut_avatar_cache_constructed (GObject *object)
+{
+  SalutAvatarCache *self = SALUT_AVATAR_CACHE (object);
+  SalutAvatarCachePrivate *priv = self->priv;
+
+  if (G_OBJECT_CLASS (salut_avatar_cache_parent_class)->constructed != NULL)
+    G_OBJECT_CLASS (salut_avatar_cache_parent_class)->constructed (object);
+
+  if (priv->directory == NULL)
+    priv->directory = g_build_filename (g_get_user_cache_dir (),
+        "telepathy", "avatars", "salut", NULL);
+
+  scan_directory (self);
+}
+
+static void
+salut_avatar_cache_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  SalutAvatarCache *self = SALUT_AVATAR_CACHE (object);
+  SalutAvatarCachePrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+      case PROP_DIRECTORY:
+        g_value_set_string (value, priv->directory);
+        break;
+      case PROP_MAX_SIZE:
+        g_value_set_uint (value, priv->max_size);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+salut_avatar_cache_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  SalutAvatarCache *self = SALUT_AVATAR_CACHE (object);
+  SalutAvatarCachePrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+      case PROP_DIRECTORY:
+        priv->directory = g_value_dup_string (value);
+        break;
+      case PROP_MAX_SIZE:
+        priv->max_size = g_value_get_uint (value);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+salut_avatar_cache_dispose (GObject *object)
+{
+  SalutAvatarCache *self = SALUT_AVATAR_CACHE (object);
+  SalutAvatarCachePrivate *priv = self->priv;
+
+  if (priv->dispose_has_run)
+    return;
+
+  priv->dispose_has_run = TRUE;
+
+  g_queue_clear (&priv->lru);
+  tp_clear_pointer (&priv->entries, g_hash_table_unref);
+
+  if (G_OBJECT_CLASS (salut_avatar_cache_parent_class)->dispose)
+    G_OBJECT_CLASS (salut_avatar_cache_parent_class)->dispose (object);
+}
+
+static void
+salut_avatar_cache_finalize (GObject *object)
+{
+  SalutAvatarCache *self = SALUT_AVATAR_CACHE (object);
+
+  g_free (self->priv->directory);
+
+  G_OBJECT_CLASS (salut_avatar_cache_parent_class)->finalize (object);
+}
+
+static void
+salut_avatar_cache_class_init (SalutAvatarCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GParamSpec *param_spec;
+
+  g_type_class_add_private (object_class, sizeof (SalutAvatarCachePrivate));
+
+  object_class->constructed = salut_avatar_cache_constructed;
+  object_class->get_property = salut_avatar_cache_get_property;
+  object_class->set_property = salut_avatar_cache_set_property;
+  object_class->dispose = salut_avatar_cache_dispose;
+  object_class->finalize = salut_avatar_cache_finalize;
+
+  param_spec = g_param_spec_string (
+      "directory",
+      "directory",
+      "The directory in which avatars are stored",
+      NULL,
+      G_PARAM_CONSTRUCT_ONLY |
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DIRECTORY,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "max-size",
+      "maximum size",
+      "The maximum number of bytes of avatar data kept on disk",
+      0, G_MAXUINT, SALUT_AVATAR_CACHE_DEFAULT_MAX_SIZE,
+      G_PARAM_CONSTRUCT_ONLY |
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_MAX_SIZE,
+      param_spec);
+}
+
+SalutAvatarCache *
+salut_avatar_cache_new (const gchar *directory,
+    gsize max_size)
+{
+  return g_object_new (SALUT_TYPE_AVATAR_CACHE,
+      "directory", directory,
+      "max-size", (guint) MIN (max_size, G_MAXUINT),
+      NULL);
+}
+
+gboolean
+salut_avatar_cache_lookup (SalutAvatarCache *self,
+    const gchar *token,
+    guint8 **data,
+    gsize *size)
+{
+  SalutAvatarCachePrivate *priv = self->priv;
+  CacheEntry *entry;
+  gchar *key;
+  gchar *path;
+  gchar *contents = NULL;
+  gsize length;
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail (token != NULL, FALSE);
+
+  key = token_to_key (token);
+  entry = g_hash_table_lookup (priv->entries, key);
+
+  if (entry == NULL)
+    {
+      g_free (key);
+      return FALSE;
+    }
+
+  path = g_build_filename (priv->directory, key, NULL);
+
+  if (!g_file_get_contents (path, &contents, &length, NULL))
+    {
+      DEBUG ("%s vanished from the cache", key);
+      remove_entry (self, entry, FALSE);
+      goto out;
+    }
+
+  if (token_is_sha1 (token))
+    {
+      gchar *sha1 = sha1_hex ((const guint8 *) contents, length);
+
+      /* don't hand out a truncated or corrupted file */
+      if (tp_strdiff (sha1, key))
+        {
+          DEBUG ("%s doesn't match its content; dropping it", key);
+          remove_entry (self, entry, TRUE);
+          g_free (sha1);
+          g_free (contents);
+          goto out;
+        }
+
+      g_free (sha1);
+    }
+
+  /* mark it as most recently used, in memory and on disk */
+  g_queue_unlink (&priv->lru, entry->link);
+  g_queue_push_head_link (&priv->lru, entry->link);
+  g_utime (path, NULL);
+
+  *data = (guint8 *) contents;
+  *size = length;
+  ret = TRUE;
+
+out:
+  g_free (path);
+  g_free (key);
+  return ret;
+}
+
+void
+salut_avatar_cache_store (SalutAvatarCache *self,
+    const gchar *token,
+    const guint8 *data,
+    gsize size)
+{
+  SalutAvatarCachePrivate *priv = self->priv;
+  CacheEntry *entry;
+  GError *error = NULL;
+  gchar *key;
+  gchar *path;
+
+  g_return_if_fail (token != NULL);
+
+  if (data == NULL || size == 0 || size > priv->max_size)
+    return;
+
+  key = token_to_key (token);
+
+  if (g_hash_table_lookup (priv->entries, key) != NULL)
+    {
+      g_free (key);
+      return;
+    }
+
+  path = g_build_filename (priv->directory, key, NULL);
+
+  if (!g_file_set_contents (path, (const gchar *) data, size, &error))
+    {
+      DEBUG ("failed to store avatar %s: %s", key, error->message);
+      g_error_free (error);
+      goto out;
+    }
+
+  entry = add_entry (self, key, size);
+  DEBUG ("stored %s (%" G_GSIZE_FORMAT " bytes)", entry->key, size);
+
+  evict (self);
+
+out:
+  g_free (path);
+  g_free (key);
+}
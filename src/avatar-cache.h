@@ -0,0 +1,82 @@
+/*
+ * avatar-cache.h - Header for SalutAvatarCache
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SALUT_AVATAR_CACHE_H__
+#define __SALUT_AVATAR_CACHE_H__
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define SALUT_TYPE_AVATAR_CACHE salut_avatar_cache_get_type ()
+
+#define SALUT_AVATAR_CACHE(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), \
+  SALUT_TYPE_AVATAR_CACHE, SalutAvatarCache))
+
+#define SALUT_AVATAR_CACHE_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST ((klass), \
+  SALUT_TYPE_AVATAR_CACHE, SalutAvatarCacheClass))
+
+#define SALUT_IS_AVATAR_CACHE(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), \
+  SALUT_TYPE_AVATAR_CACHE))
+
+#define SALUT_IS_AVATAR_CACHE_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE ((klass), \
+  SALUT_TYPE_AVATAR_CACHE))
+
+#define SALUT_AVATAR_CACHE_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), \
+  SALUT_TYPE_AVATAR_CACHE, SalutAvatarCacheClass))
+
+/* Upper bound on the total size of the avatars kept on disk */
+#define SALUT_AVATAR_CACHE_DEFAULT_MAX_SIZE (8 * 1024 * 1024)
+
+typedef struct _SalutAvatarCache SalutAvatarCache;
+typedef struct _SalutAvatarCacheClass SalutAvatarCacheClass;
+typedef struct _SalutAvatarCachePrivate SalutAvatarCachePrivate;
+
+struct _SalutAvatarCache {
+    GObject parent;
+    SalutAvatarCachePrivate *priv;
+};
+
+struct _SalutAvatarCacheClass {
+    GObjectClass parent_class;
+};
+
+GType salut_avatar_cache_get_type (void);
+
+/* If directory is NULL, $XDG_CACHE_HOME/telepathy/avatars/salut is used */
+SalutAvatarCache *salut_avatar_cache_new (const gchar *directory,
+    gsize max_size);
+
+/* On a hit, *data is set to a newly allocated copy of the avatar which must
+ * be freed with g_free */
+gboolean salut_avatar_cache_lookup (SalutAvatarCache *self,
+    const gchar *token, guint8 **data, gsize *size);
+
+void salut_avatar_cache_store (SalutAvatarCache *self, const gchar *token,
+    const guint8 *data, gsize size);
+
+G_END_DECLS
+
+#endif /* __SALUT_AVATAR_CACHE_H__ */
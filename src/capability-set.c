@@ -346,17 +346,120 @@ gabble_capabilities_finalize (gpointer conn)
     }
 }
 
+/* Feature handles are small consecutive integers allocated by
+ * feature_handles, so a set is stored as a dense bitmap indexed by handle.
+ * Sets are kept trimmed (the last word, if any, is non-zero), which makes
+ * the representation of a given set of features unique. */
+#define BITS_PER_WORD 32
+#define WORD_INDEX(handle) ((handle) / BITS_PER_WORD)
+#define BIT_MASK(handle) (1U << ((handle) % BITS_PER_WORD))
+
 struct _GabbleCapabilitySet {
-    TpHandleSet *handles;
+    guint32 *words;
+    guint n_words;
+    gint ref_count;
+    /* TRUE for the shared, immutable sets returned by
+     * gabble_capability_set_intern() */
+    gboolean interned;
+    guint hash;
 };
 
+/* GabbleCapabilitySet * -> itself, for every interned set. The sets are
+ * borrowed: each one removes itself when its last reference goes away. */
+static GHashTable *interned_sets = NULL;
+
+static void
+ensure_words (GabbleCapabilitySet *caps,
+    guint n_words)
+{
+  if (caps->n_words >= n_words)
+    return;
+
+  caps->words = g_renew (guint32, caps->words, n_words);
+  memset (caps->words + caps->n_words, 0,
+      (n_words - caps->n_words) * sizeof (guint32));
+  caps->n_words = n_words;
+}
+
+static void
+trim_words (GabbleCapabilitySet *caps)
+{
+  while (caps->n_words > 0 && caps->words[caps->n_words - 1] == 0)
+    caps->n_words--;
+
+  if (caps->n_words == 0)
+    {
+      g_free (caps->words);
+      caps->words = NULL;
+    }
+}
+
+static gboolean
+has_handle (const GabbleCapabilitySet *caps,
+    TpHandle handle)
+{
+  if (WORD_INDEX (handle) >= caps->n_words)
+    return FALSE;
+
+  return (caps->words[WORD_INDEX (handle)] & BIT_MASK (handle)) != 0;
+}
+
+static guint
+count_bits (guint32 word)
+{
+  word = word - ((word >> 1) & 0x55555555);
+  word = (word & 0x33333333) + ((word >> 2) & 0x33333333);
+  return (((word + (word >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+static guint
+compute_hash (const GabbleCapabilitySet *caps)
+{
+  guint hash = 5381;
+  guint i;
+
+  for (i = 0; i < caps->n_words; i++)
+    hash = (hash << 5) + hash + caps->words[i];
+
+  return hash;
+}
+
+static gboolean
+words_equal (const GabbleCapabilitySet *a,
+    const GabbleCapabilitySet *b)
+{
+  return a->n_words == b->n_words &&
+    (a->n_words == 0 ||
+     memcmp (a->words, b->words, a->n_words * sizeof (guint32)) == 0);
+}
+
+static guint
+interned_set_hash (gconstpointer key)
+{
+  const GabbleCapabilitySet *caps = key;
+
+  return caps->hash;
+}
+
+static gboolean
+interned_set_equal (gconstpointer a,
+    gconstpointer b)
+{
+  return words_equal (a, b);
+}
+
+#define RETURN_IF_INTERNED(caps) \
+  g_return_if_fail (!(caps)->interned)
+#define RETURN_VAL_IF_INTERNED(caps, val) \
+  g_return_val_if_fail (!(caps)->interned, (val))
+
 GabbleCapabilitySet *
 gabble_capability_set_new (void)
 {
   GabbleCapabilitySet *ret = g_slice_new0 (GabbleCapabilitySet);
 
   g_assert (feature_handles != NULL);
-  ret->handles = tp_handle_set_new (feature_handles);
+  ret->ref_count = 1;
   return ret;
 }
 
@@ -404,6 +507,7 @@ gabble_capability_set_new_from_stanza (WockyNode *query_result)
   return ret;
 }
 
+/* The copy is never interned, so it can be modified even if caps can't */
 GabbleCapabilitySet *
 gabble_capability_set_copy (const GabbleCapabilitySet *caps)
 {
@@ -418,76 +522,111 @@ gabble_capability_set_copy (const GabbleCapabilitySet *caps)
   return ret;
 }
 
-void
-gabble_capability_set_update (GabbleCapabilitySet *target,
-    const GabbleCapabilitySet *source)
+GabbleCapabilitySet *
+gabble_capability_set_ref (GabbleCapabilitySet *caps)
 {
-  TpIntset *ret;
-  g_return_if_fail (target != NULL);
-  g_return_if_fail (source != NULL);
+  g_return_val_if_fail (caps != NULL, NULL);
+  g_return_val_if_fail (caps->ref_count > 0, NULL);
+
+  caps->ref_count++;
+  return caps;
+}
+
+/*
+ * gabble_capability_set_intern:
+ * @caps: a set of capabilities
+ *
+ * Returns a new reference to the shared, immutable set with the same contents
+ * as @caps, creating it if needed. All the interned sets with the same
+ * contents are the same object, so they can be compared by pointer, and
+ * contacts advertising the same capabilities share a single instance. The
+ * reference must be released with gabble_capability_set_free().
+ */
+GabbleCapabilitySet *
+gabble_capability_set_intern (const GabbleCapabilitySet *caps)
+{
+  GabbleCapabilitySet *ret;
+
+  g_return_val_if_fail (caps != NULL, NULL);
 
-  ret = tp_handle_set_update (target->handles,
-    tp_handle_set_peek (source->handles));
+  if (caps->interned)
+    return gabble_capability_set_ref ((GabbleCapabilitySet *) caps);
 
-  tp_intset_destroy (ret);
+  if (interned_sets == NULL)
+    interned_sets = g_hash_table_new (interned_set_hash, interned_set_equal);
+
+  /* the lookup needs the hash, which is only cached on interned sets */
+  ((GabbleCapabilitySet *) caps)->hash = compute_hash (caps);
+
+  ret = g_hash_table_lookup (interned_sets, caps);
+
+  if (ret != NULL)
+    return gabble_capability_set_ref (ret);
+
+  ret = gabble_capability_set_copy (caps);
+  ret->hash = caps->hash;
+  ret->interned = TRUE;
+  g_hash_table_insert (interned_sets, ret, ret);
+
+  return ret;
 }
 
-typedef struct {
-    GSList *deleted;
-    TpHandleSet *intersect_with;
-} IntersectHelper;
+gboolean
+gabble_capability_set_is_interned (const GabbleCapabilitySet *caps)
+{
+  g_return_val_if_fail (caps != NULL, FALSE);
 
-static void
-intersect_helper (TpHandleSet *unused G_GNUC_UNUSED,
-    TpHandle handle,
-    gpointer p)
+  return caps->interned;
+}
+
+void
+gabble_capability_set_update (GabbleCapabilitySet *target,
+    const GabbleCapabilitySet *source)
 {
-  IntersectHelper *data = p;
+  guint i;
+
+  g_return_if_fail (target != NULL);
+  g_return_if_fail (source != NULL);
+  RETURN_IF_INTERNED (target);
 
-  if (!tp_handle_set_is_member (data->intersect_with, handle))
-    data->deleted = g_slist_prepend (data->deleted, GUINT_TO_POINTER (handle));
+  ensure_words (target, source->n_words);
+
+  for (i = 0; i < source->n_words; i++)
+    target->words[i] |= source->words[i];
 }
 
 void
 gabble_capability_set_intersect (GabbleCapabilitySet *target,
     const GabbleCapabilitySet *source)
 {
-  IntersectHelper data = { NULL, NULL };
+  guint i;
 
   g_return_if_fail (target != NULL);
   g_return_if_fail (source != NULL);
+  RETURN_IF_INTERNED (target);
 
   if (target == source)
     return;
 
-  data.intersect_with = source->handles;
-
-  tp_handle_set_foreach (target->handles, intersect_helper, &data);
-
-  while (data.deleted != NULL)
+  for (i = 0; i < target->n_words; i++)
     {
-      DEBUG ("dropping %s", tp_handle_inspect (feature_handles,
-            GPOINTER_TO_UINT (data.deleted->data)));
-      tp_handle_set_remove (target->handles,
-          GPOINTER_TO_UINT (data.deleted->data));
-      data.deleted = g_slist_delete_link (data.deleted, data.deleted);
+      guint32 kept = (i < source->n_words ? source->words[i] : 0);
+
+      target->words[i] &= kept;
     }
-}
 
-static void
-remove_from_set (TpHandleSet *unused G_GNUC_UNUSED,
-    TpHandle handle,
-    gpointer handles)
-{
-  tp_handle_set_remove (handles, handle);
+  trim_words (target);
 }
 
 void
 gabble_capability_set_exclude (GabbleCapabilitySet *caps,
     const GabbleCapabilitySet *removed)
 {
+  guint i;
+
   g_return_if_fail (caps != NULL);
   g_return_if_fail (removed != NULL);
+  RETURN_IF_INTERNED (caps);
 
   if (caps == removed)
     {
@@ -495,7 +634,10 @@ gabble_capability_set_exclude (GabbleCapabilitySet *caps,
       return;
     }
 
-  tp_handle_set_foreach (removed->handles, remove_from_set, caps->handles);
+  for (i = 0; i < caps->n_words && i < removed->n_words; i++)
+    caps->words[i] &= ~removed->words[i];
+
+  trim_words (caps);
 }
 
 void
@@ -506,10 +648,12 @@ gabble_capability_set_add (GabbleCapabilitySet *caps,
 
   g_return_if_fail (caps != NULL);
   g_return_if_fail (cap != NULL);
+  RETURN_IF_INTERNED (caps);
 
   handle = tp_handle_ensure (feature_handles, cap, NULL, NULL);
 
-  tp_handle_set_add (caps->handles, handle);
+  ensure_words (caps, WORD_INDEX (handle) + 1);
+  caps->words[WORD_INDEX (handle)] |= BIT_MASK (handle);
 }
 
 gboolean
@@ -520,39 +664,67 @@ gabble_capability_set_remove (GabbleCapabilitySet *caps,
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (cap != NULL, FALSE);
+  RETURN_VAL_IF_INTERNED (caps, FALSE);
 
   handle = tp_handle_lookup (feature_handles, cap, NULL, NULL);
 
-  if (handle == 0)
+  if (handle == 0 || !has_handle (caps, handle))
     return FALSE;
 
-  return tp_handle_set_remove (caps->handles, handle);
+  caps->words[WORD_INDEX (handle)] &= ~BIT_MASK (handle);
+  trim_words (caps);
+  return TRUE;
 }
 
 void
 gabble_capability_set_clear (GabbleCapabilitySet *caps)
 {
   g_return_if_fail (caps != NULL);
+  RETURN_IF_INTERNED (caps);
 
-  /* There is no tp_handle_set_clear, so do the next best thing */
-  tp_handle_set_destroy (caps->handles);
-  caps->handles = tp_handle_set_new (feature_handles);
+  g_free (caps->words);
+  caps->words = NULL;
+  caps->n_words = 0;
 }
 
+/* Releases a reference to caps; sets which were never shared with
+ * gabble_capability_set_ref() or _intern() are freed immediately. */
 void
 gabble_capability_set_free (GabbleCapabilitySet *caps)
 {
   g_return_if_fail (caps != NULL);
+  g_return_if_fail (caps->ref_count > 0);
 
-  tp_handle_set_destroy (caps->handles);
+  if (--caps->ref_count > 0)
+    return;
+
+  if (caps->interned)
+    {
+      g_hash_table_remove (interned_sets, caps);
+
+      if (g_hash_table_size (interned_sets) == 0)
+        {
+          g_hash_table_unref (interned_sets);
+          interned_sets = NULL;
+        }
+    }
+
+  g_free (caps->words);
   g_slice_free (GabbleCapabilitySet, caps);
 }
 
 gint
 gabble_capability_set_size (const GabbleCapabilitySet *caps)
 {
+  guint i;
+  gint ret = 0;
+
   g_return_val_if_fail (caps != NULL, 0);
-  return tp_handle_set_size (caps->handles);
+
+  for (i = 0; i < caps->n_words; i++)
+    ret += count_bits (caps->words[i]);
+
+  return ret;
 }
 
 /* By design, this function can be used as a GabbleCapabilitySetPredicate */
@@ -573,7 +745,7 @@ gabble_capability_set_has (const GabbleCapabilitySet *caps,
       return FALSE;
     }
 
-  return tp_handle_set_is_member (caps->handles, handle);
+  return has_handle (caps, handle);
 }
 
 /* By design, this function can be used as a GabbleCapabilitySetPredicate */
@@ -581,20 +753,15 @@ gboolean
 gabble_capability_set_has_one (const GabbleCapabilitySet *caps,
     const GabbleCapabilitySet *alternatives)
 {
-  TpIntsetFastIter iter;
-  guint element;
+  guint i;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (alternatives != NULL, FALSE);
 
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (alternatives->handles));
-
-  while (tp_intset_fast_iter_next (&iter, &element))
+  for (i = 0; i < caps->n_words && i < alternatives->n_words; i++)
     {
-      if (tp_handle_set_is_member (caps->handles, element))
-        {
-          return TRUE;
-        }
+      if ((caps->words[i] & alternatives->words[i]) != 0)
+        return TRUE;
     }
 
   return FALSE;
@@ -605,20 +772,22 @@ gboolean
 gabble_capability_set_at_least (const GabbleCapabilitySet *caps,
     const GabbleCapabilitySet *query)
 {
-  TpIntsetFastIter iter;
-  guint element;
+  guint i;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (query != NULL, FALSE);
 
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (query->handles));
+  if (caps == query)
+    return TRUE;
 
-  while (tp_intset_fast_iter_next (&iter, &element))
+  /* both are trimmed, so query has a feature beyond the end of caps */
+  if (query->n_words > caps->n_words)
+    return FALSE;
+
+  for (i = 0; i < query->n_words; i++)
     {
-      if (!tp_handle_set_is_member (caps->handles, element))
-        {
-          return FALSE;
-        }
+      if ((query->words[i] & ~caps->words[i]) != 0)
+        return FALSE;
     }
 
   return TRUE;
@@ -631,58 +800,107 @@ gabble_capability_set_equals (const GabbleCapabilitySet *a,
   g_return_val_if_fail (a != NULL, FALSE);
   g_return_val_if_fail (b != NULL, FALSE);
 
-  return tp_intset_is_equal (tp_handle_set_peek (a->handles),
-      tp_handle_set_peek (b->handles));
+  if (a == b)
+    return TRUE;
+
+  /* there is only ever one interned set with given contents */
+  if (a->interned && b->interned)
+    return FALSE;
+
+  return words_equal (a, b);
 }
 
-/* Does not iterate over quirks, only real features. */
-void
-gabble_capability_set_foreach (const GabbleCapabilitySet *caps,
-    GFunc func, gpointer user_data)
+guint
+gabble_capability_set_hash (const GabbleCapabilitySet *caps)
 {
-  TpIntsetFastIter iter;
-  guint element;
+  g_return_val_if_fail (caps != NULL, 0);
 
-  g_return_if_fail (caps != NULL);
-  g_return_if_fail (func != NULL);
+  if (caps->interned)
+    return caps->hash;
 
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (caps->handles));
+  return compute_hash (caps);
+}
 
-  while (tp_intset_fast_iter_next (&iter, &element))
+/* Calls func for each handle which is in a but not in b; b may be NULL */
+static void
+foreach_handle_difference (const GabbleCapabilitySet *a,
+    const GabbleCapabilitySet *b,
+    void (*func) (TpHandle handle, gpointer user_data),
+    gpointer user_data)
+{
+  guint i;
+
+  for (i = 0; i < a->n_words; i++)
     {
-      const gchar *var = tp_handle_inspect (feature_handles, element);
+      guint32 word = a->words[i];
 
-      g_return_if_fail (var != NULL);
+      if (b != NULL && i < b->n_words)
+        word &= ~b->words[i];
+
+      while (word != 0)
+        {
+          gint bit = g_bit_nth_lsf (word, -1);
 
-      if (var[0] != QUIRK_PREFIX_CHAR)
-        func ((gchar *) var, user_data);
+          word &= ~(1U << bit);
+          func (i * BITS_PER_WORD + bit, user_data);
+        }
     }
 }
 
+typedef struct {
+    GFunc func;
+    gpointer user_data;
+} ForeachHelper;
+
 static void
-append_intset (GString *ret,
-    const TpIntset *cap_ints,
-    const gchar *indent)
+foreach_helper (TpHandle handle,
+    gpointer p)
 {
-  TpIntsetFastIter iter;
-  guint element;
+  ForeachHelper *data = p;
+  const gchar *var = tp_handle_inspect (feature_handles, handle);
 
-  tp_intset_fast_iter_init (&iter, cap_ints);
+  g_return_if_fail (var != NULL);
 
-  while (tp_intset_fast_iter_next (&iter, &element))
-    {
-      const gchar *var = tp_handle_inspect (feature_handles, element);
+  if (var[0] != QUIRK_PREFIX_CHAR)
+    data->func ((gchar *) var, data->user_data);
+}
 
-      g_return_if_fail (var != NULL);
+/* Does not iterate over quirks, only real features. */
+void
+gabble_capability_set_foreach (const GabbleCapabilitySet *caps,
+    GFunc func, gpointer user_data)
+{
+  ForeachHelper data = { func, user_data };
 
-      if (var[0] == QUIRK_PREFIX_CHAR)
-        {
-          g_string_append_printf (ret, "%sQuirk:   %s\n", indent, var + 1);
-        }
-      else
-        {
-          g_string_append_printf (ret, "%sFeature: %s\n", indent, var);
-        }
+  g_return_if_fail (caps != NULL);
+  g_return_if_fail (func != NULL);
+
+  foreach_handle_difference (caps, NULL, foreach_helper, &data);
+}
+
+typedef struct {
+    GString *ret;
+    const gchar *indent;
+} AppendHelper;
+
+static void
+append_handle (TpHandle handle,
+    gpointer p)
+{
+  AppendHelper *data = p;
+  const gchar *var = tp_handle_inspect (feature_handles, handle);
+
+  g_return_if_fail (var != NULL);
+
+  if (var[0] == QUIRK_PREFIX_CHAR)
+    {
+      g_string_append_printf (data->ret, "%sQuirk:   %s\n", data->indent,
+          var + 1);
+    }
+  else
+    {
+      g_string_append_printf (data->ret, "%sFeature: %s\n", data->indent,
+          var);
     }
 }
 
@@ -690,19 +908,20 @@ gchar *
 gabble_capability_set_dump (const GabbleCapabilitySet *caps,
     const gchar *indent)
 {
-  GString *ret;
+  AppendHelper data;
 
   g_return_val_if_fail (caps != NULL, NULL);
 
   if (indent == NULL)
     indent = "";
 
-  ret = g_string_new (indent);
-  g_string_append (ret, "--begin--\n");
-  append_intset (ret, tp_handle_set_peek (caps->handles), indent);
-  g_string_append (ret, indent);
-  g_string_append (ret, "--end--\n");
-  return g_string_free (ret, FALSE);
+  data.ret = g_string_new (indent);
+  data.indent = indent;
+  g_string_append (data.ret, "--begin--\n");
+  foreach_handle_difference (caps, NULL, append_handle, &data);
+  g_string_append (data.ret, indent);
+  g_string_append (data.ret, "--end--\n");
+  return g_string_free (data.ret, FALSE);
 }
 
 gchar *
@@ -710,42 +929,33 @@ gabble_capability_set_dump_diff (const GabbleCapabilitySet *old_caps,
     const GabbleCapabilitySet *new_caps,
     const gchar *indent)
 {
-  TpIntset *old_ints, *new_ints, *rem, *add;
-  GString *ret;
+  AppendHelper data;
 
   g_return_val_if_fail (old_caps != NULL, NULL);
   g_return_val_if_fail (new_caps != NULL, NULL);
 
-  old_ints = tp_handle_set_peek (old_caps->handles);
-  new_ints = tp_handle_set_peek (new_caps->handles);
-
-  if (tp_intset_is_equal (old_ints, new_ints))
+  if (gabble_capability_set_equals (old_caps, new_caps))
     return g_strdup_printf ("%s--no change--", indent);
 
-  rem = tp_intset_difference (old_ints, new_ints);
-  add = tp_intset_difference (new_ints, old_ints);
+  data.ret = g_string_new ("");
+  data.indent = indent;
 
-  ret = g_string_new ("");
-
-  if (!tp_intset_is_empty (rem))
+  if (!gabble_capability_set_at_least (new_caps, old_caps))
     {
-      g_string_append (ret, indent);
-      g_string_append (ret, "--removed--\n");
-      append_intset (ret, rem, indent);
+      g_string_append (data.ret, indent);
+      g_string_append (data.ret, "--removed--\n");
+      foreach_handle_difference (old_caps, new_caps, append_handle, &data);
     }
 
-  if (!tp_intset_is_empty (add))
+  if (!gabble_capability_set_at_least (old_caps, new_caps))
     {
-      g_string_append (ret, indent);
-      g_string_append (ret, "--added--\n");
-      append_intset (ret, add, indent);
+      g_string_append (data.ret, indent);
+      g_string_append (data.ret, "--added--\n");
+      foreach_handle_difference (new_caps, old_caps, append_handle, &data);
     }
 
-  g_string_append (ret, indent);
-  g_string_append (ret, "--end--");
-
-  tp_intset_destroy (add);
-  tp_intset_destroy (rem);
+  g_string_append (data.ret, indent);
+  g_string_append (data.ret, "--end--");
 
-  return g_string_free (ret, FALSE);
+  return g_string_free (data.ret, FALSE);
 }
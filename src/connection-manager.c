@@ -60,6 +60,7 @@ salut_connection_manager_init (SalutConnectionManager *self)
       SALUT_TYPE_CONNECTION_MANAGER, SalutConnectionManagerPrivate);
 
   priv->debug_sender = tp_debug_sender_dup ();
+  debug_watch_sender (priv->debug_sender);
   g_log_set_default_handler (tp_debug_sender_log_handler, G_LOG_DOMAIN);
 
   self->priv = priv;
@@ -0,0 +1,423 @@
+/*
+ * connection-warmup.c - Opening link-local connections early
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "connection-warmup.h"
+
+#include <string.h>
+
+#define DEBUG_FLAG DEBUG_CONNECTION
+#include "debug.h"
+
+#define DEFAULT_MAX_CONNECTIONS 16
+
+/* in seconds */
+#define IDLE_TIMEOUT 300
+#define REAP_INTERVAL 60
+
+typedef struct {
+  WockyLLContact *contact;
+  gint64 last_used;
+  /* non-NULL while the connection is being opened */
+  GCancellable *cancellable;
+  /* wocky_meta_porter_open_async() holds the connection it opened for us */
+  gboolean held;
+} Entry;
+
+typedef struct {
+  SalutConnectionWarmup *self;
+  WockyLLContact *contact;
+  GCancellable *cancellable;
+  gint64 started;
+} OpenData;
+
+struct _SalutConnectionWarmup {
+  /* NULL in tests */
+  WockyMetaPorter *porter;
+  guint max_connections;
+
+  /* Entry, most recently used first */
+  GQueue lru;
+  /* borrowed WockyLLContact => GList link in lru */
+  GHashTable *links;
+
+  guint reap_source;
+
+  guint histogram[SALUT_CONNECTION_WARMUP_N_BUCKETS];
+  /* id of the histogram on the debug interface */
+  guint stats_id;
+
+  /* opens connections instead of the porter in tests */
+  SalutConnectionWarmupTestOpenFunc test_open_func;
+  gpointer test_open_data;
+};
+
+static void
+entry_free (SalutConnectionWarmup *self,
+    Entry *entry)
+{
+  if (entry->cancellable != NULL)
+    {
+      /* the open callback sees this and forgets about it */
+      g_cancellable_cancel (entry->cancellable);
+      g_object_unref (entry->cancellable);
+    }
+
+  /* the meta porter closes the connection after a while if nobody else
+   * holds it */
+  if (entry->held && self->porter != NULL)
+    wocky_meta_porter_unhold (self->porter, WOCKY_CONTACT (entry->contact));
+
+  g_object_unref (entry->contact);
+  g_slice_free (Entry, entry);
+}
+
+static void
+remove_link (SalutConnectionWarmup *self,
+    GList *link)
+{
+  Entry *entry = link->data;
+
+  g_hash_table_remove (self->links, entry->contact);
+  g_queue_delete_link (&self->lru, link);
+  entry_free (self, entry);
+}
+
+static void
+record_latency (SalutConnectionWarmup *self,
+    gint64 usec)
+{
+  guint i;
+
+  for (i = 0; i < SALUT_CONNECTION_WARMUP_N_BUCKETS - 1; i++)
+    {
+      if (usec < (G_GINT64_CONSTANT (1000) << i))
+        break;
+    }
+
+  self->histogram[i]++;
+}
+
+/* porter is NULL in tests */
+static void
+open_done (OpenData *data,
+    WockyMetaPorter *porter,
+    gboolean opened,
+    const GError *error)
+{
+  SalutConnectionWarmup *self = data->self;
+  GList *link;
+  Entry *entry;
+
+  if (g_cancellable_is_cancelled (data->cancellable))
+    {
+      /* evicted while we were opening it, so self may be gone too */
+      if (opened && porter != NULL)
+        wocky_meta_porter_unhold (porter, WOCKY_CONTACT (data->contact));
+
+      goto out;
+    }
+
+  link = g_hash_table_lookup (self->links, data->contact);
+  g_assert (link != NULL);
+  entry = link->data;
+
+  g_object_unref (entry->cancellable);
+  entry->cancellable = NULL;
+
+  if (!opened)
+    {
+      DEBUG ("couldn't open a connection to %s: %s",
+          wocky_ll_contact_get_jid (data->contact),
+          error->message);
+      remove_link (self, link);
+      goto out;
+    }
+
+  entry->held = TRUE;
+  record_latency (self, g_get_monotonic_time () - data->started);
+
+  DEBUG ("connection to %s open after %" G_GINT64_FORMAT " ms",
+      wocky_ll_contact_get_jid (data->contact),
+      (g_get_monotonic_time () - data->started) / 1000);
+
+out:
+  g_object_unref (data->contact);
+  g_object_unref (data->cancellable);
+  g_slice_free (OpenData, data);
+}
+
+static void
+open_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  GError *error = NULL;
+  gboolean opened;
+
+  opened = wocky_meta_porter_open_finish (WOCKY_META_PORTER (source), result,
+      &error);
+  open_done (user_data, WOCKY_META_PORTER (source), opened, error);
+  g_clear_error (&error);
+}
+
+static gchar *
+stats_cb (gpointer user_data)
+{
+  SalutConnectionWarmup *self = user_data;
+  GString *line;
+  guint i;
+
+  line = g_string_new ("connections warmed up:");
+
+  for (i = 0; i < SALUT_CONNECTION_WARMUP_N_BUCKETS - 1; i++)
+    {
+      if (self->histogram[i] > 0)
+        g_string_append_printf (line, " %u in under %u ms,",
+            self->histogram[i], 1 << i);
+    }
+
+  if (self->histogram[i] > 0)
+    g_string_append_printf (line, " %u took longer,", self->histogram[i]);
+
+  /* nothing opened yet */
+  if (line->str[line->len - 1] == ':')
+    {
+      g_string_free (line, TRUE);
+      return NULL;
+    }
+
+  g_string_truncate (line, line->len - 1);
+  return g_string_free (line, FALSE);
+}
+
+static guint
+max_connections_from_env (void)
+{
+  const gchar *value = g_getenv ("SALUT_WARMUP_MAX_CONNECTIONS");
+  gchar *end;
+  guint64 max;
+
+  if (value == NULL)
+    return DEFAULT_MAX_CONNECTIONS;
+
+  /* g_ascii_strtoull () takes a sign and negates what follows it */
+  max = g_ascii_strtoull (value, &end, 10);
+  if (!g_ascii_isdigit (value[0]) || *end != '\0' || max > G_MAXUINT)
+    {
+      DEBUG ("ignoring invalid SALUT_WARMUP_MAX_CONNECTIONS: %s", value);
+      return DEFAULT_MAX_CONNECTIONS;
+    }
+
+  return max;
+}
+
+/* Lets go of the connections that have been idle for too long at now */
+static void
+reap (SalutConnectionWarmup *self,
+    gint64 now)
+{
+  gint64 oldest = now - IDLE_TIMEOUT * G_USEC_PER_SEC;
+
+  /* least recently used at the tail */
+  while (self->lru.tail != NULL &&
+      ((Entry *) self->lru.tail->data)->last_used < oldest)
+    {
+      DEBUG ("letting go of the idle connection to %s",
+          wocky_ll_contact_get_jid (
+              ((Entry *) self->lru.tail->data)->contact));
+      remove_link (self, self->lru.tail);
+    }
+}
+
+static gboolean
+reap_cb (gpointer user_data)
+{
+  SalutConnectionWarmup *self = user_data;
+
+  reap (self, g_get_monotonic_time ());
+
+  if (self->lru.length > 0)
+    return TRUE;
+
+  self->reap_source = 0;
+  return FALSE;
+}
+
+SalutConnectionWarmup *
+salut_connection_warmup_new (WockyMetaPorter *porter)
+{
+  SalutConnectionWarmup *self = g_slice_new0 (SalutConnectionWarmup);
+
+  self->porter = porter;
+  /* 0 turns warming up off */
+  self->max_connections = max_connections_from_env ();
+  g_queue_init (&self->lru);
+  self->links = g_hash_table_new (NULL, NULL);
+
+  self->stats_id = debug_add_stats (DEBUG_FLAG, stats_cb, self);
+
+  return self;
+}
+
+void
+salut_connection_warmup_free (SalutConnectionWarmup *self)
+{
+  /* reports the histogram one last time */
+  debug_remove_stats (self->stats_id);
+
+  while (self->lru.head != NULL)
+    remove_link (self, self->lru.head);
+
+  if (self->reap_source != 0)
+    g_source_remove (self->reap_source);
+
+  g_hash_table_unref (self->links);
+  g_slice_free (SalutConnectionWarmup, self);
+}
+
+void
+salut_connection_warmup_touch (SalutConnectionWarmup *self,
+    WockyLLContact *contact)
+{
+  GList *link;
+  Entry *entry;
+  OpenData *data;
+
+  if (self->max_connections == 0)
+    return;
+
+  link = g_hash_table_lookup (self->links, contact);
+  if (link != NULL)
+    {
+      entry = link->data;
+      entry->last_used = g_get_monotonic_time ();
+
+      g_queue_unlink (&self->lru, link);
+      g_queue_push_head_link (&self->lru, link);
+      return;
+    }
+
+  entry = g_slice_new0 (Entry);
+  entry->contact = g_object_ref (contact);
+  entry->last_used = g_get_monotonic_time ();
+  entry->cancellable = g_cancellable_new ();
+
+  g_queue_push_head (&self->lru, entry);
+  g_hash_table_insert (self->links, contact, self->lru.head);
+
+  while (self->lru.length > self->max_connections)
+    {
+      DEBUG ("over the budget of %u connections, letting go of %s",
+          self->max_connections, wocky_ll_contact_get_jid (
+              ((Entry *) self->lru.tail->data)->contact));
+      remove_link (self, self->lru.tail);
+    }
+
+  data = g_slice_new (OpenData);
+  data->self = self;
+  data->contact = g_object_ref (contact);
+  data->cancellable = g_object_ref (entry->cancellable);
+  data->started = entry->last_used;
+
+  DEBUG ("warming up the connection to %s",
+      wocky_ll_contact_get_jid (contact));
+
+  if (self->test_open_func != NULL)
+    self->test_open_func (contact, entry->cancellable, data,
+        self->test_open_data);
+  else
+    wocky_meta_porter_open_async (self->porter, contact, entry->cancellable,
+        open_cb, data);
+
+  if (self->reap_source == 0)
+    self->reap_source = g_timeout_add_seconds (REAP_INTERVAL, reap_cb, self);
+}
+
+void
+salut_connection_warmup_forget (SalutConnectionWarmup *self,
+    WockyLLContact *contact)
+{
+  GList *link = g_hash_table_lookup (self->links, contact);
+
+  if (link == NULL)
+    return;
+
+  DEBUG ("%s went away, letting go of the connection to them",
+      wocky_ll_contact_get_jid (contact));
+  remove_link (self, link);
+}
+
+void
+salut_connection_warmup_get_latency_histogram (SalutConnectionWarmup *self,
+    guint buckets[SALUT_CONNECTION_WARMUP_N_BUCKETS])
+{
+  memcpy (buckets, self->histogram, sizeof (self->histogram));
+}
+
+guint
+_salut_connection_warmup_TEST_get_max_connections (
+    SalutConnectionWarmup *self)
+{
+  return self->max_connections;
+}
+
+void
+_salut_connection_warmup_TEST_record_latency (SalutConnectionWarmup *self,
+    gint64 usec)
+{
+  record_latency (self, usec);
+}
+
+void
+_salut_connection_warmup_TEST_set_open_func (SalutConnectionWarmup *self,
+    SalutConnectionWarmupTestOpenFunc func,
+    gpointer user_data)
+{
+  self->test_open_func = func;
+  self->test_open_data = user_data;
+}
+
+void
+_salut_connection_warmup_TEST_open_done (gpointer open_data,
+    gboolean opened)
+{
+  GError *error = NULL;
+
+  if (!opened)
+    g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_CONNECTION_REFUSED,
+        "refused by the test");
+
+  open_done (open_data, NULL, opened, error);
+  g_clear_error (&error);
+}
+
+void
+_salut_connection_warmup_TEST_reap (SalutConnectionWarmup *self,
+    gint64 now)
+{
+  reap (self, now);
+}
+
+gboolean
+_salut_connection_warmup_TEST_is_warm (SalutConnectionWarmup *self,
+    WockyLLContact *contact)
+{
+  return g_hash_table_lookup (self->links, contact) != NULL;
+}
@@ -0,0 +1,84 @@
+/*
+ * connection-warmup.h - Header for opening link-local connections early
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SALUT_CONNECTION_WARMUP_H__
+#define __SALUT_CONNECTION_WARMUP_H__
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+G_BEGIN_DECLS
+
+/* Opens the XMPP connections to the contacts we're likely to talk to before
+ * we have anything to send them, so that the first message or tube offer
+ * doesn't wait for the TCP connection and the stream handshake. The
+ * connections are kept open for the most recently used contacts only, up to
+ * SALUT_WARMUP_MAX_CONNECTIONS of them (16 by default), and let go after
+ * five minutes without traffic. */
+typedef struct _SalutConnectionWarmup SalutConnectionWarmup;
+
+/* Bucket i counts the connections that took less than 2^i ms to open; the
+ * last one counts the rest. The histogram is also reported on the Debug
+ * interface. */
+#define SALUT_CONNECTION_WARMUP_N_BUCKETS 14
+
+SalutConnectionWarmup *salut_connection_warmup_new (WockyMetaPorter *porter);
+
+void salut_connection_warmup_free (SalutConnectionWarmup *self);
+
+/* To be called when there's been traffic with contact, or it looks like
+ * there will be */
+void salut_connection_warmup_touch (SalutConnectionWarmup *self,
+    WockyLLContact *contact);
+
+/* To be called when contact went away: cancels opening the connection to
+ * them, or lets go of it */
+void salut_connection_warmup_forget (SalutConnectionWarmup *self,
+    WockyLLContact *contact);
+
+void salut_connection_warmup_get_latency_histogram (
+    SalutConnectionWarmup *self,
+    guint buckets[SALUT_CONNECTION_WARMUP_N_BUCKETS]);
+
+/* For testing only */
+guint _salut_connection_warmup_TEST_get_max_connections (
+    SalutConnectionWarmup *self);
+void _salut_connection_warmup_TEST_record_latency (
+    SalutConnectionWarmup *self, gint64 usec);
+
+/* Called instead of wocky_meta_porter_open_async(); the result is passed
+ * back with _salut_connection_warmup_TEST_open_done() */
+typedef void (*SalutConnectionWarmupTestOpenFunc) (WockyLLContact *contact,
+    GCancellable *cancellable, gpointer open_data, gpointer user_data);
+void _salut_connection_warmup_TEST_set_open_func (
+    SalutConnectionWarmup *self, SalutConnectionWarmupTestOpenFunc func,
+    gpointer user_data);
+void _salut_connection_warmup_TEST_open_done (gpointer open_data,
+    gboolean opened);
+/* Lets go of the idle connections as if it was now, in g_get_monotonic_time()
+ * microseconds */
+void _salut_connection_warmup_TEST_reap (SalutConnectionWarmup *self,
+    gint64 now);
+gboolean _salut_connection_warmup_TEST_is_warm (SalutConnectionWarmup *self,
+    WockyLLContact *contact);
+
+G_END_DECLS
+
+#endif /* __SALUT_CONNECTION_WARMUP_H__ */
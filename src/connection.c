@@ -39,6 +39,7 @@
 #ifdef USE_BACKEND_AVAHI
 #include "avahi-discovery-client.h"
 #endif
+#include "avatar-cache.h"
 #include "capabilities.h"
 #include "caps-hash.h"
 #include "connection-contact-info.h"
@@ -103,8 +104,35 @@ salut_plugin_connection_iface_init (SalutPluginConnectionInterface *iface,
 
 static void salut_conn_sidecars_iface_init (gpointer, gpointer);
 
+static void salut_free_enhanced_contact_capabilities (GPtrArray *caps);
+
 #define DISCONNECT_TIMEOUT 5
 
+/* Distinct capability sets whose requestable channel classes are kept; the
+ * cache is flushed when it grows beyond that, which only happens on networks
+ * with a very diverse set of clients */
+#define CONTACT_CAPS_CACHE_SIZE 256
+
+/* Milestones of the connection startup, whose timing is logged in the
+ * "startup" debug domain so we can keep an eye on time-to-usable */
+typedef enum {
+  STARTUP_PHASE_CONNECTING = 0,
+  STARTUP_PHASE_DISCOVERY_CLIENT_RUNNING,
+  STARTUP_PHASE_SELF_ESTABLISHED,
+  STARTUP_PHASE_ALL_FOR_NOW,
+  NUM_STARTUP_PHASES
+} StartupPhase;
+
+static const gchar * const startup_phase_names[NUM_STARTUP_PHASES] = {
+  "connecting",
+  "discovery client running",
+  "self established",
+  "all for now",
+};
+
+#define STARTUP_DEBUG(format, ...) \
+  debug (DEBUG_STARTUP, "%s: " format, G_STRFUNC, ##__VA_ARGS__)
+
 G_DEFINE_TYPE_WITH_CODE(SalutConnection,
     salut_connection,
     TP_TYPE_BASE_CONNECTION,
@@ -236,6 +264,14 @@ struct _SalutConnectionPrivate
 
   /* DNS-SD name, used for the avahi backend */
   gchar *dnssd_name;
+
+  /* interned GabbleCapabilitySet * of contacts -> GPtrArray of
+   * requestable channel classes built by the channel managers for it.
+   * Emptied when the local client capabilities change. */
+  GHashTable *contact_caps_cache;
+
+  /* monotonic time at which each StartupPhase was reached, or 0 */
+  gint64 startup_times[NUM_STARTUP_PHASES];
 };
 
 typedef struct _ChannelRequest ChannelRequest;
@@ -326,6 +362,7 @@ salut_connection_init (SalutConnection *obj)
    * parent->constructor */
   obj->session = wocky_session_new_ll (NULL);
   obj->porter = wocky_session_get_porter (obj->session);
+  obj->warmup = salut_connection_warmup_new (WOCKY_META_PORTER (obj->porter));
 
   /* allocate any data required by the object here */
   priv->published_name = g_strdup (g_get_user_name ());
@@ -364,6 +401,8 @@ salut_connection_constructed (GObject *obj)
   self->presence_cache = salut_presence_cache_new (self);
   g_signal_connect (self->presence_cache, "capabilities-update", G_CALLBACK
       (connection_capabilities_update_cb), self);
+  self->avatar_cache = salut_avatar_cache_new (NULL,
+      SALUT_AVATAR_CACHE_DEFAULT_MAX_SIZE);
 
   tp_contacts_mixin_init (obj,
       G_STRUCT_OFFSET (SalutConnection, contacts_mixin));
@@ -384,6 +423,10 @@ salut_connection_constructed (GObject *obj)
       TP_IFACE_CONNECTION_INTERFACE_CONTACT_CAPABILITIES,
           conn_contact_capabilities_fill_contact_attributes);
 
+  self->priv->contact_caps_cache = g_hash_table_new_full (NULL, NULL,
+      (GDestroyNotify) gabble_capability_set_free,
+      (GDestroyNotify) salut_free_enhanced_contact_capabilities);
+
   self->priv->sidecars = g_hash_table_new_full (g_str_hash, g_str_equal,
       g_free, g_object_unref);
   self->priv->pending_sidecars = g_hash_table_new_full (g_str_hash, g_str_equal,
@@ -953,6 +996,12 @@ salut_connection_dispose (GObject *object)
       self->presence_cache = NULL;
     }
 
+  if (self->avatar_cache != NULL)
+    {
+      g_object_unref (self->avatar_cache);
+      self->avatar_cache = NULL;
+    }
+
   if (priv->pre_connect_message != NULL)
     {
       g_free (priv->pre_connect_message);
@@ -990,6 +1039,8 @@ salut_connection_dispose (GObject *object)
     }
 #endif
 
+  tp_clear_pointer (&self->warmup, salut_connection_warmup_free);
+
   if (self->session != NULL)
     {
       g_object_unref (self->session);
@@ -1013,6 +1064,8 @@ salut_connection_dispose (GObject *object)
     }
 #endif
 
+  tp_clear_pointer (&priv->contact_caps_cache, g_hash_table_unref);
+
   g_warn_if_fail (g_hash_table_size (priv->sidecars) == 0);
   tp_clear_pointer (&priv->sidecars, g_hash_table_unref);
 
@@ -1092,6 +1145,71 @@ announce_self_caps (SalutConnection *self,
   return ret;
 }
 
+static void
+startup_phase_reached (SalutConnection *self,
+    StartupPhase phase)
+{
+  SalutConnectionPrivate *priv = self->priv;
+  gint64 now = g_get_monotonic_time ();
+  gint64 start = priv->startup_times[STARTUP_PHASE_CONNECTING];
+
+  if (priv->startup_times[phase] != 0)
+    return;
+
+  priv->startup_times[phase] = now;
+
+  if (phase == STARTUP_PHASE_CONNECTING)
+    return;
+
+  STARTUP_DEBUG ("%s after %.3f s", startup_phase_names[phase],
+      (now - start) / 1e6);
+
+  if (priv->startup_times[STARTUP_PHASE_SELF_ESTABLISHED] != 0 &&
+      priv->startup_times[STARTUP_PHASE_ALL_FOR_NOW] != 0)
+    STARTUP_DEBUG ("usable after %.3f s", (now - start) / 1e6);
+}
+
+static void
+_contact_manager_all_for_now_cb (SalutContactManager *mgr,
+    SalutConnection *self)
+{
+  startup_phase_reached (self, STARTUP_PHASE_ALL_FOR_NOW);
+}
+
+/* Starts looking for contacts and rooms; disconnects on failure */
+static gboolean
+start_browsing (SalutConnection *self)
+{
+  SalutConnectionPrivate *priv = self->priv;
+  GError *error = NULL;
+
+  if (!salut_contact_manager_start (priv->contact_manager, &error))
+    {
+      DEBUG ("failed to start contact manager: %s", error->message);
+      g_clear_error (&error);
+
+      tp_base_connection_change_status (TP_BASE_CONNECTION (self),
+          TP_CONNECTION_STATUS_DISCONNECTED,
+          TP_CONNECTION_STATUS_REASON_NETWORK_ERROR);
+      return FALSE;
+    }
+
+#ifndef USE_BACKEND_BONJOUR
+  if (!salut_roomlist_manager_start (priv->roomlist_manager, &error))
+    {
+      DEBUG ("failed to start roomlist manager: %s", error->message);
+      g_clear_error (&error);
+
+      tp_base_connection_change_status (TP_BASE_CONNECTION (self),
+          TP_CONNECTION_STATUS_DISCONNECTED,
+          TP_CONNECTION_STATUS_REASON_NETWORK_ERROR);
+      return FALSE;
+    }
+#endif
+
+  return TRUE;
+}
+
 static void
 _self_established_cb (SalutSelf *s, gpointer data)
 {
@@ -1103,6 +1221,7 @@ _self_established_cb (SalutSelf *s, gpointer data)
   GError *error = NULL;
 
   priv->self_established = TRUE;
+  startup_phase_reached (self, STARTUP_PHASE_SELF_ESTABLISHED);
 
   g_free (self->name);
   self->name = g_strdup (s->name);
@@ -1124,28 +1243,11 @@ _self_established_cb (SalutSelf *s, gpointer data)
   g_free (priv->pre_connect_message);
   priv->pre_connect_message = NULL;
 
-  if (!salut_contact_manager_start (priv->contact_manager, &error))
-    {
-      DEBUG ("failed to start contact manager: %s", error->message);
-      g_clear_error (&error);
-
-      tp_base_connection_change_status ( TP_BASE_CONNECTION (base),
-          TP_CONNECTION_STATUS_DISCONNECTED,
-          TP_CONNECTION_STATUS_REASON_NETWORK_ERROR);
-      return;
-  }
-
-#ifndef USE_BACKEND_BONJOUR
-  if (!salut_roomlist_manager_start (priv->roomlist_manager, &error))
-    {
-      DEBUG ("failed to start roomlist manager: %s", error->message);
-      g_clear_error (&error);
-
-      tp_base_connection_change_status ( TP_BASE_CONNECTION (base),
-          TP_CONNECTION_STATUS_DISCONNECTED,
-          TP_CONNECTION_STATUS_REASON_NETWORK_ERROR);
-      return;
-    }
+#ifdef USE_BACKEND_BONJOUR
+  /* The bonjour contact manager recognises our own service by its name, so
+   * it can't be started before we know it */
+  if (!start_browsing (self))
+    return;
 #endif
 
 #ifdef ENABLE_OLPC
@@ -1163,6 +1265,9 @@ _self_established_cb (SalutSelf *s, gpointer data)
 
   tp_base_connection_change_status (base, TP_CONNECTION_STATUS_CONNECTED,
       TP_CONNECTION_STATUS_REASON_NONE_SPECIFIED);
+
+  /* Announce the contacts found while we were establishing our service */
+  salut_contact_manager_self_established (priv->contact_manager);
 }
 
 
@@ -1184,6 +1289,8 @@ discovery_client_running (SalutConnection *self)
   GError *error = NULL;
   guint16 port;
 
+  startup_phase_reached (self, STARTUP_PHASE_DISCOVERY_CLIENT_RUNNING);
+
   priv->self = salut_discovery_client_create_self (priv->discovery_client,
       self, priv->nickname, priv->first_name, priv->last_name, priv->jid,
       priv->email, priv->published_name,
@@ -1240,6 +1347,10 @@ discovery_client_running (SalutConnection *self)
   /* Create the bytestream manager */
   priv->si_bytestream_manager = salut_si_bytestream_manager_new (self,
     salut_discovery_client_get_host_name_fqdn (priv->discovery_client));
+
+  /* Don't wait for Avahi to be done probing our name before browsing: the
+   * contact manager holds what it finds back until we're established */
+  start_browsing (self);
 #endif
 }
 
@@ -1438,6 +1549,28 @@ salut_connection_aliasing_fill_contact_attributes (GObject *obj,
     }
 }
 
+static void
+get_caps_from_channel_managers (SalutConnection *self,
+    TpHandle handle,
+    const GabbleCapabilitySet *set,
+    GPtrArray *arr)
+{
+  TpBaseConnection *base_conn = TP_BASE_CONNECTION (self);
+  TpChannelManagerIter iter;
+  TpChannelManager *manager;
+
+  tp_base_connection_channel_manager_iter_init (&iter, base_conn);
+
+  while (tp_base_connection_channel_manager_iter_next (&iter, &manager))
+    {
+      /* all channel managers must implement the capability interface */
+      g_assert (GABBLE_IS_CAPS_CHANNEL_MANAGER (manager));
+
+      gabble_caps_channel_manager_get_contact_capabilities (
+          GABBLE_CAPS_CHANNEL_MANAGER (manager), handle, set, arr);
+    }
+}
+
 /**
  * salut_connection_get_handle_contact_capabilities
  *
@@ -1448,41 +1581,56 @@ salut_connection_get_handle_contact_capabilities (SalutConnection *self,
   TpHandle handle, GPtrArray *arr)
 {
   TpBaseConnection *base_conn = TP_BASE_CONNECTION (self);
-  TpChannelManagerIter iter;
-  TpChannelManager *manager;
-  const GabbleCapabilitySet *set;
-  SalutContact *contact = NULL;
+  SalutConnectionPrivate *priv = self->priv;
+  SalutContact *contact;
+  GPtrArray *cached;
+  guint i;
 
   if (handle == tp_base_connection_get_self_handle (base_conn))
     {
-      if (self->priv->self == NULL)
+      if (priv->self == NULL)
         return;
 
-      set = salut_self_get_caps (self->priv->self);
+      get_caps_from_channel_managers (self, handle,
+          salut_self_get_caps (priv->self), arr);
+      return;
     }
-  else
-    {
-      contact = salut_contact_manager_get_contact (
-          self->priv->contact_manager, handle);
 
-      if (contact == NULL)
-        return;
+  contact = salut_contact_manager_get_contact (priv->contact_manager, handle);
 
-      set = contact->caps;
+  if (contact == NULL)
+    return;
+
+  if (!gabble_capability_set_is_interned (contact->caps))
+    {
+      get_caps_from_channel_managers (self, handle, contact->caps, arr);
+      g_object_unref (contact);
+      return;
     }
 
-  tp_base_connection_channel_manager_iter_init (&iter, base_conn);
+  /* Apart from the self handle, what the channel managers return only
+   * depends on the capability set, which is shared by every contact with
+   * the same caps */
+  cached = g_hash_table_lookup (priv->contact_caps_cache, contact->caps);
 
-  while (tp_base_connection_channel_manager_iter_next (&iter, &manager))
+  if (cached == NULL)
     {
-      /* all channel managers must implement the capability interface */
-      g_assert (GABBLE_IS_CAPS_CHANNEL_MANAGER (manager));
+      if (g_hash_table_size (priv->contact_caps_cache) >=
+          CONTACT_CAPS_CACHE_SIZE)
+        g_hash_table_remove_all (priv->contact_caps_cache);
 
-      gabble_caps_channel_manager_get_contact_capabilities (
-          GABBLE_CAPS_CHANNEL_MANAGER (manager), handle, set, arr);
+      cached = g_ptr_array_new ();
+      get_caps_from_channel_managers (self, handle, contact->caps, cached);
+      g_hash_table_insert (priv->contact_caps_cache,
+          gabble_capability_set_ref (contact->caps), cached);
     }
 
-  tp_clear_object (&contact);
+  for (i = 0; i < cached->len; i++)
+    g_ptr_array_add (arr, g_boxed_copy (
+          TP_STRUCT_TYPE_REQUESTABLE_CHANNEL_CLASS,
+          g_ptr_array_index (cached, i)));
+
+  g_object_unref (contact);
 }
 
 static void
@@ -2209,6 +2357,10 @@ salut_connection_update_capabilities (
           GABBLE_CAPS_CHANNEL_MANAGER (manager));
     }
 
+  /* the channel managers' view of the contacts' caps may depend on the
+   * clients they represent */
+  g_hash_table_remove_all (priv->contact_caps_cache);
+
   DEBUG ("enter");
 
   /* we're going to reset our self caps to the bare caps that we
@@ -3392,6 +3544,11 @@ _contact_manager_contact_change_cb (SalutContactManager *mgr,
   if (changes & SALUT_CONTACT_STATUS_CHANGED)
     {
       _contact_manager_contact_status_changed (self, contact, handle);
+
+      /* don't keep a connection to somebody who left open, or opening */
+      if (contact->status == SALUT_PRESENCE_OFFLINE && self->warmup != NULL)
+        salut_connection_warmup_forget (self->warmup,
+            WOCKY_LL_CONTACT (contact));
     }
 
   if (changes & SALUT_CONTACT_AVATAR_CHANGED)
@@ -3545,6 +3702,8 @@ salut_connection_create_channel_factories (TpBaseConnection *base)
       priv->discovery_client, self);
   g_signal_connect (priv->contact_manager, "contact-change",
       G_CALLBACK (_contact_manager_contact_change_cb), self);
+  g_signal_connect (priv->contact_manager, "all-for-now",
+      G_CALLBACK (_contact_manager_all_for_now_cb), self);
 
 #ifdef ENABLE_OLPC
   priv->uninvite_handler_id = wocky_porter_register_handler_from_anyone (
@@ -3827,6 +3986,8 @@ salut_connection_start_connecting (TpBaseConnection *base, GError **error)
   SalutConnectionPrivate *priv = self->priv;
   GError *client_error = NULL;
 
+  startup_phase_reached (self, STARTUP_PHASE_CONNECTING);
+
   g_signal_connect (priv->discovery_client, "state-changed",
       G_CALLBACK (_discovery_client_state_changed_cb), self);
 
@@ -30,6 +30,8 @@
 
 #include <wocky/wocky.h>
 
+#include "connection-warmup.h"
+
 #include "salut/plugin-connection.h"
 
 G_BEGIN_DECLS
@@ -54,6 +56,7 @@ typedef struct _SalutConnectionClass SalutConnectionClass;
 GType salut_connection_get_type (void);
 
 typedef struct _SalutPresenceCache SalutPresenceCache;
+typedef struct _SalutAvatarCache SalutAvatarCache;
 typedef struct _SalutDisco SalutDisco;
 
 typedef struct _SalutConnectionPrivate SalutConnectionPrivate;
@@ -71,10 +74,12 @@ struct _SalutConnection {
   TpContactsMixin contacts_mixin;
 
   SalutPresenceCache *presence_cache;
+  SalutAvatarCache *avatar_cache;
   SalutDisco *disco;
 
   WockySession *session;
   WockyPorter *porter;
+  SalutConnectionWarmup *warmup;
 
   /* Our name on the network */
   gchar *name;
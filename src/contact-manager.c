@@ -29,6 +29,7 @@
 #include "connection.h"
 #include "contact.h"
 #include "enumtypes.h"
+#include "presence-cache.h"
 
 #include <telepathy-glib/telepathy-glib.h>
 
@@ -61,6 +62,14 @@ struct _SalutContactManagerPrivate
 {
   TpHandleSet *handles;
   gulong status_changed_id;
+
+  /* We may start browsing before our own service is established; until it
+   * is, contact changes are merged in pending_changes (contact name ->
+   * SALUT_CONTACT_* flags) and the contact list isn't announced. */
+  gboolean self_established;
+  gboolean all_for_now;
+  GHashTable *pending_changes;
+
   gboolean dispose_has_run;
 };
 
@@ -179,6 +188,8 @@ salut_contact_manager_constructed (GObject *obj)
   contact_repo = tp_base_connection_get_handles (base_connection,
       TP_HANDLE_TYPE_CONTACT);
   priv->handles = tp_handle_set_new (contact_repo);
+  priv->pending_changes = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
 
   priv->status_changed_id = g_signal_connect (self->connection,
       "status-changed", (GCallback) connection_status_changed_cb, self);
@@ -239,14 +250,28 @@ contact_found_cb (SalutContact *contact, gpointer userdata)
   SalutContactManagerPrivate *priv = SALUT_CONTACT_MANAGER_GET_PRIVATE (self);
 
   tp_handle_set_add (priv->handles, contact->handle);
-  tp_base_contact_list_one_contact_changed ((TpBaseContactList *) self,
-      contact->handle);
+
+  if (priv->self_established)
+    tp_base_contact_list_one_contact_changed ((TpBaseContactList *) self,
+        contact->handle);
 }
 
 static void
 contact_change_cb (SalutContact *contact, gint changes, gpointer userdata)
 {
   SalutContactManager *mgr = SALUT_CONTACT_MANAGER (userdata);
+  SalutContactManagerPrivate *priv = SALUT_CONTACT_MANAGER_GET_PRIVATE (mgr);
+
+  if (!priv->self_established)
+    {
+      gint pending = GPOINTER_TO_INT (g_hash_table_lookup (
+            priv->pending_changes, contact->name));
+
+      DEBUG("Queueing contact changes for %s: %d", contact->name, changes);
+      g_hash_table_insert (priv->pending_changes, g_strdup (contact->name),
+          GINT_TO_POINTER (pending | changes));
+      return;
+    }
 
   DEBUG("Emitting contact changes for %s: %d", contact->name, changes);
 
@@ -260,8 +285,10 @@ contact_lost_cb (SalutContact *contact, gpointer userdata)
   SalutContactManagerPrivate *priv = SALUT_CONTACT_MANAGER_GET_PRIVATE (self);
 
   tp_handle_set_remove (priv->handles, contact->handle);
-  tp_base_contact_list_one_contact_removed ((TpBaseContactList *) self,
-      contact->handle);
+
+  if (priv->self_established)
+    tp_base_contact_list_one_contact_removed ((TpBaseContactList *) self,
+        contact->handle);
 }
 
 static gboolean
@@ -329,6 +356,7 @@ salut_contact_manager_close_all (SalutContactManager *mgr)
   SALUT_CONTACT_MANAGER_GET_CLASS (mgr)->close_all (mgr);
 
   tp_clear_pointer (&priv->handles, tp_handle_set_destroy);
+  tp_clear_pointer (&priv->pending_changes, g_hash_table_unref);
 
   if (mgr->contacts)
     {
@@ -349,6 +377,14 @@ static void
 salut_contact_manager_all_for_now_cb (SalutContactManager *self)
 {
   TpBaseContactList *base = (TpBaseContactList *) self;
+  SalutContactManagerPrivate *priv = SALUT_CONTACT_MANAGER_GET_PRIVATE (self);
+
+  if (!priv->self_established)
+    {
+      DEBUG ("Contact list received, waiting for our own service");
+      priv->all_for_now = TRUE;
+      return;
+    }
 
   DEBUG ("Contact list received");
 
@@ -391,6 +427,42 @@ salut_contact_manager_start (SalutContactManager *self,
   return success;
 }
 
+/* Called once our own service is established, to announce what has been
+ * discovered so far */
+void
+salut_contact_manager_self_established (SalutContactManager *self)
+{
+  SalutContactManagerPrivate *priv = SALUT_CONTACT_MANAGER_GET_PRIVATE (self);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (priv->self_established || self->contacts == NULL)
+    return;
+
+  priv->self_established = TRUE;
+
+  if (priv->all_for_now)
+    salut_contact_manager_all_for_now_cb (self);
+
+  DEBUG ("Flushing changes of %u contacts",
+      g_hash_table_size (priv->pending_changes));
+
+  g_hash_table_iter_init (&iter, priv->pending_changes);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      SalutContact *contact = g_hash_table_lookup (self->contacts, key);
+
+      if (contact != NULL)
+        g_signal_emit (self, signals[CONTACT_CHANGE], 0, contact,
+            GPOINTER_TO_INT (value));
+    }
+
+  g_hash_table_remove_all (priv->pending_changes);
+
+  /* Only now that the contacts are known, and our JID too */
+  salut_presence_cache_self_established (self->connection->presence_cache);
+}
+
 SalutContact *
 salut_contact_manager_get_contact (SalutContactManager *mgr, TpHandle handle)
 {
@@ -74,6 +74,8 @@ GType salut_contact_manager_get_type (void);
 
 gboolean salut_contact_manager_start (SalutContactManager *mgr, GError **error);
 
+void salut_contact_manager_self_established (SalutContactManager *mgr);
+
 SalutContact *
 salut_contact_manager_get_contact (SalutContactManager *mgr, TpHandle handle);
 
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "avatar-cache.h"
 #include "presence.h"
 #include "presence-cache.h"
 #include "enumtypes.h"
@@ -80,6 +81,8 @@ struct _SalutContactPrivate
   gboolean found;
   gboolean frozen;
   guint pending_changes;
+  /* number of users (typically channels) wanting live updates */
+  guint interest;
 };
 
 static GObject *
@@ -90,6 +93,7 @@ salut_contact_constructor (GType type,
   GObject *obj;
   SalutContact *self;
   TpHandleRepoIface *contact_repo;
+  GabbleCapabilitySet *empty;
 
   obj = G_OBJECT_CLASS (salut_contact_parent_class)->
     constructor (type, n_props, props);
@@ -104,7 +108,9 @@ salut_contact_constructor (GType type,
 
   self->handle = tp_handle_ensure (contact_repo, self->name, NULL, NULL);
 
-  self->caps = gabble_capability_set_new ();
+  empty = gabble_capability_set_new ();
+  self->caps = gabble_capability_set_intern (empty);
+  gabble_capability_set_free (empty);
   self->data_forms = g_ptr_array_new_with_free_func (g_object_unref);
 
   return obj;
@@ -329,6 +335,7 @@ salut_contact_finalize (GObject *object)
   g_free (self->full_name);
   g_free (self->email);
   g_free (self->jid);
+  tp_clear_pointer (&self->caps, gabble_capability_set_free);
 
 #ifdef ENABLE_OLPC
   if (self->olpc_key != NULL)
@@ -344,19 +351,44 @@ salut_contact_finalize (GObject *object)
   G_OBJECT_CLASS (salut_contact_parent_class)->finalize (object);
 }
 
+static gboolean
+lookup_cached_avatar (SalutContact *self,
+                      guint8 **data,
+                      gsize *size)
+{
+  if (self->avatar_token == NULL || self->connection == NULL ||
+      self->connection->avatar_cache == NULL)
+    return FALSE;
+
+  return salut_avatar_cache_lookup (self->connection->avatar_cache,
+      self->avatar_token, data, size);
+}
+
 static void
 purge_cached_avatar (SalutContact *self,
                     const gchar *token)
 {
   SalutContactPrivate *priv = self->priv;
+  guint8 *data;
+  gsize size;
 
   g_free (self->avatar_token);
   self->avatar_token = g_strdup (token);
 
+  if (priv->avatar_requests == NULL)
+    return;
+
   /* the avatar token has changed, restart retrieving the avatar if we were
-   * retrieving it */
-  if (priv->avatar_requests != NULL)
-    SALUT_CONTACT_GET_CLASS (self)->retrieve_avatar (self);
+   * retrieving it, unless we already know the new one */
+  if (lookup_cached_avatar (self, &data, &size))
+    {
+      DEBUG_CONTACT (self, "new avatar found in the cache");
+      salut_contact_avatar_request_flush (self, data, size);
+      g_free (data);
+      return;
+    }
+
+  SALUT_CONTACT_GET_CLASS (self)->retrieve_avatar (self);
 }
 
 #ifdef ENABLE_OLPC
@@ -432,6 +464,11 @@ salut_contact_avatar_request_flush (SalutContact *contact,
   GList *list, *liststart;
   AvatarRequest *request;
 
+  if (data != NULL && size > 0 && contact->avatar_token != NULL &&
+      contact->connection != NULL && contact->connection->avatar_cache != NULL)
+    salut_avatar_cache_store (contact->connection->avatar_cache,
+        contact->avatar_token, data, size);
+
   liststart = priv->avatar_requests;
   priv->avatar_requests = NULL;
 
@@ -450,6 +487,8 @@ salut_contact_get_avatar (SalutContact *contact,
   SalutContactPrivate *priv = contact->priv;
   AvatarRequest *request;
   gboolean retrieve;
+  guint8 *data;
+  gsize size;
 
   g_assert (contact != NULL);
 
@@ -460,6 +499,14 @@ salut_contact_get_avatar (SalutContact *contact,
       return;
     }
 
+  if (lookup_cached_avatar (contact, &data, &size))
+    {
+      DEBUG ("Avatar of %s found in the cache", contact->name);
+      callback (contact, data, size, user_data);
+      g_free (data);
+      return;
+    }
+
   DEBUG ("Requesting avatar for: %s", contact->name);
   request = g_slice_new0 (AvatarRequest);
   request->callback = callback;
@@ -471,25 +518,21 @@ salut_contact_get_avatar (SalutContact *contact,
     SALUT_CONTACT_GET_CLASS (contact)->retrieve_avatar (contact);
 }
 
+/* Contacts advertising the same node#ver share both the (interned) caps and
+ * the array of data forms, which are never modified once set. */
 void
 salut_contact_set_capabilities (SalutContact *contact,
     const GabbleCapabilitySet *caps,
     const GPtrArray *data_forms)
 {
-  guint i;
-
-  gabble_capability_set_free (contact->caps);
-  contact->caps = gabble_capability_set_copy (caps);
+  GabbleCapabilitySet *old_caps = contact->caps;
+  GPtrArray *old_forms = contact->data_forms;
 
-  g_ptr_array_unref (contact->data_forms);
+  contact->caps = gabble_capability_set_intern (caps);
+  gabble_capability_set_free (old_caps);
 
-  contact->data_forms = g_ptr_array_new_with_free_func (g_object_unref);
-
-  for (i = 0; i < data_forms->len; i++)
-    {
-      GObject *form = g_ptr_array_index (data_forms, i);
-      g_ptr_array_add (contact->data_forms, g_object_ref (form));
-    }
+  contact->data_forms = g_ptr_array_ref ((GPtrArray *) data_forms);
+  g_ptr_array_unref (old_forms);
 
   g_signal_emit_by_name (contact, "capabilities-changed");
 }
@@ -799,6 +842,38 @@ salut_contact_thaw (SalutContact *self)
   salut_contact_change (self, 0);
 }
 
+void
+salut_contact_add_interest (SalutContact *self)
+{
+  SalutContactPrivate *priv = self->priv;
+  SalutContactClass *klass = SALUT_CONTACT_GET_CLASS (self);
+
+  priv->interest++;
+
+  if (priv->interest == 1 && klass->interest_changed != NULL)
+    klass->interest_changed (self, TRUE);
+}
+
+void
+salut_contact_remove_interest (SalutContact *self)
+{
+  SalutContactPrivate *priv = self->priv;
+  SalutContactClass *klass = SALUT_CONTACT_GET_CLASS (self);
+
+  g_return_if_fail (priv->interest > 0);
+
+  priv->interest--;
+
+  if (priv->interest == 0 && klass->interest_changed != NULL)
+    klass->interest_changed (self, FALSE);
+}
+
+gboolean
+salut_contact_is_interesting (SalutContact *self)
+{
+  return self->priv->interest > 0;
+}
+
 #ifdef ENABLE_OLPC
 static void
 activity_valid_cb (SalutOlpcActivity *activity,
@@ -66,6 +66,10 @@ struct _SalutContactClass {
 
     /* private abstract methods */
     void (*retrieve_avatar) (SalutContact *contact);
+
+    /* private virtual methods */
+    /* Called when the contact gains its first or loses its last interest */
+    void (*interest_changed) (SalutContact *contact, gboolean interesting);
 };
 
 struct _SalutContact {
@@ -193,6 +197,13 @@ void salut_contact_lost (SalutContact *self);
 void salut_contact_freeze (SalutContact *self);
 void salut_contact_thaw (SalutContact *self);
 
+/* Channels and the like hold an interest on the contacts they talk to, so
+ * that backends which don't monitor everybody all the time keep their
+ * information about these contacts up to date */
+void salut_contact_add_interest (SalutContact *self);
+void salut_contact_remove_interest (SalutContact *self);
+gboolean salut_contact_is_interesting (SalutContact *self);
+
 G_END_DECLS
 
 #endif /* #ifndef __SALUT_CONTACT_H__*/
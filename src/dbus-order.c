@@ -0,0 +1,336 @@
+/*
+ * dbus-order.c - Ordering D-Bus messages sent over two paths
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "dbus-order.h"
+
+#define DEBUG_FLAG DEBUG_TUBES
+#include "debug.h"
+
+struct _SalutDBusOrder {
+  SalutDBusOrderFunc func;
+  gpointer user_data;
+  /* contact handle -> owned SenderOrder, for the members whose messages
+   * have to wait for one they sent over their bytestream */
+  GHashTable *orders;
+};
+
+/* A message from a member, in the order it sent it */
+typedef struct {
+  /* non-zero for the marker of a message it sent over its bytestream */
+  dbus_uint32_t serial;
+  /* NULL for a marker whose message didn't arrive yet */
+  DBusMessage *msg;
+  size_t len;
+} OrderedMessage;
+
+/* The messages of a member that have to wait for one it sent us over its
+ * bytestream */
+typedef struct {
+  /* owned OrderedMessages, oldest first. The first one is always a marker
+   * still waiting for its message. */
+  GQueue *queue;
+  /* serial -> owned OrderedMessage, for the messages that came over the
+   * bytestream before their marker */
+  GHashTable *early;
+} SenderOrder;
+
+static OrderedMessage *
+ordered_message_new (dbus_uint32_t serial,
+    DBusMessage *msg,
+    size_t len)
+{
+  OrderedMessage *ordered = g_slice_new (OrderedMessage);
+
+  ordered->serial = serial;
+  ordered->msg = msg;
+  ordered->len = len;
+  return ordered;
+}
+
+static void
+ordered_message_free (OrderedMessage *ordered)
+{
+  if (ordered->msg != NULL)
+    dbus_message_unref (ordered->msg);
+
+  g_slice_free (OrderedMessage, ordered);
+}
+
+static SenderOrder *
+sender_order_new (void)
+{
+  SenderOrder *order = g_slice_new (SenderOrder);
+
+  order->queue = g_queue_new ();
+  order->early = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) ordered_message_free);
+  return order;
+}
+
+static void
+sender_order_free (SenderOrder *order)
+{
+  g_queue_foreach (order->queue, (GFunc) ordered_message_free, NULL);
+  g_queue_free (order->queue);
+  g_hash_table_unref (order->early);
+  g_slice_free (SenderOrder, order);
+}
+
+/* How far b is past a, serials wrapping around like those of
+ * GibberRMulticastPacket */
+static gint32
+serial_diff (dbus_uint32_t a,
+    dbus_uint32_t b)
+{
+  return (gint32) (b - a);
+}
+
+/* The marker of the message with this serial, if it's still waiting for it */
+static OrderedMessage *
+sender_order_find_marker (SenderOrder *order,
+    dbus_uint32_t serial)
+{
+  GList *l;
+
+  for (l = order->queue->head; l != NULL; l = l->next)
+    {
+      OrderedMessage *ordered = l->data;
+
+      if (ordered->serial == serial && ordered->msg == NULL)
+        return ordered;
+    }
+
+  return NULL;
+}
+
+/* Drops the markers still waiting for a message sent up to serial, and the
+ * messages that came before their marker */
+static void
+sender_order_lost (SenderOrder *order,
+    TpHandle sender,
+    dbus_uint32_t serial)
+{
+  GHashTableIter iter;
+  OrderedMessage *ordered;
+  GList *l, *next;
+
+  for (l = order->queue->head; l != NULL; l = next)
+    {
+      next = l->next;
+      ordered = l->data;
+
+      if (ordered->serial != 0 && ordered->msg == NULL &&
+          serial_diff (ordered->serial, serial) >= 0)
+        {
+          DEBUG ("message %u from contact %u was lost", ordered->serial,
+              sender);
+          ordered_message_free (ordered);
+          g_queue_delete_link (order->queue, l);
+        }
+    }
+
+  g_hash_table_iter_init (&iter, order->early);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &ordered))
+    {
+      if (serial_diff (ordered->serial, serial) >= 0)
+        {
+          DEBUG ("dropping message %u from contact %u, its marker was lost",
+              ordered->serial, sender);
+          g_hash_table_iter_remove (&iter);
+        }
+    }
+}
+
+static gboolean
+is_order_marker (DBusMessage *msg,
+    const gchar *member,
+    dbus_uint32_t *serial)
+{
+  return dbus_message_is_signal (msg, SALUT_DBUS_ORDER_IFACE, member) &&
+      dbus_message_get_args (msg, NULL, DBUS_TYPE_UINT32, serial,
+          DBUS_TYPE_INVALID);
+}
+
+SalutDBusOrder *
+salut_dbus_order_new (SalutDBusOrderFunc func,
+    gpointer user_data)
+{
+  SalutDBusOrder *self = g_slice_new (SalutDBusOrder);
+
+  self->func = func;
+  self->user_data = user_data;
+  self->orders = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) sender_order_free);
+
+  return self;
+}
+
+void
+salut_dbus_order_free (SalutDBusOrder *self)
+{
+  g_hash_table_unref (self->orders);
+  g_slice_free (SalutDBusOrder, self);
+}
+
+void
+salut_dbus_order_push (SalutDBusOrder *self,
+    TpHandle sender,
+    DBusMessage *msg,
+    size_t len,
+    gboolean unicast)
+{
+  SenderOrder *order;
+  OrderedMessage *ordered;
+  dbus_uint32_t serial;
+
+  order = g_hash_table_lookup (self->orders, GUINT_TO_POINTER (sender));
+
+  if (order == NULL)
+    {
+      /* the usual case: nothing to wait for */
+      if (!unicast &&
+          !is_order_marker (msg, SALUT_DBUS_ORDER_UNICAST, &serial) &&
+          !is_order_marker (msg, SALUT_DBUS_ORDER_LOST, &serial))
+        {
+          self->func (msg, len, self->user_data);
+          return;
+        }
+
+      order = sender_order_new ();
+      g_hash_table_insert (self->orders, GUINT_TO_POINTER (sender), order);
+    }
+
+  if (unicast)
+    {
+      serial = dbus_message_get_serial (msg);
+      ordered = sender_order_find_marker (order, serial);
+
+      if (ordered != NULL)
+        {
+          ordered->msg = msg;
+          ordered->len = len;
+        }
+      else
+        {
+          g_hash_table_insert (order->early, GUINT_TO_POINTER (serial),
+              ordered_message_new (serial, msg, len));
+        }
+    }
+  else if (is_order_marker (msg, SALUT_DBUS_ORDER_UNICAST, &serial))
+    {
+      dbus_message_unref (msg);
+
+      ordered = g_hash_table_lookup (order->early, GUINT_TO_POINTER (serial));
+
+      if (ordered != NULL)
+        g_hash_table_steal (order->early, GUINT_TO_POINTER (serial));
+      else
+        ordered = ordered_message_new (serial, NULL, 0);
+
+      g_queue_push_tail (order->queue, ordered);
+    }
+  else if (is_order_marker (msg, SALUT_DBUS_ORDER_LOST, &serial))
+    {
+      dbus_message_unref (msg);
+      sender_order_lost (order, sender, serial);
+    }
+  else if (dbus_message_get_destination (msg) != NULL &&
+      (ordered = sender_order_find_marker (order,
+          dbus_message_get_serial (msg))) != NULL)
+    {
+      /* it was sent over multicast after all, as the bytestream failed */
+      ordered->msg = msg;
+      ordered->len = len;
+    }
+  else
+    {
+      g_queue_push_tail (order->queue, ordered_message_new (0, msg, len));
+    }
+
+  while ((ordered = g_queue_peek_head (order->queue)) != NULL &&
+      ordered->msg != NULL)
+    {
+      g_queue_pop_head (order->queue);
+      self->func (ordered->msg, ordered->len, self->user_data);
+      ordered->msg = NULL;
+      ordered_message_free (ordered);
+    }
+
+  if (g_queue_is_empty (order->queue) &&
+      g_hash_table_size (order->early) == 0)
+    g_hash_table_remove (self->orders, GUINT_TO_POINTER (sender));
+}
+
+void
+salut_dbus_order_unicast_closed (SalutDBusOrder *self,
+    TpHandle sender)
+{
+  SenderOrder *order;
+
+  order = g_hash_table_lookup (self->orders, GUINT_TO_POINTER (sender));
+
+  if (order == NULL)
+    return;
+
+  /* Their markers, if they were ever sent, will be followed by the
+   * ORDER_LOST that covers them */
+  if (g_hash_table_size (order->early) > 0)
+    {
+      DEBUG ("dropping %u messages from contact %u that came before their "
+          "marker", g_hash_table_size (order->early), sender);
+      g_hash_table_remove_all (order->early);
+    }
+
+  if (g_queue_is_empty (order->queue))
+    g_hash_table_remove (self->orders, GUINT_TO_POINTER (sender));
+}
+
+void
+salut_dbus_order_remove_sender (SalutDBusOrder *self,
+    TpHandle sender)
+{
+  g_hash_table_remove (self->orders, GUINT_TO_POINTER (sender));
+}
+
+guint
+salut_dbus_order_get_waiting (SalutDBusOrder *self,
+    TpHandle sender)
+{
+  SenderOrder *order;
+  guint waiting;
+  GList *l;
+
+  order = g_hash_table_lookup (self->orders, GUINT_TO_POINTER (sender));
+
+  if (order == NULL)
+    return 0;
+
+  waiting = g_hash_table_size (order->early);
+
+  for (l = order->queue->head; l != NULL; l = l->next)
+    {
+      OrderedMessage *ordered = l->data;
+
+      if (ordered->msg != NULL)
+        waiting++;
+    }
+
+  return waiting;
+}
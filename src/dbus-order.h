@@ -0,0 +1,71 @@
+/*
+ * dbus-order.h - Header for ordering D-Bus messages sent over two paths
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SALUT_DBUS_ORDER_H__
+#define __SALUT_DBUS_ORDER_H__
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+G_BEGIN_DECLS
+
+/* Members of a MUC D-Bus tube send the messages addressed to one other
+ * member over a bytestream to it, and say where each of them goes among
+ * their multicast messages with an ORDER_UNICAST signal carrying its serial,
+ * sent over multicast. When the bytestream closes, they send ORDER_LOST with
+ * the serial of the last message they sent over it: the ones up to it that
+ * didn't arrive never will. */
+#define SALUT_DBUS_ORDER_PATH "/org/freedesktop/Telepathy/Salut/DBusTube"
+#define SALUT_DBUS_ORDER_IFACE "org.freedesktop.Telepathy.Salut.DBusTube"
+#define SALUT_DBUS_ORDER_UNICAST "Unicast"
+#define SALUT_DBUS_ORDER_LOST "Lost"
+
+/* Puts the messages of each member back in the order it sent them */
+typedef struct _SalutDBusOrder SalutDBusOrder;
+
+/* Takes ownership of msg */
+typedef void (*SalutDBusOrderFunc) (DBusMessage *msg, size_t len,
+    gpointer user_data);
+
+SalutDBusOrder *salut_dbus_order_new (SalutDBusOrderFunc func,
+    gpointer user_data);
+
+void salut_dbus_order_free (SalutDBusOrder *self);
+
+/* Takes ownership of msg, which sender sent over its bytestream if unicast is
+ * TRUE, and calls func for it and the ones that were waiting for it as soon
+ * as the sender's messages before it were */
+void salut_dbus_order_push (SalutDBusOrder *self, TpHandle sender,
+    DBusMessage *msg, size_t len, gboolean unicast);
+
+/* The bytestream from sender closed: drops the messages that came over it
+ * before their marker */
+void salut_dbus_order_unicast_closed (SalutDBusOrder *self, TpHandle sender);
+
+/* Forgets about sender, dropping the messages it has waiting */
+void salut_dbus_order_remove_sender (SalutDBusOrder *self, TpHandle sender);
+
+/* Number of messages of sender that are waiting */
+guint salut_dbus_order_get_waiting (SalutDBusOrder *self, TpHandle sender);
+
+G_END_DECLS
+
+#endif /* __SALUT_DBUS_ORDER_H__ */
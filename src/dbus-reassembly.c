@@ -0,0 +1,257 @@
+/*
+ * dbus-reassembly.c - Splitting a byte stream into D-Bus messages
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "dbus-reassembly.h"
+
+#include <dbus/dbus.h>
+
+#define DEBUG_FLAG DEBUG_TUBES
+#include "debug.h"
+
+/* Each D-Bus message has a 16-byte fixed header, in which
+ *
+ * * byte 0 is 'l' (ell) or 'B' for endianness
+ * * bytes 4-7 are body length "n" in bytes in that endianness
+ * * bytes 12-15 are length "m" of param array in bytes in that
+ *   endianness
+ *
+ * followed by m + n + ((8 - (m % 8)) % 8) bytes of other content.
+ */
+#define HEADER_SIZE 16
+
+/* Don't hang on to the memory of a big message once it's been delivered */
+#define MAX_IDLE_BUFFER_SIZE (64 * 1024)
+
+struct _SalutDBusReassembly {
+  /* The start of a message we haven't got all of yet. Complete messages are
+   * handed out straight from the data we're given, so only the incomplete
+   * message at the end of a read is ever copied */
+  GString *buffer;
+};
+
+SalutDBusReassembly *
+salut_dbus_reassembly_new (void)
+{
+  SalutDBusReassembly *self = g_slice_new (SalutDBusReassembly);
+
+  self->buffer = g_string_new ("");
+
+  return self;
+}
+
+void
+salut_dbus_reassembly_free (SalutDBusReassembly *self)
+{
+  g_string_free (self->buffer, TRUE);
+  g_slice_free (SalutDBusReassembly, self);
+}
+
+static guint32
+collect_le32 (const gchar *str)
+{
+  const guchar *bytes = (const guchar *) str;
+
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
+}
+
+static guint32
+collect_be32 (const gchar *str)
+{
+  const guchar *bytes = (const guchar *) str;
+
+  return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+/* Works out the size of the message starting with header, which has to be
+ * at least HEADER_SIZE bytes */
+static gboolean
+get_message_size (const gchar *header,
+    guint32 *size)
+{
+  guint32 body_length, params_length, m;
+
+  if (header[0] == DBUS_BIG_ENDIAN)
+    {
+      body_length = collect_be32 (header + 4);
+      m = collect_be32 (header + 12);
+    }
+  else if (header[0] == DBUS_LITTLE_ENDIAN)
+    {
+      body_length = collect_le32 (header + 4);
+      m = collect_le32 (header + 12);
+    }
+  else
+    {
+      DEBUG ("D-Bus message has unknown endianness byte 0x%x",
+          (unsigned int) header[0]);
+      return FALSE;
+    }
+
+  /* pad to 8-byte boundary */
+  params_length = m + ((8 - (m % 8)) % 8);
+  g_assert (params_length % 8 == 0);
+  g_assert (params_length >= m);
+  g_assert (params_length < m + 8);
+
+  *size = params_length + body_length + HEADER_SIZE;
+
+  /* n.b.: this looks as if it could be simplified to just the third
+   * test, but that would be wrong if the addition had overflowed, so
+   * don't do that. The first and second tests are sufficient to
+   * ensure no overflow on 32-bit platforms */
+  if (body_length > DBUS_MAXIMUM_MESSAGE_LENGTH ||
+      params_length > DBUS_MAXIMUM_ARRAY_LENGTH ||
+      *size > DBUS_MAXIMUM_MESSAGE_LENGTH)
+    {
+      DEBUG ("D-Bus message is too large to be valid");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Hands out the complete messages at the start of data, setting consumed to
+ * the number of bytes they took up */
+static gboolean
+split_messages (const gchar *data,
+    gsize len,
+    SalutDBusReassemblyFunc func,
+    gpointer user_data,
+    gsize *consumed)
+{
+  guint32 size;
+
+  *consumed = 0;
+
+  while (len - *consumed >= HEADER_SIZE)
+    {
+      if (!get_message_size (data + *consumed, &size))
+        return FALSE;
+
+      if (len - *consumed < size)
+        break;
+
+      func (data + *consumed, size, user_data);
+      *consumed += size;
+    }
+
+  return TRUE;
+}
+
+/* Moves up to wanted bytes from data to the buffer */
+static void
+buffer_take (SalutDBusReassembly *self,
+    const gchar **data,
+    gsize *len,
+    gsize wanted)
+{
+  gsize n = MIN (*len, wanted);
+
+  g_string_append_len (self->buffer, *data, n);
+  *data += n;
+  *len -= n;
+}
+
+gboolean
+salut_dbus_reassembly_push (SalutDBusReassembly *self,
+    const gchar *data,
+    gsize len,
+    SalutDBusReassemblyFunc func,
+    gpointer user_data)
+{
+  guint32 size;
+  gsize consumed;
+
+  /* First finish the message we already have the start of */
+  if (self->buffer->len > 0)
+    {
+      if (self->buffer->len < HEADER_SIZE)
+        {
+          buffer_take (self, &data, &len, HEADER_SIZE - self->buffer->len);
+
+          if (self->buffer->len < HEADER_SIZE)
+            return TRUE;
+        }
+
+      if (!get_message_size (self->buffer->str, &size))
+        return FALSE;
+
+      buffer_take (self, &data, &len, size - self->buffer->len);
+
+      if (self->buffer->len < size)
+        return TRUE;
+
+      DEBUG ("Received complete D-Bus message of size %" G_GUINT32_FORMAT,
+          size);
+      func (self->buffer->str, size, user_data);
+
+      if (self->buffer->allocated_len > MAX_IDLE_BUFFER_SIZE)
+        {
+          g_string_free (self->buffer, TRUE);
+          self->buffer = g_string_new ("");
+        }
+      else
+        {
+          g_string_truncate (self->buffer, 0);
+        }
+    }
+
+  /* Then hand out all the complete messages without copying them */
+  if (!split_messages (data, len, func, user_data, &consumed))
+    return FALSE;
+
+  data += consumed;
+  len -= consumed;
+
+  /* And keep what we have of the next one */
+  g_string_append_len (self->buffer, data, len);
+
+  if (len > 0)
+    DEBUG ("Keeping %" G_GSIZE_FORMAT " bytes of an incomplete message", len);
+
+  return TRUE;
+}
+
+gboolean
+salut_dbus_reassembly_split (const gchar *data,
+    gsize len,
+    SalutDBusReassemblyFunc func,
+    gpointer user_data)
+{
+  gsize consumed;
+
+  if (!split_messages (data, len, func, user_data, &consumed))
+    return FALSE;
+
+  if (consumed != len)
+    {
+      DEBUG ("%" G_GSIZE_FORMAT " trailing bytes aren't a complete message",
+          len - consumed);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+gsize
+salut_dbus_reassembly_get_pending (SalutDBusReassembly *self)
+{
+  return self->buffer->len;
+}
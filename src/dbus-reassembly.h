@@ -0,0 +1,55 @@
+/*
+ * dbus-reassembly.h - Header for splitting a byte stream into D-Bus messages
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SALUT_DBUS_REASSEMBLY_H__
+#define __SALUT_DBUS_REASSEMBLY_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _SalutDBusReassembly SalutDBusReassembly;
+
+/* data is only valid for the duration of the call */
+typedef void (*SalutDBusReassemblyFunc) (const gchar *data, gsize len,
+    gpointer user_data);
+
+SalutDBusReassembly *salut_dbus_reassembly_new (void);
+
+void salut_dbus_reassembly_free (SalutDBusReassembly *self);
+
+/* Calls func for every message completed by data. Returns FALSE if the
+ * stream doesn't contain valid D-Bus messages, after which it shouldn't be
+ * used anymore */
+gboolean salut_dbus_reassembly_push (SalutDBusReassembly *self,
+    const gchar *data, gsize len, SalutDBusReassemblyFunc func,
+    gpointer user_data);
+
+/* For transports that keep message boundaries, where data has to consist of
+ * whole D-Bus messages. Calls func for each of them; returns FALSE if data
+ * isn't made up of valid messages */
+gboolean salut_dbus_reassembly_split (const gchar *data, gsize len,
+    SalutDBusReassemblyFunc func, gpointer user_data);
+
+/* Number of bytes of an incomplete message being held */
+gsize salut_dbus_reassembly_get_pending (SalutDBusReassembly *self);
+
+G_END_DECLS
+
+#endif /* __SALUT_DBUS_REASSEMBLY_H__ */
@@ -2,6 +2,8 @@
 #include "debug.h"
 
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,8 +15,80 @@
 
 #include <telepathy-glib/telepathy-glib.h>
 
+DebugFlags debug_active_flags = 0;
+
 static DebugFlags flags = 0;
 
+/* TRUE while a debug client has asked for our messages */
+static gboolean sender_enabled = FALSE;
+static TpDebugSender *watched_sender = NULL;
+static gulong enabled_id = 0;
+
+/* Messages nobody would see right away go to a ring buffer when
+ * SALUT_DEBUG_RING is set, and are only formatted and handed to the debug
+ * sender once a debug client shows up. A message is stored as the pointer
+ * to its format, which DEBUG() makes a string literal, followed by copies of
+ * its arguments. */
+#define RING_ARGS_SIZE 224
+
+/* Stamp of a slot a thread is writing to; slots never written have 0 */
+#define RING_WRITING (-1)
+/* Stamp of the slot holding message n, so that readers can tell it from a
+ * message written over it later. Only the low 30 bits of n are used, so that
+ * the stamp stays positive and doesn't skip when ring_next wraps around. */
+#define RING_STAMP(n) ((gint) ((n) & (G_MAXINT32 >> 1)) + 1)
+
+typedef struct {
+  volatile gint stamp;
+  DebugFlags flag;
+  gint64 time;
+  /* NULL if the message didn't fit as arguments and args holds it
+   * formatted */
+  const gchar *format;
+  gchar args[RING_ARGS_SIZE];
+} RingSlot;
+
+typedef enum {
+  ARG_NONE,
+  ARG_INT,
+  ARG_LONG,
+  ARG_LONG_LONG,
+  ARG_SIZE,
+  ARG_DOUBLE,
+  ARG_POINTER,
+  ARG_STRING,
+  ARG_UNSUPPORTED
+} ArgKind;
+
+typedef struct {
+  guint id;
+  DebugFlags flag;
+  DebugStatsFunc func;
+  gpointer user_data;
+} StatsSource;
+
+/* owned StatsSources, in the order they were added */
+static GSList *stats = NULL;
+static guint stats_next_id = 1;
+static guint stats_timer = 0;
+
+static RingSlot *ring = NULL;
+static guint ring_size = 0;
+/* index of the next message to be written */
+static volatile gint ring_next = 0;
+/* index of the first message that hasn't been handed to the debug sender */
+static guint ring_read = 0;
+static volatile gint ring_dropped = 0;
+
+static void
+update_active_flags (void)
+{
+  if (sender_enabled || ring != NULL)
+    debug_active_flags = (DebugFlags) ~0;
+  else
+    debug_active_flags = flags;
+}
+
 GDebugKey keys[] = {
   { "presence",       DEBUG_PRESENCE },
   { "groups",         DEBUG_GROUPS },
@@ -36,6 +110,7 @@ GDebugKey keys[] = {
   { "olpc-activity",      DEBUG_OLPC_ACTIVITY },
   { "ft",             DEBUG_FT },
   { "plugin",         DEBUG_PLUGIN },
+  { "startup",        DEBUG_STARTUP },
   { 0, },
 };
 
@@ -53,11 +128,24 @@ void debug_set_flags_from_env ()
   if (flags_string) {
     debug_set_flags (g_parse_debug_string (flags_string, keys, nkeys));
   }
+
+  flags_string = g_getenv ("SALUT_DEBUG_RING");
+
+  if (flags_string != NULL && ring == NULL)
+    {
+      ring_size = CLAMP (atoi (flags_string), 0, 1 << 20);
+
+      if (ring_size > 0)
+        ring = g_new0 (RingSlot, ring_size);
+
+      update_active_flags ();
+    }
 }
 
 void debug_set_flags (DebugFlags new_flags)
 {
   flags |= new_flags;
+  update_active_flags ();
 }
 
 gboolean debug_flag_is_set (DebugFlags flag)
@@ -91,9 +179,583 @@ debug_flag_to_domain (DebugFlags flag)
   return g_hash_table_lookup (flag_to_keys, GUINT_TO_POINTER (flag));
 }
 
+/* Parses the conversion specification starting at the '%' at *p and moves
+ * *p past it. stars is set to the number of int arguments the field width
+ * and precision take before the converted one, and precision_star to
+ * whether the last of them is the precision. */
+static ArgKind
+parse_conversion (const gchar **p,
+    guint *stars,
+    gboolean *precision_star,
+    gint *precision)
+{
+  const gchar *s = *p + 1;
+  gboolean in_precision = FALSE;
+  guint longs = 0;
+  gboolean size = FALSE;
+  ArgKind kind;
+
+  *stars = 0;
+  *precision_star = FALSE;
+  *precision = -1;
+
+  for (; *s != '\0' && strchr ("-+ #'0123456789.*", *s) != NULL; s++)
+    {
+      if (*s == '.')
+        {
+          in_precision = TRUE;
+          *precision = 0;
+        }
+      else if (*s == '*')
+        {
+          (*stars)++;
+          *precision_star = in_precision;
+        }
+      else if (in_precision && g_ascii_isdigit (*s))
+        {
+          *precision = *precision * 10 + (*s - '0');
+        }
+    }
+
+  for (; *s != '\0' && strchr ("hlLqjzt", *s) != NULL; s++)
+    {
+      if (*s == 'l')
+        longs++;
+      else if (*s == 'q')
+        longs += 2;
+      else if (*s == 'z' || *s == 't')
+        size = TRUE;
+      else if (*s != 'h')
+        /* long double and intmax_t, which we never use */
+        longs += 3;
+    }
+
+  switch (*s)
+    {
+      case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+        if (size)
+          kind = ARG_SIZE;
+        else if (longs == 0)
+          kind = ARG_INT;
+        else if (longs == 1)
+          kind = ARG_LONG;
+        else if (longs == 2)
+          kind = ARG_LONG_LONG;
+        else
+          kind = ARG_UNSUPPORTED;
+        break;
+
+      case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+      case 'a': case 'A':
+        kind = (longs <= 1 && !size) ? ARG_DOUBLE : ARG_UNSUPPORTED;
+        break;
+
+      case 'p':
+        kind = ARG_POINTER;
+        break;
+
+      case 's':
+        kind = longs == 0 ? ARG_STRING : ARG_UNSUPPORTED;
+        break;
+
+      case '%':
+        kind = ARG_NONE;
+        break;
+
+      default:
+        return ARG_UNSUPPORTED;
+    }
+
+  *p = s + 1;
+  return kind;
+}
+
+static gboolean
+ring_put (RingSlot *slot,
+    gsize *len,
+    gconstpointer data,
+    gsize size)
+{
+  if (*len + size > RING_ARGS_SIZE)
+    return FALSE;
+
+  memcpy (slot->args + *len, data, size);
+  *len += size;
+  return TRUE;
+}
+
+static gboolean
+ring_get (const RingSlot *slot,
+    gsize *len,
+    gpointer data,
+    gsize size)
+{
+  if (*len + size > RING_ARGS_SIZE)
+    return FALSE;
+
+  memcpy (data, slot->args + *len, size);
+  *len += size;
+  return TRUE;
+}
+
+/* Copies what we need of a string argument, cutting it short on a character
+ * boundary if it doesn't fit */
+static gboolean
+ring_put_string (RingSlot *slot,
+    gsize *len,
+    const gchar *str,
+    gint precision)
+{
+  gsize n, room;
+
+  if (str == NULL)
+    str = "(null)";
+
+  n = strlen (str);
+
+  if (precision >= 0 && (gsize) precision < n)
+    n = precision;
+
+  if (*len >= RING_ARGS_SIZE)
+    return FALSE;
+
+  room = RING_ARGS_SIZE - *len - 1;
+
+  if (n > room)
+    {
+      n = room;
+
+      while (n > 0 && (str[n] & 0xc0) == 0x80)
+        n--;
+    }
+
+  memcpy (slot->args + *len, str, n);
+  slot->args[*len + n] = '\0';
+  *len += n + 1;
+  return TRUE;
+}
+
+#define PUT(type, value) G_STMT_START {                                   \
+  type _v = (value);                                                      \
+  if (!ring_put (slot, &len, &_v, sizeof (_v)))                           \
+    return FALSE;                                                         \
+} G_STMT_END
+
+static gboolean
+ring_pack (RingSlot *slot,
+    const gchar *format,
+    va_list args)
+{
+  const gchar *p = format;
+  gsize len = 0;
+
+  while ((p = strchr (p, '%')) != NULL)
+    {
+      guint stars, i;
+      gboolean precision_star;
+      gint precision, star = 0;
+      ArgKind kind = parse_conversion (&p, &stars, &precision_star,
+          &precision);
+
+      for (i = 0; i < stars; i++)
+        {
+          star = va_arg (args, int);
+          PUT (gint, star);
+        }
+
+      if (precision_star)
+        precision = star;
+
+      switch (kind)
+        {
+          case ARG_NONE:
+            break;
+          case ARG_INT:
+            PUT (gint, va_arg (args, int));
+            break;
+          case ARG_LONG:
+            PUT (glong, va_arg (args, long));
+            break;
+          case ARG_LONG_LONG:
+            PUT (gint64, va_arg (args, gint64));
+            break;
+          case ARG_SIZE:
+            PUT (gsize, va_arg (args, gsize));
+            break;
+          case ARG_DOUBLE:
+            PUT (gdouble, va_arg (args, double));
+            break;
+          case ARG_POINTER:
+            PUT (gpointer, va_arg (args, gpointer));
+            break;
+          case ARG_STRING:
+            if (!ring_put_string (slot, &len, va_arg (args, const gchar *),
+                  precision))
+              return FALSE;
+            break;
+          case ARG_UNSUPPORTED:
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+#undef PUT
+
+/* Writes the message to the next slot without taking any lock: threads
+ * claim slots by bumping ring_next, and a slot someone else is still writing
+ * to is skipped rather than waited for. */
+static void
+ring_record (DebugFlags flag,
+    const gchar *format,
+    va_list args)
+{
+  guint n = (guint) g_atomic_int_add (&ring_next, 1);
+  RingSlot *slot = ring + n % ring_size;
+  gint stamp = g_atomic_int_get (&slot->stamp);
+  va_list copy;
+
+  if (stamp == RING_WRITING ||
+      !g_atomic_int_compare_and_exchange (&slot->stamp, stamp, RING_WRITING))
+    {
+      g_atomic_int_inc (&ring_dropped);
+      return;
+    }
+
+  slot->flag = flag;
+  slot->time = g_get_real_time ();
+  slot->format = format;
+
+  G_VA_COPY (copy, args);
+
+  if (!ring_pack (slot, format, copy))
+    {
+      /* Too many arguments, or ones we can't copy: format it now */
+      gchar *message = g_strdup_vprintf (format, args);
+      gsize len = 0;
+
+      slot->format = NULL;
+      ring_put_string (slot, &len, message, -1);
+      g_free (message);
+    }
+
+  va_end (copy);
+
+  g_atomic_int_set (&slot->stamp, RING_STAMP (n));
+}
+
+#define APPEND(value) G_STMT_START {                                      \
+  if (stars == 0)                                                         \
+    g_string_append_printf (str, spec, value);                            \
+  else if (stars == 1)                                                    \
+    g_string_append_printf (str, spec, star[0], value);                   \
+  else                                                                    \
+    g_string_append_printf (str, spec, star[0], star[1], value);          \
+} G_STMT_END
+
+#define RENDER(type) G_STMT_START {                                       \
+  type _v;                                                                \
+  if (!ring_get (slot, &len, &_v, sizeof (_v)))                           \
+    goto out;                                                             \
+  APPEND (_v);                                                            \
+} G_STMT_END
+
+static gchar *
+ring_render (const RingSlot *slot)
+{
+  GString *str = g_string_new ("");
+  const gchar *p = slot->format;
+  const gchar *start;
+  gchar *spec = NULL;
+  gsize len = 0;
+
+  if (p == NULL)
+    {
+      g_string_append (str, slot->args);
+      return g_string_free (str, FALSE);
+    }
+
+  while ((start = strchr (p, '%')) != NULL)
+    {
+      guint stars, i;
+      gboolean precision_star;
+      gint precision, star[2] = { 0, 0 };
+      ArgKind kind;
+
+      g_string_append_len (str, p, start - p);
+      p = start;
+      kind = parse_conversion (&p, &stars, &precision_star, &precision);
+
+      g_free (spec);
+      spec = g_strndup (start, p - start);
+
+      for (i = 0; i < stars; i++)
+        {
+          if (!ring_get (slot, &len, &star[MIN (i, 1)], sizeof (gint)))
+            goto out;
+        }
+
+      switch (kind)
+        {
+          case ARG_NONE:
+            g_string_append_c (str, '%');
+            break;
+          case ARG_INT:
+            RENDER (gint);
+            break;
+          case ARG_LONG:
+            RENDER (glong);
+            break;
+          case ARG_LONG_LONG:
+            RENDER (gint64);
+            break;
+          case ARG_SIZE:
+            RENDER (gsize);
+            break;
+          case ARG_DOUBLE:
+            RENDER (gdouble);
+            break;
+          case ARG_POINTER:
+            RENDER (gpointer);
+            break;
+          case ARG_STRING:
+            {
+              const gchar *arg = slot->args + len;
+
+              if (len >= RING_ARGS_SIZE)
+                goto out;
+
+              /* ring_put_string () already applied the precision, doing it
+               * again is harmless */
+              len += strlen (arg) + 1;
+              APPEND (arg);
+            }
+            break;
+          case ARG_UNSUPPORTED:
+            /* ring_pack () would have given up on it */
+            g_assert_not_reached ();
+        }
+    }
+
+  g_string_append (str, p);
+
+out:
+  g_free (spec);
+  return g_string_free (str, FALSE);
+}
+
+#undef RENDER
+#undef APPEND
+
+/* Hands the messages in the ring buffer that haven't been seen yet to the
+ * debug sender, oldest first */
+static void
+ring_flush (TpDebugSender *sender)
+{
+  guint next = (guint) g_atomic_int_get (&ring_next);
+  gint dropped = g_atomic_int_get (&ring_dropped);
+  guint n;
+
+  g_atomic_int_add (&ring_dropped, -dropped);
+
+  if (next - ring_read > ring_size)
+    {
+      dropped += next - ring_read - ring_size;
+      ring_read = next - ring_size;
+    }
+
+  for (n = ring_read; n != next; n++)
+    {
+      const RingSlot *slot = ring + n % ring_size;
+      RingSlot copy;
+      gint stamp = g_atomic_int_get (&slot->stamp);
+      gchar *message;
+      GTimeVal when;
+
+      if (stamp != RING_STAMP (n))
+        {
+          dropped++;
+          continue;
+        }
+
+      memcpy (&copy, slot, sizeof (copy));
+
+      /* written over while we were copying it */
+      if (g_atomic_int_get (&slot->stamp) != stamp)
+        {
+          dropped++;
+          continue;
+        }
+
+      message = ring_render (&copy);
+      when.tv_sec = copy.time / G_USEC_PER_SEC;
+      when.tv_usec = copy.time % G_USEC_PER_SEC;
+
+      tp_debug_sender_add_message (sender, &when,
+          debug_flag_to_domain (copy.flag), G_LOG_LEVEL_DEBUG, message);
+      g_free (message);
+    }
+
+  ring_read = next;
+
+  if (dropped > 0)
+    {
+      gchar *message = g_strdup_printf ("%d debug messages were lost from "
+          "the ring buffer", dropped);
+      GTimeVal now;
+
+      g_get_current_time (&now);
+      tp_debug_sender_add_message (sender, &now, G_LOG_DOMAIN,
+          G_LOG_LEVEL_DEBUG, message);
+      g_free (message);
+    }
+}
+
+void
+_debug_TEST_ring_seek (guint n)
+{
+  g_atomic_int_set (&ring_next, (gint) n);
+  ring_read = n;
+}
+
+void
+_debug_TEST_ring_flush (TpDebugSender *sender)
+{
+  g_return_if_fail (ring != NULL);
+
+  ring_flush (sender);
+}
+
+static void log_to_debug_sender (DebugFlags flag, const gchar *message);
+
+static void
+stats_report (StatsSource *source)
+{
+  gchar *message = source->func (source->user_data);
+
+  if (message == NULL)
+    return;
+
+  log_to_debug_sender (source->flag, message);
+  g_free (message);
+}
+
+static gboolean
+stats_timeout_cb (gpointer user_data)
+{
+  GSList *l;
+
+  for (l = stats; l != NULL; l = l->next)
+    stats_report (l->data);
+
+  return TRUE;
+}
+
+/* Only wake up for the stats while somebody is listening */
+static void
+update_stats_timer (void)
+{
+  if (sender_enabled && stats != NULL)
+    {
+      if (stats_timer == 0)
+        stats_timer = g_timeout_add_seconds (DEBUG_STATS_INTERVAL,
+            stats_timeout_cb, NULL);
+    }
+  else if (stats_timer != 0)
+    {
+      g_source_remove (stats_timer);
+      stats_timer = 0;
+    }
+}
+
+guint
+debug_add_stats (DebugFlags flag,
+    DebugStatsFunc func,
+    gpointer user_data)
+{
+  StatsSource *source = g_slice_new (StatsSource);
+
+  source->id = stats_next_id++;
+  source->flag = flag;
+  source->func = func;
+  source->user_data = user_data;
+
+  stats = g_slist_append (stats, source);
+  update_stats_timer ();
+
+  return source->id;
+}
+
+void
+debug_remove_stats (guint id)
+{
+  GSList *l;
+
+  for (l = stats; l != NULL; l = l->next)
+    {
+      StatsSource *source = l->data;
+
+      if (source->id != id)
+        continue;
+
+      if (sender_enabled)
+        stats_report (source);
+
+      stats = g_slist_delete_link (stats, l);
+      g_slice_free (StatsSource, source);
+      update_stats_timer ();
+      return;
+    }
+
+  g_return_if_reached ();
+}
+
+static void
+sender_enabled_cb (GObject *sender,
+    GParamSpec *pspec,
+    gpointer user_data)
+{
+  g_object_get (sender, "enabled", &sender_enabled, NULL);
+
+  if (sender_enabled && ring != NULL)
+    ring_flush (TP_DEBUG_SENDER (sender));
+
+  update_active_flags ();
+  update_stats_timer ();
+}
+
+/* Formats every message while a debug client is listening to sender */
+void
+debug_watch_sender (TpDebugSender *sender)
+{
+  g_return_if_fail (watched_sender == NULL);
+
+  watched_sender = g_object_ref (sender);
+  enabled_id = g_signal_connect (sender, "notify::enabled",
+      G_CALLBACK (sender_enabled_cb), NULL);
+  sender_enabled_cb (G_OBJECT (sender), NULL, NULL);
+}
+
 void
 debug_free (void)
 {
+  if (watched_sender != NULL)
+    {
+      g_signal_handler_disconnect (watched_sender, enabled_id);
+      g_object_unref (watched_sender);
+      watched_sender = NULL;
+      sender_enabled = FALSE;
+    }
+
+  update_stats_timer ();
+
+  g_free (ring);
+  ring = NULL;
+  ring_size = 0;
+
+  update_active_flags ();
+
   if (flag_to_keys == NULL)
     return;
 
@@ -126,6 +788,17 @@ void debug (DebugFlags flag,
   va_list args;
 
   va_start (args, format);
+
+  /* Nobody would see it yet */
+  if (!sender_enabled && !(flag & flags))
+    {
+      if (ring != NULL)
+        ring_record (flag, format, args);
+
+      va_end (args);
+      return;
+    }
+
   message = g_strdup_vprintf (format, args);
   va_end (args);
 
@@ -8,6 +8,8 @@
 
 #include <wocky/wocky.h>
 
+#include <telepathy-glib/telepathy-glib.h>
+
 typedef enum
 {
   DEBUG_PRESENCE       = 1 << 0,
@@ -32,19 +34,47 @@ typedef enum
   DEBUG_OLPC_ACTIVITY  = 1 << 19,
   DEBUG_FT             = 1 << 20,
   DEBUG_PLUGIN         = 1 << 21,
+  DEBUG_STARTUP        = 1 << 22,
 } DebugFlags;
 
+/* The flags whose messages go somewhere: the ones set in SALUT_DEBUG, or
+ * all of them while a debug client is listening or the ring buffer is on.
+ * DEBUG() checks it before evaluating its arguments, so a disabled message
+ * costs a single test. */
+extern DebugFlags debug_active_flags;
+
 void debug_set_flags_from_env (void);
 void debug_set_flags (DebugFlags flags);
 gboolean debug_flag_is_set (DebugFlags flag);
+void debug_watch_sender (TpDebugSender *sender);
 void debug (DebugFlags flag, const gchar *format, ...)
     G_GNUC_PRINTF (2, 3);
 void debug_free (void);
 
+/* Returns the current values of some counters as a newly allocated line */
+typedef gchar *(*DebugStatsFunc) (gpointer user_data);
+
+/* While a debug client is listening, the line returned by func is sent to it
+ * as a message of flag every DEBUG_STATS_INTERVAL seconds, and once more
+ * when it's removed. Returns an id for debug_remove_stats (). */
+#define DEBUG_STATS_INTERVAL 10
+
+guint debug_add_stats (DebugFlags flag, DebugStatsFunc func,
+    gpointer user_data);
+void debug_remove_stats (guint id);
+
+/* For testing only: make the ring buffer go on from message n, and hand
+ * what it holds to sender */
+void _debug_TEST_ring_seek (guint n);
+void _debug_TEST_ring_flush (TpDebugSender *sender);
+
 #ifdef DEBUG_FLAG
 
-#define DEBUG(format, ...) \
-  debug (DEBUG_FLAG, "%s: " format, G_STRFUNC, ##__VA_ARGS__)
+/* format has to be a string literal: the ring buffer keeps a pointer to it */
+#define DEBUG(format, ...) G_STMT_START {                                 \
+  if (G_UNLIKELY (debug_active_flags & DEBUG_FLAG))                       \
+    debug (DEBUG_FLAG, "%s: " format, G_STRFUNC, ##__VA_ARGS__);          \
+} G_STMT_END
 
 #define DEBUGGING debug_flag_is_set(DEBUG_FLAG)
 
@@ -347,6 +347,8 @@ salut_file_transfer_channel_constructed (GObject *obj)
   wocky_meta_porter_hold (WOCKY_META_PORTER (conn->porter),
       WOCKY_CONTACT (self->priv->contact));
 
+  salut_contact_add_interest (self->priv->contact);
+
   /* Initialise the available socket types hash table */
   self->priv->available_socket_types = g_hash_table_new_full (g_direct_hash,
       g_direct_equal, NULL, (GDestroyNotify) free_array);
@@ -734,6 +736,7 @@ salut_file_transfer_channel_dispose (GObject *object)
     {
       g_signal_handlers_disconnect_by_func (self->priv->contact,
           contact_lost_cb, self);
+      salut_contact_remove_interest (self->priv->contact);
       g_object_unref (self->priv->contact);
       self->priv->contact = NULL;
     }
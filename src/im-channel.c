@@ -42,6 +42,7 @@
 #include "debug.h"
 #include "connection.h"
 #include "contact.h"
+#include "message-spill.h"
 #include "util.h"
 #include "text-helper.h"
 
@@ -65,8 +66,30 @@ struct _SalutImChannelPrivate
   gboolean dispose_has_run;
   SalutContact *contact;
   guint message_handler_id;
+  SalutMessageSpill *spill;
+
+  /* id of our counters on the debug interface */
+  guint stats_id;
 };
 
+/* Most 1-1 channels never get near their budget, so they only report once
+ * messages went to disk */
+static gchar *
+im_channel_stats_cb (gpointer user_data)
+{
+  SalutImChannel *self = SALUT_IM_CHANNEL (user_data);
+  guint spilled, paged;
+
+  salut_message_spill_get_counters (self->priv->spill, &spilled, &paged);
+
+  if (spilled == 0)
+    return NULL;
+
+  return g_strdup_printf ("%s: %u messages written to disk, %u read back",
+      tp_base_channel_get_object_path (TP_BASE_CHANNEL (self)), spilled,
+      paged);
+}
+
 static void
 salut_im_channel_close (TpBaseChannel *base)
 {
@@ -181,6 +204,9 @@ salut_im_channel_constructed (GObject *obj)
       TP_DELIVERY_REPORTING_SUPPORT_FLAG_RECEIVE_FAILURES,
       supported_content_types);
 
+  priv->spill = salut_message_spill_new (obj, base_conn);
+  priv->stats_id = debug_add_stats (DEBUG_FLAG, im_channel_stats_cb, obj);
+
   /* Connect to further messages */
   jid = wocky_contact_dup_jid (WOCKY_CONTACT (priv->contact));
 
@@ -194,6 +220,13 @@ salut_im_channel_constructed (GObject *obj)
   /* ensure the connection doesn't close */
   wocky_meta_porter_hold (WOCKY_META_PORTER (porter),
       WOCKY_CONTACT (priv->contact));
+
+  /* and have it ready for the first message */
+  salut_connection_warmup_touch (SALUT_CONNECTION (base_conn)->warmup,
+      WOCKY_LL_CONTACT (priv->contact));
+
+  /* and keep the contact's presence and addresses up to date */
+  salut_contact_add_interest (priv->contact);
 }
 
 static void salut_im_channel_dispose (GObject *object);
@@ -283,9 +316,19 @@ salut_im_channel_dispose (GObject *object)
 
   /* release any references held by the object here */
 
+  salut_contact_remove_interest (priv->contact);
   g_object_unref (priv->contact);
   priv->contact = NULL;
 
+  if (priv->stats_id != 0)
+    {
+      debug_remove_stats (priv->stats_id);
+      priv->stats_id = 0;
+    }
+
+  salut_message_spill_free (priv->spill);
+  priv->spill = NULL;
+
   if (G_OBJECT_CLASS (salut_im_channel_parent_class)->dispose)
     G_OBJECT_CLASS (salut_im_channel_parent_class)->dispose (object);
 }
@@ -304,13 +347,16 @@ salut_im_channel_received_stanza (SalutImChannel *self,
                                   WockyStanza *stanza)
 {
   TpBaseChannel *base_chan = TP_BASE_CHANNEL (self);
-  TpBaseConnection *base_conn = tp_base_channel_get_connection (
-      base_chan);
   const gchar *from;
   TpChannelTextMessageType msgtype;
   const gchar *body;
   const gchar *body_offset;
 
+  /* typing notifications count too: a message is likely to follow */
+  salut_connection_warmup_touch (
+      SALUT_CONNECTION (tp_base_channel_get_connection (base_chan))->warmup,
+      WOCKY_LL_CONTACT (self->priv->contact));
+
   if (!text_helper_parse_incoming_message (stanza, &from, &msgtype,
         &body, &body_offset))
     {
@@ -326,10 +372,9 @@ salut_im_channel_received_stanza (SalutImChannel *self,
     }
 
   /* FIXME validate the from */
-  tp_message_mixin_take_received (G_OBJECT (self),
-      text_helper_create_received_message (base_conn,
-          tp_base_channel_get_target_handle (base_chan),
-          time (NULL), msgtype, body_offset));
+  salut_message_spill_receive (self->priv->spill,
+      tp_base_channel_get_target_handle (base_chan), time (NULL), msgtype,
+      body_offset);
 }
 
 static gboolean
@@ -405,6 +450,9 @@ _send_message (SalutImChannel *self,
   data->text = g_strdup (text);
   data->token = g_strdup (token);
 
+  salut_connection_warmup_touch (conn->warmup,
+      WOCKY_LL_CONTACT (self->priv->contact));
+
   wocky_porter_send_async (conn->porter,
       stanza, NULL, sent_message_cb, data);
 
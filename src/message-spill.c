@@ -0,0 +1,395 @@
+/*
+ * message-spill.c - Bounding the pending messages of text channels
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "message-spill.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#define DEBUG_FLAG DEBUG_IM
+#include "debug.h"
+#include "text-helper.h"
+
+#define DEFAULT_CHANNEL_BUDGET (4 * 1024 * 1024)
+#define DEFAULT_GLOBAL_BUDGET (32 * 1024 * 1024)
+
+/* What a pending TpMessage costs on top of its text: its parts, their hash
+ * tables and the mixin's bookkeeping */
+#define MESSAGE_OVERHEAD 512
+
+/* A message in the file is this header followed by text_len bytes of text,
+ * without the trailing NUL. The file only lives as long as the process, so
+ * the header is in host byte order. */
+typedef struct {
+  guint32 sender;
+  guint32 timestamp;
+  guint32 type;
+  guint32 text_len;
+} Record;
+
+struct _SalutMessageSpill {
+  GObject *channel;
+  TpBaseConnection *connection;
+  gulong removed_id;
+
+  /* pending message id => its estimated size */
+  GHashTable *pending;
+  gsize pending_bytes;
+
+  /* NULL when nothing is waiting in the file */
+  FILE *file;
+  gchar *path;
+  /* offset of the first message that hasn't been read back yet */
+  glong read_offset;
+  /* end of the messages written so far; a failed write leaves garbage
+   * after it, which the next one overwrites */
+  glong write_offset;
+  guint waiting;
+
+  guint spilled;
+  guint paged;
+};
+
+static gsize channel_budget = 0;
+static gsize global_budget = 0;
+static gsize global_pending_bytes = 0;
+/* every SalutMessageSpill, so that room made by one channel can be used by
+ * the others */
+static GList *spills = NULL;
+static SalutMessageSpillTakeFunc test_take_func = NULL;
+
+static gsize
+budget_from_env (const gchar *name,
+    gsize fallback)
+{
+  const gchar *value = g_getenv (name);
+  guint64 budget;
+
+  if (value == NULL)
+    return fallback;
+
+  budget = g_ascii_strtoull (value, NULL, 10);
+  if (budget == 0 || budget > G_MAXSIZE)
+    {
+      DEBUG ("ignoring invalid %s: %s", name, value);
+      return fallback;
+    }
+
+  return budget;
+}
+
+static gsize
+message_size (const gchar *text)
+{
+  return strlen (text) + MESSAGE_OVERHEAD;
+}
+
+/* A channel with nothing pending can always take one more message, however
+ * big, so that it can't get stuck */
+static gboolean
+fits (SalutMessageSpill *self,
+    gsize size)
+{
+  if (self->pending_bytes == 0)
+    return TRUE;
+
+  return self->pending_bytes + size <= channel_budget &&
+      global_pending_bytes + size <= global_budget;
+}
+
+static void
+take (SalutMessageSpill *self,
+    TpHandle sender,
+    guint timestamp,
+    TpChannelTextMessageType type,
+    const gchar *text)
+{
+  gsize size = message_size (text);
+  guint id;
+
+  if (test_take_func != NULL)
+    id = test_take_func (self->channel, sender, timestamp, type, text);
+  else
+    id = tp_message_mixin_take_received (self->channel,
+        text_helper_create_received_message (self->connection, sender,
+            timestamp, type, text));
+
+  g_hash_table_insert (self->pending, GUINT_TO_POINTER (id),
+      GSIZE_TO_POINTER (size));
+  self->pending_bytes += size;
+  global_pending_bytes += size;
+}
+
+static void
+close_file (SalutMessageSpill *self)
+{
+  if (self->file == NULL)
+    return;
+
+  fclose (self->file);
+  self->file = NULL;
+
+  /* Already gone on systems that let us remove open files */
+  g_unlink (self->path);
+  g_free (self->path);
+  self->path = NULL;
+
+  self->read_offset = 0;
+  self->write_offset = 0;
+  self->waiting = 0;
+}
+
+static gboolean
+open_file (SalutMessageSpill *self)
+{
+  GError *error = NULL;
+  gint fd;
+
+  fd = g_file_open_tmp ("telepathy-salut-XXXXXX", &self->path, &error);
+  if (fd == -1)
+    {
+      DEBUG ("couldn't create a file for pending messages: %s",
+          error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  self->file = fdopen (fd, "w+b");
+  if (self->file == NULL)
+    {
+      DEBUG ("fdopen failed: %s", g_strerror (errno));
+      close (fd);
+      g_unlink (self->path);
+      g_free (self->path);
+      self->path = NULL;
+      return FALSE;
+    }
+
+  /* Nobody else needs to see it */
+  g_unlink (self->path);
+
+  return TRUE;
+}
+
+static gboolean
+spill (SalutMessageSpill *self,
+    TpHandle sender,
+    guint timestamp,
+    TpChannelTextMessageType type,
+    const gchar *text)
+{
+  Record record;
+
+  if (self->file == NULL && !open_file (self))
+    return FALSE;
+
+  record.sender = sender;
+  record.timestamp = timestamp;
+  record.type = type;
+  record.text_len = strlen (text);
+
+  if (fseek (self->file, self->write_offset, SEEK_SET) != 0 ||
+      fwrite (&record, sizeof (record), 1, self->file) != 1 ||
+      fwrite (text, 1, record.text_len, self->file) != record.text_len)
+    {
+      DEBUG ("couldn't write a pending message: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  self->write_offset += sizeof (record) + record.text_len;
+  self->waiting++;
+  self->spilled++;
+
+  return TRUE;
+}
+
+/* Hands messages from the file to the mixin while there is room for them */
+static void
+page_in (SalutMessageSpill *self)
+{
+  while (self->waiting > 0)
+    {
+      Record record;
+      gchar *text;
+
+      if (fseek (self->file, self->read_offset, SEEK_SET) != 0 ||
+          fread (&record, sizeof (record), 1, self->file) != 1)
+        goto error;
+
+      if (!fits (self, record.text_len + MESSAGE_OVERHEAD))
+        return;
+
+      text = g_malloc (record.text_len + 1);
+
+      if (fread (text, 1, record.text_len, self->file) != record.text_len)
+        {
+          g_free (text);
+          goto error;
+        }
+
+      text[record.text_len] = '\0';
+
+      self->read_offset += sizeof (record) + record.text_len;
+      self->waiting--;
+      self->paged++;
+
+      take (self, record.sender, record.timestamp, record.type, text);
+      g_free (text);
+    }
+
+  DEBUG ("all the pending messages are back in memory (%u spilled, %u "
+      "paged in so far)", self->spilled, self->paged);
+  close_file (self);
+  return;
+
+error:
+  DEBUG ("couldn't read the pending messages back, dropping %u of them",
+      self->waiting);
+  close_file (self);
+}
+
+static void
+pending_messages_removed_cb (GObject *channel,
+    const GArray *ids,
+    gpointer user_data)
+{
+  SalutMessageSpill *self = user_data;
+  GList *l;
+  guint i;
+
+  for (i = 0; i < ids->len; i++)
+    {
+      gpointer key = GUINT_TO_POINTER (g_array_index (ids, guint, i));
+      gsize size = GPOINTER_TO_SIZE (g_hash_table_lookup (self->pending, key));
+
+      if (size == 0)
+        continue;
+
+      g_hash_table_remove (self->pending, key);
+      self->pending_bytes -= size;
+      global_pending_bytes -= size;
+    }
+
+  if (self->waiting > 0)
+    page_in (self);
+
+  /* Anything left of the global budget goes to the other channels */
+  for (l = spills; l != NULL; l = l->next)
+    {
+      SalutMessageSpill *other = l->data;
+
+      if (other != self && other->waiting > 0)
+        page_in (other);
+    }
+}
+
+SalutMessageSpill *
+salut_message_spill_new (GObject *channel,
+    TpBaseConnection *connection)
+{
+  SalutMessageSpill *self = g_slice_new0 (SalutMessageSpill);
+
+  if (channel_budget == 0)
+    {
+      channel_budget = budget_from_env ("SALUT_PENDING_CHANNEL_BUDGET",
+          DEFAULT_CHANNEL_BUDGET);
+      global_budget = budget_from_env ("SALUT_PENDING_GLOBAL_BUDGET",
+          DEFAULT_GLOBAL_BUDGET);
+    }
+
+  self->channel = channel;
+  self->connection = connection;
+  self->pending = g_hash_table_new (NULL, NULL);
+
+  /* TpMessageMixin emits this whenever messages are acknowledged */
+  self->removed_id = g_signal_connect (channel, "pending-messages-removed",
+      G_CALLBACK (pending_messages_removed_cb), self);
+
+  spills = g_list_prepend (spills, self);
+
+  return self;
+}
+
+void
+salut_message_spill_free (SalutMessageSpill *self)
+{
+  spills = g_list_remove (spills, self);
+
+  g_signal_handler_disconnect (self->channel, self->removed_id);
+
+  if (self->waiting > 0)
+    DEBUG ("dropping %u messages nobody acknowledged", self->waiting);
+
+  close_file (self);
+
+  global_pending_bytes -= self->pending_bytes;
+  g_hash_table_unref (self->pending);
+
+  g_slice_free (SalutMessageSpill, self);
+}
+
+void
+salut_message_spill_receive (SalutMessageSpill *self,
+    TpHandle sender,
+    guint timestamp,
+    TpChannelTextMessageType type,
+    const gchar *text)
+{
+  /* Once messages are waiting in the file, later ones have to queue up
+   * behind them to keep their order */
+  if (self->waiting == 0 && fits (self, message_size (text)))
+    {
+      take (self, sender, timestamp, type, text);
+      return;
+    }
+
+  if (self->waiting == 0)
+    DEBUG ("%" G_GSIZE_FORMAT " bytes of messages are pending in this "
+        "channel and %" G_GSIZE_FORMAT " overall, writing the next ones to "
+        "disk", self->pending_bytes, global_pending_bytes);
+
+  /* If we can't write it, keeping it in memory, even ahead of the ones in
+   * the file, beats losing it */
+  if (!spill (self, sender, timestamp, type, text))
+    take (self, sender, timestamp, type, text);
+}
+
+void
+salut_message_spill_get_counters (SalutMessageSpill *self,
+    guint *spilled,
+    guint *paged)
+{
+  if (spilled != NULL)
+    *spilled = self->spilled;
+
+  if (paged != NULL)
+    *paged = self->paged;
+}
+
+void
+_salut_message_spill_TEST_set_take_func (SalutMessageSpillTakeFunc func)
+{
+  test_take_func = func;
+}
@@ -0,0 +1,66 @@
+/*
+ * message-spill.h - Header for bounding the pending messages of text channels
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SALUT_MESSAGE_SPILL_H__
+#define __SALUT_MESSAGE_SPILL_H__
+
+#include <glib-object.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+G_BEGIN_DECLS
+
+/* Keeps the received messages of a channel using TpMessageMixin that haven't
+ * been acknowledged within a budget, per channel and for the whole process.
+ * Messages over the budget are appended to a file and handed to the mixin
+ * once acknowledging earlier ones made room for them.
+ *
+ * The budgets are in bytes and can be changed with the
+ * SALUT_PENDING_CHANNEL_BUDGET and SALUT_PENDING_GLOBAL_BUDGET environment
+ * variables. */
+typedef struct _SalutMessageSpill SalutMessageSpill;
+
+SalutMessageSpill *salut_message_spill_new (GObject *channel,
+    TpBaseConnection *connection);
+
+void salut_message_spill_free (SalutMessageSpill *self);
+
+/* Replaces tp_message_mixin_take_received () for messages built with
+ * text_helper_create_received_message () */
+void salut_message_spill_receive (SalutMessageSpill *self, TpHandle sender,
+    guint timestamp, TpChannelTextMessageType type, const gchar *text);
+
+/* Number of messages that went to the file, and that were read back from
+ * it, since the channel was created */
+void salut_message_spill_get_counters (SalutMessageSpill *self,
+    guint *spilled, guint *paged);
+
+/* For testing only: hand the messages to func instead of the channel's
+ * TpMessageMixin, which needs a connection. The channel has to emit
+ * pending-messages-removed with the ids func returned when they're
+ * acknowledged. NULL goes back to the mixin. */
+typedef guint (*SalutMessageSpillTakeFunc) (GObject *channel,
+    TpHandle sender, guint timestamp, TpChannelTextMessageType type,
+    const gchar *text);
+
+void _salut_message_spill_TEST_set_take_func (SalutMessageSpillTakeFunc func);
+
+G_END_DECLS
+
+#endif /* __SALUT_MESSAGE_SPILL_H__ */
@@ -49,9 +49,11 @@
 #include "contact-manager.h"
 #include "self.h"
 #include "muc-manager.h"
+#include "message-spill.h"
 #include "util.h"
 
 #include "text-helper.h"
+#include "tubes-versions.h"
 #include "tube-stream.h"
 #include "tube-dbus.h"
 
@@ -95,10 +97,24 @@ struct _SalutMucChannelPrivate
   guint timeout;
   /* (gchar *) -> (SalutContact *) */
   GHashTable *senders;
+  SalutMessageSpill *spill;
 
   gboolean autoclose;
 
   GHashTable *tubes;
+
+  /* Tubes are announced as a list of changes, each one bumping the version
+   * of our announcement; a full list is only sent when joining, when asked
+   * to, or if there are members who don't understand changes. */
+  guint tubes_version;
+  /* ids of the tubes in the current version of our announcement */
+  GHashTable *announced_tubes;
+  /* the versions of the other members' announcements we're at */
+  SalutTubesVersions *tubes_versions;
+  guint tubes_snapshot_source;
+
+  /* id of our counters on the debug interface */
+  guint stats_id;
 };
 
 /* Callback functions */
@@ -121,7 +137,7 @@ static void salut_muc_channel_send (GObject *channel,
                                     TpMessageSendingFlags flags);
 static void salut_muc_channel_close (TpBaseChannel *base);
 
-static void update_tube_info (SalutMucChannel *self);
+static void update_tube_info (SalutMucChannel *self, gboolean snapshot);
 static SalutTubeIface * create_new_tube (SalutMucChannel *self,
     TpTubeType type,
     TpHandle initiator,
@@ -251,6 +267,32 @@ muc_connection_connected_cb (GibberMucConnection *connection,
   salut_muc_channel_publish_service  (self);
 }
 
+static gchar *
+muc_channel_stats_cb (gpointer user_data)
+{
+  SalutMucChannel *self = SALUT_MUC_CHANNEL (user_data);
+  SalutMucChannelPrivate *priv = self->priv;
+  guint evictions, oldest_unstable, recovered, repaired, spilled, paged;
+  guint connecting, gathering, joining;
+  gsize bytes;
+
+  gibber_muc_connection_get_cache_stats (priv->muc_connection, &bytes,
+      &evictions, &oldest_unstable);
+  gibber_muc_connection_get_fec_counters (priv->muc_connection, &recovered,
+      &repaired);
+  gibber_muc_connection_get_join_times (priv->muc_connection, &connecting,
+      &gathering, &joining);
+  salut_message_spill_get_counters (priv->spill, &spilled, &paged);
+
+  return g_strdup_printf ("%s: last join took %u ms connecting, %u ms "
+      "gathering and %u ms joining; %" G_GSIZE_FORMAT " bytes of packets "
+      "cached, %u evicted, oldest unacked one %u ms old; %u lost packets "
+      "rebuilt from parity packets, %u repaired; %u messages written to "
+      "disk, %u read back", priv->muc_name, connecting, gathering, joining,
+      bytes, evictions, oldest_unstable, recovered, repaired, spilled,
+      paged);
+}
+
 #define NUM_SUPPORTED_MESSAGE_TYPES 3
 
 static void
@@ -288,6 +330,8 @@ salut_muc_channel_constructed (GObject *obj)
       TP_DELIVERY_REPORTING_SUPPORT_FLAG_RECEIVE_SUCCESSES,
       supported_content_types);
 
+  priv->spill = salut_message_spill_new (obj, base_conn);
+
   g_object_get (base_conn,
       "self", &(priv->self),
       NULL);
@@ -311,6 +355,10 @@ salut_muc_channel_constructed (GObject *obj)
 
   priv->tubes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
       NULL, (GDestroyNotify) g_object_unref);
+  priv->announced_tubes = g_hash_table_new (NULL, NULL);
+  priv->tubes_versions = salut_tubes_versions_new ();
+
+  priv->stats_id = debug_add_stats (DEBUG_FLAG, muc_channel_stats_cb, obj);
 }
 
 static void
@@ -745,11 +793,19 @@ salut_muc_channel_dispose (GObject *object)
 
   priv->connected = FALSE;
 
+  if (priv->stats_id != 0)
+    {
+      debug_remove_stats (priv->stats_id);
+      priv->stats_id = 0;
+    }
+
   g_signal_handlers_disconnect_matched (priv->muc_connection,
       G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, self);
 
   if (priv->muc_connection != NULL)
     {
+      gibber_muc_connection_set_filter (priv->muc_connection, NULL, NULL,
+          NULL);
       g_object_unref (priv->muc_connection);
       priv->muc_connection = NULL;
     }
@@ -767,6 +823,13 @@ salut_muc_channel_dispose (GObject *object)
     }
 
   tp_clear_pointer (&priv->tubes, g_hash_table_unref);
+  tp_clear_pointer (&priv->spill, salut_message_spill_free);
+
+  if (priv->tubes_snapshot_source != 0)
+    {
+      g_source_remove (priv->tubes_snapshot_source);
+      priv->tubes_snapshot_source = 0;
+    }
 
   /* release any references held by the object here */
   if (G_OBJECT_CLASS (salut_muc_channel_parent_class)->dispose)
@@ -782,6 +845,9 @@ salut_muc_channel_finalize (GObject *object)
   /* free any data held directly by the object here */
   g_free (priv->muc_name);
 
+  g_hash_table_unref (priv->announced_tubes);
+  salut_tubes_versions_free (priv->tubes_versions);
+
   tp_group_mixin_finalize (object);
   tp_message_mixin_finalize (object);
 
@@ -930,6 +996,7 @@ salut_muc_channel_remove_members (SalutMucChannel *self,
         }
 
       g_hash_table_remove (priv->senders, sender);
+      salut_tubes_versions_remove (priv->tubes_versions, handle);
 
       tp_intset_add (changes, handle);
     }
@@ -1044,6 +1111,227 @@ extract_tube_information (SalutMucChannel *self,
   return TRUE;
 }
 
+static gboolean
+parse_tubes_version (WockyNode *node,
+    guint *version)
+{
+  const gchar *str;
+  gchar *endptr;
+  guint64 tmp;
+
+  str = wocky_node_get_attribute (node, "version");
+  if (str == NULL)
+    return FALSE;
+
+  tmp = g_ascii_strtoull (str, &endptr, 10);
+  if (*endptr != '\0' || tmp > G_MAXUINT)
+    {
+      DEBUG ("tubes version is not numeric: %s", str);
+      return FALSE;
+    }
+
+  *version = (guint) tmp;
+  return TRUE;
+}
+
+/* Handles one <tube> announced by contact, creating the tube if we didn't
+ * know about it. Returns the tube, or NULL if the announcement was
+ * invalid. */
+static SalutTubeIface *
+handle_tube_announcement (SalutMucChannel *self,
+    TpHandle contact,
+    const gchar *sender,
+    WockyNode *tube_node,
+    gboolean *existed)
+{
+  SalutMucChannelPrivate *priv = self->priv;
+  const gchar *stream_id;
+  SalutTubeIface *tube;
+  guint tube_id;
+  TpTubeType type;
+  GibberBytestreamIface *bytestream;
+
+  *existed = FALSE;
+
+  stream_id = wocky_node_get_attribute (tube_node, "stream-id");
+
+  if (!extract_tube_information (self, tube_node, NULL,
+          NULL, NULL, NULL, &tube_id))
+    return NULL;
+
+  tube = g_hash_table_lookup (priv->tubes, GUINT_TO_POINTER (tube_id));
+
+  if (tube == NULL)
+    {
+      /* a new tube */
+      const gchar *service;
+      TpHandle initiator_handle;
+      GHashTable *parameters;
+      guint id;
+
+      if (extract_tube_information (self, tube_node, &type,
+              &initiator_handle, &service, &parameters, &id))
+        {
+          switch (type)
+            {
+            case TP_TUBE_TYPE_DBUS:
+              {
+                if (initiator_handle == 0)
+                  {
+                    DEBUG ("D-Bus tube initiator missing");
+                    g_hash_table_unref (parameters);
+                    return NULL;
+                  }
+              }
+              break;
+            case TP_TUBE_TYPE_STREAM:
+              initiator_handle = contact;
+              break;
+            default:
+              g_assert_not_reached ();
+            }
+
+          tube = create_new_tube (self, type, initiator_handle, service, parameters,
+              id, 0, NULL, FALSE);
+
+          g_signal_emit (self, signals[NEW_TUBE], 0, tube);
+
+          g_hash_table_unref (parameters);
+        }
+    }
+  else
+    {
+      *existed = TRUE;
+    }
+
+  if (tube == NULL)
+    return NULL;
+
+  g_object_get (tube,
+      "type", &type,
+      NULL);
+
+  if (type == TP_TUBE_TYPE_DBUS
+      && !salut_tube_dbus_handle_in_names (SALUT_TUBE_DBUS (tube),
+          contact))
+    {
+      /* contact just joined the tube */
+      const gchar *new_name;
+      SalutTubeDBusPeerFlags flags = 0;
+
+      new_name = wocky_node_get_attribute (tube_node, "dbus-name");
+
+      if (new_name == NULL)
+        {
+          DEBUG ("Contact %u isn't announcing his or her D-Bus name", contact);
+          return tube;
+        }
+
+      /* Older versions only unmarshal the first D-Bus message of each
+       * bytestream message, and refuse extra bytestreams for D-Bus tubes */
+      if (!tp_strdiff (wocky_node_get_attribute (tube_node, "batching"),
+            "true"))
+        flags |= SALUT_TUBE_DBUS_PEER_BATCHING;
+
+      if (!tp_strdiff (wocky_node_get_attribute (tube_node, "unicast"),
+            "true"))
+        flags |= SALUT_TUBE_DBUS_PEER_UNICAST;
+
+      salut_tube_dbus_add_name (SALUT_TUBE_DBUS (tube), contact, new_name,
+          flags);
+
+      g_object_get (tube,
+          "bytestream", &bytestream,
+          NULL);
+      g_assert (bytestream != NULL);
+
+      if (GIBBER_IS_BYTESTREAM_MUC (bytestream))
+        {
+          guint16 tmp = (guint16) atoi (stream_id);
+
+          gibber_bytestream_muc_add_sender (
+              GIBBER_BYTESTREAM_MUC (bytestream), sender, tmp);
+        }
+
+      g_object_unref (bytestream);
+    }
+
+  return tube;
+}
+
+/* contact left a D-Bus tube */
+static void
+remove_tube_member (SalutMucChannel *self,
+    TpHandle contact,
+    const gchar *sender,
+    SalutTubeDBus *tube)
+{
+  GibberBytestreamIface *bytestream;
+
+  salut_tube_dbus_remove_name (tube, contact);
+
+  g_object_get (tube,
+      "bytestream", &bytestream,
+      NULL);
+  g_assert (bytestream != NULL);
+
+  if (GIBBER_IS_BYTESTREAM_MUC (bytestream) && sender != NULL)
+    {
+      gibber_bytestream_muc_remove_sender (
+          GIBBER_BYTESTREAM_MUC (bytestream), sender);
+    }
+
+  g_object_unref (bytestream);
+}
+
+static gboolean
+send_tubes_snapshot_cb (gpointer user_data)
+{
+  SalutMucChannel *self = SALUT_MUC_CHANNEL (user_data);
+
+  self->priv->tubes_snapshot_source = 0;
+  update_tube_info (self, TRUE);
+
+  return FALSE;
+}
+
+/* Several members may want our full list at the same time, only send it
+ * once */
+static void
+schedule_tubes_snapshot (SalutMucChannel *self)
+{
+  if (self->priv->tubes_snapshot_source == 0)
+    self->priv->tubes_snapshot_source = g_idle_add (send_tubes_snapshot_cb,
+        self);
+}
+
+static void
+request_tubes_snapshot (SalutMucChannel *self,
+    const gchar *member)
+{
+  TpBaseChannel *base = TP_BASE_CHANNEL (self);
+  TpBaseConnection *base_conn = tp_base_channel_get_connection (base);
+  SalutConnection *conn = SALUT_CONNECTION (base_conn);
+  TpHandleRepoIface *room_repo = tp_base_connection_get_handles (
+      base_conn, TP_HANDLE_TYPE_ROOM);
+  WockyStanza *msg;
+  GError *error = NULL;
+
+  DEBUG ("asking %s for their full list of tubes", member);
+
+  msg = salut_tubes_versions_build_request (conn->name,
+      tp_handle_inspect (room_repo, tp_base_channel_get_target_handle (base)),
+      member);
+
+  if (!gibber_muc_connection_send (self->priv->muc_connection, msg, &error))
+    {
+      DEBUG ("sending tubes request failed: %s", error->message);
+      g_error_free (error);
+    }
+
+  g_object_unref (msg);
+}
+
 static void
 muc_channel_handle_tubes (SalutMucChannel *self,
     TpHandle contact,
@@ -1063,6 +1351,9 @@ muc_channel_handle_tubes (SalutMucChannel *self,
   gpointer key, value;
   GSList *l;
   WockyNode *tubes_node;
+  gboolean versioned;
+  guint version = 0;
+  gboolean send_ours;
 
   if (contact == TP_GROUP_MIXIN (self)->self_handle)
     /* we don't need to inspect our own tubes */
@@ -1080,6 +1371,22 @@ muc_channel_handle_tubes (SalutMucChannel *self,
       WOCKY_TELEPATHY_NS_TUBES);
   g_assert (tubes_node != NULL);
 
+  versioned = parse_tubes_version (tubes_node, &version);
+
+  if (salut_tubes_versions_snapshot (priv->tubes_versions, contact,
+          versioned, version, &send_ours) == SALUT_TUBES_VERSIONS_SKIP)
+    {
+      DEBUG ("already at version %u of %s's tubes", version, sender);
+      return;
+    }
+
+  if (send_ours)
+    {
+      /* They only understand full lists, and expect ours in exchange */
+      DEBUG ("%s sends unversioned tube lists", sender);
+      schedule_tubes_snapshot (self);
+    }
+
   /* fill old_dbus_tubes with D-Bus tubes previously announced by the
    * contact */
   old_dbus_tubes = g_hash_table_new (NULL, NULL);
@@ -1095,7 +1402,7 @@ muc_channel_handle_tubes (SalutMucChannel *self,
           NULL);
 
       if (type != TP_TUBE_TYPE_DBUS)
-        return;
+        continue;
 
       if (salut_tube_dbus_handle_in_names (SALUT_TUBE_DBUS (tube),
               contact))
@@ -1107,125 +1414,101 @@ muc_channel_handle_tubes (SalutMucChannel *self,
   for (l = tubes_node->children; l != NULL; l = l->next)
     {
       WockyNode *tube_node = (WockyNode *) l->data;
-      const gchar *stream_id;
       SalutTubeIface *tube;
-      guint tube_id;
-      TpTubeType type;
-      GibberBytestreamIface *bytestream;
-
-      stream_id = wocky_node_get_attribute (tube_node, "stream-id");
+      gboolean existed;
+      guint64 tube_id;
 
-      if (!extract_tube_information (self, tube_node, NULL,
-              NULL, NULL, NULL, &tube_id))
-        continue;
-
-      tube = g_hash_table_lookup (priv->tubes, GUINT_TO_POINTER (tube_id));
-
-      if (tube == NULL)
-        {
-          /* a new tube */
-          const gchar *service;
-          TpHandle initiator_handle;
-          GHashTable *parameters;
-          guint id;
-
-          if (extract_tube_information (self, tube_node, &type,
-                  &initiator_handle, &service, &parameters, &id))
-            {
-              switch (type)
-                {
-                case TP_TUBE_TYPE_DBUS:
-                  {
-                    if (initiator_handle == 0)
-                      {
-                        DEBUG ("D-Bus tube initiator missing");
-                        continue;
-                      }
-                  }
-                  break;
-                case TP_TUBE_TYPE_STREAM:
-                  initiator_handle = contact;
-                  break;
-                default:
-                  g_assert_not_reached ();
-                }
-
-              tube = create_new_tube (self, type, initiator_handle, service, parameters,
-                  id, 0, NULL, FALSE);
-
-              g_signal_emit (self, signals[NEW_TUBE], 0, tube);
+      tube = handle_tube_announcement (self, contact, sender, tube_node,
+          &existed);
 
-              g_hash_table_unref (parameters);
-            }
-        }
-      else
+      if (tube != NULL && existed)
         {
           /* the contact is in the tube.
            * remove it from old_dbus_tubes if needed. */
+          g_object_get (tube,
+              "id", &tube_id,
+              NULL);
           g_hash_table_remove (old_dbus_tubes, GUINT_TO_POINTER (tube_id));
         }
+    }
 
-      if (tube == NULL)
-        continue;
+  g_hash_table_iter_init (&iter, old_dbus_tubes);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    remove_tube_member (self, contact, sender, SALUT_TUBE_DBUS (value));
 
-      g_object_get (tube,
-          "type", &type,
-          NULL);
+  g_hash_table_unref (old_dbus_tubes);
+}
 
-      if (type == TP_TUBE_TYPE_DBUS
-          && !salut_tube_dbus_handle_in_names (SALUT_TUBE_DBUS (tube),
-              contact))
-        {
-          /* contact just joined the tube */
-          const gchar *new_name;
+/* Applies the changes contact made to their list of tubes since the version
+ * we're at */
+static void
+muc_channel_handle_tubes_delta (SalutMucChannel *self,
+    TpHandle contact,
+    WockyNode *delta_node)
+{
+  SalutMucChannelPrivate *priv = self->priv;
+  TpBaseConnection *base_conn = tp_base_channel_get_connection (
+      TP_BASE_CHANNEL (self));
+  TpHandleRepoIface *contact_repo =
+      tp_base_connection_get_handles (base_conn,
+          TP_HANDLE_TYPE_CONTACT);
+  const gchar *sender;
+  guint version;
+  GSList *l;
 
-          new_name = wocky_node_get_attribute (tube_node, "dbus-name");
+  if (contact == TP_GROUP_MIXIN (self)->self_handle)
+    return;
 
-          if (new_name == NULL)
-            {
-              DEBUG ("Contact %u isn't announcing his or her D-Bus name", contact);
-              continue;
-            }
+  sender = tp_handle_inspect (contact_repo, contact);
 
-          salut_tube_dbus_add_name (SALUT_TUBE_DBUS (tube), contact, new_name);
+  if (!parse_tubes_version (delta_node, &version))
+    {
+      DEBUG ("tubes delta from %s has no version, discarding", sender);
+      return;
+    }
 
-          g_object_get (tube,
-              "bytestream", &bytestream,
-              NULL);
-          g_assert (bytestream != NULL);
+  switch (salut_tubes_versions_delta (priv->tubes_versions, contact,
+          version))
+    {
+    case SALUT_TUBES_VERSIONS_SKIP:
+      DEBUG ("already at version %u of %s's tubes",
+          salut_tubes_versions_get (priv->tubes_versions, contact), sender);
+      return;
+    case SALUT_TUBES_VERSIONS_REQUEST_SNAPSHOT:
+      DEBUG ("missed some changes to %s's tubes (at %u, got %u)", sender,
+          salut_tubes_versions_get (priv->tubes_versions, contact), version);
+      request_tubes_snapshot (self, sender);
+      return;
+    case SALUT_TUBES_VERSIONS_APPLY:
+      break;
+    }
 
-          if (GIBBER_IS_BYTESTREAM_MUC (bytestream))
-            {
-              guint16 tmp = (guint16) atoi (stream_id);
+  for (l = delta_node->children; l != NULL; l = l->next)
+    {
+      WockyNode *node = (WockyNode *) l->data;
 
-              gibber_bytestream_muc_add_sender (
-                  GIBBER_BYTESTREAM_MUC (bytestream), sender, tmp);
-            }
+      if (!tp_strdiff (node->name, "tube"))
+        {
+          gboolean existed;
 
-          g_object_unref (bytestream);
+          handle_tube_announcement (self, contact, sender, node, &existed);
         }
-    }
+      else if (!tp_strdiff (node->name, "closed"))
+        {
+          SalutTubeIface *tube;
+          guint tube_id;
 
-  g_hash_table_iter_init (&iter, old_dbus_tubes);
-  while (g_hash_table_iter_next (&iter, NULL, &value))
-    {
-      SalutTubeDBus *tube = SALUT_TUBE_DBUS (value);
-      GibberBytestreamIface *bytestream;
+          if (!extract_tube_information (self, node, NULL, NULL, NULL, NULL,
+                  &tube_id))
+            continue;
 
-      salut_tube_dbus_remove_name (tube, contact);
+          tube = g_hash_table_lookup (priv->tubes, GUINT_TO_POINTER (tube_id));
 
-      g_object_get (tube,
-          "bytestream", &bytestream,
-          NULL);
-      g_assert (bytestream != NULL);
-
-      if (GIBBER_IS_BYTESTREAM_MUC (bytestream) && sender != NULL)
-        {
-          gibber_bytestream_muc_remove_sender (
-              GIBBER_BYTESTREAM_MUC (bytestream), sender);
+          if (SALUT_IS_TUBE_DBUS (tube) &&
+              salut_tube_dbus_handle_in_names (SALUT_TUBE_DBUS (tube),
+                  contact))
+            remove_tube_member (self, contact, sender, SALUT_TUBE_DBUS (tube));
         }
-
-      g_object_unref (bytestream);
     }
 }
 
@@ -1248,6 +1531,8 @@ salut_muc_channel_received_stanza (GibberMucConnection *conn,
   TpHandle from_handle;
   WockyNode *node = wocky_stanza_get_top_node (stanza);
   WockyNode *tubes_node;
+  WockyNode *delta_node;
+  WockyNode *request_node;
 
   to = wocky_node_get_attribute (node, "to");
 
@@ -1290,6 +1575,26 @@ salut_muc_channel_received_stanza (GibberMucConnection *conn,
       muc_channel_handle_tubes (self, from_handle, stanza);
     }
 
+  delta_node = wocky_node_get_child_ns (node, "tubes-delta",
+      WOCKY_TELEPATHY_NS_TUBES);
+  if (delta_node != NULL)
+    {
+      muc_channel_handle_tubes_delta (self, from_handle, delta_node);
+      return;
+    }
+
+  request_node = wocky_node_get_child_ns (node, "tubes-request",
+      WOCKY_TELEPATHY_NS_TUBES);
+  if (request_node != NULL)
+    {
+      SalutConnection *conn = SALUT_CONNECTION (base_connection);
+
+      if (!tp_strdiff (wocky_node_get_attribute (request_node, "member"),
+              conn->name))
+        schedule_tubes_snapshot (self);
+      return;
+    }
+
   if (!text_helper_parse_incoming_message (stanza, &from, &msgtype,
       &body, &body_offset))
     {
@@ -1304,9 +1609,8 @@ salut_muc_channel_received_stanza (GibberMucConnection *conn,
     }
 
   /* FIXME validate the from and the to */
-  tp_message_mixin_take_received (G_OBJECT (self),
-      text_helper_create_received_message (base_connection, from_handle,
-          time (NULL), msgtype, body_offset));
+  salut_message_spill_receive (priv->spill, from_handle, time (NULL), msgtype,
+      body_offset);
 }
 
 static void
@@ -1326,7 +1630,10 @@ salut_muc_channel_new_senders (GibberMucConnection *connection,
       salut_muc_channel_add_self_to_members (self);
     }
 
-  update_tube_info (self);
+  /* The new members need our full list, unless there's nothing in it yet.
+   * Those who already know it will skip it. */
+  if (self->priv->tubes_version > 0)
+    update_tube_info (self, TRUE);
 }
 
 static void
@@ -1338,12 +1645,30 @@ salut_muc_channel_lost_senders (GibberMucConnection *connection,
   salut_muc_channel_remove_members (self, senders);
 }
 
+static gboolean
+salut_muc_channel_sender_filter (GibberMucConnection *conn,
+                                 const gchar *sender,
+                                 gpointer user_data)
+{
+  SalutMucChannel *self = SALUT_MUC_CHANNEL (user_data);
+  TpBaseConnection *base_connection = tp_base_channel_get_connection (
+      TP_BASE_CHANNEL (self));
+  TpHandleRepoIface *contact_repo =
+      tp_base_connection_get_handles (base_connection, TP_HANDLE_TYPE_CONTACT);
+
+  /* salut_muc_channel_received_stanza discards them anyway */
+  return tp_handle_lookup (contact_repo, sender, NULL, NULL) != 0;
+}
+
 static gboolean
 salut_muc_channel_connect (SalutMucChannel *channel,
                            GError **error)
 {
   SalutMucChannelPrivate *priv = channel->priv;
 
+  gibber_muc_connection_set_filter (priv->muc_connection, priv->muc_name,
+      salut_muc_channel_sender_filter, channel);
+
   g_signal_connect (priv->muc_connection, "received-stanza",
       G_CALLBACK (salut_muc_channel_received_stanza), channel);
 
@@ -1518,6 +1843,11 @@ publish_tube_in_node (SalutMucChannel *self,
           if (name != NULL)
             wocky_node_set_attribute (node, "dbus-name", name);
 
+          /* we can take several D-Bus messages per bytestream message, and
+           * the ones addressed to us over a bytestream of their own */
+          wocky_node_set_attribute (node, "batching", "true");
+          wocky_node_set_attribute (node, "unicast", "true");
+
           g_free (name);
           g_free (stream_id);
 
@@ -1538,8 +1868,33 @@ publish_tube_in_node (SalutMucChannel *self,
   g_hash_table_unref (parameters);
 }
 
+static gboolean
+tube_is_announced (SalutMucChannel *self,
+    SalutTubeIface *tube)
+{
+  TpTubeChannelState state;
+  TpTubeType type;
+  TpHandle initiator;
+
+  g_object_get (tube,
+      "state", &state,
+      "type", &type,
+      "initiator-handle", &initiator,
+      NULL);
+
+  if (state != TP_TUBE_CHANNEL_STATE_OPEN)
+    return FALSE;
+
+  /* We only announce stream tubes we initiated */
+  return type != TP_TUBE_TYPE_STREAM
+      || initiator == TP_GROUP_MIXIN (self)->self_handle;
+}
+
+/* Announces our tubes, either as a full list if snapshot is TRUE or as the
+ * changes since the last version otherwise */
 static void
-update_tube_info (SalutMucChannel *self)
+update_tube_info (SalutMucChannel *self,
+    gboolean snapshot)
 {
   SalutMucChannelPrivate *priv = self->priv;
   TpBaseChannel *base = TP_BASE_CHANNEL (self);
@@ -1548,57 +1903,100 @@ update_tube_info (SalutMucChannel *self)
   TpHandleRepoIface *room_repo = tp_base_connection_get_handles (
       base_conn, TP_HANDLE_TYPE_ROOM);
   GHashTableIter iter;
-  gpointer value;
+  gpointer key, value;
+  GHashTable *announced;
   WockyStanza *msg;
   WockyNode *msg_node;
   WockyNode *node;
   const gchar *jid;
+  gchar *version;
+  gboolean changed = FALSE;
   GError *error = NULL;
 
   if (priv->tubes == NULL)
     return;
 
+  announced = g_hash_table_new (NULL, NULL);
+
+  g_hash_table_iter_init (&iter, priv->tubes);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (!tube_is_announced (self, value))
+        continue;
+
+      g_hash_table_add (announced, key);
+
+      if (!g_hash_table_contains (priv->announced_tubes, key))
+        changed = TRUE;
+    }
+
+  if (g_hash_table_size (announced) !=
+      g_hash_table_size (priv->announced_tubes))
+    changed = TRUE;
+
+  if (changed)
+    priv->tubes_version++;
+
+  /* members who don't know about versions need the full list */
+  if (salut_tubes_versions_has_legacy (priv->tubes_versions))
+    snapshot = TRUE;
+
+  if (!snapshot && !changed)
+    {
+      g_hash_table_unref (announced);
+      return;
+    }
+
   /* build the message */
   jid = tp_handle_inspect (room_repo,
       tp_base_channel_get_target_handle (base));
+  version = g_strdup_printf ("%u", priv->tubes_version);
 
   msg = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
       WOCKY_STANZA_SUB_TYPE_GROUPCHAT,
       conn->name, jid,
-      WOCKY_NODE_START, "tubes",
+      WOCKY_NODE_START, snapshot ? "tubes" : "tubes-delta",
         WOCKY_NODE_XMLNS, WOCKY_TELEPATHY_NS_TUBES,
+        WOCKY_NODE_ATTRIBUTE, "version", version,
       WOCKY_NODE_END, NULL);
   msg_node = wocky_stanza_get_top_node (msg);
+  node = wocky_node_get_first_child (msg_node);
 
-  node = wocky_node_get_child_ns (msg_node, "tubes",
-      WOCKY_TELEPATHY_NS_TUBES);
-
-  g_hash_table_iter_init (&iter, priv->tubes);
-  while (g_hash_table_iter_next (&iter, NULL, &value))
+  g_hash_table_iter_init (&iter, announced);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
     {
-      TpTubeChannelState state;
-      TpTubeType type;
-      TpHandle initiator;
       WockyNode *tube_node;
 
-      g_object_get (value,
-          "state", &state,
-          "type", &type,
-          "initiator-handle", &initiator,
-          NULL);
-
-      if (state != TP_TUBE_CHANNEL_STATE_OPEN)
+      /* changes only carry the new tubes */
+      if (!snapshot && g_hash_table_contains (priv->announced_tubes, key))
         continue;
 
-      if (type == TP_TUBE_TYPE_STREAM
-          && initiator != TP_GROUP_MIXIN (self)->self_handle)
-        /* We only announce stream tubes we initiated */
-        return;
-
       tube_node = wocky_node_add_child (node, "tube");
-      publish_tube_in_node (self, tube_node, value);
+      publish_tube_in_node (self, tube_node,
+          g_hash_table_lookup (priv->tubes, key));
     }
 
+  if (!snapshot)
+    {
+      g_hash_table_iter_init (&iter, priv->announced_tubes);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        {
+          WockyNode *closed_node;
+          gchar *id_str;
+
+          if (g_hash_table_contains (announced, key))
+            continue;
+
+          id_str = g_strdup_printf ("%u", GPOINTER_TO_UINT (key));
+          closed_node = wocky_node_add_child (node, "closed");
+          wocky_node_set_attribute (closed_node, "id", id_str);
+          g_free (id_str);
+        }
+    }
+
+  g_hash_table_unref (priv->announced_tubes);
+  priv->announced_tubes = announced;
+
   /* Send it */
   if (!gibber_muc_connection_send (priv->muc_connection, msg, &error))
     {
@@ -1607,6 +2005,7 @@ update_tube_info (SalutMucChannel *self)
       g_error_free (error);
     }
 
+  g_free (version);
   g_object_unref (msg);
 }
 
@@ -1623,19 +2022,20 @@ tube_opened_cb (SalutTubeIface *tube,
           NULL);
 
       salut_tube_dbus_add_name (SALUT_TUBE_DBUS (tube),
-          TP_GROUP_MIXIN (self)->self_handle, dbus_name);
+          TP_GROUP_MIXIN (self)->self_handle, dbus_name,
+          SALUT_TUBE_DBUS_PEER_BATCHING | SALUT_TUBE_DBUS_PEER_UNICAST);
 
       g_free (dbus_name);
     }
 
-  update_tube_info (self);
+  update_tube_info (self, FALSE);
 }
 
 static void
 tube_offered_cb (SalutTubeIface *tube,
     SalutMucChannel *self)
 {
-  update_tube_info (self);
+  update_tube_info (self, FALSE);
 }
 
 static void
@@ -1649,10 +2049,13 @@ tube_closed_cb (SalutTubeIface *tube,
       "id", &id,
       NULL);
 
-  update_tube_info (self);
-
-  if (priv->tubes != NULL)
-    g_hash_table_remove (priv->tubes, GUINT_TO_POINTER (id));
+  /* take it out of the list before announcing the change */
+  if (priv->tubes != NULL &&
+      g_hash_table_steal (priv->tubes, GUINT_TO_POINTER (id)))
+    {
+      update_tube_info (self, FALSE);
+      g_object_unref (tube);
+    }
 }
 
 static guint
@@ -474,6 +474,32 @@ muc_channel_new_tube_cb (SalutMucChannel *channel,
       channel);
 }
 
+/* Reads a number of KiB from the environment variable name, if it's set
+ * to one that is valid and at most max */
+static gboolean
+kib_from_env (const gchar *name,
+    guint64 max,
+    gsize *bytes)
+{
+  const gchar *value = g_getenv (name);
+  gchar *end;
+  guint64 kib;
+
+  if (value == NULL)
+    return FALSE;
+
+  /* g_ascii_strtoull () takes a sign and negates what follows it */
+  kib = g_ascii_strtoull (value, &end, 10);
+  if (!g_ascii_isdigit (value[0]) || *end != '\0' || kib > max)
+    {
+      DEBUG ("Ignoring invalid %s: %s", name, value);
+      return FALSE;
+    }
+
+  *bytes = kib * 1024;
+  return TRUE;
+}
+
 static GibberMucConnection *
 _get_connection (SalutMucManager *mgr,
                  const gchar *protocol,
@@ -481,9 +507,49 @@ _get_connection (SalutMucManager *mgr,
                  GError **error)
 {
   SalutMucManagerPrivate *priv = SALUT_MUC_MANAGER_GET_PRIVATE (mgr);
+  GibberMucConnection *connection;
+  const gchar *fec = g_getenv ("SALUT_MUC_FEC");
+  const gchar *thread = g_getenv ("SALUT_MUC_RECEIVE_THREAD");
+  const gchar *compression = g_getenv ("SALUT_MUC_COMPRESSION");
+  guint k, r;
+  gsize budget, rate;
 
-  return gibber_muc_connection_new (priv->connection->name,
+  connection = gibber_muc_connection_new (priv->connection->name,
       protocol, parameters, error);
+
+  /* Only for rooms that don't say what they want */
+  if (connection != NULL && fec != NULL &&
+      (parameters == NULL || g_hash_table_lookup (parameters, "fec") == NULL))
+    {
+      if (gibber_muc_connection_parse_fec (fec, &k, &r))
+        gibber_muc_connection_set_fec (connection, k, r);
+      else
+        DEBUG ("Ignoring invalid SALUT_MUC_FEC: %s", fec);
+    }
+
+  if (connection != NULL && thread != NULL)
+    {
+      if (!tp_strdiff (thread, "1"))
+        gibber_muc_connection_set_receive_thread (connection, TRUE);
+      else if (tp_strdiff (thread, "0"))
+        DEBUG ("Ignoring invalid SALUT_MUC_RECEIVE_THREAD: %s", thread);
+    }
+
+  if (connection != NULL && kib_from_env ("SALUT_MUC_CACHE_BUDGET",
+        G_MAXSIZE / 1024, &budget))
+    gibber_muc_connection_set_cache_budget (connection, budget);
+
+  /* per second, up to 1 GiB/s */
+  if (connection != NULL && kib_from_env ("SALUT_MUC_SEND_RATE",
+        1024 * 1024, &rate))
+    gibber_muc_connection_set_send_rate (connection, rate);
+
+  /* Rooms we join follow their creator */
+  if (connection != NULL && parameters == NULL && compression != NULL
+      && atoi (compression) != 0)
+    gibber_muc_connection_set_compression (connection, TRUE);
+
+  return connection;
 }
 
 static void
@@ -1070,6 +1136,18 @@ invite_stanza_callback (WockyPorter *porter,
           g_strdup (param->content));
     }
 
+  params = gibber_muc_connection_get_optional_parameters (
+      WOCKY_TELEPATHY_NS_CLIQUE);
+  for (p = params ; p != NULL && *p != NULL; p++)
+    {
+      WockyNode *param;
+
+      param = wocky_node_get_child (invite, *p);
+      if (param != NULL)
+        g_hash_table_insert (params_hash, (gchar *) *p,
+            g_strdup (param->content));
+    }
+
   /* FIXME proper serialisation of handle name */
   /* Create the group if it doesn't exist and myself to local_pending */
   room_handle = tp_handle_ensure (room_repo, room, NULL, NULL);
@@ -62,6 +62,7 @@ typedef struct _CapabilityInfo CapabilityInfo;
 
 struct _CapabilityInfo
 {
+  /* interned, and shared with the contacts using this node#ver */
   GabbleCapabilitySet *caps;
   GPtrArray *data_forms;
 };
@@ -82,9 +83,32 @@ struct _SalutPresenceCachePrivate
 
   guint caps_serial;
 
+  /* Disco requests need our own JID, so until our service is established
+   * the capabilities contacts advertise are only remembered here:
+   * owned SalutContact * -> HeldCaps * */
+  gboolean self_established;
+  GHashTable *held_caps;
+
   gboolean dispose_has_run;
 };
 
+typedef struct {
+  gchar *hash;
+  gchar *node;
+  gchar *ver;
+} HeldCaps;
+
+static void
+held_caps_free (gpointer data)
+{
+  HeldCaps *held = data;
+
+  g_free (held->hash);
+  g_free (held->node);
+  g_free (held->ver);
+  g_slice_free (HeldCaps, held);
+}
+
 typedef struct _DiscoWaiter DiscoWaiter;
 
 struct _DiscoWaiter
@@ -217,6 +241,8 @@ salut_presence_cache_init (SalutPresenceCache *cache)
       (GDestroyNotify) capability_info_free);
   priv->disco_pending = g_hash_table_new_full (g_str_hash, g_str_equal,
     g_free, (GDestroyNotify) disco_waiter_list_free);
+  priv->held_caps = g_hash_table_new_full (NULL, NULL, g_object_unref,
+      held_caps_free);
   priv->caps_serial = 1;
 }
 
@@ -226,14 +252,16 @@ salut_presence_cache_constructor (GType type, guint n_props,
 {
   GObject *obj;
   SalutPresenceCache *self;
+  GabbleCapabilitySet *caps;
 
   obj = G_OBJECT_CLASS (salut_presence_cache_parent_class)->
            constructor (type, n_props, props);
   self = SALUT_PRESENCE_CACHE (obj);
 
-  self->priv->not_xep_capabilities.caps = gabble_capability_set_new ();
-  gabble_capability_set_add (self->priv->not_xep_capabilities.caps,
-      QUIRK_NOT_XEP_CAPABILITIES);
+  caps = gabble_capability_set_new ();
+  gabble_capability_set_add (caps, QUIRK_NOT_XEP_CAPABILITIES);
+  self->priv->not_xep_capabilities.caps = gabble_capability_set_intern (caps);
+  gabble_capability_set_free (caps);
   self->priv->not_xep_capabilities.data_forms =
     g_ptr_array_new_with_free_func (g_object_unref);
 
@@ -259,6 +287,8 @@ salut_presence_cache_dispose (GObject *object)
   g_hash_table_unref (priv->disco_pending);
   priv->disco_pending = NULL;
 
+  tp_clear_pointer (&priv->held_caps, g_hash_table_unref);
+
   tp_clear_pointer (&(priv->not_xep_capabilities.caps),
       gabble_capability_set_free);
   tp_clear_pointer (&(priv->not_xep_capabilities.data_forms),
@@ -489,9 +519,12 @@ _caps_disco_cb (SalutDisco *disco,
 
           if (info == NULL)
             {
+              GabbleCapabilitySet *caps =
+                  gabble_capability_set_new_from_stanza (query_result);
+
               info = g_slice_new0 (CapabilityInfo);
-              info->caps = gabble_capability_set_new_from_stanza (
-                  query_result);
+              info->caps = gabble_capability_set_intern (caps);
+              gabble_capability_set_free (caps);
               info->data_forms = get_data_forms (query_result);
               g_hash_table_insert (priv->capabilities, g_strdup (node), info);
             }
@@ -592,6 +625,19 @@ salut_presence_cache_process_caps (SalutPresenceCache *self,
 
   priv = SALUT_PRESENCE_CACHE_PRIV (self);
 
+  if (!priv->self_established)
+    {
+      HeldCaps *held = g_slice_new (HeldCaps);
+
+      DEBUG ("Holding them back until our own service is established");
+
+      held->hash = g_strdup (hash);
+      held->node = g_strdup (node);
+      held->ver = g_strdup (ver);
+      g_hash_table_insert (priv->held_caps, g_object_ref (contact), held);
+      return;
+    }
+
   if (hash == NULL || node == NULL || ver == NULL ||
       tp_strdiff (hash, "sha-1"))
     {
@@ -657,6 +703,42 @@ salut_presence_cache_process_caps (SalutPresenceCache *self,
   g_free (uri);
 }
 
+/* Processes the capabilities that were held back until now */
+void
+salut_presence_cache_self_established (SalutPresenceCache *self)
+{
+  SalutPresenceCachePrivate *priv = SALUT_PRESENCE_CACHE_PRIV (self);
+  GHashTable *held_caps = priv->held_caps;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (priv->self_established)
+    return;
+
+  priv->self_established = TRUE;
+
+  DEBUG ("Processing the capabilities of %u contacts",
+      g_hash_table_size (held_caps));
+
+  /* the table can't change under us anymore, but the cache might get
+   * disposed by a handler */
+  priv->held_caps = NULL;
+  g_object_ref (self);
+
+  g_hash_table_iter_init (&iter, held_caps);
+  while (g_hash_table_iter_next (&iter, &key, &value) &&
+      !priv->dispose_has_run)
+    {
+      HeldCaps *held = value;
+
+      salut_presence_cache_process_caps (self, key, held->hash, held->node,
+          held->ver);
+    }
+
+  g_hash_table_unref (held_caps);
+  g_object_unref (self);
+}
+
 SalutPresenceCache *
 salut_presence_cache_new (SalutConnection *connection)
 {
@@ -682,7 +764,7 @@ salut_presence_cache_learn_caps (SalutPresenceCache *self,
   DEBUG ("learning %s\n", tmp);
 
   info = g_slice_new0 (CapabilityInfo);
-  info->caps = gabble_capability_set_copy (caps);
+  info->caps = gabble_capability_set_intern (caps);
   info->data_forms = g_ptr_array_ref ((GPtrArray *) data_forms);
   g_hash_table_insert (priv->capabilities, tmp, info);
 }
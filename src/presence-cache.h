@@ -74,6 +74,9 @@ void salut_presence_cache_process_caps (SalutPresenceCache *self,
     SalutContact *contact, const gchar *hash, const gchar *node,
     const gchar *ver);
 
+/* Capabilities are only looked up once our own service is established */
+void salut_presence_cache_self_established (SalutPresenceCache *self);
+
 void salut_presence_cache_learn_caps (SalutPresenceCache *self,
     const gchar *node, const gchar *ver,
     const GabbleCapabilitySet *caps, const GPtrArray *data_forms);
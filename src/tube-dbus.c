@@ -34,13 +34,19 @@
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
+#include <wocky/wocky.h>
+
 #include <gibber/gibber-bytestream-muc.h>
 #include <gibber/gibber-muc-connection.h>
 
 #define DEBUG_FLAG DEBUG_TUBES
 #include "debug.h"
 #include "connection.h"
+#include "contact-manager.h"
+#include "dbus-order.h"
+#include "dbus-reassembly.h"
 #include "muc-tube-dbus.h"
+#include "si-bytestream-manager.h"
 #include "tube-iface.h"
 #include "sha1/sha1-util.h"
 
@@ -53,6 +59,19 @@
  * arbitrary limit on the queue size set to 4MB. */
 #define MAX_QUEUE_SIZE (4096*1024)
 
+/* D-Bus messages the application sends during one main loop iteration are
+ * sent out together, up to this many bytes at a time */
+#define MAX_BATCH_SIZE (32*1024)
+
+/* In a MUC, messages addressed to one member who announced unicast='true'
+ * aren't sent over the multicast bytestream, which would have every member
+ * receive and repair them, but over a bytestream to that member that we open
+ * the first time we need it. So that they keep their place among the
+ * messages everybody gets, a small marker holding their serial goes over
+ * multicast instead, and the member only delivers them once it got there. If
+ * the bytestream closes, a Lost marker tells the member which of the
+ * messages it's waiting for will never come. */
+
 static void tube_iface_init (gpointer g_iface, gpointer iface_data);
 static void dbustube_iface_init (gpointer g_iface, gpointer iface_data);
 
@@ -138,11 +157,30 @@ struct _SalutTubeDBusPrivate
   unsigned long dbus_msg_queue_size;
   /* mapping of contact handle -> D-Bus name (NULL for 1-1 D-Bus tubes) */
   GHashTable *dbus_names;
-
-  /* Message reassembly buffer (CONTACT tubes only) */
-  GString *reassembly_buffer;
-  /* Number of bytes that will be in the next message, 0 if unknown */
-  guint32 reassembly_bytes_needed;
+  /* contact handles in dbus_names which can't take more than one D-Bus
+   * message per bytestream message (NULL for 1-1 D-Bus tubes) */
+  GHashTable *unbatched_names;
+  /* contact handles in dbus_names which take the messages addressed to them
+   * over a bytestream of their own (NULL for 1-1 D-Bus tubes) */
+  GHashTable *unicast_names;
+  /* contact handle -> owned UnicastStream (NULL for 1-1 D-Bus tubes) */
+  GHashTable *unicast_streams;
+  /* owned GibberBytestreamIface -> owned SalutDBusReassembly, for the
+   * bytestreams other members send us messages over (NULL for 1-1 D-Bus
+   * tubes) */
+  GHashTable *incoming_streams;
+  /* puts back in order the messages that members sent us over a
+   * bytestream and the others (NULL for 1-1 D-Bus tubes) */
+  SalutDBusOrder *order;
+
+  /* marshalled messages waiting to be sent out in one go */
+  GString *outgoing;
+  guint outgoing_source;
+
+  /* Message reassembly (CONTACT tubes only) */
+  SalutDBusReassembly *reassembly;
+  /* the peer (CONTACT tubes only) */
+  SalutContact *contact;
 
   gboolean closed;
 
@@ -231,6 +269,468 @@ struct _find_contact_data
   TpHandle handle;
 };
 
+/* Whether everybody on the other end can take several D-Bus messages in one
+ * bytestream message. Contact tubes are plain byte streams, so they can. */
+static gboolean
+can_batch (SalutTubeDBus *self)
+{
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+
+  return priv->unbatched_names == NULL
+      || g_hash_table_size (priv->unbatched_names) == 0;
+}
+
+static void
+send_one_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  GibberBytestreamIface *bytestream = user_data;
+
+  gibber_bytestream_iface_send (bytestream, len, data);
+}
+
+static void
+flush_outgoing (SalutTubeDBus *self)
+{
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+
+  if (priv->outgoing_source != 0)
+    {
+      g_source_remove (priv->outgoing_source);
+      priv->outgoing_source = 0;
+    }
+
+  if (priv->outgoing->len == 0 || priv->bytestream == NULL)
+    {
+      g_string_truncate (priv->outgoing, 0);
+      return;
+    }
+
+  if (can_batch (self))
+    gibber_bytestream_iface_send (priv->bytestream, priv->outgoing->len,
+        priv->outgoing->str);
+  else
+    /* somebody who can't take batches joined since these were queued */
+    salut_dbus_reassembly_split (priv->outgoing->str, priv->outgoing->len,
+        send_one_cb, priv->bytestream);
+
+  g_string_truncate (priv->outgoing, 0);
+}
+
+static gboolean
+flush_outgoing_cb (gpointer user_data)
+{
+  SalutTubeDBus *self = SALUT_TUBE_DBUS (user_data);
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+
+  priv->outgoing_source = 0;
+  flush_outgoing (self);
+
+  return FALSE;
+}
+
+static void
+send_message (SalutTubeDBus *self,
+    const gchar *marshalled,
+    gint len)
+{
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+
+  if (!can_batch (self))
+    {
+      flush_outgoing (self);
+      gibber_bytestream_iface_send (priv->bytestream, len, marshalled);
+      return;
+    }
+
+  if (priv->outgoing->len + len > MAX_BATCH_SIZE)
+    flush_outgoing (self);
+
+  g_string_append_len (priv->outgoing, marshalled, len);
+
+  if (priv->outgoing->len >= MAX_BATCH_SIZE)
+    flush_outgoing (self);
+  else if (priv->outgoing_source == 0)
+    priv->outgoing_source = g_idle_add (flush_outgoing_cb, self);
+}
+
+/* The bytestream we send the messages addressed to one member over */
+typedef struct {
+  SalutTubeDBus *self;
+  TpHandle handle;
+  /* NULL until the member accepted it */
+  GibberBytestreamIface *bytestream;
+  /* messages waiting for the bytestream to be open */
+  GString *pending;
+  gboolean opened;
+  /* serials of the last message queued and of the last one sent */
+  dbus_uint32_t last_serial;
+  dbus_uint32_t sent_serial;
+} UnicastStream;
+
+typedef struct {
+  /* weak pointer, the tube can go away while we're waiting for the reply */
+  SalutTubeDBus *self;
+  TpHandle handle;
+} UnicastNegotiateData;
+
+static void unicast_stream_state_changed_cb (GibberBytestreamIface *bytestream,
+    GibberBytestreamState state, gpointer user_data);
+static void deliver_ordered_message_cb (DBusMessage *msg, size_t len,
+    gpointer user_data);
+
+static void
+unicast_stream_free (UnicastStream *stream)
+{
+  if (stream->bytestream != NULL)
+    {
+      GibberBytestreamState state;
+
+      g_signal_handlers_disconnect_by_func (stream->bytestream,
+          unicast_stream_state_changed_cb, stream);
+
+      g_object_get (stream->bytestream, "state", &state, NULL);
+      if (state != GIBBER_BYTESTREAM_STATE_CLOSED)
+        gibber_bytestream_iface_close (stream->bytestream, NULL);
+
+      g_object_unref (stream->bytestream);
+    }
+
+  g_string_free (stream->pending, TRUE);
+  g_slice_free (UnicastStream, stream);
+}
+
+static void
+send_message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  send_message (SALUT_TUBE_DBUS (user_data), data, len);
+}
+
+/* Sends what couldn't go over the bytestream to the member over multicast
+ * instead, and forgets about the bytestream. If it never worked, the member
+ * gets everything over multicast from now on rather than us trying again for
+ * every message. */
+static void
+unicast_stream_fall_back (UnicastStream *stream)
+{
+  SalutTubeDBus *self = stream->self;
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+
+  if (!stream->opened)
+    {
+      DEBUG ("sending messages for contact %u over multicast from now on",
+          stream->handle);
+      g_hash_table_remove (priv->unicast_names,
+          GUINT_TO_POINTER (stream->handle));
+    }
+
+  if (stream->pending->len > 0)
+    {
+      DEBUG ("sending %" G_GSIZE_FORMAT " bytes for contact %u over "
+          "multicast", stream->pending->len, stream->handle);
+
+      salut_dbus_reassembly_split (stream->pending->str, stream->pending->len,
+          send_message_cb, self);
+    }
+
+  g_hash_table_remove (priv->unicast_streams,
+      GUINT_TO_POINTER (stream->handle));
+}
+
+static void
+unicast_stream_flush (UnicastStream *stream)
+{
+  stream->opened = TRUE;
+
+  if (stream->pending->len == 0)
+    return;
+
+  gibber_bytestream_iface_send (stream->bytestream, stream->pending->len,
+      stream->pending->str);
+  g_string_truncate (stream->pending, 0);
+  stream->sent_serial = stream->last_serial;
+}
+
+/* Sends an SALUT_DBUS_ORDER_IFACE signal to the member over multicast, in
+ * line with our other messages */
+static void
+send_order_marker (SalutTubeDBus *self,
+    TpHandle handle,
+    const gchar *member,
+    dbus_uint32_t serial)
+{
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+  const gchar *name = g_hash_table_lookup (priv->dbus_names,
+      GUINT_TO_POINTER (handle));
+  DBusMessage *msg;
+  gchar *marshalled;
+  gint len;
+
+  if (name == NULL)
+    return;
+
+  msg = dbus_message_new_signal (SALUT_DBUS_ORDER_PATH,
+      SALUT_DBUS_ORDER_IFACE, member);
+  dbus_message_set_sender (msg, priv->dbus_local_name);
+  dbus_message_set_destination (msg, name);
+  /* never looked at, but a message without one isn't valid */
+  dbus_message_set_serial (msg, 1);
+  dbus_message_append_args (msg, DBUS_TYPE_UINT32, &serial,
+      DBUS_TYPE_INVALID);
+
+  if (dbus_message_marshal (msg, &marshalled, &len))
+    {
+      send_message (self, marshalled, len);
+      g_free (marshalled);
+    }
+
+  dbus_message_unref (msg);
+}
+
+static void
+unicast_stream_state_changed_cb (GibberBytestreamIface *bytestream,
+    GibberBytestreamState state,
+    gpointer user_data)
+{
+  UnicastStream *stream = user_data;
+
+  if (state == GIBBER_BYTESTREAM_STATE_OPEN)
+    {
+      DEBUG ("bytestream to contact %u is open", stream->handle);
+      unicast_stream_flush (stream);
+    }
+  else if (state == GIBBER_BYTESTREAM_STATE_CLOSED)
+    {
+      DEBUG ("bytestream to contact %u has been closed", stream->handle);
+
+      /* We can't know which of the messages we sent made it. Those still
+       * pending are sent over multicast, and take the place of their
+       * markers. */
+      if (stream->sent_serial != 0)
+        send_order_marker (stream->self, stream->handle,
+            SALUT_DBUS_ORDER_LOST, stream->sent_serial);
+
+      /* the next message to them opens a new one */
+      unicast_stream_fall_back (stream);
+    }
+}
+
+static void
+unicast_negotiate_cb (GibberBytestreamIface *bytestream,
+    gpointer user_data)
+{
+  UnicastNegotiateData *data = user_data;
+  SalutTubeDBus *self = data->self;
+  TpHandle handle = data->handle;
+  UnicastStream *stream = NULL;
+  GibberBytestreamState state;
+
+  if (self != NULL)
+    {
+      SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+
+      g_object_remove_weak_pointer (G_OBJECT (self), (gpointer *) &data->self);
+
+      if (priv->unicast_streams != NULL)
+        stream = g_hash_table_lookup (priv->unicast_streams,
+            GUINT_TO_POINTER (handle));
+    }
+
+  g_slice_free (UnicastNegotiateData, data);
+
+  if (stream == NULL || stream->bytestream != NULL)
+    {
+      /* the tube or the member went away in the meantime */
+      if (bytestream != NULL)
+        gibber_bytestream_iface_close (bytestream, NULL);
+      return;
+    }
+
+  if (bytestream == NULL)
+    {
+      DEBUG ("contact %u refused the bytestream", handle);
+      unicast_stream_fall_back (stream);
+      return;
+    }
+
+  stream->bytestream = g_object_ref (bytestream);
+  g_signal_connect (bytestream, "state-changed",
+      G_CALLBACK (unicast_stream_state_changed_cb), stream);
+
+  g_object_get (bytestream, "state", &state, NULL);
+  if (state == GIBBER_BYTESTREAM_STATE_OPEN)
+    unicast_stream_flush (stream);
+}
+
+static UnicastStream *
+unicast_stream_open (SalutTubeDBus *self,
+    TpHandle handle)
+{
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+  TpBaseChannel *base = TP_BASE_CHANNEL (self);
+  TpBaseConnection *base_conn = tp_base_channel_get_connection (base);
+  SalutConnection *conn = SALUT_CONNECTION (base_conn);
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      base_conn, TP_HANDLE_TYPE_CONTACT);
+  TpHandleRepoIface *room_repo = tp_base_connection_get_handles (
+      base_conn, TP_HANDLE_TYPE_ROOM);
+  SalutSiBytestreamManager *si_bytestream_mgr;
+  SalutContactManager *contact_mgr;
+  SalutContact *contact;
+  UnicastNegotiateData *data;
+  UnicastStream *stream = NULL;
+  WockyStanza *msg;
+  WockyNode *si_node, *node;
+  gchar *stream_id, *id_str;
+  GError *error = NULL;
+
+  g_object_get (conn,
+      "si-bytestream-manager", &si_bytestream_mgr,
+      "contact-manager", &contact_mgr,
+      NULL);
+  g_assert (si_bytestream_mgr != NULL);
+  g_assert (contact_mgr != NULL);
+
+  contact = salut_contact_manager_get_contact (contact_mgr, handle);
+  if (contact == NULL)
+    {
+      DEBUG ("can't find contact with handle %u", handle);
+      goto out;
+    }
+
+  stream_id = g_strdup_printf ("%lu-%u", (unsigned long) time (NULL),
+      g_random_int ());
+  msg = salut_si_bytestream_manager_make_stream_init_iq (conn->name,
+      tp_handle_inspect (contact_repo, handle), stream_id,
+      WOCKY_TELEPATHY_NS_TUBES);
+  wocky_stanza_set_to_contact (msg, WOCKY_CONTACT (contact));
+
+  si_node = wocky_node_get_child_ns (wocky_stanza_get_top_node (msg), "si",
+      WOCKY_XMPP_NS_SI);
+  g_assert (si_node != NULL);
+
+  id_str = g_strdup_printf ("%" G_GUINT64_FORMAT, priv->id);
+
+  node = wocky_node_add_child_ns (si_node, "muc-stream",
+      WOCKY_TELEPATHY_NS_TUBES);
+  wocky_node_set_attribute (node, "muc", tp_handle_inspect (
+          room_repo, tp_base_channel_get_target_handle (base)));
+  wocky_node_set_attribute (node, "tube", id_str);
+
+  data = g_slice_new (UnicastNegotiateData);
+  data->self = self;
+  data->handle = handle;
+  g_object_add_weak_pointer (G_OBJECT (self), (gpointer *) &data->self);
+
+  if (salut_si_bytestream_manager_negotiate_stream (si_bytestream_mgr,
+        contact, msg, stream_id, unicast_negotiate_cb, data, &error))
+    {
+      DEBUG ("opening a bytestream to contact %u", handle);
+
+      stream = g_slice_new0 (UnicastStream);
+      stream->self = self;
+      stream->handle = handle;
+      stream->pending = g_string_new ("");
+
+      g_hash_table_insert (priv->unicast_streams, GUINT_TO_POINTER (handle),
+          stream);
+    }
+  else
+    {
+      DEBUG ("can't open a bytestream to contact %u: %s", handle,
+          error->message);
+      g_error_free (error);
+
+      g_object_remove_weak_pointer (G_OBJECT (self), (gpointer *) &data->self);
+      g_slice_free (UnicastNegotiateData, data);
+    }
+
+  g_object_unref (msg);
+  g_object_unref (contact);
+  g_free (stream_id);
+  g_free (id_str);
+
+out:
+  g_object_unref (si_bytestream_mgr);
+  g_object_unref (contact_mgr);
+
+  return stream;
+}
+
+static TpHandle
+find_handle_by_name (SalutTubeDBus *self,
+    const gchar *name)
+{
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, priv->dbus_names);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (!tp_strdiff (value, name))
+        return GPOINTER_TO_UINT (key);
+    }
+
+  return 0;
+}
+
+/* Returns FALSE if msg has to go over the multicast bytestream */
+static gboolean
+send_unicast (SalutTubeDBus *self,
+    DBusMessage *msg,
+    const gchar *marshalled,
+    gint len)
+{
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+  const gchar *destination;
+  UnicastStream *stream;
+  TpHandle handle;
+
+  if (priv->unicast_names == NULL)
+    return FALSE;
+
+  destination = dbus_message_get_destination (msg);
+  if (destination == NULL)
+    return FALSE;
+
+  handle = find_handle_by_name (self, destination);
+  if (handle == 0 || handle == priv->self_handle ||
+      !g_hash_table_contains (priv->unicast_names, GUINT_TO_POINTER (handle)))
+    return FALSE;
+
+  stream = g_hash_table_lookup (priv->unicast_streams,
+      GUINT_TO_POINTER (handle));
+
+  if (stream == NULL)
+    {
+      stream = unicast_stream_open (self, handle);
+
+      if (stream == NULL)
+        return FALSE;
+    }
+
+  g_string_append_len (stream->pending, marshalled, len);
+  stream->last_serial = dbus_message_get_serial (msg);
+
+  send_order_marker (self, handle, SALUT_DBUS_ORDER_UNICAST,
+      stream->last_serial);
+
+  if (stream->bytestream != NULL)
+    {
+      GibberBytestreamState state;
+
+      g_object_get (stream->bytestream, "state", &state, NULL);
+      if (state == GIBBER_BYTESTREAM_STATE_OPEN)
+        unicast_stream_flush (stream);
+    }
+
+  return TRUE;
+}
+
 static DBusHandlerResult
 filter_cb (DBusConnection *conn,
            DBusMessage *msg,
@@ -264,7 +764,8 @@ filter_cb (DBusConnection *conn,
   if (!dbus_message_marshal (msg, &marshalled, &len))
     goto out;
 
-  gibber_bytestream_iface_send (priv->bytestream, len, marshalled);
+  if (!send_unicast (tube, msg, marshalled, len))
+    send_message (tube, marshalled, len);
 
   if (GIBBER_IS_BYTESTREAM_MUC (priv->bytestream))
     {
@@ -352,6 +853,8 @@ do_close (SalutTubeDBus *self)
     return;
   priv->closed = TRUE;
 
+  flush_outgoing (self);
+
   if (priv->bytestream != NULL)
     {
       gibber_bytestream_iface_close (priv->bytestream, NULL);
@@ -459,6 +962,7 @@ salut_tube_dbus_init (SalutTubeDBus *self)
       SALUT_TYPE_TUBE_DBUS, SalutTubeDBusPrivate);
 
   self->priv = priv;
+  priv->outgoing = g_string_new ("");
 }
 
 static TpTubeChannelState
@@ -533,6 +1037,12 @@ salut_tube_dbus_dispose (GObject *object)
   if (priv->dispose_has_run)
     return;
 
+  if (priv->outgoing_source != 0)
+    {
+      g_source_remove (priv->outgoing_source);
+      priv->outgoing_source = 0;
+    }
+
   if (priv->bytestream)
     {
       gibber_bytestream_iface_close (priv->bytestream, NULL);
@@ -580,14 +1090,65 @@ salut_tube_dbus_dispose (GObject *object)
       g_hash_table_unref (priv->dbus_names);
     }
 
+  if (priv->unbatched_names != NULL)
+    {
+      g_hash_table_unref (priv->unbatched_names);
+      priv->unbatched_names = NULL;
+    }
+
+  if (priv->unicast_names != NULL)
+    {
+      g_hash_table_unref (priv->unicast_names);
+      priv->unicast_names = NULL;
+    }
+
+  if (priv->unicast_streams != NULL)
+    {
+      g_hash_table_unref (priv->unicast_streams);
+      priv->unicast_streams = NULL;
+    }
+
+  if (priv->order != NULL)
+    {
+      salut_dbus_order_free (priv->order);
+      priv->order = NULL;
+    }
+
+  if (priv->incoming_streams != NULL)
+    {
+      GHashTableIter iter;
+      gpointer key;
+
+      g_hash_table_iter_init (&iter, priv->incoming_streams);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        {
+          g_signal_handlers_disconnect_matched (key, G_SIGNAL_MATCH_DATA,
+              0, 0, NULL, NULL, self);
+          gibber_bytestream_iface_close (key, NULL);
+        }
+
+      g_hash_table_unref (priv->incoming_streams);
+      priv->incoming_streams = NULL;
+    }
+
   if (priv->muc_connection != NULL)
     {
       g_object_unref (priv->muc_connection);
       priv->muc_connection = NULL;
     }
 
-  if (priv->reassembly_buffer)
-    g_string_free (priv->reassembly_buffer, TRUE);
+  if (priv->reassembly != NULL)
+    {
+      salut_dbus_reassembly_free (priv->reassembly);
+      priv->reassembly = NULL;
+    }
+
+  if (priv->contact != NULL)
+    {
+      salut_contact_remove_interest (priv->contact);
+      g_object_unref (priv->contact);
+      priv->contact = NULL;
+    }
 
   priv->dispose_has_run = TRUE;
 
@@ -605,6 +1166,7 @@ salut_tube_dbus_finalize (GObject *object)
   g_free (priv->service);
   g_hash_table_unref (priv->parameters);
   g_array_unref (priv->supported_access_controls);
+  g_string_free (priv->outgoing, TRUE);
 
   G_OBJECT_CLASS (salut_tube_dbus_parent_class)->finalize (object);
 }
@@ -765,6 +1327,13 @@ salut_tube_dbus_constructor (GType type,
 
       priv->dbus_names = g_hash_table_new_full (g_direct_hash, g_direct_equal,
           NULL, g_free);
+      priv->unbatched_names = g_hash_table_new (NULL, NULL);
+      priv->unicast_names = g_hash_table_new (NULL, NULL);
+      priv->unicast_streams = g_hash_table_new_full (NULL, NULL, NULL,
+          (GDestroyNotify) unicast_stream_free);
+      priv->incoming_streams = g_hash_table_new_full (NULL, NULL,
+          g_object_unref, (GDestroyNotify) salut_dbus_reassembly_free);
+      priv->order = salut_dbus_order_new (deliver_ordered_message_cb, obj);
 
       priv->dbus_local_name = generate_dbus_unique_name (conn->name);
 
@@ -786,6 +1355,8 @@ salut_tube_dbus_constructor (GType type,
     }
   else
     {
+      SalutContactManager *contact_mgr;
+
       /* Private tube */
       g_assert (priv->muc_connection == NULL);
 
@@ -794,8 +1365,16 @@ salut_tube_dbus_constructor (GType type,
       priv->dbus_names = NULL;
 
       /* For contact tubes we need to be able to reassemble messages. */
-      priv->reassembly_buffer = g_string_new ("");
-      priv->reassembly_bytes_needed = 0;
+      priv->reassembly = salut_dbus_reassembly_new ();
+
+      /* and to keep the peer's presence and addresses up to date */
+      g_object_get (conn, "contact-manager", &contact_mgr, NULL);
+      priv->contact = salut_contact_manager_get_contact (contact_mgr,
+          tp_base_channel_get_target_handle (base));
+      g_object_unref (contact_mgr);
+
+      if (priv->contact != NULL)
+        salut_contact_add_interest (priv->contact);
     }
 
   /* Tube needs to be offered if we initiated and requested it. Being
@@ -1072,18 +1651,69 @@ salut_tube_dbus_offer (SalutTubeDBus *self,
   return TRUE;
 }
 
+/* Takes ownership of msg */
+static void
+deliver_message (SalutTubeDBus *tube,
+    DBusMessage *msg,
+    size_t len)
+{
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (tube);
+  guint32 serial;
+
+  if (!priv->dbus_conn)
+    {
+      DEBUG ("no D-Bus connection: queuing the message");
+
+      priv->dbus_msg_queue = g_slist_prepend (priv->dbus_msg_queue, msg);
+      priv->dbus_msg_queue_size += len;
+
+      /* returns without unref the message */
+      return;
+    }
+
+  DEBUG ("delivering message from '%s' to '%s'",
+         dbus_message_get_sender (msg),
+         dbus_message_get_destination (msg));
+
+  /* XXX: what do do if this returns FALSE? */
+  dbus_connection_send (priv->dbus_conn, msg, &serial);
+
+  dbus_message_unref (msg);
+}
+
+static void
+deliver_ordered_message_cb (DBusMessage *msg,
+    size_t len,
+    gpointer user_data)
+{
+  deliver_message (SALUT_TUBE_DBUS (user_data), msg, len);
+}
+
 static void
 message_received (SalutTubeDBus *tube,
                   TpHandle sender,
                   const char *data,
-                  size_t len)
+                  size_t len,
+                  gboolean unicast)
 {
   TpBaseChannel *base = TP_BASE_CHANNEL (tube);
   TpBaseChannelClass *cls = TP_BASE_CHANNEL_GET_CLASS (base);
   SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (tube);
   DBusMessage *msg;
   DBusError error = {0,};
-  guint32 serial;
+
+  /* If the application never connects to the private dbus connection, we
+   * don't want to eat all the memory. Only queue MAX_QUEUE_SIZE bytes. If
+   * there are more messages, drop them, before going to the trouble of
+   * parsing them. */
+  if (priv->dbus_conn == NULL
+      && priv->dbus_msg_queue_size + len > MAX_QUEUE_SIZE)
+    {
+      DEBUG ("D-Bus message queue size limit reached (%u bytes). "
+             "Ignore this message.",
+             MAX_QUEUE_SIZE);
+      return;
+    }
 
   msg = dbus_message_demarshal (data, len, &error);
 
@@ -1111,7 +1741,8 @@ message_received (SalutTubeDBus *tube,
            * Discard it. */
           DEBUG ("message not intended to this tube (destination = %s)",
               destination);
-          goto unref;
+          dbus_message_unref (msg);
+          return;
         }
 
       sender_name = g_hash_table_lookup (priv->dbus_names,
@@ -1121,57 +1752,32 @@ message_received (SalutTubeDBus *tube,
         {
           DEBUG ("invalid sender %s (expected %s for sender handle %d)",
                  dbus_message_get_sender (msg), sender_name, sender);
-          goto unref;
-        }
-    }
-
-  if (!priv->dbus_conn)
-    {
-      DEBUG ("no D-Bus connection: queuing the message");
-
-      /* If the application never connects to the private dbus connection, we
-       * don't want to eat all the memory. Only queue MAX_QUEUE_SIZE bytes. If
-       * there are more messages, drop them. */
-      if (priv->dbus_msg_queue_size + len > MAX_QUEUE_SIZE)
-        {
-          DEBUG ("D-Bus message queue size limit reached (%u bytes). "
-                 "Ignore this message.",
-                 MAX_QUEUE_SIZE);
-          goto unref;
+          dbus_message_unref (msg);
+          return;
         }
 
-      priv->dbus_msg_queue = g_slist_prepend (priv->dbus_msg_queue, msg);
-      priv->dbus_msg_queue_size += len;
-
-      /* returns without unref the message */
+      salut_dbus_order_push (priv->order, sender, msg, len, unicast);
       return;
     }
 
-  DEBUG ("delivering message from '%s' to '%s'",
-         dbus_message_get_sender (msg),
-         dbus_message_get_destination (msg));
-
-  /* XXX: what do do if this returns FALSE? */
-  dbus_connection_send (priv->dbus_conn, msg, &serial);
-
-unref:
-  dbus_message_unref (msg);
+  deliver_message (tube, msg, len);
 }
 
-static guint32
-collect_le32 (char *str)
-{
-  unsigned char *bytes = (unsigned char *) str;
-
-  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
-}
+typedef struct {
+  SalutTubeDBus *tube;
+  TpHandle sender;
+  /* whether it came over a bytestream of its own rather than multicast */
+  gboolean unicast;
+} ReassembledData;
 
-static guint32
-collect_be32 (char *str)
+static void
+reassembled_message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
 {
-  unsigned char *bytes = (unsigned char *) str;
+  ReassembledData *d = user_data;
 
-  return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 24) | bytes[3];
+  message_received (d->tube, d->sender, data, len, d->unicast);
 }
 
 static void
@@ -1198,104 +1804,34 @@ data_received_cb (GibberBytestreamIface *stream,
 
   if (cls->target_handle_type == TP_HANDLE_TYPE_CONTACT)
     {
-      GString *buf = priv->reassembly_buffer;
-
-      g_assert (buf != NULL);
+      ReassembledData d = { tube, sender, FALSE };
 
-      g_string_append_len (buf, data->str, data->len);
-      DEBUG ("Received %" G_GSIZE_FORMAT " bytes, so we now have %"
-          G_GSIZE_FORMAT " bytes in reassembly buffer", data->len, buf->len);
+      g_assert (priv->reassembly != NULL);
 
-      /* Each D-Bus message has a 16-byte fixed header, in which
-       *
-       * * byte 0 is 'l' (ell) or 'B' for endianness
-       * * bytes 4-7 are body length "n" in bytes in that endianness
-       * * bytes 12-15 are length "m" of param array in bytes in that
-       *   endianness
-       *
-       * followed by m + n + ((8 - (m % 8)) % 8) bytes of other content.
-       */
+      DEBUG ("Received %" G_GSIZE_FORMAT " bytes, %" G_GSIZE_FORMAT
+          " bytes were waiting for the rest of their message", data->len,
+          salut_dbus_reassembly_get_pending (priv->reassembly));
 
-      while (buf->len >= 16)
+      if (!salut_dbus_reassembly_push (priv->reassembly, data->str,
+            data->len, reassembled_message_cb, &d))
         {
-          guint32 body_length, params_length, m;
-
-          /* see if we have a whole message and have already calculated
-           * how many bytes it needs */
-
-          if (priv->reassembly_bytes_needed != 0)
-            {
-              if (buf->len >= priv->reassembly_bytes_needed)
-                {
-                  DEBUG ("Received complete D-Bus message of size %"
-                      G_GINT32_FORMAT, priv->reassembly_bytes_needed);
-                  message_received (tube, sender, buf->str,
-                      priv->reassembly_bytes_needed);
-                  g_string_erase (buf, 0, priv->reassembly_bytes_needed);
-                  priv->reassembly_bytes_needed = 0;
-                }
-              else
-                {
-                  /* we'll have to wait for more data */
-                  break;
-                }
-            }
-
-          if (buf->len < 16)
-            break;
-
-          /* work out how big the next message is going to be */
-
-          if (buf->str[0] == DBUS_BIG_ENDIAN)
-            {
-              body_length = collect_be32 (buf->str + 4);
-              m = collect_be32 (buf->str + 12);
-            }
-          else if (buf->str[0] == DBUS_LITTLE_ENDIAN)
-            {
-              body_length = collect_le32 (buf->str + 4);
-              m = collect_le32 (buf->str + 12);
-            }
-          else
-            {
-              DEBUG ("D-Bus message has unknown endianness byte 0x%x, "
-                  "closing tube", (unsigned int) buf->str[0]);
-              salut_tube_iface_close (SALUT_TUBE_IFACE (tube), FALSE);
-              return;
-            }
-
-          /* pad to 8-byte boundary */
-          params_length = m + ((8 - (m % 8)) % 8);
-          g_assert (params_length % 8 == 0);
-          g_assert (params_length >= m);
-          g_assert (params_length < m + 8);
-
-          priv->reassembly_bytes_needed = params_length + body_length + 16;
-
-          /* n.b.: this looks as if it could be simplified to just the third
-           * test, but that would be wrong if the addition had overflowed, so
-           * don't do that. The first and second tests are sufficient to
-           * ensure no overflow on 32-bit platforms */
-          if (body_length > DBUS_MAXIMUM_MESSAGE_LENGTH ||
-              params_length > DBUS_MAXIMUM_ARRAY_LENGTH ||
-              priv->reassembly_bytes_needed > DBUS_MAXIMUM_MESSAGE_LENGTH)
-            {
-              DEBUG ("D-Bus message is too large to be valid, closing tube");
-              salut_tube_iface_close (SALUT_TUBE_IFACE (tube), FALSE);
-              return;
-            }
-
-          g_assert (priv->reassembly_bytes_needed != 0);
-          DEBUG ("We need %" G_GINT32_FORMAT " bytes for the next full "
-              "message", priv->reassembly_bytes_needed);
+          DEBUG ("Received invalid D-Bus data, closing tube");
+          salut_tube_iface_close (SALUT_TUBE_IFACE (tube), FALSE);
+          return;
         }
     }
   else
     {
+      ReassembledData d = { tube, sender, FALSE };
+
       /* MUC bytestreams are message-boundary preserving, which is necessary,
-       * because we can't assume we started at the beginning */
+       * because we can't assume we started at the beginning. Each of their
+       * messages holds one or more whole D-Bus messages */
       g_assert (GIBBER_IS_BYTESTREAM_MUC (priv->bytestream));
-      message_received (tube, sender, data->str, data->len);
+
+      if (!salut_dbus_reassembly_split (data->str, data->len,
+            reassembled_message_cb, &d))
+        DEBUG ("received corrupted data from %d", sender);
     }
 }
 
@@ -1385,24 +1921,133 @@ salut_tube_dbus_close (SalutTubeIface *tube, gboolean closed_remotely)
   do_close (self);
 }
 
+static void
+augment_si_accept_iq (WockyNode *si,
+                      gpointer user_data)
+{
+  wocky_node_add_child_ns (si, "tube", WOCKY_TELEPATHY_NS_TUBES);
+}
+
+static void
+unicast_data_received_cb (GibberBytestreamIface *bytestream,
+                          const gchar *from,
+                          GString *data,
+                          gpointer user_data)
+{
+  SalutTubeDBus *self = SALUT_TUBE_DBUS (user_data);
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      tp_base_channel_get_connection (TP_BASE_CHANNEL (self)),
+      TP_HANDLE_TYPE_CONTACT);
+  SalutDBusReassembly *reassembly;
+  ReassembledData d = { self, 0, TRUE };
+
+  reassembly = g_hash_table_lookup (priv->incoming_streams, bytestream);
+  g_assert (reassembly != NULL);
+
+  d.sender = tp_handle_lookup (contact_repo, from, NULL, NULL);
+  if (d.sender == 0)
+    {
+      DEBUG ("unknown sender: %s", from);
+      return;
+    }
+
+  if (!salut_dbus_reassembly_push (reassembly, data->str, data->len,
+        reassembled_message_cb, &d))
+    {
+      DEBUG ("received invalid D-Bus data from %s, closing their "
+          "bytestream", from);
+      gibber_bytestream_iface_close (bytestream, NULL);
+    }
+}
+
+static void
+incoming_stream_state_changed_cb (GibberBytestreamIface *bytestream,
+                                  GibberBytestreamState state,
+                                  gpointer user_data)
+{
+  SalutTubeDBus *self = SALUT_TUBE_DBUS (user_data);
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      tp_base_channel_get_connection (TP_BASE_CHANNEL (self)),
+      TP_HANDLE_TYPE_CONTACT);
+  TpHandle handle;
+  gchar *peer_id;
+
+  if (state != GIBBER_BYTESTREAM_STATE_CLOSED)
+    return;
+
+  DEBUG ("incoming bytestream closed");
+
+  g_signal_handlers_disconnect_matched (bytestream, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, self);
+  g_hash_table_remove (priv->incoming_streams, bytestream);
+
+  /* what came over it ahead of its marker won't be wanted */
+  g_object_get (bytestream, "peer-id", &peer_id, NULL);
+  handle = tp_handle_lookup (contact_repo, peer_id, NULL, NULL);
+  g_free (peer_id);
+
+  if (handle != 0 && priv->order != NULL)
+    salut_dbus_order_unicast_closed (priv->order, handle);
+}
+
 /**
  * salut_tube_dbus_add_bytestream
  *
  * Implements salut_tube_iface_add_bytestream on SalutTubeIface
  */
-
 static void
 salut_tube_dbus_add_bytestream (SalutTubeIface *tube,
                                 GibberBytestreamIface *bytestream)
 {
-  DEBUG ("D-Bus doesn't support extra bytestream");
-  gibber_bytestream_iface_close (bytestream, NULL);
+  SalutTubeDBus *self = SALUT_TUBE_DBUS (tube);
+  SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      tp_base_channel_get_connection (TP_BASE_CHANNEL (self)),
+      TP_HANDLE_TYPE_CONTACT);
+  TpHandle handle;
+  gchar *peer_id;
+
+  if (priv->incoming_streams == NULL || priv->closed)
+    {
+      DEBUG ("this D-Bus tube doesn't take extra bytestreams");
+      gibber_bytestream_iface_close (bytestream, NULL);
+      return;
+    }
+
+  g_object_get (bytestream, "peer-id", &peer_id, NULL);
+  handle = tp_handle_lookup (contact_repo, peer_id, NULL, NULL);
+
+  if (handle == 0 || !salut_tube_dbus_handle_in_names (self, handle))
+    {
+      DEBUG ("%s isn't in this D-Bus tube, refusing their bytestream",
+          peer_id);
+      gibber_bytestream_iface_close (bytestream, NULL);
+      g_free (peer_id);
+      return;
+    }
+
+  DEBUG ("accepting a bytestream from %s for the messages addressed to us",
+      peer_id);
+  g_free (peer_id);
+
+  g_hash_table_insert (priv->incoming_streams, g_object_ref (bytestream),
+      salut_dbus_reassembly_new ());
+
+  g_signal_connect (bytestream, "data-received",
+      G_CALLBACK (unicast_data_received_cb), self);
+  g_signal_connect (bytestream, "state-changed",
+      G_CALLBACK (incoming_stream_state_changed_cb), self);
+
+  gibber_bytestream_iface_accept (bytestream, augment_si_accept_iq, self);
 }
 
 gboolean
 salut_tube_dbus_add_name (SalutTubeDBus *self,
                          TpHandle handle,
-                         const gchar *name)
+                         const gchar *name,
+                         SalutTubeDBusPeerFlags flags)
 {
   SalutTubeDBusPrivate *priv = SALUT_TUBE_DBUS_GET_PRIVATE (self);
   TpBaseChannel *base = TP_BASE_CHANNEL (self);
@@ -1443,6 +2088,16 @@ salut_tube_dbus_add_name (SalutTubeDBus *self,
   g_hash_table_insert (priv->dbus_names, GUINT_TO_POINTER (handle),
       g_strdup (name));
 
+  if (!(flags & SALUT_TUBE_DBUS_PEER_BATCHING))
+    {
+      DEBUG ("contact %d can't take batched D-Bus messages", handle);
+      g_hash_table_add (priv->unbatched_names, GUINT_TO_POINTER (handle));
+      flush_outgoing (self);
+    }
+
+  if (flags & SALUT_TUBE_DBUS_PEER_UNICAST)
+    g_hash_table_add (priv->unicast_names, GUINT_TO_POINTER (handle));
+
   /* Fire DBusNamesChanged (new API) */
   added = g_hash_table_new (g_direct_hash, g_direct_equal);
   removed = g_array_new (FALSE, FALSE, sizeof (TpHandle));
@@ -1476,6 +2131,10 @@ salut_tube_dbus_remove_name (SalutTubeDBus *self,
     return FALSE;
 
   g_hash_table_remove (priv->dbus_names, GUINT_TO_POINTER (handle));
+  g_hash_table_remove (priv->unbatched_names, GUINT_TO_POINTER (handle));
+  g_hash_table_remove (priv->unicast_names, GUINT_TO_POINTER (handle));
+  g_hash_table_remove (priv->unicast_streams, GUINT_TO_POINTER (handle));
+  salut_dbus_order_remove_sender (priv->order, handle);
 
   /* Fire DBusNamesChanged (new API) */
   added = g_hash_table_new (g_direct_hash, g_direct_equal);
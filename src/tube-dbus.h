@@ -70,8 +70,16 @@ salut_tube_dbus_new (SalutConnection *conn,
     const gchar *service, GHashTable *parameters, guint64 id,
     gboolean requested);
 
+/* What a member of a MUC D-Bus tube announced it can do */
+typedef enum {
+  /* take several D-Bus messages in one bytestream message */
+  SALUT_TUBE_DBUS_PEER_BATCHING = 1 << 0,
+  /* take the messages addressed to it over a bytestream of its own */
+  SALUT_TUBE_DBUS_PEER_UNICAST = 1 << 1,
+} SalutTubeDBusPeerFlags;
+
 gboolean salut_tube_dbus_add_name (SalutTubeDBus *self, TpHandle handle,
-    const gchar *name);
+    const gchar *name, SalutTubeDBusPeerFlags flags);
 
 gboolean salut_tube_dbus_remove_name (SalutTubeDBus *self, TpHandle handle);
 
@@ -182,6 +182,9 @@ struct _SalutTubeStreamPrivate
 
   gboolean offer_needed;
 
+  /* the peer of a 1-1 tube, NULL for MUC tubes */
+  SalutContact *contact;
+
   gboolean dispose_has_run;
 };
 
@@ -1036,6 +1039,13 @@ salut_tube_stream_dispose (GObject *object)
       priv->contact_listener = NULL;
     }
 
+  if (priv->contact != NULL)
+    {
+      salut_contact_remove_interest (priv->contact);
+      g_object_unref (priv->contact);
+      priv->contact = NULL;
+    }
+
   priv->dispose_has_run = TRUE;
 
   if (G_OBJECT_CLASS (salut_tube_stream_parent_class)->dispose)
@@ -1206,6 +1216,7 @@ salut_tube_stream_constructor (GType type,
   GObject *obj;
   SalutTubeStreamPrivate *priv;
   TpBaseChannel *base;
+  TpBaseChannelClass *cls;
 
   obj = G_OBJECT_CLASS (salut_tube_stream_parent_class)->
            constructor (type, n_props, props);
@@ -1213,6 +1224,22 @@ salut_tube_stream_constructor (GType type,
   priv = SALUT_TUBE_STREAM_GET_PRIVATE (SALUT_TUBE_STREAM (obj));
 
   base = TP_BASE_CHANNEL (obj);
+  cls = TP_BASE_CHANNEL_GET_CLASS (base);
+
+  if (cls->target_handle_type == TP_HANDLE_TYPE_CONTACT)
+    {
+      SalutContactManager *contact_mgr;
+
+      /* keep the peer's presence and addresses up to date */
+      g_object_get (tp_base_channel_get_connection (base),
+          "contact-manager", &contact_mgr, NULL);
+      priv->contact = salut_contact_manager_get_contact (contact_mgr,
+          tp_base_channel_get_target_handle (base));
+      g_object_unref (contact_mgr);
+
+      if (priv->contact != NULL)
+        salut_contact_add_interest (priv->contact);
+    }
 
   if (tp_base_channel_get_initiator (base) == priv->self_handle)
     {
@@ -755,7 +755,9 @@ static SalutTubeIface *
 new_channel_from_request (SalutTubesManager *self,
     GHashTable *request)
 {
+  SalutTubesManagerPrivate *priv = SALUT_TUBES_MANAGER_GET_PRIVATE (self);
   SalutTubeIface *tube;
+  SalutContact *contact;
 
   TpTubeType type;
   const gchar *ctype, *service;
@@ -797,6 +799,15 @@ new_channel_from_request (SalutTubesManager *self,
 
   g_hash_table_unref (parameters);
 
+  /* the offer will go out as soon as the tube is offered */
+  contact = salut_contact_manager_get_contact (priv->contact_manager, handle);
+  if (contact != NULL)
+    {
+      salut_connection_warmup_touch (priv->conn->warmup,
+          WOCKY_LL_CONTACT (contact));
+      g_object_unref (contact);
+    }
+
   return tube;
 }
 
@@ -0,0 +1,138 @@
+/*
+ * tubes-versions.c - Tracking the tube lists of MUC members
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "tubes-versions.h"
+
+struct _SalutTubesVersions {
+  /* TpHandle -> version of their announcement we're at */
+  GHashTable *versions;
+  /* TpHandles of members sending unversioned tube lists */
+  GHashTable *legacy;
+};
+
+SalutTubesVersions *
+salut_tubes_versions_new (void)
+{
+  SalutTubesVersions *self = g_slice_new (SalutTubesVersions);
+
+  self->versions = g_hash_table_new (NULL, NULL);
+  self->legacy = g_hash_table_new (NULL, NULL);
+
+  return self;
+}
+
+void
+salut_tubes_versions_free (SalutTubesVersions *self)
+{
+  g_hash_table_unref (self->versions);
+  g_hash_table_unref (self->legacy);
+  g_slice_free (SalutTubesVersions, self);
+}
+
+SalutTubesVersionsAction
+salut_tubes_versions_snapshot (SalutTubesVersions *self,
+    TpHandle member,
+    gboolean versioned,
+    guint version,
+    gboolean *send_ours)
+{
+  gpointer current;
+
+  *send_ours = FALSE;
+
+  if (!versioned)
+    {
+      if (!g_hash_table_contains (self->legacy, GUINT_TO_POINTER (member)))
+        {
+          g_hash_table_add (self->legacy, GUINT_TO_POINTER (member));
+          g_hash_table_remove (self->versions, GUINT_TO_POINTER (member));
+          *send_ours = TRUE;
+        }
+
+      return SALUT_TUBES_VERSIONS_APPLY;
+    }
+
+  g_hash_table_remove (self->legacy, GUINT_TO_POINTER (member));
+
+  if (g_hash_table_lookup_extended (self->versions,
+          GUINT_TO_POINTER (member), NULL, &current)
+      && GPOINTER_TO_UINT (current) == version)
+    return SALUT_TUBES_VERSIONS_SKIP;
+
+  g_hash_table_insert (self->versions, GUINT_TO_POINTER (member),
+      GUINT_TO_POINTER (version));
+  return SALUT_TUBES_VERSIONS_APPLY;
+}
+
+SalutTubesVersionsAction
+salut_tubes_versions_delta (SalutTubesVersions *self,
+    TpHandle member,
+    guint version)
+{
+  /* Members who changed their tubes before we joined sent us their full
+   * list when they saw us, so having heard nothing means version 0 */
+  guint current = salut_tubes_versions_get (self, member);
+
+  if (version <= current)
+    return SALUT_TUBES_VERSIONS_SKIP;
+
+  if (version != current + 1)
+    return SALUT_TUBES_VERSIONS_REQUEST_SNAPSHOT;
+
+  g_hash_table_insert (self->versions, GUINT_TO_POINTER (member),
+      GUINT_TO_POINTER (version));
+  return SALUT_TUBES_VERSIONS_APPLY;
+}
+
+guint
+salut_tubes_versions_get (SalutTubesVersions *self,
+    TpHandle member)
+{
+  return GPOINTER_TO_UINT (g_hash_table_lookup (self->versions,
+          GUINT_TO_POINTER (member)));
+}
+
+gboolean
+salut_tubes_versions_has_legacy (SalutTubesVersions *self)
+{
+  return g_hash_table_size (self->legacy) > 0;
+}
+
+void
+salut_tubes_versions_remove (SalutTubesVersions *self,
+    TpHandle member)
+{
+  g_hash_table_remove (self->versions, GUINT_TO_POINTER (member));
+  g_hash_table_remove (self->legacy, GUINT_TO_POINTER (member));
+}
+
+WockyStanza *
+salut_tubes_versions_build_request (const gchar *from,
+    const gchar *room,
+    const gchar *member)
+{
+  return wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_GROUPCHAT,
+      from, room,
+      WOCKY_NODE_START, "tubes-request",
+        WOCKY_NODE_XMLNS, WOCKY_TELEPATHY_NS_TUBES,
+        WOCKY_NODE_ATTRIBUTE, "member", member,
+      WOCKY_NODE_END, NULL);
+}
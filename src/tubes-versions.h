@@ -0,0 +1,76 @@
+/*
+ * tubes-versions.h - Header for tracking the tube lists of MUC members
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SALUT_TUBES_VERSIONS_H__
+#define __SALUT_TUBES_VERSIONS_H__
+
+#include <glib.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+#include <wocky/wocky.h>
+
+G_BEGIN_DECLS
+
+/* Members of a MUC announce their tubes as a full <tubes> list when joining
+ * or when asked to, and as <tubes-delta> changes otherwise, each one
+ * bumping the version of their announcement. Members of older versions
+ * only send unversioned full lists, and expect ours in exchange. This keeps
+ * track of the version we're at for each member, and of which ones are
+ * that old. */
+typedef struct _SalutTubesVersions SalutTubesVersions;
+
+typedef enum {
+  /* we're already at that version */
+  SALUT_TUBES_VERSIONS_SKIP,
+  SALUT_TUBES_VERSIONS_APPLY,
+  /* changes were missed, the member's full list is needed */
+  SALUT_TUBES_VERSIONS_REQUEST_SNAPSHOT,
+} SalutTubesVersionsAction;
+
+SalutTubesVersions *salut_tubes_versions_new (void);
+
+void salut_tubes_versions_free (SalutTubesVersions *self);
+
+/* For a full list from member, versioned unless it's from an older
+ * version. Sets send_ours if member just turned out to be one of those. */
+SalutTubesVersionsAction salut_tubes_versions_snapshot (
+    SalutTubesVersions *self, TpHandle member, gboolean versioned,
+    guint version, gboolean *send_ours);
+
+/* For changes from member. Only the changes right after the version we're
+ * at are applied. */
+SalutTubesVersionsAction salut_tubes_versions_delta (
+    SalutTubesVersions *self, TpHandle member, guint version);
+
+/* Version of member's announcement we're at, 0 if we heard nothing */
+guint salut_tubes_versions_get (SalutTubesVersions *self, TpHandle member);
+
+/* Whether some members need our full list rather than changes */
+gboolean salut_tubes_versions_has_legacy (SalutTubesVersions *self);
+
+/* member left */
+void salut_tubes_versions_remove (SalutTubesVersions *self, TpHandle member);
+
+/* The <tubes-request/> asking member for their full list */
+WockyStanza *salut_tubes_versions_build_request (const gchar *from,
+    const gchar *room, const gchar *member);
+
+G_END_DECLS
+
+#endif /* __SALUT_TUBES_VERSIONS_H__ */
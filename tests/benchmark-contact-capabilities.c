@@ -0,0 +1,215 @@
+/*
+ * benchmark-contact-capabilities.c - Benchmark of the ContactCapabilities
+ * attributes of a SalutConnection
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Fetches the ContactCapabilities attributes of a few thousand contacts
+ * sharing a small number of node#ver from a real SalutConnection, the way
+ * GetContactAttributes does, which goes through
+ * salut_connection_get_handle_contact_capabilities. Once with a private copy
+ * of the caps per contact, which is what salut_contact_set_capabilities used
+ * to store and which the channel managers look at for every contact, and
+ * once with interned sets as it stores now, which are only looked at once.
+ *
+ * The connection is never connected, but like any TpBaseConnection it needs
+ * a session bus: run it with dbus-launch. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+#include <wocky/wocky.h>
+
+#include <salut/capabilities.h>
+
+#include "connection.h"
+#include "contact-manager.h"
+#include "contact.h"
+#include "namespaces.h"
+#include "protocol.h"
+
+#ifdef USE_BACKEND_AVAHI
+#include "avahi-discovery-client.h"
+#define BACKEND_TYPE SALUT_TYPE_AVAHI_DISCOVERY_CLIENT
+#elif defined (USE_BACKEND_BONJOUR)
+#include "bonjour-discovery-client.h"
+#define BACKEND_TYPE SALUT_TYPE_BONJOUR_DISCOVERY_CLIENT
+#endif
+
+#ifdef BACKEND_TYPE
+
+#define N_VARIANTS 8
+#define N_ITERATIONS 20
+
+static const guint contact_counts[] = { 100, 1000, 10000, 0 };
+
+static GabbleCapabilitySet *
+make_variant (guint i)
+{
+  GabbleCapabilitySet *caps;
+  guint j;
+
+  caps = gabble_capability_set_copy (gabble_capabilities_get_legacy ());
+  gabble_capability_set_add (caps, WOCKY_XMPP_NS_IQ_OOB);
+  gabble_capability_set_add (caps, WOCKY_XMPP_NS_X_OOB);
+
+  for (j = 0; j <= i; j++)
+    {
+      gchar *ns = g_strdup_printf ("%s/stream#service%u",
+          WOCKY_TELEPATHY_NS_TUBES, j);
+
+      gabble_capability_set_add (caps, ns);
+      g_free (ns);
+    }
+
+  return caps;
+}
+
+static gdouble
+run (GabbleCapabilitySet **variants,
+    guint n_contacts,
+    gboolean intern)
+{
+  TpBaseConnection *conn;
+  SalutContactManager *contact_mgr;
+  TpHandleRepoIface *contact_repo;
+  SalutContact **contacts = g_new0 (SalutContact *, n_contacts);
+  GArray *handles = g_array_sized_new (FALSE, FALSE, sizeof (TpHandle),
+      n_contacts);
+  GPtrArray *data_forms = g_ptr_array_new ();
+  const gchar *interfaces[] = {
+      TP_IFACE_CONNECTION_INTERFACE_CONTACT_CAPABILITIES, NULL };
+  GTimer *timer;
+  guint total = 0;
+  guint i, j;
+  gdouble elapsed;
+
+  conn = g_object_new (SALUT_TYPE_CONNECTION,
+      "protocol", SALUT_PROTOCOL_LOCAL_XMPP_NAME,
+      "backend-type", BACKEND_TYPE,
+      NULL);
+  g_object_get (conn, "contact-manager", &contact_mgr, NULL);
+  g_assert (contact_mgr != NULL);
+  contact_repo = tp_base_connection_get_handles (conn,
+      TP_HANDLE_TYPE_CONTACT);
+
+  for (i = 0; i < n_contacts; i++)
+    {
+      GabbleCapabilitySet *variant = variants[i % N_VARIANTS];
+      gchar *name = g_strdup_printf ("contact%u@host", i);
+      TpHandle handle = tp_handle_ensure (contact_repo, name, NULL, NULL);
+
+      g_assert (handle != 0);
+      g_array_append_val (handles, handle);
+
+      contacts[i] = salut_contact_manager_ensure_contact (contact_mgr, name);
+
+      if (intern)
+        {
+          salut_contact_set_capabilities (contacts[i], variant, data_forms);
+        }
+      else
+        {
+          gabble_capability_set_free (contacts[i]->caps);
+          contacts[i]->caps = gabble_capability_set_copy (variant);
+        }
+
+      g_free (name);
+    }
+
+  timer = g_timer_new ();
+
+  for (j = 0; j < N_ITERATIONS; j++)
+    {
+      GHashTable *attributes = tp_contacts_mixin_get_contact_attributes (
+          G_OBJECT (conn), handles, interfaces, NULL, NULL);
+
+      total += g_hash_table_size (attributes);
+      g_hash_table_unref (attributes);
+    }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  for (i = 0; i < n_contacts; i++)
+    g_object_unref (contacts[i]);
+
+  g_free (contacts);
+  g_array_unref (handles);
+  g_ptr_array_unref (data_forms);
+  g_object_unref (contact_mgr);
+  g_object_unref (conn);
+
+  /* keep the compiler from discarding the loop */
+  if (total == 0)
+    printf ("no attributes found?\n");
+
+  return elapsed;
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  GabbleCapabilitySet *variants[N_VARIANTS];
+  guint i;
+
+  g_type_init ();
+  gabble_capabilities_init (NULL);
+
+  for (i = 0; i < N_VARIANTS; i++)
+    variants[i] = make_variant (i);
+
+  printf ("%8s %14s %14s\n", "contacts", "copied (us)", "interned (us)");
+
+  for (i = 0; contact_counts[i] != 0; i++)
+    {
+      guint n = contact_counts[i];
+      gdouble copied = run (variants, n, FALSE);
+      gdouble interned = run (variants, n, TRUE);
+
+      /* time per contact for a GetContactAttributes pass */
+      printf ("%8u %14.3f %14.3f\n", n,
+          copied * 1e6 / (n * N_ITERATIONS),
+          interned * 1e6 / (n * N_ITERATIONS));
+    }
+
+  for (i = 0; i < N_VARIANTS; i++)
+    gabble_capability_set_free (variants[i]);
+
+  gabble_capabilities_finalize (NULL);
+
+  return 0;
+}
+
+#else
+
+int
+main (int argc,
+    char **argv)
+{
+  printf ("The dummy backend has no contacts to benchmark\n");
+  return 0;
+}
+
+#endif
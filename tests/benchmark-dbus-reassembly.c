@@ -0,0 +1,222 @@
+/*
+ * benchmark-dbus-reassembly.c - Benchmark of the D-Bus message reassembly
+ * done for 1-1 D-Bus tubes
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* A burst of small signals on a 1-1 D-Bus tube tends to arrive in a single
+ * read. This program splits such bursts into messages, once the way
+ * SalutTubeDBus used to do it, appending everything to a buffer and erasing
+ * each message from the front of it, and once with SalutDBusReassembly. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "dbus-reassembly.h"
+
+#define N_MESSAGES 10000
+#define N_ITERATIONS 10
+
+/* read sizes; 0 means the whole burst in one read */
+static const gsize read_sizes[] = { 0, 65536, 1500, 100 };
+
+static GString *
+generate_burst (void)
+{
+  GString *burst = g_string_new ("");
+  guint i;
+
+  for (i = 0; i < N_MESSAGES; i++)
+    {
+      DBusMessage *msg;
+      dbus_uint32_t value = i;
+      char *data;
+      int len;
+
+      msg = dbus_message_new_signal ("/org/freedesktop/Telepathy/Bench",
+          "org.freedesktop.Telepathy.Bench", "Tick");
+      dbus_message_append_args (msg, DBUS_TYPE_UINT32, &value,
+          DBUS_TYPE_INVALID);
+      /* what the bus daemon would do */
+      dbus_message_set_serial (msg, i + 1);
+
+      if (!dbus_message_marshal (msg, &data, &len))
+        g_error ("out of memory");
+
+      g_string_append_len (burst, data, len);
+
+      dbus_free (data);
+      dbus_message_unref (msg);
+    }
+
+  return burst;
+}
+
+static guint32
+collect_le32 (const gchar *str)
+{
+  const guchar *bytes = (const guchar *) str;
+
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
+}
+
+/* What SalutTubeDBus used to do, minus the checks for bogus messages. The
+ * burst is marshalled on this machine, which main() makes sure is little
+ * endian. */
+static guint
+run_old (GString *burst,
+    gsize read_size)
+{
+  GString *buf = g_string_new ("");
+  guint32 needed = 0;
+  guint delivered = 0;
+  gsize off;
+
+  for (off = 0; off < burst->len; off += read_size)
+    {
+      g_string_append_len (buf, burst->str + off,
+          MIN (read_size, burst->len - off));
+
+      while (buf->len >= 16)
+        {
+          guint32 m;
+
+          if (needed != 0)
+            {
+              if (buf->len < needed)
+                break;
+
+              delivered++;
+              g_string_erase (buf, 0, needed);
+              needed = 0;
+            }
+
+          if (buf->len < 16)
+            break;
+
+          m = collect_le32 (buf->str + 12);
+          needed = m + ((8 - (m % 8)) % 8) + collect_le32 (buf->str + 4) + 16;
+        }
+    }
+
+  g_string_free (buf, TRUE);
+  return delivered;
+}
+
+static void
+message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  guint *delivered = user_data;
+
+  (*delivered)++;
+}
+
+static guint
+run_new (GString *burst,
+    gsize read_size)
+{
+  SalutDBusReassembly *reassembly = salut_dbus_reassembly_new ();
+  guint delivered = 0;
+  gsize off;
+
+  for (off = 0; off < burst->len; off += read_size)
+    {
+      if (!salut_dbus_reassembly_push (reassembly, burst->str + off,
+            MIN (read_size, burst->len - off), message_cb, &delivered))
+        g_error ("invalid D-Bus data");
+    }
+
+  salut_dbus_reassembly_free (reassembly);
+  return delivered;
+}
+
+static gdouble
+measure (GString *burst,
+    gsize read_size,
+    gboolean new,
+    guint *delivered)
+{
+  GTimer *timer = g_timer_new ();
+  gdouble elapsed;
+  guint i;
+
+  for (i = 0; i < N_ITERATIONS; i++)
+    {
+      if (new)
+        *delivered = run_new (burst, read_size);
+      else
+        *delivered = run_old (burst, read_size);
+    }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  /* time per burst */
+  return elapsed * 1e3 / N_ITERATIONS;
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  GString *burst;
+  guint i;
+
+  if (G_BYTE_ORDER != G_LITTLE_ENDIAN)
+    {
+      printf ("the old code path is only replayed for little endian\n");
+      return 0;
+    }
+
+  burst = generate_burst ();
+
+  printf ("%u messages, %" G_GSIZE_FORMAT " bytes per burst\n", N_MESSAGES,
+      burst->len);
+  printf ("%10s %12s %12s\n", "read size", "old (ms)", "new (ms)");
+
+  for (i = 0; i < G_N_ELEMENTS (read_sizes); i++)
+    {
+      gsize read_size = read_sizes[i] != 0 ? read_sizes[i] : burst->len;
+      guint old_delivered, new_delivered;
+      gdouble old_time, new_time;
+
+      old_time = measure (burst, read_size, FALSE, &old_delivered);
+      new_time = measure (burst, read_size, TRUE, &new_delivered);
+
+      printf ("%10" G_GSIZE_FORMAT " %12.3f %12.3f\n", read_size, old_time,
+          new_time);
+
+      if (old_delivered != N_MESSAGES || new_delivered != N_MESSAGES)
+        {
+          fprintf (stderr, "both should split the burst into %u messages\n",
+              N_MESSAGES);
+          return 1;
+        }
+    }
+
+  g_string_free (burst, TRUE);
+
+  return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * check-avatar-cache.c - Test for the on-disk cache of avatars
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "avatar-cache.h"
+#include "sha1/sha1-util.h"
+
+/* Room for three avatars */
+#define AVATAR_SIZE 1000
+#define MAX_SIZE (3 * AVATAR_SIZE)
+
+typedef struct {
+  gchar *directory;
+  SalutAvatarCache *cache;
+} Test;
+
+static void
+test_init (Test *t,
+    gsize max_size)
+{
+  GError *error = NULL;
+
+  t->directory = g_dir_make_tmp ("check-avatar-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+  t->cache = salut_avatar_cache_new (t->directory, max_size);
+}
+
+static void
+test_fini (Test *t)
+{
+  GDir *dir;
+  const gchar *name;
+
+  g_object_unref (t->cache);
+
+  dir = g_dir_open (t->directory, 0, NULL);
+  g_assert (dir != NULL);
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      gchar *path = g_build_filename (t->directory, name, NULL);
+
+      g_unlink (path);
+      g_free (path);
+    }
+
+  g_dir_close (dir);
+  g_rmdir (t->directory);
+  g_free (t->directory);
+}
+
+/* An avatar filled with c, returning its token */
+static gchar *
+make_avatar (gchar c,
+    guint8 **data)
+{
+  *data = g_malloc (AVATAR_SIZE);
+  memset (*data, c, AVATAR_SIZE);
+
+  return sha1_hex (*data, AVATAR_SIZE);
+}
+
+static gchar *
+store (Test *t,
+    gchar c)
+{
+  guint8 *data;
+  gchar *token = make_avatar (c, &data);
+
+  salut_avatar_cache_store (t->cache, token, data, AVATAR_SIZE);
+  g_free (data);
+
+  return token;
+}
+
+static gboolean
+lookup (Test *t,
+    const gchar *token)
+{
+  guint8 *data;
+  gsize size;
+
+  if (!salut_avatar_cache_lookup (t->cache, token, &data, &size))
+    return FALSE;
+
+  g_free (data);
+  return TRUE;
+}
+
+static gboolean
+file_exists (Test *t,
+    const gchar *name)
+{
+  gchar *path = g_build_filename (t->directory, name, NULL);
+  gboolean ret = g_file_test (path, G_FILE_TEST_EXISTS);
+
+  g_free (path);
+  return ret;
+}
+
+static guint
+count_files (Test *t)
+{
+  GDir *dir = g_dir_open (t->directory, 0, NULL);
+  guint n = 0;
+
+  g_assert (dir != NULL);
+
+  while (g_dir_read_name (dir) != NULL)
+    n++;
+
+  g_dir_close (dir);
+  return n;
+}
+
+/* Going over the size limit evicts the least recently used avatar, from
+ * memory and from disk */
+static void
+test_lru (void)
+{
+  Test t;
+  gchar *a, *b, *c, *d;
+
+  test_init (&t, MAX_SIZE);
+
+  a = store (&t, 'a');
+  b = store (&t, 'b');
+  c = store (&t, 'c');
+  g_assert_cmpuint (count_files (&t), ==, 3);
+
+  /* a is now more recent than b */
+  g_assert (lookup (&t, a));
+
+  d = store (&t, 'd');
+  g_assert_cmpuint (count_files (&t), ==, 3);
+  g_assert (!file_exists (&t, b));
+  g_assert (!lookup (&t, b));
+  g_assert (lookup (&t, a));
+  g_assert (lookup (&t, c));
+  g_assert (lookup (&t, d));
+
+  /* what's on disk is found again by a new cache */
+  g_object_unref (t.cache);
+  t.cache = salut_avatar_cache_new (t.directory, MAX_SIZE);
+  g_assert (lookup (&t, a));
+  g_assert (lookup (&t, c));
+  g_assert (lookup (&t, d));
+
+  g_free (a);
+  g_free (b);
+  g_free (c);
+  g_free (d);
+  test_fini (&t);
+}
+
+/* An avatar that doesn't match its SHA-1 on disk isn't handed out, and is
+ * dropped */
+static void
+test_corrupt (void)
+{
+  Test t;
+  gchar *a, *b, *path;
+  guint8 *data;
+
+  test_init (&t, MAX_SIZE);
+
+  a = store (&t, 'a');
+  b = store (&t, 'b');
+
+  /* truncated, as if we crashed while writing it */
+  path = g_build_filename (t.directory, a, NULL);
+  g_assert (g_file_set_contents (path, "aaaa", 4, NULL));
+  g_free (path);
+
+  /* overwritten with the right size but other bytes */
+  g_free (make_avatar ('x', &data));
+  path = g_build_filename (t.directory, b, NULL);
+  g_assert (g_file_set_contents (path, (const gchar *) data, AVATAR_SIZE,
+          NULL));
+  g_free (path);
+  g_free (data);
+
+  g_assert (!lookup (&t, a));
+  g_assert (!file_exists (&t, a));
+  g_assert (!lookup (&t, b));
+  g_assert (!file_exists (&t, b));
+  g_assert_cmpuint (count_files (&t), ==, 0);
+
+  /* and they can be stored again */
+  g_free (store (&t, 'a'));
+  g_assert (lookup (&t, a));
+
+  g_free (a);
+  g_free (b);
+  test_fini (&t);
+}
+
+/* Tokens that aren't a SHA-1 are never used as file names, so they can't
+ * point out of the cache directory */
+static void
+test_tokens (void)
+{
+  static const gchar * const tokens[] = {
+      "../escaped",
+      "/tmp/escaped",
+      "sub/dir",
+      /* one digit short of a SHA-1 */
+      "0123456789abcdef0123456789abcdef0123456",
+      "",
+      NULL };
+  Test t;
+  guint8 *data;
+  gchar *sha1, *upper, *outside;
+  guint i;
+
+  /* room for all of them */
+  test_init (&t, G_N_ELEMENTS (tokens) * AVATAR_SIZE);
+
+  g_free (make_avatar ('a', &data));
+
+  for (i = 0; tokens[i] != NULL; i++)
+    {
+      gchar *key = sha1_hex ((const guint8 *) tokens[i], strlen (tokens[i]));
+
+      salut_avatar_cache_store (t.cache, tokens[i], data, AVATAR_SIZE);
+      g_assert (file_exists (&t, key));
+      g_assert (lookup (&t, tokens[i]));
+      g_free (key);
+    }
+
+  g_assert_cmpuint (count_files (&t), ==, i);
+  g_assert (!g_file_test ("/tmp/escaped", G_FILE_TEST_EXISTS));
+  outside = g_build_filename (t.directory, "..", "escaped", NULL);
+  g_assert (!g_file_test (outside, G_FILE_TEST_EXISTS));
+  g_free (outside);
+
+  /* SHA-1s are used as they are, whatever their case */
+  sha1 = sha1_hex (data, AVATAR_SIZE);
+  upper = g_ascii_strup (sha1, -1);
+  salut_avatar_cache_store (t.cache, upper, data, AVATAR_SIZE);
+  g_assert (file_exists (&t, sha1));
+  g_assert (lookup (&t, sha1));
+  g_assert (lookup (&t, upper));
+
+  g_free (sha1);
+  g_free (upper);
+  g_free (data);
+  test_fini (&t);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_type_init ();
+
+  g_test_add_func ("/avatar-cache/lru", test_lru);
+  g_test_add_func ("/avatar-cache/corrupt", test_corrupt);
+  g_test_add_func ("/avatar-cache/tokens", test_tokens);
+
+  return g_test_run ();
+}
@@ -0,0 +1,331 @@
+/*
+ * check-connection-warmup.c - Test for opening link-local connections early
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "connection-warmup.h"
+
+/* None of the tests need a porter: the ones that open connections do it
+ * through a test hook */
+
+/* as documented */
+#define IDLE_TIMEOUT (5 * 60 * G_USEC_PER_SEC)
+#define N_CONTACTS 4
+
+typedef struct {
+  WockyLLContact *contact;
+  GCancellable *cancellable;
+  gpointer open_data;
+} Opening;
+
+typedef struct {
+  SalutConnectionWarmup *warmup;
+  WockyLLContact *contacts[N_CONTACTS];
+  /* connections being opened, in order */
+  GArray *opening;
+} Test;
+
+static void
+open_cb (WockyLLContact *contact,
+    GCancellable *cancellable,
+    gpointer open_data,
+    gpointer user_data)
+{
+  Test *t = user_data;
+  Opening o = { contact, g_object_ref (cancellable), open_data };
+
+  g_array_append_val (t->opening, o);
+}
+
+static void
+test_init (Test *t,
+    const gchar *max_connections)
+{
+  guint i;
+
+  g_setenv ("SALUT_WARMUP_MAX_CONNECTIONS", max_connections, TRUE);
+  t->warmup = salut_connection_warmup_new (NULL);
+  g_unsetenv ("SALUT_WARMUP_MAX_CONNECTIONS");
+  _salut_connection_warmup_TEST_set_open_func (t->warmup, open_cb, t);
+
+  for (i = 0; i < N_CONTACTS; i++)
+    {
+      gchar *jid = g_strdup_printf ("contact%u@host", i);
+
+      t->contacts[i] = wocky_ll_contact_new (jid);
+      g_free (jid);
+    }
+
+  t->opening = g_array_new (FALSE, FALSE, sizeof (Opening));
+}
+
+/* The warmup may be gone already */
+static void
+test_fini (Test *t)
+{
+  guint i;
+
+  if (t->warmup != NULL)
+    salut_connection_warmup_free (t->warmup);
+
+  g_assert_cmpuint (t->opening->len, ==, 0);
+  g_array_unref (t->opening);
+
+  for (i = 0; i < N_CONTACTS; i++)
+    g_object_unref (t->contacts[i]);
+}
+
+/* Finishes opening the oldest connection being opened, which must be to
+ * contact i, and returns whether it had been cancelled */
+static gboolean
+open_done (Test *t,
+    guint i,
+    gboolean opened)
+{
+  Opening *o;
+  gboolean cancelled;
+
+  g_assert_cmpuint (t->opening->len, >, 0);
+  o = &g_array_index (t->opening, Opening, 0);
+  g_assert (o->contact == t->contacts[i]);
+
+  cancelled = g_cancellable_is_cancelled (o->cancellable);
+  g_object_unref (o->cancellable);
+  _salut_connection_warmup_TEST_open_done (o->open_data, opened);
+  g_array_remove_index (t->opening, 0);
+
+  return cancelled;
+}
+
+static void
+check_warm (Test *t,
+    gboolean c0,
+    gboolean c1,
+    gboolean c2,
+    gboolean c3)
+{
+  g_assert (_salut_connection_warmup_TEST_is_warm (t->warmup,
+          t->contacts[0]) == c0);
+  g_assert (_salut_connection_warmup_TEST_is_warm (t->warmup,
+          t->contacts[1]) == c1);
+  g_assert (_salut_connection_warmup_TEST_is_warm (t->warmup,
+          t->contacts[2]) == c2);
+  g_assert (_salut_connection_warmup_TEST_is_warm (t->warmup,
+          t->contacts[3]) == c3);
+}
+
+static void
+check_max_connections (const gchar *value,
+    guint expected)
+{
+  SalutConnectionWarmup *warmup;
+
+  if (value != NULL)
+    g_setenv ("SALUT_WARMUP_MAX_CONNECTIONS", value, TRUE);
+  else
+    g_unsetenv ("SALUT_WARMUP_MAX_CONNECTIONS");
+
+  warmup = salut_connection_warmup_new (NULL);
+  g_assert_cmpuint (_salut_connection_warmup_TEST_get_max_connections (
+      warmup), ==, expected);
+  salut_connection_warmup_free (warmup);
+}
+
+/* Anything but a plain count falls back to the default */
+static void
+test_max_connections (void)
+{
+  check_max_connections (NULL, 16);
+  check_max_connections ("0", 0);
+  check_max_connections ("3", 3);
+  check_max_connections ("1000", 1000);
+
+  check_max_connections ("-1", 16);
+  check_max_connections ("+4", 16);
+  check_max_connections ("", 16);
+  check_max_connections ("lots", 16);
+  check_max_connections ("4 ", 16);
+  check_max_connections ("4x", 16);
+  check_max_connections ("99999999999999999999", 16);
+
+  g_unsetenv ("SALUT_WARMUP_MAX_CONNECTIONS");
+}
+
+/* Bucket i counts the times under 2^i ms, the last one the rest */
+static void
+test_histogram (void)
+{
+  SalutConnectionWarmup *warmup = salut_connection_warmup_new (NULL);
+  guint expected[SALUT_CONNECTION_WARMUP_N_BUCKETS];
+  guint buckets[SALUT_CONNECTION_WARMUP_N_BUCKETS];
+  guint last = SALUT_CONNECTION_WARMUP_N_BUCKETS - 1;
+
+  memset (expected, 0, sizeof (expected));
+
+  _salut_connection_warmup_TEST_record_latency (warmup, 0);
+  _salut_connection_warmup_TEST_record_latency (warmup, 999);
+  expected[0] = 2;
+
+  _salut_connection_warmup_TEST_record_latency (warmup, 1000);
+  _salut_connection_warmup_TEST_record_latency (warmup, 1999);
+  expected[1] = 2;
+
+  _salut_connection_warmup_TEST_record_latency (warmup, 2000);
+  expected[2] = 1;
+
+  _salut_connection_warmup_TEST_record_latency (warmup,
+      (G_GINT64_CONSTANT (1000) << (last - 1)) - 1);
+  expected[last - 1] = 1;
+
+  _salut_connection_warmup_TEST_record_latency (warmup,
+      G_GINT64_CONSTANT (1000) << (last - 1));
+  _salut_connection_warmup_TEST_record_latency (warmup,
+      600 * G_USEC_PER_SEC);
+  expected[last] = 2;
+
+  salut_connection_warmup_get_latency_histogram (warmup, buckets);
+  g_assert (memcmp (buckets, expected, sizeof (buckets)) == 0);
+
+  salut_connection_warmup_free (warmup);
+}
+
+/* Going over SALUT_WARMUP_MAX_CONNECTIONS lets go of the least recently
+ * used connection */
+static void
+test_lru (void)
+{
+  Test t;
+  guint i;
+
+  test_init (&t, "3");
+
+  for (i = 0; i < 3; i++)
+    {
+      salut_connection_warmup_touch (t.warmup, t.contacts[i]);
+      g_assert (!open_done (&t, i, TRUE));
+    }
+
+  check_warm (&t, TRUE, TRUE, TRUE, FALSE);
+
+  /* contact 0 is now more recent than 1 */
+  salut_connection_warmup_touch (t.warmup, t.contacts[0]);
+  g_assert_cmpuint (t.opening->len, ==, 0);
+
+  salut_connection_warmup_touch (t.warmup, t.contacts[3]);
+  check_warm (&t, TRUE, FALSE, TRUE, TRUE);
+  g_assert (!open_done (&t, 3, TRUE));
+
+  /* and a new connection to contact 1 evicts contact 2 */
+  salut_connection_warmup_touch (t.warmup, t.contacts[1]);
+  check_warm (&t, TRUE, TRUE, FALSE, TRUE);
+  g_assert (!open_done (&t, 1, TRUE));
+
+  test_fini (&t);
+}
+
+/* Connections are let go of after IDLE_TIMEOUT without traffic */
+static void
+test_idle (void)
+{
+  Test t;
+  gint64 now;
+
+  test_init (&t, "16");
+
+  salut_connection_warmup_touch (t.warmup, t.contacts[0]);
+  salut_connection_warmup_touch (t.warmup, t.contacts[1]);
+  g_assert (!open_done (&t, 0, TRUE));
+  g_assert (!open_done (&t, 1, TRUE));
+  now = g_get_monotonic_time ();
+
+  _salut_connection_warmup_TEST_reap (t.warmup, now + IDLE_TIMEOUT / 2);
+  check_warm (&t, TRUE, TRUE, FALSE, FALSE);
+
+  _salut_connection_warmup_TEST_reap (t.warmup,
+      now + IDLE_TIMEOUT - G_USEC_PER_SEC);
+  check_warm (&t, TRUE, TRUE, FALSE, FALSE);
+
+  _salut_connection_warmup_TEST_reap (t.warmup,
+      now + IDLE_TIMEOUT + G_USEC_PER_SEC);
+  check_warm (&t, FALSE, FALSE, FALSE, FALSE);
+
+  /* a failed connection isn't kept either */
+  salut_connection_warmup_touch (t.warmup, t.contacts[2]);
+  g_assert (!open_done (&t, 2, FALSE));
+  check_warm (&t, FALSE, FALSE, FALSE, FALSE);
+
+  test_fini (&t);
+}
+
+/* A connection still being opened when its contact goes away, or when the
+ * warmup is freed, is cancelled, and its result ignored */
+static void
+test_cancel (void)
+{
+  Test t;
+
+  test_init (&t, "16");
+
+  salut_connection_warmup_touch (t.warmup, t.contacts[0]);
+  salut_connection_warmup_touch (t.warmup, t.contacts[1]);
+  check_warm (&t, TRUE, TRUE, FALSE, FALSE);
+
+  salut_connection_warmup_forget (t.warmup, t.contacts[0]);
+  check_warm (&t, FALSE, TRUE, FALSE, FALSE);
+
+  /* it was opened by the time the cancellation was noticed */
+  g_assert (open_done (&t, 0, TRUE));
+  check_warm (&t, FALSE, TRUE, FALSE, FALSE);
+
+  /* nothing to cancel once it's open */
+  g_assert (!open_done (&t, 1, TRUE));
+  salut_connection_warmup_forget (t.warmup, t.contacts[1]);
+  check_warm (&t, FALSE, FALSE, FALSE, FALSE);
+
+  /* forgetting somebody we never warmed up to is fine */
+  salut_connection_warmup_forget (t.warmup, t.contacts[3]);
+
+  salut_connection_warmup_touch (t.warmup, t.contacts[2]);
+  salut_connection_warmup_free (t.warmup);
+  t.warmup = NULL;
+  g_assert (open_done (&t, 2, TRUE));
+
+  test_fini (&t);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_type_init ();
+
+  g_test_add_func ("/connection-warmup/max-connections",
+      test_max_connections);
+  g_test_add_func ("/connection-warmup/histogram", test_histogram);
+  g_test_add_func ("/connection-warmup/lru", test_lru);
+  g_test_add_func ("/connection-warmup/idle", test_idle);
+  g_test_add_func ("/connection-warmup/cancel", test_cancel);
+
+  return g_test_run ();
+}
@@ -0,0 +1,253 @@
+/*
+ * check-dbus-order.c - Test for ordering D-Bus tube messages
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "dbus-order.h"
+
+#define SENDER 42
+#define NAME ":2.c2VuZGVy"
+#define DESTINATION ":2.cmVjZWl2ZXI_"
+
+typedef struct {
+  SalutDBusOrder *order;
+  /* serials of the messages delivered, in order */
+  GArray *delivered;
+} Test;
+
+static void
+deliver_cb (DBusMessage *msg,
+    size_t len,
+    gpointer user_data)
+{
+  Test *t = user_data;
+  dbus_uint32_t serial = dbus_message_get_serial (msg);
+
+  g_array_append_val (t->delivered, serial);
+  dbus_message_unref (msg);
+}
+
+static void
+test_init (Test *t)
+{
+  t->order = salut_dbus_order_new (deliver_cb, t);
+  t->delivered = g_array_new (FALSE, FALSE, sizeof (dbus_uint32_t));
+}
+
+static void
+test_fini (Test *t)
+{
+  salut_dbus_order_free (t->order);
+  g_array_unref (t->delivered);
+}
+
+/* A signal to everybody, over multicast */
+static void
+multicast (Test *t,
+    dbus_uint32_t serial)
+{
+  DBusMessage *msg = dbus_message_new_signal ("/", "com.example.Test",
+      "Broadcast");
+
+  dbus_message_set_sender (msg, NAME);
+  dbus_message_set_serial (msg, serial);
+  salut_dbus_order_push (t->order, SENDER, msg, 1, FALSE);
+}
+
+/* A method call to us, over the bytestream if unicast is TRUE or over
+ * multicast after it failed */
+static void
+addressed (Test *t,
+    dbus_uint32_t serial,
+    gboolean unicast)
+{
+  DBusMessage *msg = dbus_message_new_method_call (DESTINATION, "/",
+      "com.example.Test", "Unicast");
+
+  dbus_message_set_sender (msg, NAME);
+  dbus_message_set_serial (msg, serial);
+  salut_dbus_order_push (t->order, SENDER, msg, 1, unicast);
+}
+
+/* ORDER_UNICAST or ORDER_LOST for serial. Markers have serials of their
+ * own, which don't matter. */
+static void
+marker (Test *t,
+    const gchar *member,
+    dbus_uint32_t serial)
+{
+  DBusMessage *msg = dbus_message_new_signal (SALUT_DBUS_ORDER_PATH,
+      SALUT_DBUS_ORDER_IFACE, member);
+
+  dbus_message_set_sender (msg, NAME);
+  dbus_message_set_destination (msg, DESTINATION);
+  dbus_message_set_serial (msg, 1000);
+  dbus_message_append_args (msg, DBUS_TYPE_UINT32, &serial,
+      DBUS_TYPE_INVALID);
+  salut_dbus_order_push (t->order, SENDER, msg, 1, FALSE);
+}
+
+static void
+check_delivered (Test *t,
+    guint n,
+    ...)
+{
+  va_list ap;
+  guint i;
+
+  g_assert_cmpuint (t->delivered->len, ==, n);
+
+  va_start (ap, n);
+  for (i = 0; i < n; i++)
+    g_assert_cmpuint (g_array_index (t->delivered, dbus_uint32_t, i), ==,
+        va_arg (ap, dbus_uint32_t));
+  va_end (ap);
+}
+
+/* Messages sent after one that went over the bytestream wait for it,
+ * whichever way round its marker and itself arrive */
+static void
+test_reorder (void)
+{
+  Test t;
+
+  test_init (&t);
+
+  multicast (&t, 1);
+  marker (&t, SALUT_DBUS_ORDER_UNICAST, 2);
+  multicast (&t, 3);
+  check_delivered (&t, 1, 1);
+  g_assert_cmpuint (salut_dbus_order_get_waiting (t.order, SENDER), ==, 1);
+
+  addressed (&t, 2, TRUE);
+  check_delivered (&t, 3, 1, 2, 3);
+
+  /* this time it's faster than its marker */
+  addressed (&t, 4, TRUE);
+  check_delivered (&t, 3, 1, 2, 3);
+  g_assert_cmpuint (salut_dbus_order_get_waiting (t.order, SENDER), ==, 1);
+
+  marker (&t, SALUT_DBUS_ORDER_UNICAST, 4);
+  multicast (&t, 5);
+  check_delivered (&t, 5, 1, 2, 3, 4, 5);
+  g_assert_cmpuint (salut_dbus_order_get_waiting (t.order, SENDER), ==, 0);
+
+  test_fini (&t);
+}
+
+/* Once the bytestream closed, nothing waits for what it lost, and what came
+ * over it too late or ahead of a marker that got lost isn't kept */
+static void
+test_lost (void)
+{
+  Test t;
+
+  test_init (&t);
+
+  marker (&t, SALUT_DBUS_ORDER_UNICAST, 1);
+  marker (&t, SALUT_DBUS_ORDER_UNICAST, 2);
+  multicast (&t, 3);
+  addressed (&t, 1, TRUE);
+  check_delivered (&t, 1, 1);
+
+  marker (&t, SALUT_DBUS_ORDER_LOST, 2);
+  check_delivered (&t, 2, 1, 3);
+
+  /* too late */
+  addressed (&t, 2, TRUE);
+  g_assert_cmpuint (salut_dbus_order_get_waiting (t.order, SENDER), ==, 1);
+  salut_dbus_order_unicast_closed (t.order, SENDER);
+  g_assert_cmpuint (salut_dbus_order_get_waiting (t.order, SENDER), ==, 0);
+
+  /* no marker will come for it */
+  addressed (&t, 4, TRUE);
+  marker (&t, SALUT_DBUS_ORDER_LOST, 4);
+  g_assert_cmpuint (salut_dbus_order_get_waiting (t.order, SENDER), ==, 0);
+
+  multicast (&t, 5);
+  check_delivered (&t, 3, 1, 3, 5);
+
+  test_fini (&t);
+}
+
+/* Lost covers the serials before it even when they wrapped around */
+static void
+test_lost_wrap (void)
+{
+  Test t;
+
+  test_init (&t);
+
+  marker (&t, SALUT_DBUS_ORDER_UNICAST, G_MAXUINT32 - 1);
+  marker (&t, SALUT_DBUS_ORDER_UNICAST, G_MAXUINT32);
+  marker (&t, SALUT_DBUS_ORDER_UNICAST, 1);
+  multicast (&t, 2);
+  check_delivered (&t, 0);
+
+  marker (&t, SALUT_DBUS_ORDER_LOST, 1);
+  check_delivered (&t, 1, 2);
+  g_assert_cmpuint (salut_dbus_order_get_waiting (t.order, SENDER), ==, 0);
+
+  test_fini (&t);
+}
+
+/* When the bytestream fails before the messages queued for it went, they're
+ * sent over multicast and take the place of their markers */
+static void
+test_fallback (void)
+{
+  Test t;
+
+  test_init (&t);
+
+  marker (&t, SALUT_DBUS_ORDER_UNICAST, 1);
+  marker (&t, SALUT_DBUS_ORDER_UNICAST, 2);
+  multicast (&t, 3);
+  check_delivered (&t, 0);
+
+  addressed (&t, 1, FALSE);
+  check_delivered (&t, 1, 1);
+  addressed (&t, 2, FALSE);
+  check_delivered (&t, 3, 1, 2, 3);
+
+  /* and from then on they're all sent over multicast */
+  addressed (&t, 4, FALSE);
+  multicast (&t, 5);
+  check_delivered (&t, 5, 1, 2, 3, 4, 5);
+  g_assert_cmpuint (salut_dbus_order_get_waiting (t.order, SENDER), ==, 0);
+
+  test_fini (&t);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/dbus-order/reorder", test_reorder);
+  g_test_add_func ("/dbus-order/lost", test_lost);
+  g_test_add_func ("/dbus-order/lost-wrap", test_lost_wrap);
+  g_test_add_func ("/dbus-order/fallback", test_fallback);
+
+  return g_test_run ();
+}
@@ -0,0 +1,346 @@
+/*
+ * check-dbus-reassembly.c - Test for splitting a byte stream into D-Bus
+ * messages
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "dbus-reassembly.h"
+
+#define HEADER_SIZE 16
+
+typedef struct {
+  SalutDBusReassembly *reassembly;
+  /* owned GStrings, the messages handed out in order */
+  GPtrArray *messages;
+} Test;
+
+static void
+message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  Test *t = user_data;
+  DBusMessage *msg;
+  DBusError error = DBUS_ERROR_INIT;
+
+  /* each one is a whole, valid message */
+  msg = dbus_message_demarshal (data, len, &error);
+  if (msg == NULL)
+    g_error ("%s: %s", error.name, error.message);
+  dbus_message_unref (msg);
+
+  g_ptr_array_add (t->messages, g_string_new_len (data, len));
+}
+
+static void
+string_free (gpointer s)
+{
+  g_string_free (s, TRUE);
+}
+
+static void
+test_init (Test *t)
+{
+  t->reassembly = salut_dbus_reassembly_new ();
+  t->messages = g_ptr_array_new_with_free_func (string_free);
+}
+
+static void
+test_fini (Test *t)
+{
+  salut_dbus_reassembly_free (t->reassembly);
+  g_ptr_array_unref (t->messages);
+}
+
+static void
+push (Test *t,
+    const GString *data,
+    gsize start,
+    gsize end)
+{
+  g_assert (salut_dbus_reassembly_push (t->reassembly, data->str + start,
+          end - start, message_cb, t));
+}
+
+static void
+check_message (Test *t,
+    guint i,
+    const GString *expected)
+{
+  GString *message;
+
+  g_assert_cmpuint (t->messages->len, >, i);
+  message = g_ptr_array_index (t->messages, i);
+  g_assert_cmpuint (message->len, ==, expected->len);
+  g_assert (memcmp (message->str, expected->str, expected->len) == 0);
+}
+
+/* A signal with a string argument, marshalled in our byte order */
+static GString *
+marshal (dbus_uint32_t serial,
+    const gchar *arg)
+{
+  DBusMessage *msg;
+  GString *marshalled;
+  char *data;
+  int len;
+
+  msg = dbus_message_new_signal ("/org/freedesktop/Telepathy/Test",
+      "org.freedesktop.Telepathy.Test", "Signal");
+  dbus_message_append_args (msg, DBUS_TYPE_STRING, &arg,
+      DBUS_TYPE_INVALID);
+  dbus_message_set_serial (msg, serial);
+
+  if (!dbus_message_marshal (msg, &data, &len))
+    g_error ("out of memory");
+
+  marshalled = g_string_new_len (data, len);
+
+  dbus_free (data);
+  dbus_message_unref (msg);
+  return marshalled;
+}
+
+static guint32
+header_fields_length (const GString *message)
+{
+  guint32 m;
+
+  memcpy (&m, message->str + 12, sizeof (m));
+
+  if (message->str[0] == DBUS_BIG_ENDIAN)
+    return GUINT32_FROM_BE (m);
+
+  return GUINT32_FROM_LE (m);
+}
+
+/* Pushes message in two reads split at each of the offsets from start to
+ * end */
+static void
+check_splits (const GString *message,
+    gsize start,
+    gsize end)
+{
+  gsize split;
+
+  for (split = start; split < end; split++)
+    {
+      Test t;
+
+      test_init (&t);
+
+      push (&t, message, 0, split);
+      g_assert_cmpuint (t.messages->len, ==, 0);
+      g_assert_cmpuint (salut_dbus_reassembly_get_pending (t.reassembly), ==,
+          split);
+
+      push (&t, message, split, message->len);
+      g_assert_cmpuint (t.messages->len, ==, 1);
+      check_message (&t, 0, message);
+      g_assert_cmpuint (salut_dbus_reassembly_get_pending (t.reassembly), ==,
+          0);
+
+      test_fini (&t);
+    }
+}
+
+/* Reads that end within the fixed header, or right after it */
+static void
+test_split_header (void)
+{
+  GString *message = marshal (1, "hello");
+
+  check_splits (message, 1, HEADER_SIZE + 1);
+
+  g_string_free (message, TRUE);
+}
+
+/* Reads that end within the header fields array, or the body after it */
+static void
+test_split_fields (void)
+{
+  GString *message = marshal (1, "hello");
+  guint32 m = header_fields_length (message);
+
+  g_assert_cmpuint (HEADER_SIZE + m, <, message->len);
+  check_splits (message, HEADER_SIZE + 1, message->len);
+
+  g_string_free (message, TRUE);
+}
+
+/* Several messages in one read, with the start of the next one, and one
+ * byte at a time */
+static void
+test_several (void)
+{
+  GString *messages[4];
+  GString *stream = g_string_new ("");
+  gsize end_of_third;
+  Test t;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (messages); i++)
+    {
+      gchar *arg = g_strnfill (i * 10, 'x');
+
+      messages[i] = marshal (i + 1, arg);
+      g_string_append_len (stream, messages[i]->str, messages[i]->len);
+      g_free (arg);
+    }
+
+  end_of_third = messages[0]->len + messages[1]->len + messages[2]->len;
+
+  test_init (&t);
+  push (&t, stream, 0, end_of_third + 3);
+  g_assert_cmpuint (t.messages->len, ==, 3);
+  g_assert_cmpuint (salut_dbus_reassembly_get_pending (t.reassembly), ==, 3);
+  push (&t, stream, end_of_third + 3, stream->len);
+  g_assert_cmpuint (t.messages->len, ==, 4);
+
+  for (i = 0; i < G_N_ELEMENTS (messages); i++)
+    check_message (&t, i, messages[i]);
+
+  test_fini (&t);
+
+  test_init (&t);
+
+  for (i = 0; i < stream->len; i++)
+    push (&t, stream, i, i + 1);
+
+  g_assert_cmpuint (t.messages->len, ==, 4);
+
+  for (i = 0; i < G_N_ELEMENTS (messages); i++)
+    check_message (&t, i, messages[i]);
+
+  test_fini (&t);
+
+  for (i = 0; i < G_N_ELEMENTS (messages); i++)
+    g_string_free (messages[i], TRUE);
+
+  g_string_free (stream, TRUE);
+}
+
+static void
+put_be32 (GString *s,
+    gsize offset,
+    guint32 value)
+{
+  value = GUINT32_TO_BE (value);
+  memcpy (s->str + offset, &value, sizeof (value));
+}
+
+/* Signal a.b.C on / carrying the uint32 arg, from a big-endian peer, which
+ * libdbus wouldn't produce here */
+static GString *
+marshal_big_endian (dbus_uint32_t serial,
+    dbus_uint32_t arg)
+{
+  GString *s = g_string_new ("");
+
+  /* zeroes, which is what the padding is */
+  g_string_set_size (s, 76);
+  memset (s->str, 0, s->len);
+
+  s->str[0] = DBUS_BIG_ENDIAN;
+  s->str[1] = DBUS_MESSAGE_TYPE_SIGNAL;
+  s->str[3] = DBUS_MAJOR_PROTOCOL_VERSION;
+  put_be32 (s, 4, sizeof (arg));
+  put_be32 (s, 8, serial);
+  /* the fields end at 71, and are padded to 72 */
+  put_be32 (s, 12, 71 - HEADER_SIZE);
+
+  memcpy (s->str + 16, "\x01\x01o\0", 4);
+  put_be32 (s, 20, 1);
+  memcpy (s->str + 24, "/", 2);
+
+  memcpy (s->str + 32, "\x02\x01s\0", 4);
+  put_be32 (s, 36, 3);
+  memcpy (s->str + 40, "a.b", 4);
+
+  memcpy (s->str + 48, "\x03\x01s\0", 4);
+  put_be32 (s, 52, 1);
+  memcpy (s->str + 56, "C", 2);
+
+  memcpy (s->str + 64, "\x08\x01g\0", 4);
+  memcpy (s->str + 68, "\x01u", 3);
+
+  put_be32 (s, 72, arg);
+
+  g_assert_cmpint (dbus_message_demarshal_bytes_needed (s->str, s->len), ==,
+      s->len);
+  return s;
+}
+
+/* The lengths of messages from big-endian peers are read as such */
+static void
+test_big_endian (void)
+{
+  GString *big = marshal_big_endian (1, 0x01020304);
+  GString *little = marshal (2, "hello");
+  GString *stream = g_string_new ("");
+  Test t;
+
+  check_splits (big, 1, big->len);
+
+  /* mixed with our own */
+  g_string_append_len (stream, big->str, big->len);
+  g_string_append_len (stream, little->str, little->len);
+  g_string_append_len (stream, big->str, big->len);
+
+  test_init (&t);
+  push (&t, stream, 0, big->len + HEADER_SIZE);
+  g_assert_cmpuint (t.messages->len, ==, 1);
+  push (&t, stream, big->len + HEADER_SIZE, stream->len);
+  g_assert_cmpuint (t.messages->len, ==, 3);
+  check_message (&t, 0, big);
+  check_message (&t, 1, little);
+  check_message (&t, 2, big);
+  test_fini (&t);
+
+  /* and one claiming to be too big is refused */
+  put_be32 (big, 4, DBUS_MAXIMUM_MESSAGE_LENGTH);
+  test_init (&t);
+  g_assert (!salut_dbus_reassembly_push (t.reassembly, big->str, big->len,
+          message_cb, &t));
+  g_assert_cmpuint (t.messages->len, ==, 0);
+  test_fini (&t);
+
+  g_string_free (big, TRUE);
+  g_string_free (little, TRUE);
+  g_string_free (stream, TRUE);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/dbus-reassembly/split-header", test_split_header);
+  g_test_add_func ("/dbus-reassembly/split-fields", test_split_fields);
+  g_test_add_func ("/dbus-reassembly/several", test_several);
+  g_test_add_func ("/dbus-reassembly/big-endian", test_big_endian);
+
+  return g_test_run ();
+}
@@ -0,0 +1,284 @@
+/*
+ * check-debug-ring.c - Test for the debug ring buffer
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "debug.h"
+
+#define NR_RACING ((guint) 100000)
+
+static TpDebugSender *sender;
+/* owned strings, the messages the sender got */
+static GPtrArray *messages;
+/* how many of them the ring buffer said it lost */
+static guint lost;
+
+static void
+new_debug_message_cb (TpDebugSender *dbg,
+    gdouble timestamp,
+    const gchar *domain,
+    guint level,
+    const gchar *message,
+    gpointer user_data)
+{
+  guint n;
+
+  if (sscanf (message, "%u debug messages were lost", &n) == 1)
+    lost += n;
+  else
+    g_ptr_array_add (messages, g_strdup (message));
+}
+
+/* Messages only go to the ring buffer as long as nobody watches the sender
+ * debug_watch_sender () would be called with, so this one is only used to
+ * see what gets flushed */
+static void
+setup (const gchar *ring_size)
+{
+  g_unsetenv ("SALUT_DEBUG");
+  g_setenv ("SALUT_DEBUG_RING", ring_size, TRUE);
+  debug_set_flags_from_env ();
+
+  messages = g_ptr_array_new_with_free_func (g_free);
+  lost = 0;
+
+  sender = tp_debug_sender_dup ();
+  g_object_set (sender, "enabled", TRUE, NULL);
+  g_signal_connect (sender, "new-debug-message",
+      G_CALLBACK (new_debug_message_cb), NULL);
+}
+
+static void
+teardown (void)
+{
+  g_signal_handlers_disconnect_by_func (sender, new_debug_message_cb, NULL);
+  g_object_unref (sender);
+  g_ptr_array_unref (messages);
+  debug_free ();
+}
+
+static void
+flush (void)
+{
+  g_ptr_array_set_size (messages, 0);
+  lost = 0;
+  _debug_TEST_ring_flush (sender);
+}
+
+#define CHECK_FORMAT(format, ...) G_STMT_START {                          \
+  gchar *_expected = g_strdup_printf (format, __VA_ARGS__);               \
+  debug (DEBUG_MUC, format, __VA_ARGS__);                                 \
+  flush ();                                                               \
+  g_assert_cmpuint (messages->len, ==, 1);                                \
+  g_assert_cmpuint (lost, ==, 0);                                         \
+  g_assert_cmpstr (g_ptr_array_index (messages, 0), ==, _expected);       \
+  g_free (_expected);                                                     \
+} G_STMT_END
+
+/* Messages are rendered as if they had been formatted right away */
+static void
+test_formats (void)
+{
+  gchar long_string[301];
+  gchar *expected;
+
+  setup ("8");
+
+  CHECK_FORMAT ("%s", "hello");
+  CHECK_FORMAT ("%s and %s", "hello", (const gchar *) NULL);
+  CHECK_FORMAT ("%p", (gpointer) &sender);
+  CHECK_FORMAT ("%.*s|", 3, "abcdef");
+  CHECK_FORMAT ("%*.*s|", 6, 2, "abcdef");
+  CHECK_FORMAT ("%.2s|%-4d|", "abcdef", 7);
+  CHECK_FORMAT ("%" G_GINT64_FORMAT " %" G_GUINT64_FORMAT,
+      G_MININT64, G_MAXUINT64);
+  CHECK_FORMAT ("%" G_GSIZE_FORMAT " %ld %lu", (gsize) G_MAXSIZE,
+      (glong) G_MINLONG, (gulong) G_MAXULONG);
+  CHECK_FORMAT ("100%% of %u%%", 42);
+  CHECK_FORMAT ("%5.2f %g %c", 3.14159, 1e-10, 'x');
+
+  /* Arguments the slot can't hold are formatted right away */
+  CHECK_FORMAT ("%Lf %s", (long double) 2.5, "and a string");
+
+  /* A string argument that doesn't fit is cut short */
+  memset (long_string, 'a', sizeof (long_string) - 1);
+  long_string[sizeof (long_string) - 1] = '\0';
+  debug (DEBUG_MUC, "%s", long_string);
+  flush ();
+  g_assert_cmpuint (messages->len, ==, 1);
+  expected = g_strndup (long_string, 223);
+  g_assert_cmpstr (g_ptr_array_index (messages, 0), ==, expected);
+  g_free (expected);
+
+  teardown ();
+}
+
+#undef CHECK_FORMAT
+
+static void
+check_messages (guint first,
+    guint last)
+{
+  guint i;
+
+  g_assert_cmpuint (messages->len, ==, last - first + 1);
+
+  for (i = first; i <= last; i++)
+    {
+      gchar *expected = g_strdup_printf ("message %u", i);
+
+      g_assert_cmpstr (g_ptr_array_index (messages, i - first), ==,
+          expected);
+      g_free (expected);
+    }
+}
+
+/* Only the newest messages are kept, and the others are counted as lost */
+static void
+test_wraparound (void)
+{
+  guint i;
+
+  setup ("4");
+
+  for (i = 0; i < 10; i++)
+    debug (DEBUG_MUC, "message %u", i);
+
+  flush ();
+  check_messages (6, 9);
+  g_assert_cmpuint (lost, ==, 6);
+
+  /* Nothing new */
+  flush ();
+  g_assert_cmpuint (messages->len, ==, 0);
+  g_assert_cmpuint (lost, ==, 0);
+
+  teardown ();
+}
+
+/* The stamps of the slots stay valid when the message count goes past
+ * G_MAXINT32, and when it wraps around */
+static void
+test_stamp_overflow (void)
+{
+  guint32 starts[] = { G_MAXINT32 - 1, G_MAXUINT32 - 1 };
+  guint i, j;
+
+  setup ("4");
+
+  for (j = 0; j < G_N_ELEMENTS (starts); j++)
+    {
+      _debug_TEST_ring_seek (starts[j]);
+
+      for (i = 0; i < 4; i++)
+        debug (DEBUG_MUC, "message %u", i);
+
+      flush ();
+      check_messages (0, 3);
+      g_assert_cmpuint (lost, ==, 0);
+    }
+
+  teardown ();
+}
+
+static volatile gint writer_done = 0;
+
+static gpointer
+writer_thread (gpointer data)
+{
+  guint i;
+
+  for (i = 0; i < NR_RACING; i++)
+    debug (DEBUG_MUC, "message %u of %s", i, "the writer");
+
+  g_atomic_int_set (&writer_done, 1);
+  return NULL;
+}
+
+/* Messages flushed while they're being written are either whole or counted
+ * as lost */
+static void
+test_racing_writer (void)
+{
+  GThread *writer;
+  guint received = 0, lost_total = 0;
+  gint last = -1;
+  gboolean done;
+
+  setup ("64");
+  writer_done = 0;
+
+  writer = g_thread_new ("writer", writer_thread, NULL);
+
+  do
+    {
+      guint i;
+
+      done = g_atomic_int_get (&writer_done);
+      flush ();
+
+      for (i = 0; i < messages->len; i++)
+        {
+          const gchar *message = g_ptr_array_index (messages, i);
+          gchar *expected;
+          guint n;
+
+          g_assert (sscanf (message, "message %u of", &n) == 1);
+          g_assert_cmpint ((gint) n, >, last);
+          last = n;
+
+          expected = g_strdup_printf ("message %u of %s", n, "the writer");
+          g_assert_cmpstr (message, ==, expected);
+          g_free (expected);
+        }
+
+      received += messages->len;
+      lost_total += lost;
+    }
+  while (!done);
+
+  g_thread_join (writer);
+
+  g_assert_cmpuint (received, >, 0);
+  g_assert_cmpuint (received + lost_total, ==, NR_RACING);
+
+  teardown ();
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_type_init ();
+
+  g_test_add_func ("/debug-ring/formats", test_formats);
+  g_test_add_func ("/debug-ring/wraparound", test_wraparound);
+  g_test_add_func ("/debug-ring/stamp-overflow", test_stamp_overflow);
+  g_test_add_func ("/debug-ring/racing-writer", test_racing_writer);
+
+  return g_test_run ();
+}
@@ -0,0 +1,312 @@
+/*
+ * check-message-spill.c - Test for bounding the pending messages of channels
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+#include <telepathy-glib/telepathy-glib-dbus.h>
+
+#include "message-spill.h"
+
+/* Room for 7 short messages per channel and 11 overall, each one costing
+ * its text and 512 bytes */
+#define CHANNEL_BUDGET "4096"
+#define GLOBAL_BUDGET "6144"
+#define PER_CHANNEL 7
+#define OVERALL 11
+
+/* Stands in for a channel with a TpMessageMixin: it only needs to emit
+ * pending-messages-removed */
+typedef struct {
+  GObject parent;
+  /* owned strings, the texts of the messages it got, in order */
+  GPtrArray *received;
+  /* ids of the ones that haven't been acknowledged */
+  GArray *pending;
+} TestChannel;
+
+typedef struct {
+  GObjectClass parent_class;
+} TestChannelClass;
+
+static GType test_channel_get_type (void);
+
+G_DEFINE_TYPE_WITH_CODE (TestChannel, test_channel, G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_INTERFACE_MESSAGES, NULL))
+
+static void
+test_channel_init (TestChannel *self)
+{
+  self->received = g_ptr_array_new_with_free_func (g_free);
+  self->pending = g_array_new (FALSE, FALSE, sizeof (guint));
+}
+
+static void
+test_channel_finalize (GObject *object)
+{
+  TestChannel *self = (TestChannel *) object;
+
+  g_ptr_array_unref (self->received);
+  g_array_unref (self->pending);
+
+  G_OBJECT_CLASS (test_channel_parent_class)->finalize (object);
+}
+
+static void
+test_channel_class_init (TestChannelClass *klass)
+{
+  G_OBJECT_CLASS (klass)->finalize = test_channel_finalize;
+}
+
+static guint next_id = 1;
+
+static guint
+take_cb (GObject *channel,
+    TpHandle sender,
+    guint timestamp,
+    TpChannelTextMessageType type,
+    const gchar *text)
+{
+  TestChannel *self = (TestChannel *) channel;
+  guint id = next_id++;
+
+  /* without the padding of long messages */
+  g_ptr_array_add (self->received, g_strndup (text, strcspn (text, ".")));
+  g_array_append_val (self->pending, id);
+
+  return id;
+}
+
+typedef struct {
+  TestChannel *channel;
+  SalutMessageSpill *spill;
+  guint sent;
+} Channel;
+
+static void
+channel_init (Channel *c)
+{
+  c->channel = g_object_new (test_channel_get_type (), NULL);
+  c->spill = salut_message_spill_new (G_OBJECT (c->channel), NULL);
+  c->sent = 0;
+}
+
+static void
+channel_free (Channel *c)
+{
+  salut_message_spill_free (c->spill);
+  g_object_unref (c->channel);
+}
+
+static void
+receive_padded (Channel *c,
+    guint n,
+    gsize padding)
+{
+  gchar *dots = g_strnfill (padding, '.');
+  guint i;
+
+  for (i = 0; i < n; i++)
+    {
+      gchar *text = g_strdup_printf ("message %u%s", c->sent++, dots);
+
+      salut_message_spill_receive (c->spill, 42, 0,
+          TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL, text);
+      g_free (text);
+    }
+
+  g_free (dots);
+}
+
+static void
+receive (Channel *c,
+    guint n)
+{
+  receive_padded (c, n, 0);
+}
+
+/* Acknowledges the n oldest pending messages, which pages in the ones that
+ * fit now. The ids are copied, as the spill adds to the pending ones while
+ * handling the signal. */
+static void
+ack (Channel *c,
+    guint n)
+{
+  GArray *ids;
+
+  n = MIN (n, c->channel->pending->len);
+  ids = g_array_sized_new (FALSE, FALSE, sizeof (guint), n);
+  g_array_append_vals (ids, c->channel->pending->data, n);
+  g_array_remove_range (c->channel->pending, 0, n);
+
+  tp_svc_channel_interface_messages_emit_pending_messages_removed (
+      c->channel, ids);
+
+  g_array_unref (ids);
+}
+
+/* Every message was delivered, once and in order */
+static void
+check_all_received (Channel *c)
+{
+  guint i;
+
+  g_assert_cmpuint (c->channel->received->len, ==, c->sent);
+
+  for (i = 0; i < c->sent; i++)
+    {
+      gchar *expected = g_strdup_printf ("message %u", i);
+
+      g_assert_cmpstr (g_ptr_array_index (c->channel->received, i), ==,
+          expected);
+      g_free (expected);
+    }
+}
+
+static void
+check_counters (Channel *c,
+    guint expected_spilled,
+    guint expected_paged)
+{
+  guint spilled, paged;
+
+  salut_message_spill_get_counters (c->spill, &spilled, &paged);
+  g_assert_cmpuint (spilled, ==, expected_spilled);
+  g_assert_cmpuint (paged, ==, expected_paged);
+}
+
+/* Messages over the budget wait on disk, and are read back in order as
+ * acknowledging earlier ones makes room */
+static void
+test_in_order (void)
+{
+  Channel c;
+
+  channel_init (&c);
+
+  receive (&c, 50);
+  g_assert_cmpuint (c.channel->received->len, ==, PER_CHANNEL);
+  check_counters (&c, 50 - PER_CHANNEL, 0);
+
+  ack (&c, 1);
+  g_assert_cmpuint (c.channel->received->len, ==, PER_CHANNEL + 1);
+  check_counters (&c, 50 - PER_CHANNEL, 1);
+
+  while (c.channel->received->len < c.sent)
+    ack (&c, 3);
+
+  check_all_received (&c);
+  check_counters (&c, 50 - PER_CHANNEL, 50 - PER_CHANNEL);
+
+  channel_free (&c);
+}
+
+/* Messages that arrive while others wait on disk queue up behind them, even
+ * when there would be room for them */
+static void
+test_queue_behind (void)
+{
+  Channel c;
+
+  channel_init (&c);
+
+  receive (&c, PER_CHANNEL - 1);
+  /* too big for what's left of the budget */
+  receive_padded (&c, 1, 2000);
+  /* would fit, but has to wait for the one before it */
+  receive (&c, 1);
+  g_assert_cmpuint (c.channel->received->len, ==, PER_CHANNEL - 1);
+  check_counters (&c, 2, 0);
+
+  ack (&c, 1);
+  g_assert_cmpuint (c.channel->received->len, ==, PER_CHANNEL - 1);
+
+  ack (&c, PER_CHANNEL);
+  g_assert_cmpuint (c.channel->received->len, ==, PER_CHANNEL + 1);
+  check_counters (&c, 2, 2);
+  check_all_received (&c);
+
+  receive (&c, 20);
+  ack (&c, 4);
+  receive (&c, 5);
+
+  while (c.channel->received->len < c.sent)
+    ack (&c, 1);
+
+  check_all_received (&c);
+
+  channel_free (&c);
+}
+
+/* The global budget is shared: room made in one channel goes to the
+ * messages waiting for the others */
+static void
+test_global (void)
+{
+  Channel a, b;
+  guint spilled;
+
+  channel_init (&a);
+  channel_init (&b);
+
+  receive (&a, PER_CHANNEL);
+  receive (&b, 10);
+  g_assert_cmpuint (b.channel->received->len, ==, OVERALL - PER_CHANNEL);
+
+  /* b can't take more without going over the global budget */
+  salut_message_spill_get_counters (b.spill, &spilled, NULL);
+  g_assert_cmpuint (spilled, ==, 10 - (OVERALL - PER_CHANNEL));
+
+  ack (&a, 2);
+  g_assert_cmpuint (b.channel->received->len, ==, OVERALL - PER_CHANNEL + 2);
+
+  ack (&a, PER_CHANNEL);
+  while (b.channel->received->len < b.sent)
+    ack (&b, 1);
+
+  check_all_received (&a);
+  check_all_received (&b);
+
+  channel_free (&a);
+  channel_free (&b);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_type_init ();
+
+  /* Only read when the first spill is created */
+  g_setenv ("SALUT_PENDING_CHANNEL_BUDGET", CHANNEL_BUDGET, TRUE);
+  g_setenv ("SALUT_PENDING_GLOBAL_BUDGET", GLOBAL_BUDGET, TRUE);
+  _salut_message_spill_TEST_set_take_func (take_cb);
+
+  g_test_add_func ("/message-spill/in-order", test_in_order);
+  g_test_add_func ("/message-spill/queue-behind", test_queue_behind);
+  g_test_add_func ("/message-spill/global", test_global);
+
+  return g_test_run ();
+}
@@ -0,0 +1,164 @@
+/*
+ * check-tubes-versions.c - Test for tracking the tube lists of MUC members
+ * Copyright (C) 2012 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "tubes-versions.h"
+
+#define ALICE 1
+#define BOB 2
+
+/* Changes that follow the version we're at are applied, the ones we
+ * already have are skipped */
+static void
+test_in_order (void)
+{
+  SalutTubesVersions *versions = salut_tubes_versions_new ();
+  gboolean send_ours;
+  guint i;
+
+  /* nothing heard from Alice yet, her first change is version 1 */
+  for (i = 1; i <= 3; i++)
+    {
+      g_assert_cmpint (salut_tubes_versions_delta (versions, ALICE, i), ==,
+          SALUT_TUBES_VERSIONS_APPLY);
+      g_assert_cmpuint (salut_tubes_versions_get (versions, ALICE), ==, i);
+    }
+
+  /* sent again */
+  g_assert_cmpint (salut_tubes_versions_delta (versions, ALICE, 3), ==,
+      SALUT_TUBES_VERSIONS_SKIP);
+  g_assert_cmpint (salut_tubes_versions_delta (versions, ALICE, 2), ==,
+      SALUT_TUBES_VERSIONS_SKIP);
+
+  /* her full list, sent when somebody else joined */
+  g_assert_cmpint (salut_tubes_versions_snapshot (versions, ALICE, TRUE, 3,
+          &send_ours), ==, SALUT_TUBES_VERSIONS_SKIP);
+  g_assert (!send_ours);
+
+  /* Bob's are tracked on their own */
+  g_assert_cmpuint (salut_tubes_versions_get (versions, BOB), ==, 0);
+  g_assert_cmpint (salut_tubes_versions_delta (versions, BOB, 1), ==,
+      SALUT_TUBES_VERSIONS_APPLY);
+
+  g_assert (!salut_tubes_versions_has_legacy (versions));
+
+  salut_tubes_versions_free (versions);
+}
+
+/* Missing a change means asking for the full list, which brings us to its
+ * version */
+static void
+test_gap (void)
+{
+  SalutTubesVersions *versions = salut_tubes_versions_new ();
+  WockyStanza *request;
+  WockyNode *node;
+  gboolean send_ours;
+
+  g_assert_cmpint (salut_tubes_versions_delta (versions, ALICE, 1), ==,
+      SALUT_TUBES_VERSIONS_APPLY);
+
+  g_assert_cmpint (salut_tubes_versions_delta (versions, ALICE, 3), ==,
+      SALUT_TUBES_VERSIONS_REQUEST_SNAPSHOT);
+  g_assert_cmpuint (salut_tubes_versions_get (versions, ALICE), ==, 1);
+
+  /* what's asked for */
+  request = salut_tubes_versions_build_request ("bob@host", "room@host",
+      "alice@host");
+  node = wocky_node_get_child_ns (wocky_stanza_get_top_node (request),
+      "tubes-request", WOCKY_TELEPATHY_NS_TUBES);
+  g_assert (node != NULL);
+  g_assert_cmpstr (wocky_node_get_attribute (node, "member"), ==,
+      "alice@host");
+  g_object_unref (request);
+
+  /* until the full list comes, later changes ask again */
+  g_assert_cmpint (salut_tubes_versions_delta (versions, ALICE, 4), ==,
+      SALUT_TUBES_VERSIONS_REQUEST_SNAPSHOT);
+
+  g_assert_cmpint (salut_tubes_versions_snapshot (versions, ALICE, TRUE, 4,
+          &send_ours), ==, SALUT_TUBES_VERSIONS_APPLY);
+  g_assert (!send_ours);
+  g_assert_cmpuint (salut_tubes_versions_get (versions, ALICE), ==, 4);
+
+  g_assert_cmpint (salut_tubes_versions_delta (versions, ALICE, 5), ==,
+      SALUT_TUBES_VERSIONS_APPLY);
+
+  /* once she's gone, we start over */
+  salut_tubes_versions_remove (versions, ALICE);
+  g_assert_cmpuint (salut_tubes_versions_get (versions, ALICE), ==, 0);
+
+  salut_tubes_versions_free (versions);
+}
+
+/* Members of older versions only send full lists without a version: each
+ * one is applied, and they get ours in full the first time */
+static void
+test_legacy (void)
+{
+  SalutTubesVersions *versions = salut_tubes_versions_new ();
+  gboolean send_ours;
+
+  g_assert_cmpint (salut_tubes_versions_snapshot (versions, BOB, FALSE, 0,
+          &send_ours), ==, SALUT_TUBES_VERSIONS_APPLY);
+  g_assert (send_ours);
+  g_assert (salut_tubes_versions_has_legacy (versions));
+
+  /* the same list again still has to be looked at */
+  g_assert_cmpint (salut_tubes_versions_snapshot (versions, BOB, FALSE, 0,
+          &send_ours), ==, SALUT_TUBES_VERSIONS_APPLY);
+  g_assert (!send_ours);
+
+  /* others are unaffected */
+  g_assert_cmpint (salut_tubes_versions_delta (versions, ALICE, 1), ==,
+      SALUT_TUBES_VERSIONS_APPLY);
+
+  salut_tubes_versions_remove (versions, BOB);
+  g_assert (!salut_tubes_versions_has_legacy (versions));
+
+  /* Bob upgrades, and sends versions from then on */
+  g_assert_cmpint (salut_tubes_versions_snapshot (versions, BOB, FALSE, 0,
+          &send_ours), ==, SALUT_TUBES_VERSIONS_APPLY);
+  g_assert (send_ours);
+  g_assert_cmpint (salut_tubes_versions_snapshot (versions, BOB, TRUE, 2,
+          &send_ours), ==, SALUT_TUBES_VERSIONS_APPLY);
+  g_assert (!send_ours);
+  g_assert (!salut_tubes_versions_has_legacy (versions));
+  g_assert_cmpint (salut_tubes_versions_delta (versions, BOB, 3), ==,
+      SALUT_TUBES_VERSIONS_APPLY);
+
+  salut_tubes_versions_free (versions);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_type_init ();
+
+  g_test_add_func ("/tubes-versions/in-order", test_in_order);
+  g_test_add_func ("/tubes-versions/gap", test_gap);
+  g_test_add_func ("/tubes-versions/legacy", test_legacy);
+
+  return g_test_run ();
+}